@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/NESCHAN_APP.dir/src/neschan.cpp.o"
+  "CMakeFiles/NESCHAN_APP.dir/src/neschan.cpp.o.d"
+  "neschan"
+  "neschan.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/NESCHAN_APP.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/NESCHAN_BENCH.dir/tools/neschan_bench.cpp.o"
+  "CMakeFiles/NESCHAN_BENCH.dir/tools/neschan_bench.cpp.o.d"
+  "neschan_bench"
+  "neschan_bench.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/NESCHAN_BENCH.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
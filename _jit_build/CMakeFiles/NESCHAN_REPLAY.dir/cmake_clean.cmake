@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/NESCHAN_REPLAY.dir/tools/neschan_replay.cpp.o"
+  "CMakeFiles/NESCHAN_REPLAY.dir/tools/neschan_replay.cpp.o.d"
+  "neschan_replay"
+  "neschan_replay.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/NESCHAN_REPLAY.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/NESCHAN_ROMTEST.dir/tools/neschan_romtest.cpp.o"
+  "CMakeFiles/NESCHAN_ROMTEST.dir/tools/neschan_romtest.cpp.o.d"
+  "neschan_romtest"
+  "neschan_romtest.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/NESCHAN_ROMTEST.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
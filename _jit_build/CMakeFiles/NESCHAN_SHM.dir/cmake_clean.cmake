@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/NESCHAN_SHM.dir/tools/neschan_shm.cpp.o"
+  "CMakeFiles/NESCHAN_SHM.dir/tools/neschan_shm.cpp.o.d"
+  "neschan_shm"
+  "neschan_shm.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/NESCHAN_SHM.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/NESCHAN_TRACE.dir/tools/neschan_trace.cpp.o"
+  "CMakeFiles/NESCHAN_TRACE.dir/tools/neschan_trace.cpp.o.d"
+  "neschan_trace"
+  "neschan_trace.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/NESCHAN_TRACE.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,40 @@
+
+# Consider dependencies only in project.
+set(CMAKE_DEPENDS_IN_PROJECT_ONLY OFF)
+
+# The set of languages for which implicit dependencies are needed:
+set(CMAKE_DEPENDS_LANGUAGES
+  )
+
+# The set of dependency files which are needed:
+set(CMAKE_DEPENDS_DEPENDENCY_FILES
+  "/root/repo/lib/src/mappers/nes_mapper_mmc1.cpp" "lib/CMakeFiles/NESCHANLIB.dir/src/mappers/nes_mapper_mmc1.cpp.o" "gcc" "lib/CMakeFiles/NESCHANLIB.dir/src/mappers/nes_mapper_mmc1.cpp.o.d"
+  "/root/repo/lib/src/mappers/nes_mapper_nrom.cpp" "lib/CMakeFiles/NESCHANLIB.dir/src/mappers/nes_mapper_nrom.cpp.o" "gcc" "lib/CMakeFiles/NESCHANLIB.dir/src/mappers/nes_mapper_nrom.cpp.o.d"
+  "/root/repo/lib/src/nes_apu.cpp" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_apu.cpp.o" "gcc" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_apu.cpp.o.d"
+  "/root/repo/lib/src/nes_arena.cpp" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_arena.cpp.o" "gcc" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_arena.cpp.o.d"
+  "/root/repo/lib/src/nes_batch.cpp" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_batch.cpp.o" "gcc" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_batch.cpp.o.d"
+  "/root/repo/lib/src/nes_cpu.cpp" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_cpu.cpp.o" "gcc" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_cpu.cpp.o.d"
+  "/root/repo/lib/src/nes_cpu_jit.cpp" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_cpu_jit.cpp.o" "gcc" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_cpu_jit.cpp.o.d"
+  "/root/repo/lib/src/nes_frame.cpp" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_frame.cpp.o" "gcc" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_frame.cpp.o.d"
+  "/root/repo/lib/src/nes_input.cpp" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_input.cpp.o" "gcc" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_input.cpp.o.d"
+  "/root/repo/lib/src/nes_mapper_mmc3.cpp" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_mapper_mmc3.cpp.o" "gcc" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_mapper_mmc3.cpp.o.d"
+  "/root/repo/lib/src/nes_memory.cpp" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_memory.cpp.o" "gcc" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_memory.cpp.o.d"
+  "/root/repo/lib/src/nes_observation.cpp" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_observation.cpp.o" "gcc" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_observation.cpp.o.d"
+  "/root/repo/lib/src/nes_perf.cpp" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_perf.cpp.o" "gcc" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_perf.cpp.o.d"
+  "/root/repo/lib/src/nes_ppu.cpp" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_ppu.cpp.o" "gcc" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_ppu.cpp.o.d"
+  "/root/repo/lib/src/nes_recorder.cpp" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_recorder.cpp.o" "gcc" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_recorder.cpp.o.d"
+  "/root/repo/lib/src/nes_replay.cpp" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_replay.cpp.o" "gcc" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_replay.cpp.o.d"
+  "/root/repo/lib/src/nes_rollback.cpp" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_rollback.cpp.o" "gcc" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_rollback.cpp.o.d"
+  "/root/repo/lib/src/nes_rom_suite.cpp" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_rom_suite.cpp.o" "gcc" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_rom_suite.cpp.o.d"
+  "/root/repo/lib/src/nes_shm.cpp" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_shm.cpp.o" "gcc" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_shm.cpp.o.d"
+  "/root/repo/lib/src/nes_system.cpp" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_system.cpp.o" "gcc" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_system.cpp.o.d"
+  "/root/repo/lib/src/nes_trace.cpp" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_trace.cpp.o" "gcc" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_trace.cpp.o.d"
+  "/root/repo/lib/src/nes_worker_pool.cpp" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_worker_pool.cpp.o" "gcc" "lib/CMakeFiles/NESCHANLIB.dir/src/nes_worker_pool.cpp.o.d"
+  )
+
+# Targets to which this target links.
+set(CMAKE_TARGET_LINKED_INFO_FILES
+  )
+
+# Fortran module output directory.
+set(CMAKE_Fortran_TARGET_MODULE_DIR "")
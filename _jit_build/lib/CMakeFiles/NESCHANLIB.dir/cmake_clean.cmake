@@ -0,0 +1,53 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/NESCHANLIB.dir/src/mappers/nes_mapper_mmc1.cpp.o"
+  "CMakeFiles/NESCHANLIB.dir/src/mappers/nes_mapper_mmc1.cpp.o.d"
+  "CMakeFiles/NESCHANLIB.dir/src/mappers/nes_mapper_nrom.cpp.o"
+  "CMakeFiles/NESCHANLIB.dir/src/mappers/nes_mapper_nrom.cpp.o.d"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_apu.cpp.o"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_apu.cpp.o.d"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_arena.cpp.o"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_arena.cpp.o.d"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_batch.cpp.o"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_batch.cpp.o.d"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_cpu.cpp.o"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_cpu.cpp.o.d"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_cpu_jit.cpp.o"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_cpu_jit.cpp.o.d"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_frame.cpp.o"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_frame.cpp.o.d"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_input.cpp.o"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_input.cpp.o.d"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_mapper_mmc3.cpp.o"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_mapper_mmc3.cpp.o.d"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_memory.cpp.o"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_memory.cpp.o.d"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_observation.cpp.o"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_observation.cpp.o.d"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_perf.cpp.o"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_perf.cpp.o.d"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_ppu.cpp.o"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_ppu.cpp.o.d"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_recorder.cpp.o"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_recorder.cpp.o.d"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_replay.cpp.o"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_replay.cpp.o.d"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_rollback.cpp.o"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_rollback.cpp.o.d"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_rom_suite.cpp.o"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_rom_suite.cpp.o.d"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_shm.cpp.o"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_shm.cpp.o.d"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_system.cpp.o"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_system.cpp.o.d"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_trace.cpp.o"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_trace.cpp.o.d"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_worker_pool.cpp.o"
+  "CMakeFiles/NESCHANLIB.dir/src/nes_worker_pool.cpp.o.d"
+  "libNESCHANLIB.a"
+  "libNESCHANLIB.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/NESCHANLIB.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,34 @@
+
+# Consider dependencies only in project.
+set(CMAKE_DEPENDS_IN_PROJECT_ONLY OFF)
+
+# The set of languages for which implicit dependencies are needed:
+set(CMAKE_DEPENDS_LANGUAGES
+  )
+
+# The set of dependency files which are needed:
+set(CMAKE_DEPENDS_DEPENDENCY_FILES
+  "/root/repo/test/batch_test.cpp" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/batch_test.cpp.o" "gcc" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/batch_test.cpp.o.d"
+  "/root/repo/test/cpu_test.cpp" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/cpu_test.cpp.o" "gcc" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/cpu_test.cpp.o.d"
+  "/root/repo/test/jit_test.cpp" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/jit_test.cpp.o" "gcc" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/jit_test.cpp.o.d"
+  "/root/repo/test/memory_test.cpp" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/memory_test.cpp.o" "gcc" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/memory_test.cpp.o.d"
+  "/root/repo/test/observation_test.cpp" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/observation_test.cpp.o" "gcc" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/observation_test.cpp.o.d"
+  "/root/repo/test/ppu_test.cpp" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/ppu_test.cpp.o" "gcc" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/ppu_test.cpp.o.d"
+  "/root/repo/test/recorder_test.cpp" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/recorder_test.cpp.o" "gcc" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/recorder_test.cpp.o.d"
+  "/root/repo/test/replay_test.cpp" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/replay_test.cpp.o" "gcc" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/replay_test.cpp.o.d"
+  "/root/repo/test/rollback_test.cpp" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/rollback_test.cpp.o" "gcc" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/rollback_test.cpp.o.d"
+  "/root/repo/test/rom_suite_test.cpp" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/rom_suite_test.cpp.o" "gcc" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/rom_suite_test.cpp.o.d"
+  "/root/repo/test/shm_test.cpp" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/shm_test.cpp.o" "gcc" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/shm_test.cpp.o.d"
+  "/root/repo/test/state_test.cpp" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/state_test.cpp.o" "gcc" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/state_test.cpp.o.d"
+  "/root/repo/test/stdafx.cpp" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/stdafx.cpp.o" "gcc" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/stdafx.cpp.o.d"
+  "/root/repo/test/system_test.cpp" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/system_test.cpp.o" "gcc" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/system_test.cpp.o.d"
+  "/root/repo/test/test.cpp" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/test.cpp.o" "gcc" "test/CMakeFiles/NESCHAN_TEST_EXE.dir/test.cpp.o.d"
+  )
+
+# Targets to which this target links.
+set(CMAKE_TARGET_LINKED_INFO_FILES
+  "/root/repo/_jit_build/lib/CMakeFiles/NESCHANLIB.dir/DependInfo.cmake"
+  )
+
+# Fortran module output directory.
+set(CMAKE_Fortran_TARGET_MODULE_DIR "")
@@ -0,0 +1,39 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/batch_test.cpp.o"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/batch_test.cpp.o.d"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/cpu_test.cpp.o"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/cpu_test.cpp.o.d"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/jit_test.cpp.o"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/jit_test.cpp.o.d"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/memory_test.cpp.o"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/memory_test.cpp.o.d"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/observation_test.cpp.o"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/observation_test.cpp.o.d"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/ppu_test.cpp.o"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/ppu_test.cpp.o.d"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/recorder_test.cpp.o"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/recorder_test.cpp.o.d"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/replay_test.cpp.o"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/replay_test.cpp.o.d"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/rollback_test.cpp.o"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/rollback_test.cpp.o.d"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/rom_suite_test.cpp.o"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/rom_suite_test.cpp.o.d"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/shm_test.cpp.o"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/shm_test.cpp.o.d"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/state_test.cpp.o"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/state_test.cpp.o.d"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/stdafx.cpp.o"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/stdafx.cpp.o.d"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/system_test.cpp.o"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/system_test.cpp.o.d"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/test.cpp.o"
+  "CMakeFiles/NESCHAN_TEST_EXE.dir/test.cpp.o.d"
+  "test"
+  "test.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/NESCHAN_TEST_EXE.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,76 @@
+//=================================================================================================
+// NESChan
+// Author: Yi Zhang (yizhang82@outlook.com)
+//=================================================================================================
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+
+using namespace std;
+
+// Everything placed in an arena starts on its own cache line
+#define NES_ARENA_ALIGN 64
+
+// Arena memory goes wherever the OS puts it
+#define NES_ARENA_ANY_NODE -1
+
+//
+// One block of memory that objects and buffers get placed in back to back, so that everything that
+// belongs together (a nes_system's components and their buffers) is a single allocation - fewer
+// page table entries / TLB misses per instance and nothing shared with instances on other cores.
+// The block comes straight from the OS, zeroed, and can be asked to live on a NUMA node (Linux and
+// Windows - elsewhere, and if the node doesn't exist, it goes wherever the OS puts it).
+//
+// Nothing gets freed individually and destructors aren't tracked - whoever places objects in here
+// destroys them before the arena goes away
+//
+class nes_arena
+{
+public :
+    nes_arena(size_t capacity, int numa_node = NES_ARENA_ANY_NODE);
+    ~nes_arena();
+
+    nes_arena(const nes_arena &) = delete;
+    nes_arena &operator =(const nes_arena &) = delete;
+
+    // NES_ARENA_ALIGN aligned and zeroed, or nullptr if there is no space left
+    void *allocate(size_t size);
+
+    template<typename T, typename... Args>
+    T *construct(Args &&... args)
+    {
+        static_assert(alignof(T) <= NES_ARENA_ALIGN, "arena objects can't need more than NES_ARENA_ALIGN");
+        void *mem = allocate(sizeof(T));
+        return mem ? new (mem) T(std::forward<Args>(args)...) : nullptr;
+    }
+
+    // Buffer from arena, or a zeroed one from the heap kept in owned if there is no arena - for
+    // components that can live either way
+    static uint8_t *allocate_buffer(nes_arena *arena, size_t size, unique_ptr<uint8_t[]> &owned);
+
+    // size rounded up to what it takes in an arena
+    static size_t aligned_size(size_t size) { return (size + NES_ARENA_ALIGN - 1) & ~size_t(NES_ARENA_ALIGN - 1); }
+
+    const uint8_t *base() const { return _base; }
+    size_t capacity() const { return _capacity; }
+    size_t used() const { return _used; }
+
+    bool contains(const void *p) const { return p >= _base && p < _base + _capacity; }
+
+    // Node asked for, and whether the memory actually got bound to it
+    int numa_node() const { return _numa_node; }
+    bool is_numa_bound() const { return _numa_bound; }
+
+private :
+    uint8_t *_base;
+    size_t _capacity;
+    size_t _mapped_size;            // capacity rounded up to pages
+    size_t _used;
+    int _numa_node;
+    bool _numa_bound;
+};
@@ -0,0 +1,60 @@
+//=================================================================================================
+// NESChan
+// Author: Yi Zhang (yizhang82@outlook.com)
+//=================================================================================================
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "nes_input.h"
+#include "nes_system.h"
+#include "nes_worker_pool.h"
+
+using namespace std;
+
+//
+// Many instances of one ROM on a nes_worker_pool, for hosts that run lots of them (training, batch
+// evaluation). Instance i belongs to worker i % worker_count for its whole life: the worker creates
+// it - so its arena is first touched on, and bound to, the worker's NUMA node - and only that worker
+// ever runs it, so its state stays in the caches of that core instead of following the scheduler
+// around. Instances don't trace (see nes_system::set_tracer).
+//
+// Input goes through the latched input snapshot (nes_input_latch_mode_manual) - set_buttons between
+// runs, nothing gets polled
+//
+class nes_batch_runner
+{
+public :
+    typedef function<void(uint32_t instance, nes_system &system)> instance_function;
+
+    // Throws if the ROM can't be loaded. pool needs to outlive the runner
+    nes_batch_runner(nes_worker_pool &pool, const string &rom_path, uint32_t instance_count);
+    ~nes_batch_runner();
+
+    uint32_t instance_count() const { return uint32_t(_systems.size()); }
+    uint32_t worker_of(uint32_t instance) const { return instance % _pool.worker_count(); }
+
+    // Only between runs
+    nes_system &system(uint32_t instance) { return *_systems[instance]; }
+
+    // Buttons instance runs the next frames with
+    void set_buttons(uint32_t instance, const nes_button_flags (&buttons)[NES_MAX_PLAYER]);
+
+    // Every instance runs frames more frames - each worker runs its instances one after another.
+    // Returns false if any of them got stopped
+    bool run_frames(uint32_t frames);
+
+    // Runs fn for every instance on its worker, in parallel, and waits for all of them. fn must not
+    // throw
+    void for_each(instance_function fn);
+
+private :
+    nes_worker_pool &_pool;
+    vector<unique_ptr<nes_system>> _systems;
+};
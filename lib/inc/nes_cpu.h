@@ -5,9 +5,12 @@
 
 #pragma once
 
+#include "nes_arena.h"
 #include "nes_memory.h"
 #include "nes_mapper.h"
 #include "nes_component.h"
+#include "nes_cpu_jit.h"
+#include "nes_trace.h"
 #include <vector>
 
 using namespace std;
@@ -83,6 +86,96 @@ struct nes_cpu_context
     unsigned char P;        // Status register - used by ALU unit
 };
 
+//
+// Tracks the loop CPU is currently spinning in (the target of last backward branch / jump)
+// If an iteration doesn't write anything, only reads RAM / ROM / PPUSTATUS, and comes back with the
+// exact same registers, the next iteration will do the exact same thing until something external
+// (NMI, PPUSTATUS change) happens - such as LDA $2002 / BPL or JMP * waiting for NMI
+//
+struct nes_cpu_idle_loop
+{
+    uint16_t head;              // loop start
+    nes_cpu_context context;    // registers when CPU arrived at head last time
+    nes_cycle_t cycle;          // cycle when CPU arrived at head last time
+    nes_cycle_t length;         // cycles taken by last iteration
+    nes_cycle_t ppu_cycle;      // PPU cycle when CPU arrived at head last time
+    int repeat;                 // consecutive identical iterations
+    bool pure;                  // no writes / reads with side effects since arriving at head
+    bool reads_ppu_status;      // loop polls PPUSTATUS
+};
+
+class nes_cpu;
+typedef void (nes_cpu::*nes_cpu_op_handler)(nes_addr_mode);
+
+// What an ALU / load instruction does with its operand once it has been read (see _LDA, _ADC, etc)
+typedef void (nes_cpu::*nes_cpu_op_core)(uint8_t);
+
+// Only PRG ROM ($8000~$ffff) is decoded ahead of time
+#define NES_CPU_BLOCK_START 0x8000
+#define NES_CPU_BLOCK_MAX_OPS 64
+
+// How nes_cpu::exec_block runs a decoded instruction
+enum nes_cpu_block_op_kind : uint8_t
+{
+    nes_cpu_block_op_handler,       // interpreter handler decodes the operand - I/O, stack, control flow, etc
+    nes_cpu_block_op_register,      // only touches registers (TAX, INX, CLC, ASL A, etc) - handler without operand
+    nes_cpu_block_op_read_imm,      // core(immediate)
+    nes_cpu_block_op_read,          // core(RAM / PRG ROM at a fixed address)
+    nes_cpu_block_op_write,         // RAM at a fixed address = reg
+};
+
+// An instruction decoded ahead of time
+struct nes_cpu_block_op
+{
+    nes_cpu_op_handler handler;
+    nes_cpu_op_core core;                   // read ops
+    uint8_t nes_cpu_context::*reg;          // write ops
+    uint16_t pc;                            // address of op code
+    uint16_t operand;                       // read_imm: the value, read / write: address with mirroring folded
+    nes_addr_mode addr_mode;
+    nes_cpu_block_op_kind kind;
+    uint8_t length;                         // op code + operand bytes
+    uint8_t op_code;
+    uint8_t cycles;                         // CPU cycles - for everything but handler ops
+
+    // Ops from this one on that can run back to back with nothing but a check up front - no I/O,
+    // no control flow. 0 for handler ops
+    uint8_t run_length;
+    uint16_t run_cycles;                    // their CPU cycles
+};
+
+//
+// Basic block - straight line of instructions in PRG ROM up to the first branch / jump / return
+// Decoded blocks are kept until nes_memory::code_generation changes (PRG bank switching, new ROM, etc)
+//
+// Operands with a fixed address (immediate, zero page, absolute into RAM / PRG ROM) are resolved
+// while decoding, and runs of instructions that can't do I/O get their cycles summed up - so that
+// exec_block checks once per run whether it can finish before the next PPU event, instead of after
+// every instruction
+//
+struct nes_cpu_block
+{
+    uint16_t pc;                // start address
+    uint8_t op_count;
+    uint32_t first_op;          // index in nes_cpu::_block_ops
+#ifdef NESCHAN_JIT
+    nes_cpu_jit_code code;      // compiled block, nullptr if not compiled (yet)
+    uint32_t hits;              // times executed since decoded
+#endif
+};
+
+// Decoded blocks / ops kept at a time - when either runs out, all of them are thrown away and
+// decoded again as they get executed
+#define NES_CPU_BLOCK_COUNT 4096
+#define NES_CPU_BLOCK_OP_COUNT 16384
+
+// Blocks, ops and the table of blocks by address - one buffer (see nes_cpu::nes_cpu)
+#define NES_CPU_BLOCK_TABLE_SIZE (0x10000 - NES_CPU_BLOCK_START)
+#define NES_CPU_BLOCK_CACHE_SIZE \
+    (nes_arena::aligned_size(sizeof(nes_cpu_block) * NES_CPU_BLOCK_COUNT) + \
+     nes_arena::aligned_size(sizeof(nes_cpu_block_op) * NES_CPU_BLOCK_OP_COUNT) + \
+     nes_arena::aligned_size(sizeof(uint16_t) * NES_CPU_BLOCK_TABLE_SIZE))
+
 enum nes_op_code
 {
     ORA_base = 0x00,
@@ -98,10 +191,22 @@ enum nes_op_code
 class nes_cpu : public nes_component
 {
 public :
-    nes_cpu() 
+    // Block cache goes in arena if there is one (see nes_system)
+    nes_cpu(nes_arena *arena = nullptr)
     {
         _system = nullptr;
         _mem = nullptr;
+        _tracer = nullptr;
+
+        uint8_t *cache = nes_arena::allocate_buffer(arena, NES_CPU_BLOCK_CACHE_SIZE, _block_cache_owned);
+        _blocks = reinterpret_cast<nes_cpu_block *>(cache);
+        cache += nes_arena::aligned_size(sizeof(nes_cpu_block) * NES_CPU_BLOCK_COUNT);
+        _block_ops = reinterpret_cast<nes_cpu_block_op *>(cache);
+        cache += nes_arena::aligned_size(sizeof(nes_cpu_block_op) * NES_CPU_BLOCK_OP_COUNT);
+        _block_table = reinterpret_cast<uint16_t *>(cache);
+        _block_count = 0;
+        _block_op_count = 0;
+        _block_generation = 0;
     }
 
 public :
@@ -113,11 +218,19 @@ public :
     virtual void reset();
     virtual void step_to(nes_cycle_t count);
 
+public :
+    // Tracer of the system - what the trace macros resolve to in here (see nes_trace_context)
+    nes_tracer *nes_trace_context() const { return _tracer; }
+    void set_tracer(nes_tracer *tracer) { _tracer = tracer; }
+
 public :
 
     void stop_at_infinite_loop() { _stop_at_infinite_loop = true; }
     void stop_at_addr(uint16_t addr) { _is_stop_at_addr = true;  _stop_at_addr = addr; }
 
+    // Buffer decoded blocks live in (see nes_cpu_block)
+    const void *block_cache() const { return _blocks; }
+
     void set_carry_flag(bool set) { set_flag(PROCESSOR_STATUS_CARRY_MASK, set); }
     uint8_t get_carry() { return (_context.P & PROCESSOR_STATUS_CARRY_MASK); }
 
@@ -138,7 +251,15 @@ public :
     void set_negative_flag(bool set) { set_flag(PROCESSOR_STATUS_NEGATIVE_MASK, set); }
     bool is_negative() { return _context.P & PROCESSOR_STATUS_NEGATIVE_MASK; }
 
-    uint8_t peek(uint16_t addr) { return _mem->get_byte(addr); }
+    uint8_t peek(uint16_t addr)
+    {
+        // $2000~$5fff are all registers - anything other than PPUSTATUS has side effects
+        if (addr >= 0x2000 && addr < 0x6000)
+            idle_loop_io_read(addr);
+
+        return _mem->get_byte(addr);
+    }
+
     uint16_t peek_word(uint16_t addr) { return _mem->get_word(addr); }
     void poke(uint16_t addr, uint8_t value);
     
@@ -149,12 +270,30 @@ public :
     uint8_t &P() { return _context.P; }
     uint8_t &S() { return _context.S; }
 
+    nes_cycle_t cycle() const { return _cycle; }
+
+#ifdef NESCHAN_JIT
+    //
+    // Compiles hot blocks to x86-64 code - see nes_cpu_jit
+    // If shadow is given it needs to be an identical system (same ROM, same state) - it runs the
+    // interpreter in lockstep and gets compared against after every compiled block
+    //
+    void enable_jit(nes_system *shadow = nullptr) { _jit = make_unique<nes_cpu_jit>(this, shadow); }
+    nes_cpu_jit *jit() { return _jit.get(); }
+#endif
+
     void request_nmi() { _nmi_pending = true; };
     void request_dma(uint16_t addr) { _dma_pending = true; _dma_addr = addr; }
 
     void serialize(vector<uint8_t> &out) const;
     bool deserialize(const uint8_t *data, size_t size, size_t &offset);
 
+    // Name / addressing mode of op_code. name is nullptr for illegal op codes
+    static void get_op_info(uint8_t op_code, const char *&name, nes_addr_mode &addr_mode, bool &is_official);
+
+    // Renders record in Nintendulator trace format (same as nestest.log)
+    static string format_trace_record(const nes_trace_record &record);
+
 public :
     //
     // Stack operations
@@ -165,6 +304,7 @@ public :
     {
         // stack grow top->down
         // no underflow/overflow detection
+        _idle_loop.pure = false;
         _mem->set_byte(_context.S + STACK_OFFSET, val);
         _context.S--;
     }
@@ -198,16 +338,118 @@ private :
     void NMI();
     void OAMDMA();
 
+    //
+    // Block cache - see nes_cpu_block
+    //
+    template <typename visitor_t>
+    static void dispatch_op(uint8_t op_code, visitor_t &&visit);
+    static uint8_t get_op_length(nes_addr_mode addr_mode);
+    bool exec_block(nes_cycle_t new_count);
+    nes_cpu_block *find_block(uint16_t pc);
+    void clear_blocks();
+    void decode_block_op(nes_cpu_block_op &op);
+
+    const nes_cpu_block_op *block_ops(const nes_cpu_block *block) const { return &_block_ops[block->first_op]; }
+
+    // Runs a decoded instruction, leaving PC after it
+    void exec_block_op(const nes_cpu_block_op &op)
+    {
+        if (op.kind == nes_cpu_block_op_handler)
+        {
+            PC() = op.pc + 1;
+            (this->*op.handler)(op.addr_mode);
+        }
+        else
+        {
+            PC() = op.pc + op.length;
+            exec_run_op(op);
+        }
+    }
+
+    //
+    // Runs an instruction that is part of a run (see nes_cpu_block_op::run_length) - leaves PC alone.
+    // Returns false if the instruction wrote to a page with watches / dirty tracking on - which calls
+    // out of the CPU, so whatever follows needs checking as if it were a handler op
+    //
+    bool exec_run_op(const nes_cpu_block_op &op)
+    {
+        switch (op.kind)
+        {
+        case nes_cpu_block_op_register:
+            (this->*op.handler)(op.addr_mode);
+            return true;
+        case nes_cpu_block_op_read_imm:
+            (this->*op.core)(uint8_t(op.operand));
+            break;
+        case nes_cpu_block_op_read:
+            (this->*op.core)(_mem->ram_data()[op.operand]);
+            break;
+        case nes_cpu_block_op_write:
+            if (_mem->page_flags(op.operand))
+            {
+                poke(op.operand, _context.*op.reg);
+                step_cpu(int64_t(op.cycles));
+                return false;
+            }
+
+            _idle_loop.pure = false;
+            _mem->ram_data()[op.operand] = _context.*op.reg;
+            break;
+        default:
+            assert(false);
+            break;
+        }
+
+        step_cpu(int64_t(op.cycles));
+        return true;
+    }
+
+#ifdef NESCHAN_JIT
+    friend class nes_cpu_jit;
+
+    bool exec_jit_block(nes_cpu_block *block, nes_cycle_t new_count);
+
+    // Called by compiled code for instructions it doesn't compile natively. Returns false if the block
+    // needs to stop after this instruction
+    static bool jit_exec_op(nes_cpu *cpu, const nes_cpu_block_op *op);
+
+    // Called by compiled code for a backward branch taken to a new loop head
+    static void jit_enter_idle_loop(nes_cpu *cpu, uint16_t head);
+
+    // Called by compiled code after a backward branch taken to its own block - runs the loop head the
+    // way step_to would. Returns true if compiled code can go on with the instruction at next_pc
+    static bool jit_loop_head(nes_cpu *cpu, uint16_t next_pc);
+#endif
+
+    //
+    // Idle loop detection - see nes_cpu_idle_loop
+    //
+    void reset_idle_loop();
+    void enter_idle_loop(uint16_t head);
+    void arrive_idle_loop_head();
+    void idle_loop_io_read(uint16_t addr)
+    {
+        if ((addr & 0xe007) == 0x2002)
+            _idle_loop.reads_ppu_status = true;
+        else
+            _idle_loop.pure = false;
+    }
+
     uint8_t decode_byte()
     {
-        return _mem->get_byte(_context.PC++);
+        // PRG ROM has no side effects and isn't mirrored - read it directly
+        uint16_t pc = _context.PC++;
+        if (pc >= NES_CPU_BLOCK_START)
+            return _mem->ram_data()[pc];
+
+        return _mem->get_byte(pc);
     }
 
     uint16_t decode_word()
     {
-        auto word = _mem->get_word(_context.PC);
-        _context.PC += 2;
-        return word;
+        uint8_t lo = decode_byte();
+        uint8_t hi = decode_byte();
+        return uint16_t(lo) + (uint16_t(hi) << 8);
     }
 
     void set_flag(uint8_t mask, bool set)
@@ -394,10 +636,10 @@ private :
             ((val1 & 0x80) != (new_value & 0x80)));
     }
 
-    string get_op_str(const char *op, nes_addr_mode addr_mode, bool is_official = true);
-    void append_operand_str(string &str, nes_addr_mode addr_mode);
+    nes_trace_record capture_trace_record(nes_addr_mode addr_mode);
 
     void branch(bool cond, nes_addr_mode addr_mode);
+    void compare(uint8_t reg, uint8_t val);
 
     // ADC - Add with carry
     void ADC(nes_addr_mode addr_mode);
@@ -405,6 +647,7 @@ private :
 
     // AND - Logical AND
     void AND(nes_addr_mode addr_mode);
+    void _AND(uint8_t val);
 
     // ASL - Arithmetic Shift Left
     void ASL(nes_addr_mode addr_mode);
@@ -420,6 +663,7 @@ private :
 
     // BIT - Bit test
     void BIT(nes_addr_mode addr_mode);
+    void _BIT(uint8_t val);
 
     // BMI - Branch if minus
     void BMI(nes_addr_mode addr_mode);
@@ -453,12 +697,15 @@ private :
 
     // CMP - Compare 
     void CMP(nes_addr_mode addr_mode);
+    void _CMP(uint8_t val);
 
     // CPX - Compare X register
     void CPX(nes_addr_mode addr_mode);
+    void _CPX(uint8_t val);
 
     // CPY - Compare Y register
     void CPY(nes_addr_mode addr_mode);
+    void _CPY(uint8_t val);
 
     // DEC - Decrement memory
     void DEC(nes_addr_mode addr_mode);
@@ -471,6 +718,7 @@ private :
 
     // Exclusive OR 
     void EOR(nes_addr_mode addr_mode);
+    void _EOR(uint8_t val);
 
     // INC - Increment memory
     void INC(nes_addr_mode addr_mode);
@@ -489,12 +737,15 @@ private :
 
     // LDA - Load Accumulator
     void LDA(nes_addr_mode addr_mode);
+    void _LDA(uint8_t val);
 
     // LDX - Load X register
     void LDX(nes_addr_mode addr_mode);
+    void _LDX(uint8_t val);
 
     // LDY - Load Y register
     void LDY(nes_addr_mode addr_mode);
+    void _LDY(uint8_t val);
 
     // LSR - Logical shift right
     void LSR(nes_addr_mode addr_mode);
@@ -504,6 +755,7 @@ private :
 
     // ORA - Logical Inclusive OR
     void ORA(nes_addr_mode addr_mode);
+    void _ORA(uint8_t val);
 
     // PHA - Push accumulator
     void PHA(nes_addr_mode addr_mode);
@@ -599,6 +851,7 @@ private :
     nes_system      *_system;
     nes_memory      *_mem;
     nes_ppu         *_ppu;
+    nes_tracer      *_tracer;               // system's tracer, or nullptr for none
     nes_cpu_context _context;
     nes_cycle_t     _cycle;
     bool            _nmi_pending;           // NMI interrupt pending from PPU vertical blanking
@@ -607,4 +860,21 @@ private :
     bool            _stop_at_infinite_loop; // stop at when the ROM starts infinite loop - useful for testing
     bool            _is_stop_at_addr;       // stop at a certain address - useful for testing
     uint16_t        _stop_at_addr;          // stop at a certain address - useful for testing
+    nes_cpu_idle_loop _idle_loop;           // loop CPU is spinning in - skipped ahead when idle
+
+    // Block cache - see nes_cpu_block
+    nes_cpu_block *_blocks;                 // NES_CPU_BLOCK_COUNT, the first _block_count are in use
+    nes_cpu_block_op *_block_ops;           // NES_CPU_BLOCK_OP_COUNT, the first _block_op_count are in use
+    uint16_t *_block_table;                 // 1 + index in _blocks of the block decoded at each PRG ROM address
+    unique_ptr<uint8_t[]> _block_cache_owned;   // when there is no arena
+    uint32_t _block_count;
+    uint32_t _block_op_count;
+    uint32_t _block_generation;             // nes_memory::code_generation the blocks were decoded in
+
+#ifdef NESCHAN_JIT
+    unique_ptr<nes_cpu_jit> _jit;
+    nes_cycle_t _jit_limit;                 // compiled code stops once reaching this cycle
+    nes_cycle_t _jit_new_count;             // cycle the current step_to is running to
+    uint32_t _jit_generation;               // generation of the block being run
+#endif
 };
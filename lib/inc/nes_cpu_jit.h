@@ -0,0 +1,138 @@
+//=================================================================================================
+// NESChan
+// Author: Yi Zhang (yizhang82@outlook.com)
+//=================================================================================================
+
+#pragma once
+
+#ifdef NESCHAN_JIT
+
+#if !defined(__x86_64__)
+#error "NESCHAN_JIT is only supported on x86-64"
+#endif
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "nes_cycle.h"
+
+using namespace std;
+
+class nes_cpu;
+class nes_system;
+class nes_tracer;
+struct nes_cpu_block;
+struct nes_cpu_block_op;
+
+// Compiled block - runs the block against the given CPU
+typedef void (*nes_cpu_jit_code)(nes_cpu *cpu);
+
+// Blocks get compiled after being executed this many times
+#define NES_CPU_JIT_THRESHOLD 16
+
+// Executable memory for compiled blocks
+#define NES_CPU_JIT_ARENA_SIZE (1024 * 1024)
+
+//
+// Executable memory compiled blocks live in. Memory is only made writable while a block is being
+// copied in. There is no freeing of individual blocks - when it is full everything is thrown away
+// and hot blocks get compiled again
+//
+class nes_cpu_jit_arena
+{
+public :
+    nes_cpu_jit_arena();
+    ~nes_cpu_jit_arena();
+
+    // Copies code in and returns its executable address, or nullptr if there is no space left
+    void *place(const vector<uint8_t> &code);
+
+    void reset() { _used = 0; }
+
+private :
+    uint8_t *_base;
+    size_t _used;
+};
+
+// Write in a compiled run that has to go through the interpreter after all - see nes_cpu_jit::compile
+struct nes_cpu_jit_stub
+{
+    size_t rel32;                   // jcc to patch
+    const nes_cpu_block_op *op;
+    int32_t run_cycles;             // cycles of the run before op
+};
+
+//
+// Minimal x86-64 JIT for nes_cpu blocks (see nes_cpu_block)
+//
+// Runs of instructions that can't do I/O (see nes_cpu_block_op::run_length) are emitted as native
+// code - register ops, loads / ALU ops / compares with an immediate or fixed RAM / PRG ROM operand, and
+// stores to fixed RAM addresses - with one check up front and their cycles added once, same as
+// nes_cpu::exec_block does. So is a conditional branch at the end of the block, and if it loops back
+// into the block the compiled code keeps going around after the interpreter has run the loop head.
+// Everything else calls the interpreter handler for that instruction - so memory / IO accesses go
+// through exactly the same path and account cycles at exactly the same points as the interpreter.
+// Between instructions the compiled code performs the same checks as nes_cpu::exec_block and returns
+// to the interpreter whenever it would have stopped.
+//
+// Compiled code lives as long as the block - when nes_memory::code_generation changes (PRG bank
+// switch, new ROM) the block is decoded again and recompiled once it gets hot again.
+//
+class nes_cpu_jit
+{
+public :
+    nes_cpu_jit(nes_cpu *cpu, nes_system *shadow);
+
+    // Returns nullptr if arena is full - caller needs to forget all compiled code and call reset
+    nes_cpu_jit_code compile(const nes_cpu_block *block);
+    void reset();
+
+    //
+    // Differential testing - shadow is an identical system running the interpreter. After every
+    // compiled block shadow is stepped to the same cycle and the CPU registers and RAM are compared
+    //
+    void verify();
+
+    // Blocks get compiled after this many executions - with a shadow every block gets compiled right away
+    uint32_t threshold() const { return _threshold; }
+
+    uint64_t compiled_block_count() const { return _compiled_block_count; }
+    uint64_t executed_block_count() const { return _executed_block_count; }
+    uint64_t mismatch_count() const { return _mismatch_count; }
+
+    void on_block_executed() { _executed_block_count++; }
+
+private :
+    // Traces go wherever the CPU's do
+    nes_tracer *nes_trace_context() const;
+
+    void emit_run_op(vector<uint8_t> &code, const nes_cpu_block_op &op, int32_t run_cycles, vector<nes_cpu_jit_stub> &stubs);
+    void emit_core(vector<uint8_t> &code, void (nes_cpu::*core)(uint8_t));
+    int loop_resume(const nes_cpu_block *block, uint16_t target);
+    static bool get_branch_flag(const nes_cpu_block_op &op, uint8_t &mask, bool &if_set);
+
+private :
+    nes_cpu *_cpu;
+    nes_system *_shadow;
+    nes_cpu_jit_arena _arena;
+    uint32_t _threshold;
+
+    // Offsets of nes_cpu fields compiled code reads / writes
+    int32_t _A_offset;
+    int32_t _X_offset;
+    int32_t _Y_offset;
+    int32_t _S_offset;
+    int32_t _P_offset;
+    int32_t _PC_offset;
+    int32_t _cycle_offset;
+    int32_t _limit_offset;
+    int32_t _idle_loop_head_offset;
+    int32_t _idle_loop_pure_offset;
+
+    uint64_t _compiled_block_count;
+    uint64_t _executed_block_count;
+    uint64_t _mismatch_count;
+};
+
+#endif
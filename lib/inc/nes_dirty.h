@@ -0,0 +1,102 @@
+//=================================================================================================
+// NESChan
+// Author: Yi Zhang (yizhang82@outlook.com)
+//=================================================================================================
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+// Dirty tracking granularity - CPU address space goes by nes_memory's 256 byte pages, and PPU memory
+// by 64 bytes (two name table rows, four pattern tiles, 16 sprites)
+#define NES_DIRTY_RAM_PAGE_SHIFT 8
+#define NES_DIRTY_VRAM_PAGE_SHIFT 6
+#define NES_DIRTY_OAM_PAGE_SHIFT 6
+
+//
+// One bit per page of a memory - set when anything writes to the page, cleared by whoever decides
+// when an epoch ends (see nes_system::enable_dirty_tracking)
+//
+class nes_dirty_bitmap
+{
+public :
+    nes_dirty_bitmap(size_t size, uint32_t page_shift)
+        :_page_shift(page_shift), _page_count(size >> page_shift), _bits((_page_count + 63) / 64, 0)
+    {}
+
+    uint32_t page_shift() const { return _page_shift; }
+    size_t page_size() const { return size_t(1) << _page_shift; }
+    size_t page_count() const { return _page_count; }
+
+    void mark(uint32_t addr)
+    {
+        uint32_t page = addr >> _page_shift;
+        _bits[page / 64] |= uint64_t(1) << (page % 64);
+    }
+
+    void mark_range(uint32_t addr, size_t size)
+    {
+        if (size == 0)
+            return;
+
+        uint32_t last_page = uint32_t((addr + size - 1) >> _page_shift);
+        for (uint32_t page = addr >> _page_shift; page <= last_page; ++page)
+            _bits[page / 64] |= uint64_t(1) << (page % 64);
+    }
+
+    bool is_dirty(size_t page) const { return (_bits[page / 64] >> (page % 64)) & 1; }
+
+    bool any() const
+    {
+        for (auto word : _bits)
+        {
+            if (word)
+                return true;
+        }
+        return false;
+    }
+
+    size_t dirty_count() const
+    {
+        size_t count = 0;
+        for (size_t page = 0; page < _page_count; ++page)
+            count += is_dirty(page) ? 1 : 0;
+        return count;
+    }
+
+    void clear() { fill(_bits.begin(), _bits.end(), uint64_t(0)); }
+
+    // Page n is bit n % 64 of word n / 64
+    const vector<uint64_t> &words() const { return _bits; }
+
+private :
+    uint32_t _page_shift;
+    size_t _page_count;
+    vector<uint64_t> _bits;
+};
+
+//
+// Pages written since the epoch started, of every memory that is part of the state
+//
+struct nes_dirty_pages
+{
+    nes_dirty_pages();
+
+    nes_dirty_bitmap ram;           // CPU address space as nes_memory stores it - mirrors folded
+    nes_dirty_bitmap vram;          // PPU address space
+    nes_dirty_bitmap oam;
+
+    bool any() const { return ram.any() || vram.any() || oam.any(); }
+
+    void clear()
+    {
+        ram.clear();
+        vram.clear();
+        oam.clear();
+    }
+};
@@ -0,0 +1,117 @@
+//=================================================================================================
+// NESChan
+// Author: Yi Zhang (yizhang82@outlook.com)
+//=================================================================================================
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "nes_arena.h"
+
+using namespace std;
+
+// Completed frames readers hold on to - see nes_frame_pool
+#define NES_FRAME_POOL_SIZE 4
+
+class nes_frame_pool;
+
+//
+// A completed frame held by a reader. Pixels stay valid and unchanged until it is released (or
+// destroyed), no matter how far emulation moves on
+//
+class nes_frame_ref
+{
+public :
+    nes_frame_ref()
+        :_pool(nullptr), _slot(0), _sequence(0), _pixels(nullptr)
+    {}
+
+    nes_frame_ref(nes_frame_ref &&other);
+    nes_frame_ref &operator =(nes_frame_ref &&other);
+
+    nes_frame_ref(const nes_frame_ref &) = delete;
+    nes_frame_ref &operator =(const nes_frame_ref &) = delete;
+
+    ~nes_frame_ref() { release(); }
+
+    bool valid() const { return _pool != nullptr; }
+
+    // Frame number (nes_ppu::frame_count right after the frame completed) - 0 before the first frame
+    uint64_t sequence() const { return _sequence; }
+
+    // Palette indices - see nes_ppu::frame_buffer
+    const uint8_t *pixels() const { return _pixels; }
+
+    void release();
+
+private :
+    friend class nes_frame_pool;
+
+    nes_frame_ref(nes_frame_pool *pool, int slot, uint64_t sequence, const uint8_t *pixels)
+        :_pool(pool), _slot(slot), _sequence(sequence), _pixels(pixels)
+    {}
+
+private :
+    nes_frame_pool *_pool;
+    int _slot;
+    uint64_t _sequence;
+    const uint8_t *_pixels;
+};
+
+//
+// Completed frames PPU publishes, so that other threads (renderer, encoder, exporters) can read them
+// without locking or blocking emulation.
+//
+// Publishing copies the frame into the write slot and makes it the latest frame (a single atomic
+// store), then moves on to a slot nobody is reading. Readers pin the latest slot by bumping its reader
+// count and checking it is still the latest afterwards - the pool never picks a pinned slot or the
+// latest one, so a pinned frame can't change underneath the reader. If readers hold every other slot
+// the frame is dropped (counted in dropped_count) rather than waiting. PPU renders into buffers of its
+// own, so a dropped frame only means readers see an older frame - emulation state is never affected.
+//
+// Everything except acquire / latest_sequence / dropped_count is for the emulation thread only.
+//
+class nes_frame_pool
+{
+public :
+    // Frames go in arena if there is one
+    nes_frame_pool(size_t frame_size, nes_arena *arena = nullptr);
+
+    // Clears all frames - nobody should be holding a frame at this point
+    void reset();
+
+    // Makes a copy of pixels the latest frame. Returns false if it got dropped instead
+    bool publish(const uint8_t *pixels, uint64_t sequence);
+
+    //
+    // Any thread
+    //
+    nes_frame_ref acquire();
+    uint64_t latest_sequence() const { return _latest_sequence.load(memory_order_acquire); }
+    uint64_t dropped_count() const { return _dropped_count.load(memory_order_relaxed); }
+
+private :
+    friend class nes_frame_ref;
+
+    void release(int slot) { _slots[slot].readers--; }
+
+private :
+    struct slot
+    {
+        uint8_t *pixels;
+        atomic<uint32_t> readers;
+        uint64_t sequence;
+    };
+
+    slot _slots[NES_FRAME_POOL_SIZE];
+    unique_ptr<uint8_t[]> _owned_pixels;    // every slot's pixels when not in an arena
+    size_t _frame_size;
+    int _write;                             // slot the next frame gets copied into
+    atomic<int> _latest;                    // slot of the latest complete frame
+    atomic<uint64_t> _latest_sequence;
+    atomic<uint64_t> _dropped_count;
+};
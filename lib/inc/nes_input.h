@@ -4,14 +4,20 @@
 // http://wiki.nesdev.com/w/index.php/Standard_controller
 
 #include <cstdint>
+#include <cstring>
 #include <memory>
 #include <vector>
 
 #include <nes_component.h>
 
+class nes_replay;
+
 #define NES_CONTROLLER_STROBE_BIT 0x1
 #define NES_MAX_PLAYER 4
 
+// Frame number that is never reached - the latched snapshot hasn't been polled yet
+#define NES_INPUT_NO_FRAME 0xffffffff
+
 // The controller are reported always in bit 0 in the order of
 // A, B, Select, Start, Up, Down, Left, Right
 // When shifting them leftwards, you get the following bits
@@ -28,6 +34,24 @@ enum nes_button_flags : uint8_t
     nes_button_flags_right = 0x1
 };
 
+//
+// How strobing the controllers gets each port's buttons
+//
+enum nes_input_latch_mode
+{
+    // nes_input_device::poll_status of every port on every strobe - devices see every strobe
+    nes_input_latch_mode_poll,
+
+    // Every port is polled once per frame (first strobe in it) into a snapshot, and strobes copy
+    // from the snapshot. Same buttons as polling for devices that only change between frames (input
+    // streams, replays) - what register_input_stream / register_input_replay switch to
+    nes_input_latch_mode_frame,
+
+    // Devices are never polled by strobes - the snapshot only changes through latch_inputs /
+    // set_latched_buttons, e.g. buttons of a batch of agents being set before each run_frame
+    nes_input_latch_mode_manual
+};
+
 class nes_input_device
 {
 public:
@@ -42,7 +66,7 @@ public:
     bool deserialize(const uint8_t *data, size_t size, size_t &offset);
 
 public:
-    virtual void power_on(nes_system *system) { init(); }
+    virtual void power_on(nes_system *system) { _system = system; init(); }
     virtual void reset() { init(); }
     virtual void step_to(nes_cycle_t count) {}
 
@@ -50,17 +74,44 @@ public:
     void unregister_input(int id) { _user_inputs[id] = nullptr; }
     void unregister_all_inputs() { for (auto &input : _user_inputs) input = nullptr; }
 
+    // Plays back recorded buttons - stream[i] is what is held during frame i (see doc/replay_input_log.md)
+    void register_input_stream(int id, const std::vector<nes_button_flags> &stream);
+
+    // Plays back player's buttons from a binary replay (see nes_replay)
+    void register_input_replay(int id, std::shared_ptr<nes_replay> replay, uint32_t player);
+
+    //
+    // Latched input snapshot - see nes_input_latch_mode
+    //
+    void set_latch_mode(nes_input_latch_mode mode) { _latch_mode = mode; _latched_frame = NES_INPUT_NO_FRAME; }
+    nes_input_latch_mode latch_mode() const { return _latch_mode; }
+
+    // Polls every port into the snapshot right now
+    void latch_inputs();
+
+    void set_latched_buttons(int id, nes_button_flags buttons) { _latched_flags[id] = buttons; }
+    void set_latched_buttons(const nes_button_flags (&buttons)[NES_MAX_PLAYER]) { memcpy(_latched_flags, buttons, sizeof(_latched_flags)); }
+    nes_button_flags latched_buttons(int id) const { return _latched_flags[id]; }
+
 private:
     void init();
     void reload();
+    void poll_inputs(nes_button_flags (&buttons)[NES_MAX_PLAYER]);
 
 public:
     void write_CONTROLLER(uint8_t val);
     uint8_t read_CONTROLLER(uint8_t id);
 
 public:
+    nes_system *_system;
     bool _strobe_on;
     nes_button_flags _button_flags[NES_MAX_PLAYER];
     uint8_t _button_id[NES_MAX_PLAYER];
     std::shared_ptr<nes_input_device> _user_inputs[NES_MAX_PLAYER];
+
+    // Not part of the serialized state - in frame mode it is polled again from the devices (which
+    // only depend on the frame), and in manual mode it is whatever the owner sets
+    nes_input_latch_mode _latch_mode = nes_input_latch_mode_poll;
+    nes_button_flags _latched_flags[NES_MAX_PLAYER] = {};
+    uint32_t _latched_frame = NES_INPUT_NO_FRAME;       // frame _latched_flags was polled in
 };
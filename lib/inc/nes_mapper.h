@@ -247,8 +247,18 @@ public:
         uint8_t reserved[5];
     };
 
-    static shared_ptr<nes_mapper> load_from(const char *path)
+    // Traces go to tracer - the loading system's
+    static shared_ptr<nes_mapper> load_from(const char *path, nes_tracer *tracer = &nes_tracer::get())
+    {
+        return nes_rom_loader(tracer).load(path);
+    }
+
+private :
+    nes_rom_loader(nes_tracer *tracer) : _tracer(tracer) {}
 
+    nes_tracer *nes_trace_context() const { return _tracer; }
+
+    shared_ptr<nes_mapper> load(const char *path)
     {
         NES_TRACE1("[NES_ROM] Opening NES ROM file '" << path << "' ...");
 
@@ -314,4 +324,7 @@ public:
         file.close();
         return mapper;
     }
+
+private :
+    nes_tracer *_tracer;
 };
@@ -3,23 +3,60 @@
 #include <vector>
 #include <cassert>
 #include <memory>
+#include <functional>
 
 #include <nes_component.h>
 #include <nes_mapper.h>
+#include <nes_dirty.h>
+#include <nes_arena.h>
 
 using namespace std;
 
 #define RAM_SIZE 0x10000
 
+// Page table granularity - 256 pages of 256 bytes
+#define NES_MEMORY_PAGE_SHIFT 8
+#define NES_MEMORY_PAGE_COUNT (RAM_SIZE >> NES_MEMORY_PAGE_SHIFT)
+
+// One bit per watch in nes_watch_mask
+#define NES_MEMORY_MAX_WATCHES 64
+
+enum nes_memory_page_flags : uint8_t
+{
+    nes_memory_page_flags_none = 0,
+
+    // Writes to the page are checked against the watch list
+    nes_memory_page_flags_watched = 0x1,
+
+    // Dirty tracking is on and the page hasn't been written this epoch - the first write marks it
+    // dirty and drops the flag
+    nes_memory_page_flags_clean = 0x2,
+};
+
+// Bit n set - watch n changed
+typedef uint64_t nes_watch_mask;
+
+// Called on the emulation thread as the write happens - addr is after mirroring is folded
+typedef function<void(int watch_id, uint16_t addr, uint8_t old_value, uint8_t new_value)> nes_watch_callback;
+
+struct nes_memory_watch
+{
+    uint16_t addr = 0;              // first byte, mirrors folded ($0800 is watched as $0000)
+    uint16_t size = 0;              // 0 for a free watch slot
+    nes_watch_callback callback;
+};
+
 class nes_mapper;
 class nes_ppu;
 
 class nes_memory : public nes_component
 {
 public :
-    nes_memory()
+    // RAM goes in arena if there is one (see nes_system)
+    nes_memory(nes_arena *arena = nullptr)
     {
-        _ram.assign(RAM_SIZE, 0);
+        _ram = nes_arena::allocate_buffer(arena, RAM_SIZE, _ram_owned);
+        _code_generation = 0;
     }
 
     bool is_io_reg(uint16_t addr)
@@ -33,6 +70,12 @@ public :
         return false;
     }
 
+    bool is_ppu_reg(uint16_t addr)
+    {
+        // $2000~$2007, and $4014 OAMDMA
+        return ((addr & 0xfff8) == 0x2000) || addr == 0x4014;
+    }
+
     uint8_t read_io_reg(uint16_t addr);
     void write_io_reg(uint16_t addr, uint8_t val);
 
@@ -57,7 +100,12 @@ public :
     {
         assert(size + addr <= RAM_SIZE);
         redirect_addr(addr);
+        if (_dirty)
+            mark_dirty(addr, size);
+        if (_watched_pages)
+            check_watches(addr, data, size);
         memcpy_s(&_ram[0] + addr, RAM_SIZE - addr, data, size);
+        _code_generation++;
     }
 
     void get_bytes(uint8_t *dest, uint16_t dest_size, uint16_t src_addr, size_t src_size)
@@ -90,9 +138,49 @@ public :
 
     void load_mapper(shared_ptr<nes_mapper> &mapper);
 
-    const uint8_t *ram_data() const { return _ram.data(); }
-    uint8_t *ram_data() { return _ram.data(); }
-    size_t ram_size() const { return _ram.size(); }
+    const uint8_t *ram_data() const { return _ram; }
+    uint8_t *ram_data() { return _ram; }
+    size_t ram_size() const { return RAM_SIZE; }
+
+    // Changes whenever PRG ROM might have changed (bank switching, loading ROM / state, etc)
+    // so that anything decoded from it can be thrown away
+    uint32_t code_generation() const { return _code_generation; }
+
+    //
+    // RAM watches - feature extraction without diffing RAM every frame. Only pages with a watch on
+    // them are flagged in the page table, so writes anywhere else cost a single flag test. A write
+    // that changes a watched byte sets the watch's bit in the changed mask (and calls its callback).
+    // Writing a byte back to its old value within a frame still counts as a change
+    //
+
+    // Watches size bytes from addr - returns the watch id, or -1 if all NES_MEMORY_MAX_WATCHES are
+    // taken or the range is empty / out of the address space
+    int add_watch(uint16_t addr, uint16_t size = 1, nes_watch_callback callback = nullptr);
+    void remove_watch(int watch_id);
+    void clear_watches();
+
+    const nes_memory_watch &watch(int watch_id) const { return _watches[watch_id]; }
+
+    // Watches changed since the last take_changed_watches - typically called once after each frame
+    nes_watch_mask changed_watches() const { return _changed_watches; }
+    nes_watch_mask take_changed_watches()
+    {
+        nes_watch_mask changed = _changed_watches;
+        _changed_watches = 0;
+        return changed;
+    }
+
+    // Same as take_changed_watches, as a list of watch ids - the compact per frame change vector
+    void take_changed_watches(vector<int> &watch_ids);
+
+    uint8_t page_flags(uint16_t addr) const { return _page_flags[addr >> NES_MEMORY_PAGE_SHIFT]; }
+
+    // Where page_flags(addr) is kept - for code that checks it without calling in (see nes_cpu_jit)
+    const uint8_t *page_flags_ptr(uint16_t addr) const { return &_page_flags[addr >> NES_MEMORY_PAGE_SHIFT]; }
+
+    // Writes mark their page in dirty (NES_DIRTY_RAM_PAGE_SHIFT pages) from now on, or nothing if it is
+    // nullptr. Pages dirty already are left alone - call again after clearing dirty to start over
+    void track_dirty_pages(nes_dirty_bitmap *dirty);
 
     nes_mapper& get_mapper() { return *_mapper; }
     bool has_mapper() const { return _mapper != nullptr; }
@@ -116,7 +204,13 @@ public :
     }
 
 private :
-    vector<uint8_t>        _ram;
+    void check_watches(uint16_t addr, const uint8_t *data, size_t size);
+    void update_page_flags();
+    void mark_dirty(uint16_t addr, size_t size);
+
+private :
+    uint8_t                *_ram;           // RAM_SIZE
+    unique_ptr<uint8_t[]>  _ram_owned;      // _ram when not in an arena
     shared_ptr<nes_mapper> _mapper;
 
     nes_system *_system;
@@ -124,4 +218,13 @@ private :
     nes_input *_input;
 
     nes_mapper_info _mapper_info;
+
+    uint32_t _code_generation;      // see code_generation
+
+    nes_memory_watch _watches[NES_MEMORY_MAX_WATCHES];
+    nes_watch_mask _changed_watches = 0;
+    nes_watch_mask _page_watches[NES_MEMORY_PAGE_COUNT] = {};          // watches overlapping each page
+    uint8_t _page_flags[NES_MEMORY_PAGE_COUNT] = {};                    // nes_memory_page_flags
+    uint32_t _watched_pages = 0;                                        // pages flagged watched
+    nes_dirty_bitmap *_dirty = nullptr;                                 // see track_dirty_pages
 };
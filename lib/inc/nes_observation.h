@@ -0,0 +1,102 @@
+//=================================================================================================
+// NESChan
+// Author: Yi Zhang (yizhang82@outlook.com)
+//=================================================================================================
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+// Rows at the top and bottom that most TVs cut off - games tend to leave garbage in them
+#define NES_OBSERVATION_OVERSCAN_ROWS 8
+
+// Largest nes_observation_stack depth
+#define NES_OBSERVATION_MAX_STACK 64
+
+enum nes_observation_format
+{
+    // Palette indices as they are - downsampling keeps the top left pixel of each block
+    nes_observation_format_palette,
+
+    // 0~255 luma of each palette color (BT.601, full range) - downsampling averages each block
+    nes_observation_format_luma
+};
+
+struct nes_observation_spec
+{
+    nes_observation_format format;
+    uint32_t downsample;            // 1, 2 or 4 in both directions
+    bool crop_overscan;             // drop NES_OBSERVATION_OVERSCAN_ROWS at the top and bottom
+};
+
+//
+// Turns frames (nes_system_snapshot::frame_buffer, nes_frame_ref::pixels, etc.) into model
+// observations in one pass, straight into the caller's buffer - cropping, grayscale and area
+// downsampling happen a few rows at a time without a full size intermediate frame. The kernels use
+// SSE2 / SSSE3 where the CPU has them and plain loops otherwise - both give identical results
+//
+class nes_observation
+{
+public :
+    // spec needs to be valid (see is_valid)
+    explicit nes_observation(const nes_observation_spec &spec);
+
+    static bool is_valid(const nes_observation_spec &spec);
+
+    const nes_observation_spec &spec() const { return _spec; }
+    uint32_t width() const { return _width; }
+    uint32_t height() const { return _height; }
+    size_t size() const { return size_t(_width) * _height; }
+
+    // Writes size() bytes, row after row
+    void transform(const uint8_t *frame, uint8_t *out) const;
+
+    // Luma of each of the NES palette colors
+    static const uint8_t *luma_palette();
+
+    // Turns SIMD kernels off (or back on, if the CPU has them) for the whole process - for comparing
+    // against the plain loops
+    static void enable_simd(bool enabled);
+    static bool simd_enabled();
+
+private :
+    nes_observation_spec _spec;
+    uint32_t _width;
+    uint32_t _height;
+    uint32_t _first_row;
+};
+
+//
+// Last depth observations of consecutive frames (frame stacking). Observations are transformed
+// straight into a ring, so pushing a frame costs one transform and nothing gets shifted around
+//
+class nes_observation_stack
+{
+public :
+    // spec needs to be valid, and depth 1 ~ NES_OBSERVATION_MAX_STACK
+    nes_observation_stack(const nes_observation_spec &spec, uint32_t depth);
+
+    const nes_observation &observation() const { return _observation; }
+    uint32_t depth() const { return _depth; }
+
+    void push(const uint8_t *frame);
+
+    // Back to all zero observations - e.g. when a new episode starts
+    void clear();
+
+    // age 0 is the latest frame pushed. Frames before the first push are all zero
+    const uint8_t *get(uint32_t age) const;
+
+    // Writes depth * observation().size() bytes, oldest first
+    void copy_to(uint8_t *out) const;
+
+private :
+    nes_observation _observation;
+    uint32_t _depth;
+    uint32_t _latest;
+    vector<uint8_t> _ring;
+};
@@ -0,0 +1,99 @@
+//=================================================================================================
+// NESChan
+// Author: Yi Zhang (yizhang82@outlook.com)
+//=================================================================================================
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define NES_PERF_HAS_RDTSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define NES_PERF_HAS_RDTSC 1
+#endif
+
+using namespace std;
+
+// I/O registers counted individually - $2000~$2007 first, then $4000~$401f
+#define NES_PERF_PPU_REG_COUNT 8
+#define NES_PERF_APU_IO_REG_COUNT 0x20
+#define NES_PERF_IO_REG_COUNT (NES_PERF_PPU_REG_COUNT + NES_PERF_APU_IO_REG_COUNT)
+
+// Timestamp for nes_perf_counters timing - TSC ticks where available, nanoseconds otherwise
+inline uint64_t nes_perf_ticks()
+{
+#ifdef NES_PERF_HAS_RDTSC
+    return __rdtsc();
+#else
+    return uint64_t(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+//
+// Per frame hot path counters (see nes_system::enable_perf_counters)
+//
+// Everything is a plain increment on a field the component already has a pointer to, so they are
+// cheap enough to leave on - the only real cost is the timestamps taken around CPU / PPU stepping.
+//
+struct nes_perf_counters
+{
+    uint32_t frame;                             // PPU frame these are for
+
+    //
+    // CPU
+    //
+    uint64_t instructions;                      // instructions retired
+    uint64_t opcodes[0x100];                    // instructions retired per op code
+    uint64_t io_reads[NES_PERF_IO_REG_COUNT];   // see nes_perf_counters::io_reg_index
+    uint64_t io_writes[NES_PERF_IO_REG_COUNT];
+    uint64_t bank_switches;                     // mapper register writes
+    uint64_t oam_dmas;
+    uint64_t nmis;
+    uint64_t idle_loop_cycles_skipped;          // PPU cycles skipped by idle loop detection
+
+    //
+    // PPU
+    //
+    uint64_t ppu_syncs;                         // times PPU caught up to the CPU
+    uint64_t ppu_status_fast;                   // PPUSTATUS reads answered without catching PPU up
+    uint64_t ppu_status_slow;                   // PPUSTATUS reads that had to catch PPU up
+    uint64_t scanlines;
+    uint64_t render_scanlines;                  // visible scanlines with background / sprites on
+
+    //
+    // Time - see nes_perf_ticks
+    //
+    uint64_t cpu_ticks;                         // inside nes_system::step, minus PPU
+    uint64_t ppu_ticks;                         // catching up PPU
+    uint64_t apu_ticks;                         // APU isn't stepped by nes_system yet - always 0
+    uint64_t frontend_ticks;                    // between nes_system::step calls
+
+    void clear(uint32_t frame_count)
+    {
+        *this = {};
+        frame = frame_count;
+    }
+
+    // Index into io_reads / io_writes for I/O register at addr
+    static int io_reg_index(uint16_t addr)
+    {
+        if ((addr & 0xfff8) == 0x2000)
+            return addr & 0x7;
+        return NES_PERF_PPU_REG_COUNT + (addr & 0x1f);
+    }
+
+    static uint16_t io_reg_addr(int index)
+    {
+        if (index < NES_PERF_PPU_REG_COUNT)
+            return uint16_t(0x2000 + index);
+        return uint16_t(0x4000 + index - NES_PERF_PPU_REG_COUNT);
+    }
+
+    // Single line JSON object - zero op code / I/O register counts are left out
+    string to_json() const;
+};
@@ -8,6 +8,9 @@
 #include <nes_cycle.h>
 #include <nes_trace.h>
 #include <nes_mapper.h>
+#include <nes_frame.h>
+#include <nes_dirty.h>
+#include <nes_arena.h>
 
 // PPU has its own separate 16KB memory address space
 // http://wiki.nesdev.com/w/index.php/PPU_memory_map
@@ -82,6 +85,7 @@
 #define PPUSTATUS_VBLANK_START 0x80
 
 #define PPU_SCREEN_X 256
+#define PPU_PALETTE_COLOR_COUNT 0x40
 #define PPU_SCREEN_Y 240
 
 #define PPU_SCANLINE_COUNT 262
@@ -124,10 +128,16 @@ private :
 class nes_ppu : public nes_component
 {
 public :
-    nes_ppu() 
+    // VRAM, OAM and frames go in arena if there is one (see nes_system)
+    nes_ppu(nes_arena *arena = nullptr)
+        :_frames(PPU_SCREEN_Y * PPU_SCREEN_X, arena)
     {
-        _vram = make_unique<uint8_t[]>(PPU_VRAM_SIZE);
-        _oam = make_unique<uint8_t[]>(PPU_OAM_SIZE);
+        _vram = nes_arena::allocate_buffer(arena, PPU_VRAM_SIZE, _vram_owned);
+        _oam = nes_arena::allocate_buffer(arena, PPU_OAM_SIZE, _oam_owned);
+
+        // Latest and in-progress frame - each on its own cache line in an arena
+        _latest_frame = nes_arena::allocate_buffer(arena, nes_arena::aligned_size(frame_size()) * 2, _frame_buffers_owned);
+        _frame_buffer = _latest_frame + nes_arena::aligned_size(frame_size());
     }
     
     ~nes_ppu();
@@ -142,6 +152,11 @@ public :
 
     virtual void step_to(nes_cycle_t count);
 
+public :
+    // Tracer of the system - what the trace macros resolve to in here (see nes_trace_context)
+    nes_tracer *nes_trace_context() const { return _tracer; }
+    void set_tracer(nes_tracer *tracer) { _tracer = tracer; }
+
 public :
     void init();
 
@@ -153,6 +168,25 @@ public :
 
     bool is_ready() { return _master_cycle > nes_ppu_cycle_t(29658); }
 
+    // Cycle PPU has caught up to - it lags behind CPU (see nes_system::sync_ppu)
+    nes_cycle_t cycle() const { return _master_cycle; }
+
+    // PPU is stepped lazily (see nes_system::step). This is the earliest cycle where PPU has
+    // something to tell the rest of the system on its own - VBlank NMI or frame boundary.
+    // Everything else (PPUSTATUS, sprite 0 hit, etc) is only observable through register access
+    // which catches up PPU anyway
+    nes_cycle_t next_event_cycle() const { return _next_event_cycle; }
+
+    // Earliest cycle where any of the PPUSTATUS flags (VBlank, sprite 0 hit, sprite overflow) could
+    // change. Reading PPUSTATUS before that doesn't need PPU to catch up - this is what keeps games
+    // spinning on $2002 for sprite 0 hit from forcing a catch-up on every single read.
+    // Sprite 0 hit / overflow are predicted from OAM, name table and pattern table - any write to
+    // those goes through catch-up first (see nes_system::sync_ppu) which invalidates the prediction
+    nes_cycle_t next_status_change_cycle();
+
+    // Cycle where the frame in progress ends (PPU wraps from scanline 261 to 0)
+    nes_cycle_t next_frame_cycle() const { return cycle_at(0, 0); }
+
     void stop_after_frame(uint32_t frame) 
     {
         _auto_stop = true;
@@ -161,6 +195,9 @@ public :
 
     bool is_render_off() { return !_show_bg && !_show_sprites; }
 
+    // Frames completed since power on
+    uint32_t frame_count() const { return _frame_count; }
+
     void load_mapper(shared_ptr<nes_mapper> &mapper);
 
     void serialize(vector<uint8_t> &out) const;
@@ -168,44 +205,66 @@ public :
 
     void set_mirroring(nes_mapper_flags flags);
 
-    // Returns the latest fully rendered frame buffer (double-buffered read buffer).
+    // Returns the latest fully rendered frame buffer.
     // Contract:
     // - This pointer always points to the completed frame.
-    // - It remains stable until the next frame boundary when swap_buffer() is called.
-    // - swap_buffer() is triggered when the PPU wraps from scanline 261 to 0.
+    // - It remains stable until the next frame boundary when publish_frame() is called.
+    // - publish_frame() is triggered when the PPU wraps from scanline 261 to 0.
     // - Returned pixels are NES palette indices (not expanded RGB).
-    const uint8_t *frame_buffer() const
-    {
-        // Return the completed buffer
-        if (_frame_buffer == _frame_buffer_1)
-            return _frame_buffer_2;
-        else
-            return _frame_buffer_1;
-    }
+    // - It is PPU's own copy - readers holding frames (acquire_frame) or suppress_frames don't change it.
+    // - Only meant for the emulation thread - other threads should use acquire_frame.
+    const uint8_t *frame_buffer() const { return _latest_frame; }
+    uint8_t *frame_buffer() { return _latest_frame; }
 
-    uint8_t *frame_buffer()
-    {
-        return const_cast<uint8_t *>(static_cast<const nes_ppu *>(this)->frame_buffer());
-    }
+    // Pins the latest completed frame so that any thread can read it while emulation keeps going
+    nes_frame_ref acquire_frame() { return _frames.acquire(); }
+
+    // Sequence (frame count) of the latest completed frame - any thread
+    uint64_t latest_frame_sequence() const { return _frames.latest_sequence(); }
+
+    // Frames not published because readers were holding all the other buffers
+    uint64_t dropped_frame_count() const { return _frames.dropped_count(); }
+
+    // 0x00RRGGBB of each of the NES palette colors
+    static const uint32_t *argb_palette();
+
+    // Converts a frame of palette indices (see frame_buffer) into PPU_SCREEN_X * PPU_SCREEN_Y 0x00RRGGBB pixels
+    static void frame_to_argb(const uint8_t *frame, uint32_t *pixels);
 
     uint16_t frame_width() const { return PPU_SCREEN_X; }
     uint16_t frame_height() const { return PPU_SCREEN_Y; }
     size_t frame_size() const { return size_t(PPU_SCREEN_X) * size_t(PPU_SCREEN_Y); }
 
-    const uint8_t *vram() const { return _vram.get(); }
+    const uint8_t *vram() const { return _vram; }
     size_t vram_size() const { return PPU_VRAM_SIZE; }
 
-    const uint8_t *oam() const { return _oam.get(); }
+    const uint8_t *oam() const { return _oam; }
     size_t oam_size() const { return PPU_OAM_SIZE; }
 
-    void swap_buffer()
+    // Writes to VRAM / OAM mark their page in vram / oam from now on - nullptr for no tracking
+    void track_dirty_pages(nes_dirty_bitmap *vram, nes_dirty_bitmap *oam)
     {
-        if (_frame_buffer == _frame_buffer_1)
-            _frame_buffer = _frame_buffer_2;
-        else
-            _frame_buffer = _frame_buffer_1;
+        _vram_dirty = vram;
+        _oam_dirty = oam;
     }
 
+    void publish_frame()
+    {
+        // PPU doesn't draw anything while rendering is off - keep going from the completed frame
+        memcpy(_latest_frame, _frame_buffer, frame_size());
+        if (!_frames_suppressed)
+            _frames.publish(_latest_frame, _frame_count);
+    }
+
+    //
+    // With frames suppressed nothing gets published to the frame pool, so nothing reading frames from
+    // PPU (acquire_frame, renderers) sees frames being re-simulated or states being loaded. Emulation
+    // and state are exactly the same either way, and frame_buffer still returns the latest frame.
+    // Turning suppression off publishes the latest frame rendered meanwhile
+    //
+    void suppress_frames(bool suppress);
+    bool frames_suppressed() const { return _frames_suppressed; }
+
 public :
 
     //
@@ -228,6 +287,8 @@ public :
         if (addr >= PPU_VRAM_SIZE)
             return;
 
+        if (_vram_dirty)
+            _vram_dirty->mark(addr);
         _vram[addr] = val;
     }
 
@@ -237,7 +298,9 @@ public :
             return;
 
         redirect_addr(addr);
-        memcpy_s(_vram.get() + addr, PPU_VRAM_SIZE - addr, src, src_size);
+        if (_vram_dirty)
+            _vram_dirty->mark_range(addr, src_size);
+        memcpy_s(_vram + addr, PPU_VRAM_SIZE - addr, src, src_size);
     }
 
     void redirect_addr(uint16_t &addr)
@@ -371,6 +434,8 @@ public :
     {
         write_latch(val);
 
+        if (_oam_dirty)
+            _oam_dirty->mark(_oam_addr);
         _oam[_oam_addr] = val;
         _oam_addr++;
     }
@@ -481,12 +546,76 @@ private :
         uint8_t pos_x;
     };
 
+    void schedule_next_event();
+
+    // Next cycle (after current one) when PPU reaches dot <dot> of <scanline>
+    nes_cycle_t cycle_at(int scanline, int dot) const;
+
+    nes_cycle_t predict_status_change();
+    nes_cycle_t predict_sprite_overflow();
+    nes_cycle_t predict_sprite_0_hit();
+    bool predict_bg_addr(int scanline, uint16_t &addr);
+    void predict_bg_row(int scanline, uint16_t addr, uint8_t *row);
+    bool sprite_0_overlaps(int scanline, const uint8_t *bg_row);
+
+    void fetch_sprite_bitplanes(sprite_info *sprite, int scanline, uint8_t &bitplane0, uint8_t &bitplane1);
+
+    bool is_sprite_in_range(uint8_t pos_y, int scanline)
+    {
+        // pos_y is off by 1
+        return (pos_y + 1 <= scanline && scanline < pos_y + 1 + _sprite_height);
+    }
+
+    // Increment coarse X, wrapping to the next horizontal name table
+    static void increment_x(uint16_t &addr)
+    {
+        if ((addr & 0x1f) == 0x1f)
+        {
+            // Wrap to the next name table
+            addr &= ~0x1f;
+            addr ^= 0x0400;
+        }
+        else
+        {
+            addr++;
+        }
+    }
+
+    // Increment fine Y, overflowing into coarse Y and wrapping to the next vertical name table
+    static void increment_y(uint16_t &addr)
+    {
+        if ((addr & 0x7000) != 0x7000)
+        {
+            // Increase fine Y position (within tile)
+            addr += 0x1000;
+        }
+        else
+        {
+            addr &= ~0x7000;
+
+            // == row 29?
+            if ((addr & 0x3e0) != 0x3a0)
+            {
+                // Increase coarse Y position (next tile)
+                addr += 0x20;
+            }
+            else
+            {
+                // wrap around
+                addr &= ~0x3e0;
+
+                // switch to another vertical name table
+                addr ^= 0x0800;
+            }
+        }
+    }
+
     sprite_info *get_sprite(uint8_t sprite_id)
     {
         assert(sprite_id < PPU_SPRITE_MAX);
 
         // sprite info resides in OAM memory and there are 64 sprites x 4 bytes each = 256 bytes
-        return &((sprite_info *)_oam.get())[sprite_id];
+        return &((sprite_info *)_oam)[sprite_id];
     }
 
     uint8_t get_palette_color(bool is_background, uint8_t palette_index_4_bit)
@@ -522,9 +651,17 @@ private :
 
  private :
     nes_system *_system;
+    nes_tracer *_tracer = nullptr;              // system's tracer, or nullptr for none
+
+    uint8_t *_vram;
+    uint8_t *_oam;
+    unique_ptr<uint8_t[]> _vram_owned;          // _vram / _oam when not in an arena
+    unique_ptr<uint8_t[]> _oam_owned;
+
+    nes_dirty_bitmap *_vram_dirty = nullptr;    // see track_dirty_pages
+    nes_dirty_bitmap *_oam_dirty = nullptr;
 
-    unique_ptr<uint8_t[]> _vram;
-    unique_ptr<uint8_t[]> _oam;
+    bool _frames_suppressed = false;            // see suppress_frames
 
     // PPUCTRL data
     uint16_t _name_tbl_addr;
@@ -567,6 +704,9 @@ private :
     uint8_t _vram_read_buf;             // delayed VRAM reads
 
     nes_cycle_t _master_cycle;
+    nes_cycle_t _next_event_cycle;      // earliest cycle PPU needs to catch up to - see next_event_cycle
+    nes_cycle_t _status_change_cycle;   // cached next_status_change_cycle
+    bool _status_change_valid;          // _status_change_cycle is up to date
     nes_ppu_cycle_t _scanline_cycle;
     int _cur_scanline;
     uint32_t _frame_count;
@@ -579,10 +719,11 @@ private :
     uint8_t _tile_index;                // tile index from name table - it consists of 
     uint8_t _tile_palette_bit32;        // palette index bit 3/2 from attribute table
     uint8_t _bitplane0;                 // bitplane0 of current tile from pattern table
-    uint8_t *_frame_buffer;             // entire frame buffer - only 4 bit is used
-    uint8_t _frame_buffer_1[PPU_SCREEN_Y * PPU_SCREEN_X];   // frame buffer 1 - used for double buffering
+    uint8_t *_frame_buffer;             // frame being rendered - only 4 bit is used
+    uint8_t *_latest_frame;             // last completed frame - see frame_buffer
+    unique_ptr<uint8_t[]> _frame_buffers_owned; // _latest_frame / _frame_buffer when not in an arena
+    nes_frame_pool _frames;             // copies of completed frames handed out to readers
     uint8_t _frame_buffer_bg[PPU_SCREEN_Y * PPU_SCREEN_X];  // sprite 0 hit detection
-    uint8_t _frame_buffer_2[PPU_SCREEN_Y * PPU_SCREEN_X];   // frame buffer 2 - used for double buffering
     uint8_t _pixel_cycle[8];            // pixels in each cycle
     uint8_t _shift_reg;                 // which bit do we care about
     uint8_t _x_offset;                  // current X offset
@@ -0,0 +1,176 @@
+//=================================================================================================
+// NESChan
+// Author: Yi Zhang (yizhang82@outlook.com)
+//=================================================================================================
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Frames that can be pending to be written by nes_frame_recorder - ~4MB of palette indices
+#define NES_RECORDER_QUEUE_SIZE 64
+
+// Frames per chunk in nes_frame_archive_sink
+#define NES_FRAME_ARCHIVE_CHUNK_FRAMES 60
+
+//
+// Where recorded frames go. Frames are palette indices (see nes_ppu::frame_buffer) tagged with their
+// frame number - numbers skip if frames got dropped. Sinks are only ever called from the recorder's
+// writer thread, and return false if they can't write (stops the recording)
+//
+class nes_frame_sink
+{
+public :
+    virtual ~nes_frame_sink() {}
+
+    virtual bool begin(uint16_t width, uint16_t height) = 0;
+    virtual bool write_frame(uint64_t sequence, const uint8_t *pixels) = 0;
+    virtual bool end() { return true; }
+
+    // Picks a sink by path: *.y4m => nes_y4m_sink, *.rgb or '-' (stdout) => nes_rgb24_sink,
+    // anything else => nes_frame_archive_sink
+    static unique_ptr<nes_frame_sink> create(const string &path);
+};
+
+//
+// Base for sinks writing to a file, or stdout if path is '-'
+//
+class nes_file_frame_sink : public nes_frame_sink
+{
+public :
+    nes_file_frame_sink(const string &path)
+        :_path(path), _file(nullptr), _width(0), _height(0)
+    {}
+
+    ~nes_file_frame_sink();
+
+    virtual bool begin(uint16_t width, uint16_t height);
+    virtual bool end();
+
+protected :
+    bool write(const void *data, size_t size) { return fwrite(data, 1, size, _file) == size; }
+
+protected :
+    string _path;
+    FILE *_file;
+    uint16_t _width;
+    uint16_t _height;
+};
+
+//
+// YUV4MPEG2 (4:4:4) video - plays in mpv / ffplay and goes straight into ffmpeg
+//
+class nes_y4m_sink : public nes_file_frame_sink
+{
+public :
+    nes_y4m_sink(const string &path);
+
+    virtual bool begin(uint16_t width, uint16_t height);
+    virtual bool write_frame(uint64_t sequence, const uint8_t *pixels);
+
+private :
+    uint8_t _palette_yuv[3][0x40];
+    vector<uint8_t> _planes;
+};
+
+//
+// Headerless RGB24 frames back to back - meant to be piped into something like
+// ffmpeg -f rawvideo -pix_fmt rgb24 -s 256x240 -r 60.0988 -i -
+//
+class nes_rgb24_sink : public nes_file_frame_sink
+{
+public :
+    nes_rgb24_sink(const string &path)
+        :nes_file_frame_sink(path)
+    {}
+
+    virtual bool write_frame(uint64_t sequence, const uint8_t *pixels);
+
+private :
+    vector<uint8_t> _rgb;
+};
+
+//
+// Lossless archive of palette indices with their frame numbers, for dataset generation
+//
+// File format (little-endian):
+//   header: magic 'NESF', version, width, height
+//   chunks: frame count, then (frame number, width * height palette indices) per frame
+//
+class nes_frame_archive_sink : public nes_file_frame_sink
+{
+public :
+    nes_frame_archive_sink(const string &path)
+        :nes_file_frame_sink(path), _chunk_frames(0)
+    {}
+
+    ~nes_frame_archive_sink() { end(); }
+
+    virtual bool begin(uint16_t width, uint16_t height);
+    virtual bool write_frame(uint64_t sequence, const uint8_t *pixels);
+    virtual bool end();
+
+    // Reads the entire archive. Returns false if it isn't a valid frame archive
+    static bool read(const char *path, function<void(uint64_t sequence, const uint8_t *pixels, uint16_t width, uint16_t height)> callback);
+
+private :
+    bool flush_chunk();
+
+private :
+    vector<uint8_t> _chunk;
+    uint32_t _chunk_frames;
+};
+
+//
+// Records frames to a sink in the background. record is a copy into a preallocated queue slot - the
+// writer thread does the converting and IO. If the writer falls a whole queue behind (slow disk, or
+// the other end of the pipe not keeping up) the frame is dropped and counted instead of making
+// emulation wait
+//
+class nes_frame_recorder
+{
+public :
+    nes_frame_recorder(unique_ptr<nes_frame_sink> sink, uint16_t width, uint16_t height);
+    ~nes_frame_recorder();
+
+    // Single producer. Returns false if the frame got dropped (queue full, or sink failed)
+    bool record(uint64_t sequence, const uint8_t *pixels);
+
+    // Waits for the queued frames to be written and ends the sink. Returns false if the sink failed
+    bool stop();
+
+    uint64_t recorded_count() const { return _recorded_count; }
+    uint64_t dropped_count() const { return _dropped_count; }
+    bool failed() const { return _failed; }
+
+private :
+    void write_loop();
+    bool write_pending();
+
+private :
+    unique_ptr<nes_frame_sink> _sink;
+    uint16_t _width;
+    uint16_t _height;
+    size_t _frame_size;
+    unique_ptr<uint8_t[]> _frames;          // NES_RECORDER_QUEUE_SIZE frames of palette indices
+    uint64_t _sequences[NES_RECORDER_QUEUE_SIZE];
+
+    atomic<uint64_t> _head;                 // next frame to record - only written by producer
+    atomic<uint64_t> _tail;                 // next frame to write - only written by writer thread
+
+    atomic<uint64_t> _recorded_count;
+    atomic<uint64_t> _dropped_count;
+    atomic<bool> _failed;
+
+    atomic<bool> _stop;
+    thread _thread;
+};
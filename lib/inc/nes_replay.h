@@ -0,0 +1,229 @@
+//=================================================================================================
+// NESChan
+// Author: Yi Zhang (yizhang82@outlook.com)
+//=================================================================================================
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "nes_input.h"
+#include "nes_system.h"
+
+using namespace std;
+
+// Frames between index entries - a lookup scans at most this many runs
+#define NES_REPLAY_INDEX_INTERVAL 256
+
+// Default frames between keyframes - a minute of gameplay
+#define NES_REPLAY_KEYFRAME_INTERVAL 3600
+
+//
+// Binary replay file (see doc/replay_input_log.md). Laid out so that it can be used straight out of
+// a memory mapped file - little-endian, every struct at an offset aligned to its size:
+//
+//   nes_replay_header
+//   nes_replay_keyframe_info (version 2 and up)
+//   nes_replay_player[player_count]
+//   per player: uint32_t index[index_count], nes_replay_run runs[run_count]
+//   keyframes (optional): nes_replay_keyframe[keyframe_count], then the states they point to
+//   frame hashes (optional): uint64_t hashes[hash_count]
+//
+struct nes_replay_header
+{
+    uint32_t magic;                 // 'NESR'
+    uint32_t version;
+    uint64_t rom_hash;              // nes_replay::hash_file of the ROM - 0 if unknown
+    uint64_t start_state_hash;      // nes_state_blob::hash right after power on + reset - 0 if unknown
+    uint32_t frame_count;           // frames with input - no buttons afterwards
+    uint32_t player_count;
+};
+
+static_assert(sizeof(nes_replay_header) == 32, "nes_replay_header is part of the replay file format");
+
+//
+// Emulator states embedded so that a replay can be picked up anywhere without emulating everything
+// before it. State of frame f is the state when nes_system::run_frame completes frame f - f = 0 is
+// right after power on + reset
+//
+struct nes_replay_keyframe_info
+{
+    uint64_t keyframes_offset;
+    uint64_t hashes_offset;         // hashes[f] is nes_state_blob::hash of the state of frame f
+    uint32_t keyframe_interval;     // frames between keyframes - 0 if there are none
+    uint32_t keyframe_count;
+    uint32_t hash_count;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(nes_replay_keyframe_info) == 32, "nes_replay_keyframe_info is part of the replay file format");
+
+struct nes_replay_keyframe
+{
+    uint32_t frame;
+    uint32_t reserved;
+    uint64_t state_offset;          // nes_state_blob::data
+    uint64_t state_size;
+};
+
+static_assert(sizeof(nes_replay_keyframe) == 24, "nes_replay_keyframe is part of the replay file format");
+
+struct nes_replay_player
+{
+    uint64_t index_offset;          // index[i] is the run frame i * NES_REPLAY_INDEX_INTERVAL is in
+    uint64_t runs_offset;
+    uint32_t index_count;
+    uint32_t run_count;
+};
+
+static_assert(sizeof(nes_replay_player) == 24, "nes_replay_player is part of the replay file format");
+
+// Buttons held from start_frame until the next run starts
+struct nes_replay_run
+{
+    uint32_t start_frame;
+    uint8_t buttons;                // nes_button_flags
+    uint8_t reserved[3];
+};
+
+static_assert(sizeof(nes_replay_run) == 8, "nes_replay_run is part of the replay file format");
+
+//
+// Read-only view of a memory mapped replay file. Nothing gets parsed or expanded up front - opening
+// only validates the layout, and looking up the buttons of any frame is an index lookup plus a scan
+// of at most NES_REPLAY_INDEX_INTERVAL runs, however long the replay is
+//
+class nes_replay
+{
+public :
+    ~nes_replay();
+
+    // Returns nullptr if the file can't be mapped or isn't a valid replay
+    static shared_ptr<nes_replay> open(const char *path);
+
+    const nes_replay_header &header() const { return *_header; }
+    uint32_t player_count() const { return _header->player_count; }
+    uint32_t frame_count() const { return _header->frame_count; }
+
+    nes_button_flags buttons(uint32_t player, uint32_t frame) const;
+
+    //
+    // Keyframes - see nes_replay_keyframe_info
+    //
+    uint32_t keyframe_interval() const { return _keyframes ? _keyframes->keyframe_interval : 0; }
+    uint32_t keyframe_count() const { return _keyframes ? _keyframes->keyframe_count : 0; }
+    uint32_t keyframe_frame(uint32_t index) const { return keyframe_table()[index].frame; }
+    nes_state_blob keyframe_state(uint32_t index) const;
+
+    // Index of the last keyframe at or before frame, or -1 if there isn't one
+    int find_keyframe(uint32_t frame) const;
+
+    // Frames that have a state hash - 0 if there are none
+    uint32_t hashed_frame_count() const { return _keyframes ? _keyframes->hash_count : 0; }
+    uint64_t frame_hash(uint32_t frame) const { return reinterpret_cast<const uint64_t *>(_data + _keyframes->hashes_offset)[frame]; }
+
+    // FNV-1a of the entire file - what rom_hash is
+    static uint64_t hash_file(const char *path);
+
+    // Converts the text log (see doc/replay_input_log.md) into a single player binary replay
+    static bool convert_text_log(const char *text_path, const char *replay_path, uint64_t rom_hash, uint64_t start_state_hash);
+
+private :
+    nes_replay() {}
+
+    bool validate();
+    bool validate_keyframes();
+
+    const nes_replay_keyframe *keyframe_table() const { return reinterpret_cast<const nes_replay_keyframe *>(_data + _keyframes->keyframes_offset); }
+
+private :
+    const uint8_t *_data = nullptr;
+    size_t _size = 0;
+#ifdef _WIN32
+    void *_file = nullptr;
+    void *_mapping = nullptr;
+#endif
+
+    const nes_replay_header *_header = nullptr;
+    const nes_replay_keyframe_info *_keyframes = nullptr;
+    const nes_replay_player *_players = nullptr;
+};
+
+//
+// Builds a binary replay - buttons are given per frame in increasing frame order (per player), and
+// frames that are skipped have no buttons held
+//
+class nes_replay_writer
+{
+public :
+    nes_replay_writer(uint32_t player_count, uint64_t rom_hash, uint64_t start_state_hash);
+
+    // Same buttons and ROM / start state hash as replay - without its keyframes and frame hashes
+    nes_replay_writer(const nes_replay &replay);
+
+    void set_start_state_hash(uint64_t hash) { _start_state_hash = hash; }
+
+    void set_buttons(uint32_t player, uint32_t frame, nes_button_flags buttons);
+
+    // Keyframes are added in increasing frame order, and frame hashes one frame after another from 0
+    void set_keyframe_interval(uint32_t interval) { _keyframe_interval = interval; }
+    void add_keyframe(uint32_t frame, const nes_state_blob &state);
+    void add_frame_hash(uint64_t hash) { _hashes.push_back(hash); }
+
+    bool save(const char *path) const;
+
+private :
+    struct player_runs
+    {
+        vector<nes_replay_run> runs;
+        uint32_t next_frame = 0;       // frames before this are covered by runs
+    };
+
+    uint64_t _rom_hash;
+    uint64_t _start_state_hash;
+    vector<player_runs> _players;
+
+    uint32_t _keyframe_interval = 0;
+    vector<pair<uint32_t, nes_state_blob>> _keyframes;
+    vector<uint64_t> _hashes;
+};
+
+//
+// Plays replays on nes_system - embedding keyframes, seeking, and verifying a replay still plays out
+// the same way (emulator changes, different machine, etc.)
+//
+class nes_replay_runner
+{
+public :
+    nes_replay_runner(shared_ptr<nes_replay> replay, const string &rom_path)
+        :_replay(replay), _rom_path(rom_path)
+    {}
+
+    // Powers on system with the ROM loaded and the replay's buttons as input. Throws if the ROM
+    // can't be loaded
+    void prepare(nes_system &system) const;
+
+    // Plays the replay from power on, and writes it out with a keyframe every interval frames and the
+    // state hash of every frame. Frames default to the replay's frame count
+    bool embed_keyframes(const char *path, uint32_t interval, uint32_t frames = 0) const;
+
+    // Takes a prepared system to the state of frame - from the last keyframe at or before it if there
+    // is one, otherwise from wherever system is (it can only go forward then)
+    bool seek(nes_system &system, uint32_t frame) const;
+
+    //
+    // Re-emulates the replay and compares the state hash of every frame with the recorded ones. Each
+    // keyframe interval starts from its keyframe so intervals are checked in parallel, thread_count at
+    // a time, and the last frame of each is also checked against the next keyframe itself.
+    // Returns false on the first frame that doesn't match (mismatch_frame), or if there is nothing to
+    // verify against. The systems don't trace (see nes_system::set_tracer)
+    //
+    bool verify(uint32_t thread_count, uint32_t &mismatch_frame) const;
+
+private :
+    shared_ptr<nes_replay> _replay;
+    string _rom_path;
+};
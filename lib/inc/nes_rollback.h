@@ -0,0 +1,142 @@
+//=================================================================================================
+// NESChan
+// Author: Yi Zhang (yizhang82@outlook.com)
+//=================================================================================================
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+#include "nes_input.h"
+#include "nes_system.h"
+
+using namespace std;
+
+// Largest nes_rollback_session window
+#define NES_ROLLBACK_MAX_WINDOW 128
+
+#define NES_ROLLBACK_NO_FRAME 0xffffffff
+
+// Buttons of every controller port for one frame
+struct nes_rollback_inputs
+{
+    nes_button_flags buttons[NES_MAX_PLAYER];
+
+    bool operator ==(const nes_rollback_inputs &other) const { return memcmp(buttons, other.buttons, sizeof(buttons)) == 0; }
+    bool operator !=(const nes_rollback_inputs &other) const { return !(*this == other); }
+};
+
+struct nes_rollback_stats
+{
+    uint64_t rollbacks;                 // re-simulations
+    uint64_t resimulated_frames;
+    uint32_t max_resimulated_frames;    // most frames a single rollback re-simulated
+    uint64_t unchanged_corrections;     // corrections that matched the inputs the frame already ran with
+};
+
+//
+// GGPO style rollback on top of a nes_system - keeps the state at the start of and the inputs of the
+// last window frames, so that inputs that arrive late (netplay) can replace what a frame ran with.
+// The frames from the corrected one on get re-simulated with frames suppressed (see
+// nes_ppu::suppress_frames), so whatever displays frames only ever sees the corrected timeline.
+//
+// States go into a ring of blobs allocated up front - advancing and rolling back don't allocate.
+// Input goes through the latched input snapshot (nes_input_latch_mode_manual): the session sets every
+// port's buttons itself and nothing gets polled
+//
+class nes_rollback_session
+{
+public :
+    // system needs to have its ROM loaded - the session takes over its input. window is how many
+    // frames back corrections can go, 1 ~ NES_ROLLBACK_MAX_WINDOW
+    nes_rollback_session(nes_system &system, uint32_t window);
+
+    nes_system &system() { return _system; }
+    uint32_t window() const { return _window; }
+
+    // Frames advanced so far - the frame the next advance runs
+    uint32_t frame() const { return _frame; }
+
+    // Oldest frame whose inputs can still be corrected
+    uint32_t oldest_frame() const { return _frame > _window ? _frame - _window : 0; }
+
+    // Re-simulates pending corrections, then runs a frame with inputs. Returns false if emulation got
+    // stopped
+    bool advance(const nes_rollback_inputs &inputs);
+
+    // Inputs a frame ran with - oldest_frame ~ frame() - 1
+    const nes_rollback_inputs &inputs(uint32_t frame) const { return _ring[frame % _window].inputs; }
+
+    // Replaces the inputs a past frame ran with. Nothing is re-simulated until resimulate / the next
+    // advance, so correcting several frames costs a single re-simulation from the earliest one.
+    // Returns false if frame is outside oldest_frame ~ frame() - 1
+    bool correct_inputs(uint32_t frame, const nes_rollback_inputs &corrected);
+
+    // correct_inputs, and re-simulates up to the current frame right away
+    bool rollback_to(uint32_t frame, const nes_rollback_inputs &corrected);
+
+    // Re-simulates from the earliest corrected frame, if there is one. Returns false if emulation got
+    // stopped
+    bool resimulate();
+
+    const nes_rollback_stats &stats() const { return _stats; }
+
+private :
+    struct entry
+    {
+        nes_state_blob state;           // at the start of the frame
+        nes_rollback_inputs inputs;
+    };
+
+    bool run_frame(uint32_t frame, bool save_state);
+
+private :
+    nes_system &_system;
+    uint32_t _window;
+    uint32_t _frame;
+    uint32_t _resimulate_from;          // earliest corrected frame, or NES_ROLLBACK_NO_FRAME
+    vector<entry> _ring;                // frame n at n % window
+    nes_rollback_stats _stats;
+};
+
+//
+// Stand-in for two player netplay over a relay, for testing rollback without a network - each session
+// is one player's side, and the inputs each side sends reach the other one latency frames late. Until
+// then the receiving side predicts the remote player by repeating the last buttons it got from them,
+// and rolls back if the real ones turn out different
+//
+class nes_rollback_loopback
+{
+public :
+    // Both sessions need to start out from the same state. latency needs to be 1 ~ their window
+    nes_rollback_loopback(nes_rollback_session &peer0, nes_rollback_session &peer1, uint32_t latency);
+
+    // Delivers whatever is due, then both sides run a frame with their own player's buttons and the
+    // prediction of the other's
+    bool advance(nes_button_flags player0, nes_button_flags player1);
+
+    // Delivers everything still in flight and re-simulates - both sides end up with the same inputs
+    // and the same state
+    bool flush();
+
+private :
+    struct message
+    {
+        uint32_t frame;
+        int player;                     // who sent it
+        nes_button_flags buttons;
+        uint32_t deliver_at;            // tick
+    };
+
+    void deliver(const message &msg);
+
+private :
+    nes_rollback_session *_peers[2];
+    uint32_t _latency;
+    uint32_t _tick;
+    deque<message> _in_flight;
+    nes_button_flags _last_received[2];     // by each side, from the other player
+};
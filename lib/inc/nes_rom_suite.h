@@ -0,0 +1,74 @@
+//=================================================================================================
+// NESChan
+// Author: Yi Zhang (yizhang82@outlook.com)
+//=================================================================================================
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Test ROMs that haven't finished by then count as failed (hung) - 60 seconds of NES time
+#define NES_ROM_SUITE_MAX_FRAMES 3600
+
+// Frames the checks that look at memory after a fixed time (older blargg tests, smoke) run for
+#define NES_ROM_SUITE_FIXED_FRAMES 10
+
+//
+// How a test ROM reports its result - goes by the directory it is in (see nes_rom_suite::discover)
+//
+enum nes_rom_check
+{
+    // nestest in automation mode (runs from $C000) - $02 / $03 hold the error codes, 0 when passed
+    nes_rom_check_nestest,
+
+    // blargg's newer tests (instr_test-v5, etc) - $6000 holds the result code once the ROM loops
+    // forever at the end, 0 when passed, with $6001~$6003 DE B0 61 and the text output at $6004
+    nes_rom_check_blargg,
+
+    // blargg's older PPU tests - $F0 is 1 when passed, after NES_ROM_SUITE_FIXED_FRAMES frames
+    nes_rom_check_blargg_ppu,
+
+    // Anything else - passes if it runs NES_ROM_SUITE_FIXED_FRAMES frames without the CPU stopping
+    nes_rom_check_smoke
+};
+
+struct nes_rom_test
+{
+    string name;                    // path under the suite root, with '/'
+    string path;
+    nes_rom_check check;
+};
+
+struct nes_rom_test_result
+{
+    nes_rom_test test;
+    bool passed;
+    string detail;                  // why it failed - result code, text output, etc
+    uint32_t frames;                // emulated
+    double seconds;
+};
+
+//
+// ROM regression suite - every test ROM runs in its own nes_system, on as many threads as asked
+// for. The systems don't trace (see nes_system::set_tracer)
+//
+class nes_rom_suite
+{
+public :
+    typedef function<void(const nes_rom_test_result &result)> result_callback;
+
+    // Finds every *.nes under root, sorted by name
+    static vector<nes_rom_test> discover(const string &root);
+
+    static nes_rom_test_result run(const nes_rom_test &test);
+
+    // Runs tests on thread_count threads (0 for one per hardware thread) and returns the results in
+    // the same order. on_result gets each result as soon as it is done - one at a time, from any of
+    // the threads
+    static vector<nes_rom_test_result> run_all(const vector<nes_rom_test> &tests, uint32_t thread_count, result_callback on_result = nullptr);
+};
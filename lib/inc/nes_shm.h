@@ -0,0 +1,176 @@
+//=================================================================================================
+// NESChan
+// Author: Yi Zhang (yizhang82@outlook.com)
+//=================================================================================================
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "nes_input.h"
+#include "nes_system.h"
+
+using namespace std;
+
+// CPU internal RAM ($0000-$07FF) - what goes into observations. The rest of the CPU address space is
+// mirrors, registers and cartridge
+#define NES_SHM_RAM_SIZE 0x800
+
+// How long a blocked wait sleeps before checking again whether it should give up
+#define NES_SHM_WAIT_SLICE_MS 100
+
+//
+// Shared memory transport between emulators and an agent process on the same machine (see
+// doc/shm_transport.md). A POSIX shm segment holds a header and slot_count slots, and each slot is
+// the channel of one emulator instance - an agent posts actions to any number of slots, the
+// emulators step in parallel, and the agent picks up the observations. Nothing is serialized or sent
+// over a socket - both sides read and write the mapped slots in place.
+//
+// Whoever owns a slot is given by its sequence number:
+//   even - agent: the observation is ready, and actions / command can be written
+//   odd  - emulator: the command is being executed
+// Each side bumps the sequence with release semantics once it is done with the slot and wakes the
+// other side through a futex on it (Linux - elsewhere the waiting side polls)
+//
+// Segment layout - little-endian, every slot at a multiple of 64 bytes:
+//
+//   nes_shm_header
+//   slots[slot_count], slot_size bytes apart: nes_shm_slot, uint8_t pixels[frame_width * frame_height],
+//   uint8_t ram[ram_size]
+//
+struct nes_shm_header
+{
+    uint32_t magic;                 // 'NESM'
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t slot_size;
+    uint32_t frame_width;
+    uint32_t frame_height;
+    uint32_t ram_size;
+    uint32_t owner_pid;             // emulator process that created the segment
+};
+
+static_assert(sizeof(nes_shm_header) == 32, "nes_shm_header is part of the shared memory layout");
+
+enum nes_shm_command : uint32_t
+{
+    nes_shm_command_step,           // runs a frame with actions held
+    nes_shm_command_reset,          // back to power on + reset
+    nes_shm_command_close           // emulator stops serving the slot
+};
+
+enum nes_shm_status : uint32_t
+{
+    nes_shm_status_ok,
+    nes_shm_status_stopped,         // emulation stopped (CPU stopped, infinite loop, etc.)
+    nes_shm_status_closed,
+    nes_shm_status_bad_command
+};
+
+struct nes_shm_slot
+{
+    atomic<uint32_t> sequence;
+
+    // Written by the agent
+    uint32_t command;               // nes_shm_command
+    uint8_t actions[NES_MAX_PLAYER];   // nes_button_flags of each player
+
+    // Written by the emulator
+    uint32_t status;                // nes_shm_status
+    uint32_t frame;                 // frames completed since power on
+    float reward;
+    uint8_t reserved[40];
+};
+
+static_assert(sizeof(nes_shm_slot) == 64, "nes_shm_slot is part of the shared memory layout");
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "nes_shm_slot::sequence needs to be lock free to work across processes");
+
+//
+// Mapping of a transport segment. The creating side (emulators) unlinks the name when it goes away -
+// mappings other processes still have stay valid until they unmap
+//
+class nes_shm_segment
+{
+public :
+    ~nes_shm_segment();
+
+    // Returns nullptr if the segment can't be created / mapped (or on Windows - POSIX only), including
+    // when the name is taken by a segment whose emulator is still running. A segment left over from an
+    // emulator that is gone gets replaced
+    static unique_ptr<nes_shm_segment> create(const char *name, uint32_t slot_count);
+
+    // Returns nullptr if there is no such segment or it isn't a transport segment
+    static unique_ptr<nes_shm_segment> open(const char *name);
+
+    const nes_shm_header &header() const { return *_header; }
+    uint32_t slot_count() const { return _header->slot_count; }
+
+    nes_shm_slot &slot(uint32_t index) { return *reinterpret_cast<nes_shm_slot *>(slot_data(index)); }
+    const uint8_t *pixels(uint32_t index) { return slot_data(index) + sizeof(nes_shm_slot); }
+    const uint8_t *ram(uint32_t index) { return pixels(index) + _header->frame_width * _header->frame_height; }
+
+    //
+    // Agent side
+    //
+
+    // Hands the slot to its emulator. The slot needs to be the agent's (see wait)
+    void post(uint32_t index, nes_shm_command command, const nes_button_flags (&actions)[NES_MAX_PLAYER]);
+
+    // Waits until the slot is back with the agent - up to timeout_ms, or forever if it is negative.
+    // Returns false on timeout
+    bool wait(uint32_t index, int timeout_ms = -1);
+
+private :
+    nes_shm_segment() {}
+
+    uint8_t *slot_data(uint32_t index) { return _data + sizeof(nes_shm_header) + size_t(index) * _header->slot_size; }
+
+    friend class nes_shm_server;
+
+private :
+    uint8_t *_data = nullptr;
+    size_t _size = 0;
+    string _name;
+    bool _owner = false;            // unlinks the name
+    nes_shm_header *_header = nullptr;
+};
+
+//
+// Emulator side - one nes_system per slot, each served by its own thread. Actions go through the
+// latched input snapshot (nes_input_latch_mode_manual) so a step never polls anything. The systems
+// don't trace (see nes_system::set_tracer)
+//
+class nes_shm_server
+{
+public :
+    // Reward of the frame that just completed - 0 if not set. Called on the serving threads, so it
+    // needs to be safe to call for different systems at the same time
+    typedef function<float(nes_system &)> reward_function;
+
+    // Throws if the ROM can't be loaded
+    nes_shm_server(shared_ptr<nes_shm_segment> segment, const string &rom_path);
+    ~nes_shm_server();
+
+    void set_reward(reward_function reward) { _reward = reward; }
+
+    // Serves every slot until each is closed by the agent or stop is called
+    void run();
+    void stop() { _stop_requested = true; }
+
+private :
+    void serve(uint32_t index);
+    void observe(uint32_t index, nes_shm_status status);
+
+private :
+    shared_ptr<nes_shm_segment> _segment;
+    vector<unique_ptr<nes_system>> _systems;
+    nes_state_blob _start_state;
+    reward_function _reward;
+    atomic<bool> _stop_requested;
+};
@@ -6,6 +6,10 @@
 #include <vector>
 
 #include "nes_component.h"
+#include "nes_perf.h"
+#include "nes_frame.h"
+#include "nes_dirty.h"
+#include "nes_arena.h"
 
 using namespace std;
 
@@ -14,6 +18,7 @@ class nes_memory;
 class nes_apu;
 class nes_ppu;
 class nes_input;
+class nes_tracer;
 
 struct nes_memory_view
 {
@@ -55,6 +60,18 @@ enum nes_rom_exec_mode
 struct nes_state_blob
 {
     vector<uint8_t> data;
+
+    // FNV-1a of the state - identical runs end up with identical hashes
+    uint64_t hash() const
+    {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (auto byte : data)
+        {
+            hash ^= byte;
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
 };
 
 
@@ -62,12 +79,22 @@ struct nes_state_blob
 // The NES system hardware that manages all the invidual components - CPU, PPU, APU, RAM, etc
 // It synchronizes between different components
 //
+// Systems are independent of each other - all of a system's state is in the system, so any number of
+// them can run on their own threads (one thread per system at a time). Nothing is shared unless
+// asked for - a system doesn't even trace until given a tracer, see set_tracer
+//
 class nes_system
 {
 public :
-    nes_system();
+    // Components and their buffers (RAM, VRAM, OAM, frames, decoded CPU blocks) go in a single cache
+    // line aligned arena, allocated on numa_node if asked for - see nes_arena. The one exception is
+    // JIT compiled code (NESCHAN_JIT), which needs executable memory of its own - see nes_cpu_jit_arena
+    explicit nes_system(int numa_node = NES_ARENA_ANY_NODE);
     ~nes_system();
 
+    nes_system(const nes_system &) = delete;
+    nes_system &operator =(const nes_system &) = delete;
+
 public :
     void power_on();
     void reset();
@@ -80,24 +107,34 @@ public :
 
     void load_rom(const char *rom_path, nes_rom_exec_mode mode);
 
-    nes_cpu     *cpu()      { return _cpu.get();   }
-    nes_memory  *ram()      { return _ram.get();   }
-    nes_ppu     *ppu()      { return _ppu.get();   } 
-    nes_input   *input()    { return _input.get(); }
+    nes_cpu     *cpu()      { return _cpu;   }
+    nes_memory  *ram()      { return _ram;   }
+    nes_ppu     *ppu()      { return _ppu;   } 
+    nes_input   *input()    { return _input; }
+
+    const nes_arena &arena() const { return *_arena; }
 
     // Returns a read-only snapshot view for deterministic embedding extraction.
     //
     // Snapshot contract:
     // - frame_buffer points to the latest fully completed frame only.
-    // - The frame pointer remains stable until the next PPU frame boundary swap.
-    // - PPU swaps buffers at the 261->0 scanline transition (end of frame).
+    // - The frame pointer remains stable until the next PPU frame boundary.
+    // - PPU publishes a new frame at the 261->0 scanline transition (end of frame).
     // - Callers should sample snapshots at a consistent point in emulation timing for
     //   reproducible embeddings.
+    // - Only valid on the emulation thread - other threads should use acquire_frame.
     nes_system_snapshot snapshot() const;
 
+    // Pins the latest completed frame for reading from any thread (renderer, recorder, etc.) without
+    // copying or blocking emulation - see nes_frame_pool
+    nes_frame_ref acquire_frame();
+
     nes_state_blob serialize() const;
     bool deserialize(const nes_state_blob &state);
 
+    // Same as serialize, into blob's buffer - doesn't allocate once blob has held a state before
+    void serialize(nes_state_blob &blob) const;
+
 public :
     //
     // step <count> amount of cycles
@@ -106,13 +143,70 @@ public :
     // 2. Let CPU drive cycle - and other component "catch up"
     // 3. Let each component own their own thread - and synchronizes at cycle granuarity
     //
-    // I think option #1 will produce the most accurate timing without subjecting too much to OS resource
-    // management.
+    // nes_system drives the CPU (option #1), but PPU uses option #2: it only catches up to the CPU when
+    // something can observe it - CPU touching $2000~$2007/$4014, a mapper register write, or a PPU
+    // event (VBlank NMI, frame boundary) being due. Most instructions never touch PPU so this saves
+    // interleaving the two on every single cycle, and the result is identical to lockstep.
     //
     void step(nes_cycle_t count);
 
+    // Steps until PPU completes the frame in progress - the frame is what frame_buffer / snapshot
+    // returns afterwards. Returns false if emulation got stopped before the frame completed
+    bool run_frame();
+
+    // Bring the lazily stepped PPU up to the current CPU cycle
+    void sync_ppu();
+
+    // Same as sync_ppu but skips catching up if PPUSTATUS can't have changed since PPU last stepped
+    void sync_ppu_status();
+
     bool stop_requested() { return _stop_requested; }
 
+public :
+    //
+    // Tracer the components of this system trace to - none (nullptr) unless set. A null tracer makes
+    // every trace site a single branch that is never taken. Systems that should log into what
+    // INIT_TRACE opened pass &nes_tracer::get(); systems running on different threads each need
+    // their own tracer
+    //
+    void set_tracer(nes_tracer *tracer);
+    nes_tracer *tracer() const { return _tracer; }
+
+public :
+    //
+    // Per frame performance counters - off by default. Components check perf() on their hot paths
+    // and bump counters when it isn't null. Counters roll over at the PPU frame boundary.
+    // Compiled JIT blocks (see nes_cpu_jit) don't count instructions, so they are bypassed while
+    // counters are on
+    //
+    void enable_perf_counters(bool enable);
+    bool is_perf_counters_enabled() const { return _perf_enabled; }
+
+    // Counters of the frame in progress, or nullptr if counters are off
+    nes_perf_counters *perf() { return _perf_enabled ? &_perf_frame : nullptr; }
+
+    // Counters of the last completed frame
+    nes_perf_counters perf_snapshot() const { return _perf_last_frame; }
+    string perf_json() const { return _perf_last_frame.to_json(); }
+
+    // Called by PPU at the frame boundary
+    void end_perf_frame(uint32_t next_frame);
+
+public :
+    //
+    // Dirty page tracking - off by default. While on, every write to CPU RAM (PRG banks mapped in
+    // included), VRAM and OAM marks its page until clear_dirty_pages starts a new epoch - what
+    // incremental hashing, delta snapshots and sync need to look at. Off, the write paths only test a
+    // page flag / null pointer they test anyway; on, a RAM page costs extra on its first write of the
+    // epoch only. Loading state marks just the pages whose contents change
+    //
+    void enable_dirty_tracking(bool enable);
+    bool is_dirty_tracking_enabled() const { return _dirty_enabled; }
+
+    // Pages written since tracking got enabled or the last clear_dirty_pages - all clean while off
+    const nes_dirty_pages &dirty_pages() const { return _dirty_pages; }
+    void clear_dirty_pages();
+
 private :
     // Emulation loop that is only intended for tests 
     void test_loop();
@@ -122,12 +216,24 @@ private :
 private :
     nes_cycle_t _master_cycle;              // keep count of current cycle
 
-    unique_ptr<nes_cpu> _cpu;
-    unique_ptr<nes_memory> _ram;
-    unique_ptr<nes_ppu> _ppu;
-    unique_ptr<nes_input> _input;
+    unique_ptr<nes_arena> _arena;           // components live in here - see nes_system()
+    nes_cpu *_cpu;
+    nes_memory *_ram;
+    nes_ppu *_ppu;
+    nes_input *_input;
 
     vector<nes_component *> _components;
 
+    nes_tracer *_tracer;                    // see set_tracer
+
     bool _stop_requested;                   // useful for internal testing, or synchronization to rendering
+
+    bool _perf_enabled;
+    nes_perf_counters _perf_frame;          // see perf
+    nes_perf_counters _perf_last_frame;     // see perf_snapshot
+    uint64_t _perf_step_end;                // when the last step returned - the rest is frontend time
+    uint64_t _perf_step_ppu_ticks;          // PPU time within the current step
+
+    bool _dirty_enabled;
+    nes_dirty_pages _dirty_pages;           // see dirty_pages
 };
@@ -3,6 +3,13 @@
 #include <memory>
 #include <fstream>
 #include <cstring>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <unordered_map>
 
 using namespace std;
 
@@ -16,12 +23,117 @@ enum nes_tracer_level : uint8_t
     nes_tracer_level_debug = 5,         // like diag, but only exist in debug
 };
 
+//
+// One executed instruction in binary trace, captured right before it executes
+// Has everything needed to render the Nintendulator style text trace offline - see
+// nes_cpu::format_trace_record
+//
+struct nes_trace_record
+{
+    int64_t cycle;          // nes_cycle_t
+    uint16_t pc;
+    uint16_t addr;          // address read from memory by ind_x / ind_y / ind_jmp
+    uint8_t bytes[3];       // op code + operand
+    uint8_t value;          // value at the effective address, for modes that access memory
+    uint8_t A;
+    uint8_t X;
+    uint8_t Y;
+    uint8_t P;
+    uint8_t S;
+    uint8_t reserved[3];
+};
+
+static_assert(sizeof(nes_trace_record) == 24, "nes_trace_record is part of the binary trace file format");
+
+// Records per thread that can be pending to be written
+#define NES_TRACE_RING_SIZE (1 << 16)
+
+//
+// Single producer (emulation thread) / single consumer (writer thread) lock-free ring of records
+//
+class nes_trace_ring
+{
+public :
+    nes_trace_ring(uint32_t thread_index)
+        :_records(new nes_trace_record[NES_TRACE_RING_SIZE])
+    {
+        _thread_index = thread_index;
+        _head = 0;
+        _tail = 0;
+    }
+
+    // Returns false if ring is full
+    bool push(const nes_trace_record &record)
+    {
+        uint64_t head = _head.load(memory_order_relaxed);
+        if (head - _tail.load(memory_order_acquire) == NES_TRACE_RING_SIZE)
+            return false;
+
+        _records[head & (NES_TRACE_RING_SIZE - 1)] = record;
+        _head.store(head + 1, memory_order_release);
+        return true;
+    }
+
+    // Writes out everything pushed so far. Returns number of records written
+    size_t drain(ofstream &out);
+
+private :
+    unique_ptr<nes_trace_record[]> _records;
+    uint32_t _thread_index;
+    atomic<uint64_t> _head;         // next record to push - only written by producer
+    atomic<uint64_t> _tail;         // next record to write - only written by consumer
+};
+
+//
+// Writes binary trace in the background. Each thread recording gets its own ring, and a writer
+// thread drains all rings to the file - so recording is a copy into memory and never waits for IO
+// unless the writer falls an entire ring behind.
+//
+// File format (little-endian):
+//   header: magic 'NEST', version, record size
+//   chunks: thread index, record count, records
+//
+class nes_trace_writer
+{
+public :
+    nes_trace_writer(const char *file_name);
+    ~nes_trace_writer();
+
+    void record(const nes_trace_record &record);
+
+    // Number of threads that have recorded into this writer so far
+    size_t ring_count();
+
+    // Reads the entire binary trace file. Returns false if it isn't a valid trace file
+    static bool read(const char *file_name, function<void(uint32_t thread_index, const nes_trace_record &record)> callback);
+
+    // Number of threads that recorded into the binary trace file, from the chunk headers alone.
+    // Returns false if it isn't a valid trace file
+    static bool read_thread_count(const char *file_name, uint32_t &thread_count);
+
+private :
+    nes_trace_ring *find_thread_ring();
+    void drain_loop();
+    bool drain();
+
+private :
+    uint64_t _id;                   // identifies this writer to the per thread ring cache
+    ofstream _file;
+
+    mutex _rings_lock;
+    vector<unique_ptr<nes_trace_ring>> _rings;
+    unordered_map<thread::id, nes_trace_ring *> _thread_rings;     // one ring per recording thread
+
+    atomic<bool> _stop;
+    thread _thread;
+};
+
 class nes_tracer
 {
 public :
     nes_tracer()
     {
-        _level = nes_tracer_level_quiet;
+        set_level(nes_tracer_level_quiet);
     }
 
     void init(const char *filename)
@@ -36,9 +148,9 @@ public :
         }
 
 #ifdef _DEBUG
-        _level = nes_tracer_level_detail;
+        set_level(nes_tracer_level_detail);
 #else
-        _level = nes_tracer_level_minimal;
+        set_level(nes_tracer_level_minimal);
 #endif
         _file_name = filename;
         _stream->open(_file_name);
@@ -53,6 +165,32 @@ public :
         }
     }
 
+    //
+    // Binary tracing - records every instruction into filename in nes_trace_record format instead of
+    // formatting text. Render it offline with neschan_trace. Independent of the text trace level
+    //
+    void init_binary(const char *filename)
+    {
+        _binary = nullptr;
+        _binary = make_unique<nes_trace_writer>(filename);
+    }
+
+    // Finishes writing everything recorded so far and closes the file
+    void stop_binary()
+    {
+        _binary = nullptr;
+    }
+
+    bool is_binary_enabled()
+    {
+        return _binary != nullptr;
+    }
+
+    void record(const nes_trace_record &record)
+    {
+        _binary->record(record);
+    }
+
     void set_level(nes_tracer_level level)
     {
         _level = level;
@@ -63,6 +201,13 @@ public :
         return (level <= _level);
     }
 
+    //
+    // What the trace macros check, against the tracer of whoever traces (see nes_trace_context) -
+    // false for a null tracer, and text also needs init to have opened a file
+    //
+    static bool is_level_on(const nes_tracer *tracer, nes_tracer_level level) { return tracer && level <= tracer->_level && tracer->_stream; }
+    static bool is_binary_on(const nes_tracer *tracer) { return tracer && tracer->_binary; }
+
     void trace(string str)
     {
         if (_stream)
@@ -75,6 +220,10 @@ public :
             _stream->write(str, strlen(str));
     }
 
+    //
+    // The process wide tracer - what INIT_TRACE sets up and the frontend logs to. A nes_system only
+    // traces into it when asked to (see nes_system::set_tracer)
+    //
     static nes_tracer &get()
     {
         static nes_tracer s_trace;
@@ -90,10 +239,18 @@ private :
     string _service_name;
     string _file_name;
     unique_ptr<ofstream> _stream;
+    unique_ptr<nes_trace_writer> _binary;
 
     nes_tracer_level _level;            // current level of tracing
 };
 
+//
+// Tracer the trace macros write to. Components that belong to a nes_system (nes_cpu, nes_ppu, ...)
+// have a member of the same name returning their system's tracer, which hides this one inside them -
+// everything else (frontend, audio) goes to the process wide tracer
+//
+inline nes_tracer *nes_trace_context() { return &nes_tracer::get(); }
+
 static ostream& operator <<(ostream &os, const string &str)
 {
     os << str.c_str();
@@ -105,18 +262,57 @@ static ostream& operator <<(ostream &os, const string &str)
 
 #define INIT_TRACE_DIAG(filename) { nes_tracer::get().init(filename); nes_tracer::get().set_level(nes_tracer_level_diag); }
 #define INIT_TRACE_DEBUG(filename) { nes_tracer::get().init(filename); nes_tracer::get().set_level(nes_tracer_level_debug); }
+#define INIT_TRACE_BINARY(filename) nes_tracer::get().init_binary(filename);
+
+//
+// Highest trace level compiled in (see nes_tracer_level) - trace sites above it compile to nothing,
+// and NES_TRACE_ENABLED for them is a constant false. Builds that don't need instruction level
+// tracing should use 2 (normal) or lower, which takes all tracing out of CPU / PPU hot paths
+// Binary instruction tracing counts as diag (4)
+//
+#ifndef NES_TRACE_MAX_LEVEL
+#ifdef _DEBUG
+#define NES_TRACE_MAX_LEVEL 5
+#else
+#define NES_TRACE_MAX_LEVEL 4
+#endif
+#endif
+
+// A null tracer makes these a single, predictable branch
+#define NES_TRACE_ENABLED(level) ((level) <= NES_TRACE_MAX_LEVEL && nes_tracer::is_level_on(nes_trace_context(), level))
+#define NES_TRACE_BINARY_ENABLED() (NES_TRACE_MAX_LEVEL >= 4 && nes_tracer::is_binary_on(nes_trace_context()))
 
 // No need to flush - endl automatically flushes  
 #define NES_LOG(expr) nes_tracer::get().stream() << expr << endl;
-#define NES_LOG_IF(level, expr) if (nes_tracer::get().is_enabled(level)) { nes_tracer::get().stream() << expr << endl; }
+#define NES_LOG_IF(level, expr) if (NES_TRACE_ENABLED(level)) { nes_trace_context()->stream() << expr << endl; }
 
 #define NES_TRACE0(expr) NES_LOG_IF(nes_tracer_level_quiet, expr);
+
+#if NES_TRACE_MAX_LEVEL >= 1
 #define NES_TRACE1(expr) NES_LOG_IF(nes_tracer_level_minimal, expr); 
+#else
+#define NES_TRACE1(expr) ;
+#endif
+
+#if NES_TRACE_MAX_LEVEL >= 2
 #define NES_TRACE2(expr) NES_LOG_IF(nes_tracer_level_normal, expr);
+#else
+#define NES_TRACE2(expr) ;
+#endif
+
+#if NES_TRACE_MAX_LEVEL >= 3
 #define NES_TRACE3(expr) NES_LOG_IF(nes_tracer_level_detail, expr);
+#else
+#define NES_TRACE3(expr) ;
+#endif
+
+#if NES_TRACE_MAX_LEVEL >= 4
 #define NES_TRACE4(expr) NES_LOG_IF(nes_tracer_level_diag, expr);
+#else
+#define NES_TRACE4(expr) ;
+#endif
 
-#ifdef _DEBUG
+#if NES_TRACE_MAX_LEVEL >= 5
 #define NES_DBG(expr) NES_LOG_IF(nes_tracer_level_debug, expr); 
 #else
 #define NES_DBG(expr) ;
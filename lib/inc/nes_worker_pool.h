@@ -0,0 +1,87 @@
+//=================================================================================================
+// NESChan
+// Author: Yi Zhang (yizhang82@outlook.com)
+//=================================================================================================
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "nes_arena.h"
+
+using namespace std;
+
+// A CPU the process may run on, and the NUMA node it belongs to (NES_ARENA_ANY_NODE if unknown)
+struct nes_cpu_core
+{
+    int cpu;
+    int node;
+};
+
+//
+// Worker threads that each stick to one CPU, for hosting many emulator instances - work queued for a
+// worker always runs on that worker, so whatever it creates (a nes_system's arena, see nes_system)
+// gets first touched, and stays, on the worker's NUMA node and in its caches.
+//
+// Workers take CPUs alternating between NUMA nodes, so that a pool smaller than the machine still
+// gets the memory bandwidth of every node. Pinning is Linux / Windows only - elsewhere workers are
+// just threads
+//
+class nes_worker_pool
+{
+public :
+    typedef function<void()> task;
+
+    // worker_count 0 is one worker per CPU the process may run on
+    nes_worker_pool(uint32_t worker_count = 0, bool pin = true);
+    ~nes_worker_pool();
+
+    nes_worker_pool(const nes_worker_pool &) = delete;
+    nes_worker_pool &operator =(const nes_worker_pool &) = delete;
+
+    uint32_t worker_count() const { return uint32_t(_workers.size()); }
+
+    // CPU / NUMA node worker is on - what it is pinned to if pinning
+    const nes_cpu_core &worker_core(uint32_t worker) const { return _workers[worker]->core; }
+    bool is_pinned() const { return _pin; }
+
+    // Queues fn to run on worker. Tasks on the same worker run one at a time, in order, and must not
+    // throw
+    void run(uint32_t worker, task fn);
+
+    // Waits until every task queued so far has run
+    void wait();
+
+    // CPUs the process may run on, ordered alternating between NUMA nodes
+    static vector<nes_cpu_core> cores();
+
+private :
+    struct worker
+    {
+        nes_cpu_core core;
+        mutex lock;
+        condition_variable wake;
+        deque<task> tasks;
+        thread handle;
+    };
+
+    void worker_loop(worker &w);
+    void task_done();
+
+private :
+    vector<unique_ptr<worker>> _workers;
+    bool _pin;
+    atomic<bool> _stop;
+
+    mutex _pending_lock;
+    condition_variable _idle;
+    uint64_t _pending;                  // tasks queued and not done yet
+};
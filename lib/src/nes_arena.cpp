@@ -0,0 +1,111 @@
+#include "stdafx.h"
+#include "nes_arena.h"
+
+#include <cassert>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+
+namespace
+{
+    static const size_t PAGE_SIZE_FALLBACK = 4096;
+
+#if defined(__linux__)
+    // From linux/mempolicy.h - libnuma isn't needed for a single mbind
+    static const int MPOL_PREFERRED_MODE = 1;
+
+    // Prefers node for every page of the range - pages aren't there yet, so they get allocated on
+    // node when first touched, and elsewhere if node runs out
+    bool bind_to_node(void *mem, size_t size, int node)
+    {
+        const int max_node = int(sizeof(unsigned long) * 8);
+        if (node < 0 || node >= max_node)
+            return false;
+
+        unsigned long node_mask = 1ul << node;
+        return syscall(SYS_mbind, mem, size, MPOL_PREFERRED_MODE, &node_mask, max_node + 1, 0) == 0;
+    }
+#endif
+
+    size_t page_size()
+    {
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return info.dwPageSize;
+#else
+        long size = sysconf(_SC_PAGESIZE);
+        return size > 0 ? size_t(size) : PAGE_SIZE_FALLBACK;
+#endif
+    }
+}
+
+nes_arena::nes_arena(size_t capacity, int numa_node)
+    :_base(nullptr), _capacity(capacity), _used(0), _numa_node(numa_node), _numa_bound(false)
+{
+    size_t page = page_size();
+    _mapped_size = (capacity + page - 1) / page * page;
+
+#ifdef _WIN32
+    void *mem = nullptr;
+    if (numa_node != NES_ARENA_ANY_NODE)
+    {
+        mem = VirtualAllocExNuma(GetCurrentProcess(), nullptr, _mapped_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, DWORD(numa_node));
+        _numa_bound = (mem != nullptr);
+    }
+    if (!mem)
+        mem = VirtualAlloc(nullptr, _mapped_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    _base = reinterpret_cast<uint8_t *>(mem);
+#else
+    void *mem = mmap(nullptr, _mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    _base = (mem == MAP_FAILED) ? nullptr : reinterpret_cast<uint8_t *>(mem);
+#ifdef __linux__
+    if (_base && numa_node != NES_ARENA_ANY_NODE)
+        _numa_bound = bind_to_node(_base, _mapped_size, numa_node);
+#endif
+#endif
+
+    if (!_base)
+        throw bad_alloc();
+}
+
+nes_arena::~nes_arena()
+{
+#ifdef _WIN32
+    VirtualFree(_base, 0, MEM_RELEASE);
+#else
+    munmap(_base, _mapped_size);
+#endif
+}
+
+void *nes_arena::allocate(size_t size)
+{
+    // _base is page aligned, so aligning offsets is enough
+    size_t start = aligned_size(_used);
+    if (start + size > _capacity)
+        return nullptr;
+
+    _used = start + size;
+    return _base + start;
+}
+
+uint8_t *nes_arena::allocate_buffer(nes_arena *arena, size_t size, unique_ptr<uint8_t[]> &owned)
+{
+    if (arena)
+    {
+        auto buffer = reinterpret_cast<uint8_t *>(arena->allocate(size));
+        assert(buffer);
+        return buffer;
+    }
+
+    owned = make_unique<uint8_t[]>(size);
+    return owned.get();
+}
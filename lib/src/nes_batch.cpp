@@ -0,0 +1,72 @@
+#include "stdafx.h"
+#include "nes_batch.h"
+
+nes_batch_runner::nes_batch_runner(nes_worker_pool &pool, const string &rom_path, uint32_t instance_count)
+    :_pool(pool), _systems(instance_count)
+{
+    // Load it here once first - loading throws, and workers can't
+    {
+        nes_system probe;
+        probe.power_on();
+        probe.load_rom(rom_path.c_str(), nes_rom_exec_mode_reset);
+    }
+
+    for (uint32_t worker = 0; worker < _pool.worker_count(); ++worker)
+    {
+        _pool.run(worker, [this, worker, rom_path]() {
+            // Only bind to the node of the core the worker is pinned to - otherwise it moves around
+            int node = _pool.is_pinned() ? _pool.worker_core(worker).node : NES_ARENA_ANY_NODE;
+            for (uint32_t i = worker; i < _systems.size(); i += _pool.worker_count())
+            {
+                auto system = make_unique<nes_system>(node);
+                system->power_on();
+                system->load_rom(rom_path.c_str(), nes_rom_exec_mode_reset);
+                system->input()->set_latch_mode(nes_input_latch_mode_manual);
+                _systems[i] = move(system);
+            }
+        });
+    }
+
+    _pool.wait();
+}
+
+nes_batch_runner::~nes_batch_runner()
+{
+    // Freed by the workers that own them, like they were allocated
+    for_each([this](uint32_t instance, nes_system &) { _systems[instance] = nullptr; });
+}
+
+void nes_batch_runner::set_buttons(uint32_t instance, const nes_button_flags (&buttons)[NES_MAX_PLAYER])
+{
+    _systems[instance]->input()->set_latched_buttons(buttons);
+}
+
+bool nes_batch_runner::run_frames(uint32_t frames)
+{
+    atomic<bool> stopped(false);
+    for_each([&](uint32_t, nes_system &system) {
+        for (uint32_t frame = 0; frame < frames; ++frame)
+        {
+            if (!system.run_frame())
+            {
+                stopped = true;
+                return;
+            }
+        }
+    });
+    return !stopped;
+}
+
+void nes_batch_runner::for_each(instance_function fn)
+{
+    // One task per worker rather than per instance - the instances of a worker run back to back
+    for (uint32_t worker = 0; worker < _pool.worker_count() && worker < _systems.size(); ++worker)
+    {
+        _pool.run(worker, [this, worker, &fn]() {
+            for (uint32_t i = worker; i < _systems.size(); i += _pool.worker_count())
+                fn(i, *_systems[i]);
+        });
+    }
+
+    _pool.wait();
+}
@@ -1,5 +1,6 @@
 #include "stdafx.h"
 #include <cstring>
+#include <algorithm>
 #include "nes_cpu.h"
 #include "nes_system.h"
 #include "nes_trace.h"
@@ -33,11 +34,14 @@ void nes_cpu::power_on(nes_system *system)
     _system = system;
     _mem = system->ram();
     _ppu = system->ppu();
+    _tracer = system->tracer();
     _cycle = nes_cycle_t(0);
     _nmi_pending = false;
     _dma_pending = false;
+    _dma_addr = 0;
 
     _is_stop_at_addr = false;
+    _stop_at_addr = 0;
     _stop_at_infinite_loop = false;
 
     // @TODO - Simulate full power-on state
@@ -46,6 +50,10 @@ void nes_cpu::power_on(nes_system *system)
     _context.A = _context.X = _context.Y = 0;
     _context.S = 0xfd;
     _context.PC = 0;
+
+    reset_idle_loop();
+
+    clear_blocks();
 }
 
 void nes_cpu::reset()
@@ -57,14 +65,89 @@ void nes_cpu::reset()
 
 void nes_cpu::poke(uint16_t addr, uint8_t value)
 { 
+    _idle_loop.pure = false;
     _mem->set_byte(addr, value); 
 }
 
+void nes_cpu::reset_idle_loop()
+{
+    // 0 is in zero page and never a branch target in practice
+    _idle_loop.head = 0;
+    _idle_loop.context = {};
+    _idle_loop.cycle = nes_cycle_t(0);
+    _idle_loop.length = nes_cycle_t(0);
+    _idle_loop.ppu_cycle = nes_cycle_t(0);
+    _idle_loop.repeat = 0;
+    _idle_loop.pure = false;
+    _idle_loop.reads_ppu_status = false;
+}
+
+void nes_cpu::enter_idle_loop(uint16_t head)
+{
+    if (_idle_loop.head == head)
+        return;
+
+    reset_idle_loop();
+    _idle_loop.head = head;
+}
+
+void nes_cpu::arrive_idle_loop_head()
+{
+    auto &loop = _idle_loop;
+    nes_cycle_t length = _cycle - loop.cycle;
+
+    // PPU catching up in the middle could have changed what the loop reads after it read it
+    bool same = loop.pure && length == loop.length && _ppu->cycle() == loop.ppu_cycle &&
+        loop.context.A == _context.A && loop.context.X == _context.X && loop.context.Y == _context.Y &&
+        loop.context.S == _context.S && loop.context.P == _context.P;
+
+    if (same)
+    {
+        loop.repeat++;
+    }
+    else
+    {
+        loop.repeat = 0;
+        loop.reads_ppu_status = false;
+    }
+
+    loop.context = _context;
+    loop.cycle = _cycle;
+    loop.length = length;
+    loop.ppu_cycle = _ppu->cycle();
+    loop.pure = true;
+
+    // The first identical iteration might still have cleared VBlank / toggle by reading PPUSTATUS
+    // Wait for another one to make sure we are really going in circles
+    if (loop.repeat < 2)
+        return;
+
+    // Nothing the loop observes changes until PPU has its next event (NMI / end of frame) or
+    // PPUSTATUS changes. Skip every iteration that would complete before that - in lockstep they
+    // don't catch PPU up either so the end result is exactly the same
+    nes_cycle_t until = _ppu->next_event_cycle();
+    if (loop.reads_ppu_status)
+        until = std::min(until, _ppu->next_status_change_cycle());
+
+    if (until > _cycle)
+    {
+        auto iterations = (until - _cycle) / length;
+        _cycle += iterations * length;
+        loop.cycle = _cycle;
+
+        if (auto perf = _system->perf())
+            perf->idle_loop_cycles_skipped += uint64_t((iterations * length).count());
+    }
+}
+
 void nes_cpu::step_to(nes_cycle_t new_count)
 {
     // we are asked to proceed to new_count - keep executing one instruction
     while (_cycle < new_count && !_system->stop_requested())
-        exec_one_instruction();    
+    {
+        if (!exec_block(new_count))
+            exec_one_instruction();
+    }
 }
 
 void nes_cpu::serialize(vector<uint8_t> &out) const
@@ -108,10 +191,12 @@ bool nes_cpu::deserialize(const uint8_t *data, size_t size, size_t &offset)
     _is_stop_at_addr = (b != 0);
     if (!read_value(data, size, offset, _stop_at_addr)) return false;
 
+    reset_idle_loop();
+
     return true;
 }
 
-#define IS_ALU_OP_CODE_(op, offset, mode) case nes_op_code::op##_base + offset : NES_TRACE4(get_op_str(#op, nes_addr_mode::nes_addr_mode_##mode)); op(nes_addr_mode::nes_addr_mode_##mode); break; 
+#define IS_ALU_OP_CODE_(op, offset, mode) case nes_op_code::op##_base + offset : visit(#op, &nes_cpu::op, nes_addr_mode::nes_addr_mode_##mode, true); break; 
 #define IS_ALU_OP_CODE(op) \
     IS_ALU_OP_CODE_(op, 0x9, imm) \
     IS_ALU_OP_CODE_(op, 0x5, zp) \
@@ -131,7 +216,7 @@ bool nes_cpu::deserialize(const uint8_t *data, size_t size, size_t &offset)
     IS_ALU_OP_CODE_(op, 0x1, ind_x) \
     IS_ALU_OP_CODE_(op, 0x11, ind_y)
 
-#define IS_RMW_OP_CODE_(op, opcode, offset, mode) case opcode + offset : NES_TRACE4(get_op_str(#op, nes_addr_mode::nes_addr_mode_##mode)); op(nes_addr_mode::nes_addr_mode_##mode); break; 
+#define IS_RMW_OP_CODE_(op, opcode, offset, mode) case opcode + offset : visit(#op, &nes_cpu::op, nes_addr_mode::nes_addr_mode_##mode, true); break; 
 #define IS_RMW_OP_CODE(op, opcode) \
     IS_RMW_OP_CODE_(op, opcode, 0x6, zp) \
     IS_RMW_OP_CODE_(op, opcode, 0xa, acc) \
@@ -139,11 +224,11 @@ bool nes_cpu::deserialize(const uint8_t *data, size_t size, size_t &offset)
     IS_RMW_OP_CODE_(op, opcode, 0xe, abs) \
     IS_RMW_OP_CODE_(op, opcode, 0x1e, abs_x)
 
-#define IS_OP_CODE(op, opcode) case opcode : NES_TRACE4(get_op_str(#op, nes_addr_mode_imp)); op(nes_addr_mode_imp); break;
-#define IS_OP_CODE_MODE(op, opcode, mode) case opcode : NES_TRACE4(get_op_str(#op, nes_addr_mode_##mode)); op(nes_addr_mode_##mode); break;
+#define IS_OP_CODE(op, opcode) case opcode : visit(#op, &nes_cpu::op, nes_addr_mode_imp, true); break;
+#define IS_OP_CODE_MODE(op, opcode, mode) case opcode : visit(#op, &nes_cpu::op, nes_addr_mode_##mode, true); break;
 
-#define IS_UNOFFICIAL_OP_CODE(op, opcode) case opcode : NES_TRACE4(get_op_str(#op, nes_addr_mode_imp, false)); op(nes_addr_mode_imp); break;
-#define IS_UNOFFICIAL_OP_CODE_MODE(op, opcode, mode) case opcode : NES_TRACE4(get_op_str(#op, nes_addr_mode_##mode, false)); op(nes_addr_mode_##mode); break;
+#define IS_UNOFFICIAL_OP_CODE(op, opcode) case opcode : visit(#op, &nes_cpu::op, nes_addr_mode_imp, false); break;
+#define IS_UNOFFICIAL_OP_CODE_MODE(op, opcode, mode) case opcode : visit(#op, &nes_cpu::op, nes_addr_mode_##mode, false); break;
 
 void nes_cpu::NMI()
 {
@@ -156,14 +241,22 @@ void nes_cpu::NMI()
 
     step_cpu(7);
     PC() = peek_word(NMI_HANDLER);
+
+    if (auto perf = _system->perf())
+        perf->nmis++;
 }
 
 void nes_cpu::OAMDMA()
 {
     NES_TRACE3("[NES_CPU] OAMDMA at " << _dma_addr);
 
+    // PPU needs to finish rendering with the old OAM first
+    _system->sync_ppu();
     _system->ppu()->oam_dma(_dma_addr);
 
+    if (auto perf = _system->perf())
+        perf->oam_dmas++;
+
     // The entire DMA takes 513 or 514 cycles
     // http://wiki.nesdev.com/w/index.php/PPU_registers#OAMDMA
     if (_cycle % 2 == nes_cpu_cycle_t(0))
@@ -174,6 +267,14 @@ void nes_cpu::OAMDMA()
 
 void nes_cpu::exec_one_instruction()
 {
+    // This might skip ahead to right before the next PPU event - so do this before the check below
+    if (PC() == _idle_loop.head && !_nmi_pending && !_dma_pending)
+        arrive_idle_loop_head();
+
+    // PPU is lagging behind - catch up if it has a NMI / frame boundary due
+    if (_cycle >= _ppu->next_event_cycle())
+        _system->sync_ppu();
+
     if (_is_stop_at_addr && _stop_at_addr == PC())
     {
         _system->stop();
@@ -197,238 +298,595 @@ void nes_cpu::exec_one_instruction()
     {
         // next op
         auto op_code = decode_byte();
+        dispatch_op(op_code, [this](const char *, nes_cpu_op_handler handler, nes_addr_mode addr_mode, bool) {
+            if (!handler)
+            {
+                NES_TRACE0("[NES_CPU] Unrecognized instruction or illegal instruction!");
+                assert(false);
+                return;
+            }
+
+#if NES_TRACE_MAX_LEVEL >= 4
+            if (nes_tracer::is_binary_on(_tracer))
+                _tracer->record(capture_trace_record(addr_mode));
+#endif
+            NES_TRACE4(format_trace_record(capture_trace_record(addr_mode)));
+
+            (this->*handler)(addr_mode);
+        });
 
-        // Let's start with a switch / case
-        // Compiler should do good enough job to create a jump table
-        // The problem with starting with my own table is that it get massive with lots of empty entries before I code
-        // up any instructions.
-        switch (op_code)
+        if (auto perf = _system->perf())
         {
-        IS_ALU_OP_CODE(ADC)
-        IS_ALU_OP_CODE(AND)
-        IS_ALU_OP_CODE(CMP)
-        IS_ALU_OP_CODE(EOR)
-        IS_ALU_OP_CODE(ORA)
-        IS_ALU_OP_CODE(SBC)
-        IS_ALU_OP_CODE_NO_IMM(STA)
-        IS_ALU_OP_CODE(LDA)
-
-        IS_RMW_OP_CODE(ASL, 0x0)
-        IS_RMW_OP_CODE(ROL, 0x20)
-        IS_RMW_OP_CODE(LSR, 0x40)
-        IS_RMW_OP_CODE(ROR, 0x60)
-
-        IS_OP_CODE_MODE(LDX, 0xa2, imm)
-        IS_OP_CODE_MODE(LDX, 0xa6, zp)
-        IS_OP_CODE_MODE(LDX, 0xb6, zp_ind_y)
-        IS_OP_CODE_MODE(LDX, 0xae, abs)
-        IS_OP_CODE_MODE(LDX, 0xbe, abs_y)
-        IS_OP_CODE_MODE(LDY, 0xa0, imm)
-        IS_OP_CODE_MODE(LDY, 0xa4, zp)
-        IS_OP_CODE_MODE(LDY, 0xb4, zp_ind_x)
-        IS_OP_CODE_MODE(LDY, 0xac, abs)
-        IS_OP_CODE_MODE(LDY, 0xbc, abs_x)
-
-        IS_OP_CODE_MODE(STX, 0x86, zp)
-        IS_OP_CODE_MODE(STX, 0x96, zp_ind_y)
-        IS_OP_CODE_MODE(STX, 0x8e, abs)
-        IS_OP_CODE_MODE(STY, 0x84, zp)
-        IS_OP_CODE_MODE(STY, 0x94, zp_ind_x)
-        IS_OP_CODE_MODE(STY, 0x8c, abs)
-
-        IS_OP_CODE_MODE(CPX, 0xe0, imm)
-        IS_OP_CODE_MODE(CPX, 0xe4, zp)
-        IS_OP_CODE_MODE(CPX, 0xec, abs)
-        IS_OP_CODE_MODE(CPY, 0xc0, imm)
-        IS_OP_CODE_MODE(CPY, 0xc4, zp)
-        IS_OP_CODE_MODE(CPY, 0xcc, abs)
-
-        IS_OP_CODE(TAX, 0xaa)
-        IS_OP_CODE(TAY, 0xa8)
-        IS_OP_CODE(TSX, 0xba)
-        IS_OP_CODE(TXA, 0x8a)
-        IS_OP_CODE(TXS, 0x9a)
-        IS_OP_CODE(TYA, 0x98)
-
-        IS_OP_CODE_MODE(INC, 0xe6, zp)
-        IS_OP_CODE_MODE(INC, 0xf6, zp_ind_x)
-        IS_OP_CODE_MODE(INC, 0xee, abs)
-        IS_OP_CODE_MODE(INC, 0xfe, abs_x)
-        IS_OP_CODE(INX, 0xe8)
-        IS_OP_CODE(INY, 0xc8)
-        IS_OP_CODE_MODE(DEC, 0xc6, zp)
-        IS_OP_CODE_MODE(DEC, 0xd6, zp_ind_x)
-        IS_OP_CODE_MODE(DEC, 0xce, abs)
-        IS_OP_CODE_MODE(DEC, 0xde, abs_x)
-        IS_OP_CODE(DEX, 0xca)
-        IS_OP_CODE(DEY, 0x88)
-
-        IS_OP_CODE(SEC, 0x38)
-        IS_OP_CODE(SED, 0xf8)
-        IS_OP_CODE(SEI, 0x78)
-        IS_OP_CODE(CLC, 0x18)
-        IS_OP_CODE(CLD, 0xd8)
-        IS_OP_CODE(CLI, 0x58)
-        IS_OP_CODE(CLV, 0xB8)
-
-        IS_OP_CODE_MODE(JMP, 0x4c, abs_jmp)
-        IS_OP_CODE_MODE(JMP, 0x6c, ind_jmp)
-        
-        IS_OP_CODE_MODE(BCC, 0x90, rel)
-        IS_OP_CODE_MODE(BCS, 0xb0, rel)
-        IS_OP_CODE_MODE(BEQ, 0xf0, rel)
-        IS_OP_CODE_MODE(BMI, 0x30, rel)
-        IS_OP_CODE_MODE(BNE, 0xd0, rel)
-        IS_OP_CODE_MODE(BPL, 0x10, rel)
-        IS_OP_CODE_MODE(BVC, 0x50, rel)
-        IS_OP_CODE_MODE(BVS, 0x70, rel)
-
-        IS_OP_CODE_MODE(BIT, 0x24, zp)
-        IS_OP_CODE_MODE(BIT, 0x2c, abs)
-
-        IS_OP_CODE(PHA, 0x48)
-        IS_OP_CODE(PHP, 0x08)
-        IS_OP_CODE(PLA, 0x68)
-        IS_OP_CODE(PLP, 0x28)
-
-        IS_OP_CODE(RTI, 0x40)
-        IS_OP_CODE_MODE(JSR, 0x20, abs_jmp)
-
-        IS_OP_CODE(RTS, 0x60)
-
-        IS_OP_CODE(KIL, 0x02)
-        IS_OP_CODE(KIL, 0x12)
-        IS_OP_CODE(KIL, 0x22)
-        IS_OP_CODE(KIL, 0x32)
-        IS_OP_CODE(KIL, 0x42)
-        IS_OP_CODE(KIL, 0x52)
-        IS_OP_CODE(KIL, 0x62)
-        IS_OP_CODE(KIL, 0x72)
-        IS_OP_CODE(KIL, 0x92)
-        IS_OP_CODE(KIL, 0xB2)
-        IS_OP_CODE(KIL, 0xd2)
-        IS_OP_CODE(KIL, 0xf2)
-
-        IS_OP_CODE(BRK, 0x00)
-
-        // The real NOP
-        IS_OP_CODE_MODE(NOP, 0xea, imp)
-
-        //===============================================================================
-        // Unofficial instructions
-        //===============================================================================
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x80, imm)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x04, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x44, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x64, zp)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x0c, abs)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x14, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x34, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x54, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x74, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xd4, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xf4, zp_ind_x)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x1c, abs_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x3c, abs_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x5c, abs_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x7c, abs_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xdc, abs_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xfc, abs_x)
-       
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x89, imm)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x82, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xc2, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xe2, imm)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x1a, imp)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x3a, imp)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x5a, imp)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x7a, imp)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xda, imp)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xfa, imp)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x03, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x07, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(ANC, 0x0b, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x0f, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x13, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x17, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x1b, abs_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x1f, abs_x)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x23, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x27, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(ANC, 0x2b, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x2f, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x33, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x37, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x3b, abs_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x3f, abs_x)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x43, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x47, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(ALR, 0x4b, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x4f, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x53, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x57, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x5b, abs_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x5f, abs_x)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x63, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x67, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(ARR, 0x6b, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x6f, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x73, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x77, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x7b, abs_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x7f, abs_x)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(SAX, 0x83, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(SAX, 0x87, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(XAA, 0x8b, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(SAX, 0x8f, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(AHX, 0x93, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(SAX, 0x97, zp_ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(TAS, 0x9b, abs_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(AHX, 0x9f, abs_y)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xa3, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xa7, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xab, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xaf, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xb3, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xb7, zp_ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(LAS, 0xbb, zp_ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xbf, abs_y)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xc3, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xc7, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(AXS, 0xcb, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xcf, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xd3, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xd7, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xdb, abs_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xdf, abs_x)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xe3, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xe7, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(SBC, 0xeb, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xef, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xf3, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xf7, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xfb, abs_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xff, abs_x)
-
-        default:
-            NES_TRACE0("[NES_CPU] Unrecognized instruction or illegal instruction!");
-            assert(false);
+            perf->instructions++;
+            perf->opcodes[op_code]++;
+        }
+    }
+}
+
+//
+// Runs decoded instructions from the block at PC back to back. This is only done when everything
+// exec_one_instruction checks between instructions is known to be a no-op - nothing pending, no PPU
+// event due, not at the idle loop head, etc - so the end result is exactly the same.
+// Returns false if nothing was executed and caller should fall back to exec_one_instruction.
+//
+bool nes_cpu::exec_block(nes_cycle_t new_count)
+{
+    if (PC() < NES_CPU_BLOCK_START || PC() == _idle_loop.head || _nmi_pending || _dma_pending || _is_stop_at_addr ||
+        _cycle >= _ppu->next_event_cycle())
+        return false;
+
+    // Tracing wants every instruction - leave it to the interpreter
+    if (NES_TRACE_ENABLED(nes_tracer_level_diag) || NES_TRACE_BINARY_ENABLED())
+        return false;
+
+    nes_cpu_block *block = find_block(PC());
+    if (!block)
+        return false;
+
+    nes_perf_counters *perf = _system->perf();
+
+#ifdef NESCHAN_JIT
+    if (_jit && !perf && exec_jit_block(block, new_count))
+        return true;
+#endif
+
+    uint32_t generation = _block_generation;
+    const nes_cpu_block_op *op = block_ops(block);
+    const nes_cpu_block_op *end = op + block->op_count;
+    while (op != end)
+    {
+        // Nothing in a run does I/O or changes control flow. If all of it finishes before the next
+        // PPU event / new_count and doesn't pass the idle loop head, none of the checks below would
+        // stop it halfway - so they are done once for the whole run
+        if (op->run_length && !perf &&
+            _cycle + nes_cpu_cycle_t(op->run_cycles) < min(new_count, _ppu->next_event_cycle()) &&
+            (_idle_loop.head <= op->pc || _idle_loop.head > uint32_t(op[op->run_length - 1].pc) + op[op->run_length - 1].length))
+        {
+            const nes_cpu_block_op *run_end = op + op->run_length;
+            bool unchecked = true;
+            while (op != run_end && unchecked)
+                unchecked = exec_run_op(*op++);
+            PC() = (op - 1)->pc + (op - 1)->length;
+
+            if (unchecked)
+                continue;
+        }
+        else
+        {
+            exec_block_op(*op);
+
+            if (perf)
+            {
+                perf->instructions++;
+                perf->opcodes[op->op_code]++;
+            }
+
+            ++op;
+        }
+
+        // Anything that needs exec_one_instruction's attention before the next instruction
+        if (_nmi_pending || _dma_pending || _system->stop_requested() || PC() == _idle_loop.head ||
+            _mem->code_generation() != generation || _cycle >= new_count || _cycle >= _ppu->next_event_cycle())
+            break;
+
+        // Branch taken - continue with the block over there
+        if (op != end && op->pc != PC())
+            break;
+    }
+
+    return true;
+}
+
+#ifdef NESCHAN_JIT
+bool nes_cpu::exec_jit_block(nes_cpu_block *block, nes_cycle_t new_count)
+{
+    if (!block->code)
+    {
+        if (++block->hits < _jit->threshold())
+            return false;
+
+        block->code = _jit->compile(block);
+        if (!block->code)
+        {
+            // Out of space - start over
+            for (uint32_t i = 0; i < _block_count; ++i)
+                _blocks[i].code = nullptr;
+            _jit->reset();
+
+            block->code = _jit->compile(block);
+            if (!block->code)
+                return false;
+        }
+    }
+
+    _jit_new_count = new_count;
+    _jit_generation = _block_generation;
+    _jit_limit = min(new_count, _ppu->next_event_cycle());
+
+    // Compiled code gives up before its first instruction if that one can't run without checks -
+    // leave it to exec_block then
+    nes_cycle_t start = _cycle;
+    block->code(this);
+    if (_cycle == start)
+        return false;
+
+    _jit->on_block_executed();
+    _jit->verify();
+
+    return true;
+}
+
+bool nes_cpu::jit_exec_op(nes_cpu *cpu, const nes_cpu_block_op *op)
+{
+    // Same as one iteration of exec_block
+    cpu->exec_block_op(*op);
+
+    if (cpu->_nmi_pending || cpu->_dma_pending || cpu->_system->stop_requested() || cpu->PC() == cpu->_idle_loop.head ||
+        cpu->_mem->code_generation() != cpu->_jit_generation)
+        return false;
+
+    // PPU might have been synced and scheduled a new event
+    cpu->_jit_limit = min(cpu->_jit_new_count, cpu->_ppu->next_event_cycle());
+    return cpu->_cycle < cpu->_jit_limit;
+}
+
+void nes_cpu::jit_enter_idle_loop(nes_cpu *cpu, uint16_t head)
+{
+    cpu->enter_idle_loop(head);
+}
+
+bool nes_cpu::jit_loop_head(nes_cpu *cpu, uint16_t next_pc)
+{
+    // exec_block stops at the loop head, and step_to goes around once more with exec_one_instruction
+    if (cpu->_cycle >= cpu->_jit_new_count || cpu->_system->stop_requested())
+        return false;
+
+    cpu->exec_one_instruction();
+
+    // Same as exec_block starting over at next_pc
+    if (cpu->PC() != next_pc || cpu->PC() == cpu->_idle_loop.head || cpu->_nmi_pending || cpu->_dma_pending ||
+        cpu->_is_stop_at_addr || cpu->_system->stop_requested() || cpu->_mem->code_generation() != cpu->_jit_generation)
+        return false;
+
+    cpu->_jit_limit = min(cpu->_jit_new_count, cpu->_ppu->next_event_cycle());
+    return cpu->_cycle < cpu->_jit_limit;
+}
+#endif
+
+//
+// Calls visit(name, handler, addr_mode, is_official) with the instruction for op_code, or with a null
+// handler for illegal instructions. This is the single op code table shared by the interpreter
+// (which executes the instruction) and the block decoder (which records it).
+//
+template <typename visitor_t>
+void nes_cpu::dispatch_op(uint8_t op_code, visitor_t &&visit)
+{
+    // Let's start with a switch / case
+    // Compiler should do good enough job to create a jump table
+    // The problem with starting with my own table is that it get massive with lots of empty entries before I code
+    // up any instructions.
+    switch (op_code)
+    {
+    IS_ALU_OP_CODE(ADC)
+    IS_ALU_OP_CODE(AND)
+    IS_ALU_OP_CODE(CMP)
+    IS_ALU_OP_CODE(EOR)
+    IS_ALU_OP_CODE(ORA)
+    IS_ALU_OP_CODE(SBC)
+    IS_ALU_OP_CODE_NO_IMM(STA)
+    IS_ALU_OP_CODE(LDA)
+
+    IS_RMW_OP_CODE(ASL, 0x0)
+    IS_RMW_OP_CODE(ROL, 0x20)
+    IS_RMW_OP_CODE(LSR, 0x40)
+    IS_RMW_OP_CODE(ROR, 0x60)
+
+    IS_OP_CODE_MODE(LDX, 0xa2, imm)
+    IS_OP_CODE_MODE(LDX, 0xa6, zp)
+    IS_OP_CODE_MODE(LDX, 0xb6, zp_ind_y)
+    IS_OP_CODE_MODE(LDX, 0xae, abs)
+    IS_OP_CODE_MODE(LDX, 0xbe, abs_y)
+    IS_OP_CODE_MODE(LDY, 0xa0, imm)
+    IS_OP_CODE_MODE(LDY, 0xa4, zp)
+    IS_OP_CODE_MODE(LDY, 0xb4, zp_ind_x)
+    IS_OP_CODE_MODE(LDY, 0xac, abs)
+    IS_OP_CODE_MODE(LDY, 0xbc, abs_x)
+
+    IS_OP_CODE_MODE(STX, 0x86, zp)
+    IS_OP_CODE_MODE(STX, 0x96, zp_ind_y)
+    IS_OP_CODE_MODE(STX, 0x8e, abs)
+    IS_OP_CODE_MODE(STY, 0x84, zp)
+    IS_OP_CODE_MODE(STY, 0x94, zp_ind_x)
+    IS_OP_CODE_MODE(STY, 0x8c, abs)
+
+    IS_OP_CODE_MODE(CPX, 0xe0, imm)
+    IS_OP_CODE_MODE(CPX, 0xe4, zp)
+    IS_OP_CODE_MODE(CPX, 0xec, abs)
+    IS_OP_CODE_MODE(CPY, 0xc0, imm)
+    IS_OP_CODE_MODE(CPY, 0xc4, zp)
+    IS_OP_CODE_MODE(CPY, 0xcc, abs)
+
+    IS_OP_CODE(TAX, 0xaa)
+    IS_OP_CODE(TAY, 0xa8)
+    IS_OP_CODE(TSX, 0xba)
+    IS_OP_CODE(TXA, 0x8a)
+    IS_OP_CODE(TXS, 0x9a)
+    IS_OP_CODE(TYA, 0x98)
+
+    IS_OP_CODE_MODE(INC, 0xe6, zp)
+    IS_OP_CODE_MODE(INC, 0xf6, zp_ind_x)
+    IS_OP_CODE_MODE(INC, 0xee, abs)
+    IS_OP_CODE_MODE(INC, 0xfe, abs_x)
+    IS_OP_CODE(INX, 0xe8)
+    IS_OP_CODE(INY, 0xc8)
+    IS_OP_CODE_MODE(DEC, 0xc6, zp)
+    IS_OP_CODE_MODE(DEC, 0xd6, zp_ind_x)
+    IS_OP_CODE_MODE(DEC, 0xce, abs)
+    IS_OP_CODE_MODE(DEC, 0xde, abs_x)
+    IS_OP_CODE(DEX, 0xca)
+    IS_OP_CODE(DEY, 0x88)
+
+    IS_OP_CODE(SEC, 0x38)
+    IS_OP_CODE(SED, 0xf8)
+    IS_OP_CODE(SEI, 0x78)
+    IS_OP_CODE(CLC, 0x18)
+    IS_OP_CODE(CLD, 0xd8)
+    IS_OP_CODE(CLI, 0x58)
+    IS_OP_CODE(CLV, 0xB8)
+
+    IS_OP_CODE_MODE(JMP, 0x4c, abs_jmp)
+    IS_OP_CODE_MODE(JMP, 0x6c, ind_jmp)
+    
+    IS_OP_CODE_MODE(BCC, 0x90, rel)
+    IS_OP_CODE_MODE(BCS, 0xb0, rel)
+    IS_OP_CODE_MODE(BEQ, 0xf0, rel)
+    IS_OP_CODE_MODE(BMI, 0x30, rel)
+    IS_OP_CODE_MODE(BNE, 0xd0, rel)
+    IS_OP_CODE_MODE(BPL, 0x10, rel)
+    IS_OP_CODE_MODE(BVC, 0x50, rel)
+    IS_OP_CODE_MODE(BVS, 0x70, rel)
+
+    IS_OP_CODE_MODE(BIT, 0x24, zp)
+    IS_OP_CODE_MODE(BIT, 0x2c, abs)
+
+    IS_OP_CODE(PHA, 0x48)
+    IS_OP_CODE(PHP, 0x08)
+    IS_OP_CODE(PLA, 0x68)
+    IS_OP_CODE(PLP, 0x28)
+
+    IS_OP_CODE(RTI, 0x40)
+    IS_OP_CODE_MODE(JSR, 0x20, abs_jmp)
+
+    IS_OP_CODE(RTS, 0x60)
+
+    IS_OP_CODE(KIL, 0x02)
+    IS_OP_CODE(KIL, 0x12)
+    IS_OP_CODE(KIL, 0x22)
+    IS_OP_CODE(KIL, 0x32)
+    IS_OP_CODE(KIL, 0x42)
+    IS_OP_CODE(KIL, 0x52)
+    IS_OP_CODE(KIL, 0x62)
+    IS_OP_CODE(KIL, 0x72)
+    IS_OP_CODE(KIL, 0x92)
+    IS_OP_CODE(KIL, 0xB2)
+    IS_OP_CODE(KIL, 0xd2)
+    IS_OP_CODE(KIL, 0xf2)
+
+    IS_OP_CODE(BRK, 0x00)
+
+    // The real NOP
+    IS_OP_CODE_MODE(NOP, 0xea, imp)
+
+    //===============================================================================
+    // Unofficial instructions
+    //===============================================================================
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x80, imm)
+
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x04, zp)
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x44, zp)
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x64, zp)
+
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x0c, abs)
+
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x14, zp_ind_x)
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x34, zp_ind_x)
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x54, zp_ind_x)
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x74, zp_ind_x)
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xd4, zp_ind_x)
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xf4, zp_ind_x)
+
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x1c, abs_x)
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x3c, abs_x)
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x5c, abs_x)
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x7c, abs_x)
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xdc, abs_x)
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xfc, abs_x)
+   
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x89, imm)
+
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x82, imm)
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xc2, imm)
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xe2, imm)
+
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x1a, imp)
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x3a, imp)
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x5a, imp)
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x7a, imp)
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xda, imp)
+    IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xfa, imp)
+
+    IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x03, ind_x)     
+    IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x07, zp)
+    IS_UNOFFICIAL_OP_CODE_MODE(ANC, 0x0b, imm)
+    IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x0f, abs)
+    IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x13, ind_y)
+    IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x17, zp_ind_x)
+    IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x1b, abs_y)
+    IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x1f, abs_x)
+
+    IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x23, ind_x)     
+    IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x27, zp)
+    IS_UNOFFICIAL_OP_CODE_MODE(ANC, 0x2b, imm)
+    IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x2f, abs)
+    IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x33, ind_y)
+    IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x37, zp_ind_x)
+    IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x3b, abs_y)
+    IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x3f, abs_x)
+
+    IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x43, ind_x)     
+    IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x47, zp)
+    IS_UNOFFICIAL_OP_CODE_MODE(ALR, 0x4b, imm)
+    IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x4f, abs)
+    IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x53, ind_y)
+    IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x57, zp_ind_x)
+    IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x5b, abs_y)
+    IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x5f, abs_x)
+
+    IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x63, ind_x)     
+    IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x67, zp)
+    IS_UNOFFICIAL_OP_CODE_MODE(ARR, 0x6b, imm)
+    IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x6f, abs)
+    IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x73, ind_y)
+    IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x77, zp_ind_x)
+    IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x7b, abs_y)
+    IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x7f, abs_x)
+
+    IS_UNOFFICIAL_OP_CODE_MODE(SAX, 0x83, ind_x)     
+    IS_UNOFFICIAL_OP_CODE_MODE(SAX, 0x87, zp)
+    IS_UNOFFICIAL_OP_CODE_MODE(XAA, 0x8b, imm)
+    IS_UNOFFICIAL_OP_CODE_MODE(SAX, 0x8f, abs)
+    IS_UNOFFICIAL_OP_CODE_MODE(AHX, 0x93, ind_y)
+    IS_UNOFFICIAL_OP_CODE_MODE(SAX, 0x97, zp_ind_y)
+    IS_UNOFFICIAL_OP_CODE_MODE(TAS, 0x9b, abs_y)
+    IS_UNOFFICIAL_OP_CODE_MODE(AHX, 0x9f, abs_y)
+
+    IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xa3, ind_x)     
+    IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xa7, zp)
+    IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xab, imm)
+    IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xaf, abs)
+    IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xb3, ind_y)
+    IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xb7, zp_ind_y)
+    IS_UNOFFICIAL_OP_CODE_MODE(LAS, 0xbb, zp_ind_y)
+    IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xbf, abs_y)
+
+    IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xc3, ind_x)     
+    IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xc7, zp)
+    IS_UNOFFICIAL_OP_CODE_MODE(AXS, 0xcb, imm)
+    IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xcf, abs)
+    IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xd3, ind_y)
+    IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xd7, zp_ind_x)
+    IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xdb, abs_y)
+    IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xdf, abs_x)
+
+    IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xe3, ind_x)     
+    IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xe7, zp)
+    IS_UNOFFICIAL_OP_CODE_MODE(SBC, 0xeb, imm)
+    IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xef, abs)
+    IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xf3, ind_y)
+    IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xf7, zp_ind_x)
+    IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xfb, abs_y)
+    IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xff, abs_x)
+
+    default:
+        visit(nullptr, nullptr, nes_addr_mode_imp, false);
+        break;
+    }
+}
+
+uint8_t nes_cpu::get_op_length(nes_addr_mode addr_mode)
+{
+    switch (addr_mode)
+    {
+    case nes_addr_mode_imp:
+    case nes_addr_mode_acc:
+        return 1;
+    case nes_addr_mode_abs:
+    case nes_addr_mode_abs_x:
+    case nes_addr_mode_abs_y:
+    case nes_addr_mode_abs_jmp:
+    case nes_addr_mode_ind_jmp:
+        return 3;
+    default:
+        return 2;
+    }
+}
+
+void nes_cpu::clear_blocks()
+{
+    // Table entries are checked against the block they point to - no need to clear them
+    _block_count = 0;
+    _block_op_count = 0;
+    _block_generation = _mem->code_generation();
+
+#ifdef NESCHAN_JIT
+    // Nothing runs the compiled code anymore
+    if (_jit)
+        _jit->reset();
+#endif
+}
+
+nes_cpu_block *nes_cpu::find_block(uint16_t pc)
+{
+    // PRG ROM changed - nothing decoded so far is any good
+    if (_block_generation != _mem->code_generation())
+        clear_blocks();
+
+    uint16_t &entry = _block_table[pc - NES_CPU_BLOCK_START];
+    if (entry > 0 && entry <= _block_count && _blocks[entry - 1].pc == pc)
+    {
+        nes_cpu_block *block = &_blocks[entry - 1];
+        return block->op_count ? block : nullptr;
+    }
+
+    if (_block_count == NES_CPU_BLOCK_COUNT || _block_op_count + NES_CPU_BLOCK_MAX_OPS > NES_CPU_BLOCK_OP_COUNT)
+        clear_blocks();
+
+    nes_cpu_block *block = &_blocks[_block_count++];
+    entry = uint16_t(_block_count);
+    block->pc = pc;
+    block->op_count = 0;
+    block->first_op = _block_op_count;
+#ifdef NESCHAN_JIT
+    block->code = nullptr;
+    block->hits = 0;
+#endif
+
+    // Decode until the first instruction that changes control flow
+    uint32_t addr = pc;
+    while (block->op_count < NES_CPU_BLOCK_MAX_OPS)
+    {
+        nes_cpu_block_op &op = _block_ops[_block_op_count];
+        op = {};
+        op.op_code = _mem->get_byte(uint16_t(addr));
+        dispatch_op(op.op_code, [&op](const char *, nes_cpu_op_handler handler, nes_addr_mode addr_mode, bool) {
+            op.handler = handler;
+            op.addr_mode = addr_mode;
+        });
+
+        // illegal instruction - leave it to the interpreter
+        if (!op.handler)
+            break;
+
+        op.pc = uint16_t(addr);
+        op.length = get_op_length(op.addr_mode);
+        if (addr + op.length > 0x10000)
+            break;
+
+        decode_block_op(op);
+        block->op_count++;
+        _block_op_count++;
+        addr += op.length;
+
+        if (op.addr_mode == nes_addr_mode_rel || op.addr_mode == nes_addr_mode_abs_jmp || op.addr_mode == nes_addr_mode_ind_jmp ||
+            op.handler == &nes_cpu::RTS || op.handler == &nes_cpu::RTI || op.handler == &nes_cpu::BRK || op.handler == &nes_cpu::KIL)
             break;
+    }
+
+    // Runs - see nes_cpu_block_op::run_length
+    nes_cpu_block_op *ops = &_block_ops[block->first_op];
+    for (int i = block->op_count - 1; i >= 0; --i)
+    {
+        nes_cpu_block_op &op = ops[i];
+        if (op.kind == nes_cpu_block_op_handler)
+            continue;
+
+        bool is_last = (i + 1 == block->op_count);
+        op.run_length = uint8_t(1 + (is_last ? 0 : ops[i + 1].run_length));
+        op.run_cycles = uint16_t(op.cycles + (is_last ? 0 : ops[i + 1].run_cycles));
+    }
+
+    return block->op_count ? block : nullptr;
+}
+
+//
+// Works out how exec_block can run op (see nes_cpu_block_op_kind) and resolves its operand if it
+// doesn't depend on registers. Anything that might touch I/O stays with the handler
+//
+void nes_cpu::decode_block_op(nes_cpu_block_op &op)
+{
+    auto handler = op.handler;
+    op.kind = nes_cpu_block_op_handler;
+
+    if (op.addr_mode == nes_addr_mode_imp || op.addr_mode == nes_addr_mode_acc)
+    {
+        if (handler == &nes_cpu::TAX || handler == &nes_cpu::TAY || handler == &nes_cpu::TSX || handler == &nes_cpu::TXA ||
+            handler == &nes_cpu::TXS || handler == &nes_cpu::TYA || handler == &nes_cpu::INX || handler == &nes_cpu::INY ||
+            handler == &nes_cpu::DEX || handler == &nes_cpu::DEY || handler == &nes_cpu::CLC || handler == &nes_cpu::SEC ||
+            handler == &nes_cpu::CLI || handler == &nes_cpu::SEI || handler == &nes_cpu::CLD || handler == &nes_cpu::SED ||
+            handler == &nes_cpu::CLV || handler == &nes_cpu::NOP ||
+            handler == &nes_cpu::ASL || handler == &nes_cpu::LSR || handler == &nes_cpu::ROL || handler == &nes_cpu::ROR)
+        {
+            op.kind = nes_cpu_block_op_register;
+            op.cycles = 2;
         }
+        return;
+    }
+
+    if (op.addr_mode != nes_addr_mode_imm && op.addr_mode != nes_addr_mode_zp && op.addr_mode != nes_addr_mode_abs)
+        return;
+
+    // Operand bytes are in PRG ROM - the block goes away if that changes
+    uint16_t operand = (op.addr_mode == nes_addr_mode_abs) ? _mem->get_word(op.pc + 1) : _mem->get_byte(op.pc + 1);
+    operand_t resolved = { operand, operand_kind_addr, false };
+    op.cycles = uint8_t(get_cpu_cycle(resolved, op.addr_mode).count());
+
+    nes_cpu_op_core core = nullptr;
+    if (handler == &nes_cpu::LDA) core = &nes_cpu::_LDA;
+    else if (handler == &nes_cpu::LDX) core = &nes_cpu::_LDX;
+    else if (handler == &nes_cpu::LDY) core = &nes_cpu::_LDY;
+    else if (handler == &nes_cpu::ADC) core = &nes_cpu::_ADC;
+    else if (handler == &nes_cpu::SBC) core = &nes_cpu::_SBC;
+    else if (handler == &nes_cpu::AND) core = &nes_cpu::_AND;
+    else if (handler == &nes_cpu::ORA) core = &nes_cpu::_ORA;
+    else if (handler == &nes_cpu::EOR) core = &nes_cpu::_EOR;
+    else if (handler == &nes_cpu::CMP) core = &nes_cpu::_CMP;
+    else if (handler == &nes_cpu::CPX) core = &nes_cpu::_CPX;
+    else if (handler == &nes_cpu::CPY) core = &nes_cpu::_CPY;
+    else if (handler == &nes_cpu::BIT) core = &nes_cpu::_BIT;
+
+    uint8_t nes_cpu_context::*reg = nullptr;
+    if (handler == &nes_cpu::STA) reg = &nes_cpu_context::A;
+    else if (handler == &nes_cpu::STX) reg = &nes_cpu_context::X;
+    else if (handler == &nes_cpu::STY) reg = &nes_cpu_context::Y;
+
+    if (core && op.addr_mode == nes_addr_mode_imm)
+    {
+        op.kind = nes_cpu_block_op_read_imm;
+        op.core = core;
+        op.operand = operand;
+    }
+    else if (core && (operand < 0x2000 || operand >= 0x6000))
+    {
+        // RAM (mirrored) / PRG RAM / PRG ROM - reads have no side effects
+        op.kind = nes_cpu_block_op_read;
+        op.core = core;
+        op.operand = (operand < 0x2000) ? (operand & 0x7ff) : operand;
+    }
+    else if (reg && operand < 0x2000)
+    {
+        op.kind = nes_cpu_block_op_write;
+        op.reg = reg;
+        op.operand = operand & 0x7ff;
     }
 }
 
@@ -468,54 +926,27 @@ static void align(string &str, int loc)
 // 0         1         2         3         4         5         6         7         8
 // 012345678901234567890123456789012345678901234567890123456789012345678901234567890
 // C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD CYC:  0
-string nes_cpu::get_op_str(const char *op, nes_addr_mode addr_mode, bool is_official)
+string nes_cpu::format_trace_record(const nes_trace_record &record)
 {
-    nes_ppu_protect protect(_ppu);
-
-    int operand_size = 0;
-    switch (addr_mode)
-    {
-        case nes_addr_mode::nes_addr_mode_imp: 
-        case nes_addr_mode::nes_addr_mode_acc:
-            break;
+    const char *op;
+    nes_addr_mode addr_mode;
+    bool is_official;
+    get_op_info(record.bytes[0], op, addr_mode, is_official);
+    if (!op)
+        op = "???";
 
-        case nes_addr_mode::nes_addr_mode_rel: 
-        case nes_addr_mode::nes_addr_mode_imm:
-        case nes_addr_mode::nes_addr_mode_zp:
-        case nes_addr_mode::nes_addr_mode_zp_ind_x:
-        case nes_addr_mode::nes_addr_mode_zp_ind_y:
-        case nes_addr_mode::nes_addr_mode_ind_x:
-        case nes_addr_mode::nes_addr_mode_ind_y:
-            operand_size = 1;
-            break;
-
-        case nes_addr_mode::nes_addr_mode_ind_jmp:
-        case nes_addr_mode::nes_addr_mode_abs:
-        case nes_addr_mode::nes_addr_mode_abs_jmp:
-        case nes_addr_mode::nes_addr_mode_abs_x:
-        case nes_addr_mode::nes_addr_mode_abs_y:
-            operand_size = 2;
-            break;
-
-        default:
-            assert(false);
-    }
+    int operand_size = get_op_length(addr_mode) - 1;
 
     string msg;
 
-    // 0         1         2         3         4         5         6         7         8
-    // 012345678901234567890123456789012345678901234567890123456789012345678901234567890
-    // C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD CYC:  0
-
     // Opcode
-    // We've already decoded the op code so it's PC - 1
-    append_word(msg, PC() - 1);
+    append_word(msg, record.pc);
     align(msg, 6);
 
     // Dump instruction bytes
     for (int i = 0; i < operand_size + 1; ++i)
     {
-        append_byte(msg, peek(PC() - 1 + i));
+        append_byte(msg, record.bytes[i]);
         append_space(msg);
     }
 
@@ -530,173 +961,224 @@ string nes_cpu::get_op_str(const char *op, nes_addr_mode addr_mode, bool is_offi
     }
 
     msg.append(op);
-    append_operand_str(msg, addr_mode);
-
-    align(msg, 48);
-
-    msg.append("A:");
-    append_byte(msg, A());
-    append_space(msg);
-
-    msg.append("X:");
-    append_byte(msg, X());
-    append_space(msg);
-
-    msg.append("Y:");
-    append_byte(msg, Y());
     append_space(msg);
 
-    msg.append("P:");
-    append_byte(msg, P());
-    append_space(msg);
-
-    msg.append("SP:");
-    append_byte(msg, S());
-    append_space(msg);
-
-    msg.append("CYC:");
-
-    nes_cycle_t cycle_count_in_scanline = _cycle % PPU_SCANLINE_CYCLE;
-    int64_t cycle_count = cycle_count_in_scanline.count();
-
-    string cycle_str = std::to_string(cycle_count);
-    size_t cycle_space = 3 - cycle_str.size();
-    if (cycle_space > 0)
-        msg.append(cycle_space, ' ');
-    msg.append(cycle_str);
-
-    return msg;
-}
-
-void nes_cpu::append_operand_str(string &str, nes_addr_mode addr_mode)
-{
-    append_space(str);
+    uint8_t operand_byte = record.bytes[1];
+    uint16_t operand_word = record.bytes[1] + (uint16_t(record.bytes[2]) << 8);
     switch (addr_mode)
     {
     case nes_addr_mode::nes_addr_mode_imp:
-        return;
+        break;
 
     case nes_addr_mode::nes_addr_mode_acc:
-        str.append("A");
+        msg.append("A");
         break;
 
     case nes_addr_mode::nes_addr_mode_imm:
-        str.append("#$");
-        append_byte(str, peek(PC()));
+        msg.append("#$");
+        append_byte(msg, operand_byte);
         break;
 
     case nes_addr_mode::nes_addr_mode_rel:
         // display the real address directly after accounting for offset
-        str.append("$");
-        append_word(str, int8_t(peek(PC())) + PC() + 1);
+        msg.append("$");
+        append_word(msg, int8_t(operand_byte) + record.pc + 2);
         break;
 
     case nes_addr_mode::nes_addr_mode_zp:
     case nes_addr_mode::nes_addr_mode_zp_ind_x:
     case nes_addr_mode::nes_addr_mode_zp_ind_y:
-    {
-        str.append("$");
-        uint8_t addr = peek(PC());
-        append_byte(str, addr);
+        msg.append("$");
+        append_byte(msg, operand_byte);
         if (addr_mode == nes_addr_mode_zp_ind_x)
         {
-            str.append(",X @ ");
-            addr += X();
-            append_byte(str, addr);
+            msg.append(",X @ ");
+            append_byte(msg, operand_byte + record.X);
         }
         else if (addr_mode == nes_addr_mode_zp_ind_y)
         {
-            str.append(",Y @ ");
-            addr += Y();
-            append_byte(str, addr);
+            msg.append(",Y @ ");
+            append_byte(msg, operand_byte + record.Y);
         }
 
-        str.append(" = ");
-        append_byte(str, peek(addr));
+        msg.append(" = ");
+        append_byte(msg, record.value);
         break;
-    }
+
     case nes_addr_mode::nes_addr_mode_abs_jmp:
     case nes_addr_mode::nes_addr_mode_abs:
     case nes_addr_mode::nes_addr_mode_abs_x:
     case nes_addr_mode::nes_addr_mode_abs_y:
-    {
-        str.append("$");
-        uint16_t addr = peek_word(PC());
-        append_word(str, addr);
+        msg.append("$");
+        append_word(msg, operand_word);
         if (addr_mode != nes_addr_mode_abs_jmp)
         {
             if (addr_mode == nes_addr_mode_abs_x)
             {
-                str.append(",X @ ");
-                addr += X();
-                append_word(str, addr);
+                msg.append(",X @ ");
+                append_word(msg, operand_word + record.X);
             }
             else if (addr_mode == nes_addr_mode_abs_y)
             {
-                str.append(",Y @ ");
-                addr += Y();
-                append_word(str, addr);
+                msg.append(",Y @ ");
+                append_word(msg, operand_word + record.Y);
             }
 
-            str.append(" = ");
-            append_byte(str, peek(addr));
+            msg.append(" = ");
+            append_byte(msg, record.value);
         }
         break;
-    }
+
     case nes_addr_mode::nes_addr_mode_ind_jmp:
+        msg.append("($");
+        append_word(msg, operand_word);
+        msg.append(") = ");
+        append_word(msg, record.addr);
+        break;
+
+    case nes_addr_mode::nes_addr_mode_ind_x:
+        msg.append("($");
+        append_byte(msg, operand_byte);
+        msg.append(",X) @ ");
+        append_byte(msg, operand_byte + record.X);
+        msg.append(" = ");
+        append_word(msg, record.addr);
+        msg.append(" = ");
+        append_byte(msg, record.value);
+        break;
+
+    case nes_addr_mode::nes_addr_mode_ind_y:
+        msg.append("($");
+        append_byte(msg, operand_byte);
+        msg.append("),Y = ");
+        append_word(msg, record.addr);
+        msg.append(" @ ");
+        append_word(msg, record.addr + record.Y);
+        msg.append(" = ");
+        append_byte(msg, record.value);
+        break;
+
+    default:
+        assert(false);
+    }
+
+    align(msg, 48);
+
+    msg.append("A:");
+    append_byte(msg, record.A);
+    append_space(msg);
+
+    msg.append("X:");
+    append_byte(msg, record.X);
+    append_space(msg);
+
+    msg.append("Y:");
+    append_byte(msg, record.Y);
+    append_space(msg);
+
+    msg.append("P:");
+    append_byte(msg, record.P);
+    append_space(msg);
+
+    msg.append("SP:");
+    append_byte(msg, record.S);
+    append_space(msg);
+
+    msg.append("CYC:");
+
+    string cycle_str = std::to_string(record.cycle % PPU_SCANLINE_CYCLE.count());
+    if (cycle_str.size() < 3)
+        msg.append(3 - cycle_str.size(), ' ');
+    msg.append(cycle_str);
+
+    return msg;
+}
+
+//
+// Everything format_trace_record needs about the instruction at PC - 1 (op code is already decoded),
+// read without side effects on PPU
+//
+nes_trace_record nes_cpu::capture_trace_record(nes_addr_mode addr_mode)
+{
+    nes_ppu_protect protect(_ppu);
+
+    nes_trace_record record = {};
+    record.cycle = _cycle.count();
+    record.pc = PC() - 1;
+    record.A = A();
+    record.X = X();
+    record.Y = Y();
+    record.P = P();
+    record.S = S();
+
+    uint8_t length = get_op_length(addr_mode);
+    for (uint8_t i = 0; i < length; ++i)
+        record.bytes[i] = peek(record.pc + i);
+
+    uint8_t operand_byte = record.bytes[1];
+    uint16_t operand_word = record.bytes[1] + (uint16_t(record.bytes[2]) << 8);
+    switch (addr_mode)
     {
-        uint16_t addr = peek_word(PC());
-        str.append("($");
-        append_word(str, addr);
-        str.append(") = ");
+    case nes_addr_mode::nes_addr_mode_zp:
+        record.value = peek(operand_byte);
+        break;
+    case nes_addr_mode::nes_addr_mode_zp_ind_x:
+        record.value = peek(uint8_t(operand_byte + X()));
+        break;
+    case nes_addr_mode::nes_addr_mode_zp_ind_y:
+        record.value = peek(uint8_t(operand_byte + Y()));
+        break;
 
-        if ((addr & 0xff) == 0xff)
+    case nes_addr_mode::nes_addr_mode_abs:
+        record.value = peek(operand_word);
+        break;
+    case nes_addr_mode::nes_addr_mode_abs_x:
+        record.value = peek(operand_word + X());
+        break;
+    case nes_addr_mode::nes_addr_mode_abs_y:
+        record.value = peek(operand_word + Y());
+        break;
+
+    case nes_addr_mode::nes_addr_mode_ind_jmp:
+        if ((operand_word & 0xff) == 0xff)
         {
             // Account for JMP hardware bug
             // http://wiki.nesdev.com/w/index.php/Errata
-            append_word(str, peek(addr) + (uint16_t(peek(addr & 0xff00)) << 8));
+            record.addr = peek(operand_word) + (uint16_t(peek(operand_word & 0xff00)) << 8);
         }
         else
         {
-            append_word(str, peek_word(addr));
+            record.addr = peek_word(operand_word);
         }
         break;
-    }
-
 
     case nes_addr_mode::nes_addr_mode_ind_x:
-    {
-        uint8_t addr = peek(PC());
-        str.append("($");
-        append_byte(str, addr);
-        str.append(",X) @ ");
-        append_byte(str, addr + X());
-        uint16_t final_addr = peek((addr + _context.X) & 0xff) + (uint16_t(peek((addr + _context.X + 1) & 0xff)) << 8);
-        str.append(" = ");
-        append_word(str, final_addr);
-        str.append(" = ");
-        append_byte(str, peek(final_addr));
+        record.addr = peek((operand_byte + X()) & 0xff) + (uint16_t(peek((operand_byte + X() + 1) & 0xff)) << 8);
+        record.value = peek(record.addr);
         break;
-    }
+
     case nes_addr_mode::nes_addr_mode_ind_y:
-    {
-        uint8_t addr = peek(PC());
-        str.append("($");
-        append_byte(str, addr);
-        str.append("),Y = ");
-        uint16_t final_addr = peek(addr) + (uint16_t(peek((addr + 1) & 0xff)) << 8);
-        append_word(str, final_addr);
-        str.append(" @ ");
-        final_addr += _context.Y;
-        append_word(str, final_addr);
-        str.append(" = ");
-        append_byte(str, peek(final_addr));
+        record.addr = peek(operand_byte) + (uint16_t(peek((operand_byte + 1) & 0xff)) << 8);
+        record.value = peek(record.addr + Y());
         break;
-    }
 
     default:
-        assert(false);
+        break;
     }
+
+    return record;
+}
+
+void nes_cpu::get_op_info(uint8_t op_code, const char *&name, nes_addr_mode &addr_mode, bool &is_official)
+{
+    name = nullptr;
+    addr_mode = nes_addr_mode_imp;
+    is_official = true;
+    dispatch_op(op_code, [&](const char *op_name, nes_cpu_op_handler, nes_addr_mode op_addr_mode, bool op_is_official) {
+        name = op_name;
+        addr_mode = op_addr_mode;
+        is_official = op_is_official;
+    });
 }
 
 nes_cpu_cycle_t nes_cpu::get_cpu_cycle(operand_t operand, nes_addr_mode mode)
@@ -817,13 +1299,18 @@ void nes_cpu::AND(nes_addr_mode addr_mode)
 {
     operand_t op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
+    _AND(val);
+
+    // cycle count
+    step_cpu(get_cpu_cycle(op, addr_mode));
+}
+
+void nes_cpu::_AND(uint8_t val)
+{
     A() &= val;
 
     // flags    
     calc_alu_flag(A());
-    
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 // Compare 
@@ -831,16 +1318,25 @@ void nes_cpu::CMP(nes_addr_mode addr_mode)
 {
     operand_t op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);;
+    _CMP(val);
 
+    // cycle count
+    step_cpu(get_cpu_cycle(op, addr_mode));
+}
+
+void nes_cpu::_CMP(uint8_t val)
+{
+    compare(A(), val);
+}
+
+void nes_cpu::compare(uint8_t reg, uint8_t val)
+{
     // flags
-    uint8_t diff = A() - val;
+    uint8_t diff = reg - val;
 
-    set_carry_flag(A() >= val);
+    set_carry_flag(reg >= val);
     set_zero_flag(diff == 0);
     set_negative_flag(diff & 0x80);
-
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 // Exclusive OR 
@@ -848,14 +1344,18 @@ void nes_cpu::EOR(nes_addr_mode addr_mode)
 {
     operand_t op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
+    _EOR(val);
+
+    // cycle count
+    step_cpu(get_cpu_cycle(op, addr_mode));
+}
 
+void nes_cpu::_EOR(uint8_t val)
+{
     A() ^= val;
 
     // flags
     calc_alu_flag(A());
-
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 // Logical Inclusive OR
@@ -863,13 +1363,17 @@ void nes_cpu::ORA(nes_addr_mode addr_mode)
 {
     operand_t op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
+    _ORA(val);
+
+    // cycle count
+    step_cpu(get_cpu_cycle(op, addr_mode));
+}
 
+void nes_cpu::_ORA(uint8_t val)
+{
     A() |= val;
 
     calc_alu_flag(A());
-
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 // Subtract with carry
@@ -894,14 +1398,18 @@ void nes_cpu::LDA(nes_addr_mode addr_mode)
 {
     operand_t op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
+    _LDA(val);
+
+    // cycle count
+    step_cpu(get_cpu_cycle(op, addr_mode));
+}
 
+void nes_cpu::_LDA(uint8_t val)
+{
     A() = val;
 
     // flags
     calc_alu_flag(A());
-
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 // ASL - Arithmetic shift left
@@ -931,6 +1439,8 @@ void nes_cpu::branch(bool cond, nes_addr_mode addr_mode)
     if (cond)
     {
         PC() += rel;
+        if (rel < 0)
+            enter_idle_loop(PC());
         if (rel == -2 && _stop_at_infinite_loop)
         {
             _system->stop();
@@ -965,15 +1475,20 @@ void nes_cpu::BIT(nes_addr_mode addr_mode)
 {
     operand_t op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
+    _BIT(val);
+
+    // cycle count
+    step_cpu(get_cpu_cycle(op, addr_mode));
+}
+
+void nes_cpu::_BIT(uint8_t val)
+{
     uint8_t new_val = val & A();
 
     // flags
     set_zero_flag(new_val == 0);
     set_overflow_flag(val & 0x40);
     set_negative_flag(val & 0x80);
-
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 // BMI - Branch if minus
@@ -1032,35 +1547,33 @@ void nes_cpu::CPX(nes_addr_mode addr_mode)
 {
     auto op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
-
-    // flags
-    uint8_t diff = X() - val;
-
-    set_carry_flag(X() >= val);
-    set_zero_flag(diff == 0);
-    set_negative_flag(diff & 0x80);
+    _CPX(val);
 
     // cycle count
     step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
+void nes_cpu::_CPX(uint8_t val)
+{
+    compare(X(), val);
+}
+
 // CPY - Compare Y register
 void nes_cpu::CPY(nes_addr_mode addr_mode) 
 {
     auto op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);;
-
-    // flags
-    uint8_t diff = Y() - val;
-
-    set_carry_flag(Y() >= val);
-    set_zero_flag(diff == 0);
-    set_negative_flag(diff & 0x80);
+    _CPY(val);
 
     // cycle count
     step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
+void nes_cpu::_CPY(uint8_t val)
+{
+    compare(Y(), val);
+}
+
 // DEC - Decrement memory
 void nes_cpu::DEC(nes_addr_mode addr_mode) 
 {
@@ -1153,6 +1666,8 @@ void nes_cpu::JMP(nes_addr_mode addr_mode)
     }
 
     PC() = addr;
+    if (addr_mode == nes_addr_mode_abs_jmp && addr < old_pc)
+        enter_idle_loop(addr);
     
     // No impact to flags
     step_cpu(addr_mode == nes_addr_mode_abs_jmp ? 3 : 5);
@@ -1173,26 +1688,36 @@ void nes_cpu::JSR(nes_addr_mode addr_mode)
 void nes_cpu::LDX(nes_addr_mode addr_mode) 
 {
     operand_t op = decode_operand(addr_mode);
-    X() = read_operand(op);
-
-    calc_alu_flag(X());
+    _LDX(read_operand(op));
 
     // cycle count
     step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
+void nes_cpu::_LDX(uint8_t val)
+{
+    X() = val;
+
+    calc_alu_flag(X());
+}
+
 // LDY - Load Y register
 void nes_cpu::LDY(nes_addr_mode addr_mode) 
 {
     operand_t op = decode_operand(addr_mode);
-    Y() = read_operand(op);
-
-    calc_alu_flag(Y());
+    _LDY(read_operand(op));
 
     // cycle count
     step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
+void nes_cpu::_LDY(uint8_t val)
+{
+    Y() = val;
+
+    calc_alu_flag(Y());
+}
+
 // LSR - Logical shift right
 void nes_cpu::LSR(nes_addr_mode addr_mode)
 {
@@ -0,0 +1,640 @@
+#include "stdafx.h"
+
+#ifdef NESCHAN_JIT
+
+#include <sys/mman.h>
+#include <cstring>
+#include <initializer_list>
+
+#include "nes_cpu.h"
+#include "nes_cpu_jit.h"
+#include "nes_system.h"
+#include "nes_trace.h"
+
+namespace
+{
+    //
+    // x86-64 encoding helpers. Compiled code keeps the nes_cpu pointer in rbx and nes_memory::ram_data
+    // in r12, and only ever addresses [rbx + disp32] / [r12 + disp32] - plus [rax] for page flags
+    //
+    void emit(vector<uint8_t> &code, std::initializer_list<uint8_t> bytes)
+    {
+        code.insert(code.end(), bytes.begin(), bytes.end());
+    }
+
+    template<typename T>
+    void emit_value(vector<uint8_t> &code, T value)
+    {
+        for (size_t i = 0; i < sizeof(T); ++i)
+            code.push_back(uint8_t((uint64_t(value) >> (i * 8)) & 0xff));
+    }
+
+    // ModRM for [rbx + disp32] with reg (or op code extension) in the middle
+    void emit_rbx_disp(vector<uint8_t> &code, uint8_t reg, int32_t disp)
+    {
+        code.push_back(uint8_t(0x80 | (reg << 3) | 3));
+        emit_value(code, disp);
+    }
+
+    // ModRM + SIB for [r12 + disp32] - needs a REX.B prefix
+    void emit_r12_disp(vector<uint8_t> &code, uint8_t reg, int32_t disp)
+    {
+        code.push_back(uint8_t(0x80 | (reg << 3) | 4));
+        code.push_back(0x24);
+        emit_value(code, disp);
+    }
+
+    // jcc rel32 to be patched later - returns offset of rel32
+    size_t emit_jcc(vector<uint8_t> &code, uint8_t cc)
+    {
+        emit(code, { 0x0f, cc });
+        size_t offset = code.size();
+        emit_value(code, int32_t(0));
+        return offset;
+    }
+
+    // jmp rel32 to be patched later - returns offset of rel32
+    size_t emit_jmp(vector<uint8_t> &code)
+    {
+        emit(code, { 0xe9 });
+        size_t offset = code.size();
+        emit_value(code, int32_t(0));
+        return offset;
+    }
+
+    // Points rel32 at target
+    void patch_rel(vector<uint8_t> &code, size_t rel32, size_t target)
+    {
+        int32_t disp = int32_t(target - (rel32 + sizeof(int32_t)));
+        memcpy(&code[rel32], &disp, sizeof(disp));
+    }
+
+    // mov rax, fn / call rax
+    void emit_call(vector<uint8_t> &code, void *fn)
+    {
+        emit(code, { 0x48, 0xb8 }); emit_value(code, reinterpret_cast<uint64_t>(fn));
+        emit(code, { 0xff, 0xd0 });
+    }
+
+    const uint8_t JCC_E = 0x84;
+    const uint8_t JCC_NE = 0x85;
+    const uint8_t JCC_BE = 0x86;
+    const uint8_t JCC_GE = 0x8d;
+
+    // test byte [rbx + disp], imm8 / jcc - returns offset of rel32
+    size_t emit_jcc_test_byte(vector<uint8_t> &code, int32_t disp, uint8_t imm, uint8_t cc)
+    {
+        emit(code, { 0xf6 }); emit_rbx_disp(code, 0, disp); code.push_back(imm);
+        return emit_jcc(code, cc);
+    }
+
+    // movzx eax, byte [rbx + disp]
+    void emit_load_al(vector<uint8_t> &code, int32_t disp) { emit(code, { 0x0f, 0xb6 }); emit_rbx_disp(code, 0, disp); }
+
+    // mov byte [rbx + disp], al
+    void emit_store_al(vector<uint8_t> &code, int32_t disp) { emit(code, { 0x88 }); emit_rbx_disp(code, 0, disp); }
+
+    // movzx eax, byte [r12 + addr] - RAM / PRG ROM
+    void emit_load_al_ram(vector<uint8_t> &code, uint16_t addr) { emit(code, { 0x41, 0x0f, 0xb6 }); emit_r12_disp(code, 0, addr); }
+
+    // mov byte [r12 + addr], al
+    void emit_store_al_ram(vector<uint8_t> &code, uint16_t addr) { emit(code, { 0x41, 0x88 }); emit_r12_disp(code, 0, addr); }
+
+    // and byte [rbx + disp], imm8
+    void emit_and_byte(vector<uint8_t> &code, int32_t disp, uint8_t imm) { emit(code, { 0x80 }); emit_rbx_disp(code, 4, disp); code.push_back(imm); }
+
+    // or byte [rbx + disp], imm8
+    void emit_or_byte(vector<uint8_t> &code, int32_t disp, uint8_t imm) { emit(code, { 0x80 }); emit_rbx_disp(code, 1, disp); code.push_back(imm); }
+
+    // mov word [rbx + disp], imm16
+    void emit_store_word(vector<uint8_t> &code, int32_t disp, uint16_t imm) { emit(code, { 0x66, 0xc7 }); emit_rbx_disp(code, 0, disp); emit_value(code, imm); }
+
+    // cmp word [rbx + disp], imm16
+    void emit_cmp_word(vector<uint8_t> &code, int32_t disp, uint16_t imm) { emit(code, { 0x66, 0x81 }); emit_rbx_disp(code, 7, disp); emit_value(code, imm); }
+
+    // add qword [rbx + disp], imm32
+    void emit_add_qword(vector<uint8_t> &code, int32_t disp, int32_t imm) { emit(code, { 0x48, 0x81 }); emit_rbx_disp(code, 0, disp); emit_value(code, imm); }
+
+    // Same as nes_cpu::calc_alu_flag(al)
+    void emit_calc_alu_flag(vector<uint8_t> &code, int32_t P_disp)
+    {
+        emit(code, { 0x0f, 0xb6 }); emit_rbx_disp(code, 1, P_disp);         // movzx ecx, byte [P]
+        emit(code, { 0x83, 0xe1, uint8_t(~(PROCESSOR_STATUS_ZERO_MASK | PROCESSOR_STATUS_NEGATIVE_MASK)) });    // and ecx, ~(Z | N)
+        emit(code, { 0x84, 0xc0 });                                         // test al, al
+        emit(code, { 0x0f, 0x94, 0xc2 });                                   // sete dl
+        emit(code, { 0x00, 0xd2 });                                         // add dl, dl -> Z
+        emit(code, { 0x08, 0xd1 });                                         // or cl, dl
+        emit(code, { 0x88, 0xc2 });                                         // mov dl, al
+        emit(code, { 0x80, 0xe2, PROCESSOR_STATUS_NEGATIVE_MASK });         // and dl, N
+        emit(code, { 0x08, 0xd1 });                                         // or cl, dl
+        emit(code, { 0x88 }); emit_rbx_disp(code, 1, P_disp);               // mov byte [P], cl
+    }
+
+    // CPU cycles in nes_cpu::_cycle units
+    int32_t cpu_cycles(int64_t cycles) { return int32_t(nes_cycle_t(nes_cpu_cycle_t(cycles)).count()); }
+
+    template<typename T>
+    int32_t field_offset(const nes_cpu *cpu, const T *field)
+    {
+        return int32_t(reinterpret_cast<const uint8_t *>(field) - reinterpret_cast<const uint8_t *>(cpu));
+    }
+}
+
+nes_cpu_jit_arena::nes_cpu_jit_arena()
+{
+    void *mem = mmap(nullptr, NES_CPU_JIT_ARENA_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    _base = (mem == MAP_FAILED) ? nullptr : reinterpret_cast<uint8_t *>(mem);
+    _used = 0;
+}
+
+nes_cpu_jit_arena::~nes_cpu_jit_arena()
+{
+    if (_base)
+        munmap(_base, NES_CPU_JIT_ARENA_SIZE);
+}
+
+void *nes_cpu_jit_arena::place(const vector<uint8_t> &code)
+{
+    // keep blocks 16-byte aligned
+    size_t start = (_used + 15) & ~size_t(15);
+    if (!_base || start + code.size() > NES_CPU_JIT_ARENA_SIZE)
+        return nullptr;
+
+    // Only writable while copying code in
+    if (mprotect(_base, NES_CPU_JIT_ARENA_SIZE, PROT_READ | PROT_WRITE) != 0)
+        return nullptr;
+    memcpy(_base + start, code.data(), code.size());
+    if (mprotect(_base, NES_CPU_JIT_ARENA_SIZE, PROT_READ | PROT_EXEC) != 0)
+        return nullptr;
+
+    _used = start + code.size();
+    return _base + start;
+}
+
+nes_cpu_jit::nes_cpu_jit(nes_cpu *cpu, nes_system *shadow)
+{
+    _cpu = cpu;
+    _shadow = shadow;
+    _threshold = shadow ? 1 : NES_CPU_JIT_THRESHOLD;
+
+    _A_offset = field_offset(cpu, &cpu->_context.A);
+    _X_offset = field_offset(cpu, &cpu->_context.X);
+    _Y_offset = field_offset(cpu, &cpu->_context.Y);
+    _S_offset = field_offset(cpu, &cpu->_context.S);
+    _P_offset = field_offset(cpu, &cpu->_context.P);
+    _PC_offset = field_offset(cpu, &cpu->_context.PC);
+    _cycle_offset = field_offset(cpu, &cpu->_cycle);
+    _limit_offset = field_offset(cpu, &cpu->_jit_limit);
+    _idle_loop_head_offset = field_offset(cpu, &cpu->_idle_loop.head);
+    _idle_loop_pure_offset = field_offset(cpu, &cpu->_idle_loop.pure);
+
+    _compiled_block_count = 0;
+    _executed_block_count = 0;
+    _mismatch_count = 0;
+}
+
+nes_tracer *nes_cpu_jit::nes_trace_context() const
+{
+    return _cpu->nes_trace_context();
+}
+
+void nes_cpu_jit::reset()
+{
+    _arena.reset();
+}
+
+//
+// Compiled as:
+//
+//      push rbx
+//      push r12
+//      sub rsp, 8                  ; keeps stack aligned for calls
+//      mov rbx, rdi                ; nes_cpu *
+//      mov r12, ram                ; nes_memory::ram_data
+//
+//  for each run (see nes_cpu_block_op::run_length) - same check exec_block does once per run:
+//      cmp _cycle + run_cycles, _jit_limit
+//      jge exit
+//      cmp _idle_loop.head - (pc + 1), end - (pc + 1)  ; head in (pc, end]
+//      jbe exit
+//      <op>...                     ; registers / RAM, operands and cycles resolved at compile time
+//      add _cycle, run cycles
+//      mov PC, end
+//
+//  for other ops:
+//      call jit_exec_op(rdi=cpu, rsi=op)
+//      test al, al
+//      jz exit
+//      cmp PC, next_pc             ; branch taken
+//      jne exit
+//
+//  for a conditional branch at the end:
+//      test P, flag
+//      jcc not_taken
+//      call jit_enter_idle_loop    ; backward - unless already the head
+//      add _cycle, taken cycles
+//      mov PC, target
+//      call jit_loop_head          ; only if the loop is in this block - see loop_resume
+//      test al, al
+//      jz exit
+//      jmp resume
+//  not_taken:
+//      add _cycle, 2 cycles
+//      mov PC, next_pc
+//
+//  exit:
+//      add rsp, 8
+//      pop r12
+//      pop rbx
+//      ret
+//
+//  for writes to pages with watches / dirty tracking on, out of line:
+//      add _cycle, run cycles so far
+//      call jit_exec_op(rdi=cpu, rsi=op)
+//      jmp exit
+//
+nes_cpu_jit_code nes_cpu_jit::compile(const nes_cpu_block *block)
+{
+    vector<uint8_t> code;
+    vector<size_t> exits;
+    vector<nes_cpu_jit_stub> stubs;
+
+    const nes_cpu_block_op *ops = _cpu->block_ops(block);
+    int count = block->op_count;
+    const nes_cpu_block_op &last = ops[count - 1];
+
+    // Native conditional branch at the end, and where to go on if it loops within the block
+    uint8_t branch_mask = 0;
+    bool branch_if_set = false;
+    int resume = -1;
+    bool native_branch = get_branch_flag(last, branch_mask, branch_if_set);
+    int8_t rel = native_branch ? int8_t(_cpu->_mem->get_byte(last.pc + 1)) : 0;
+    uint16_t next_pc = uint16_t(last.pc + last.length);
+    uint16_t target = uint16_t(next_pc + rel);
+
+    // BNE * etc - leave that to the handler which knows about stop_at_infinite_loop
+    if (rel == -2)
+        native_branch = false;
+    if (native_branch && rel < 0)
+        resume = loop_resume(block, target);
+
+    emit(code, { 0x53 });                                                   // push rbx
+    emit(code, { 0x41, 0x54 });                                             // push r12
+    emit(code, { 0x48, 0x83, 0xec, 0x08 });                                 // sub rsp, 8
+    emit(code, { 0x48, 0x89, 0xfb });                                       // mov rbx, rdi
+    emit(code, { 0x49, 0xbc }); emit_value(code, reinterpret_cast<uint64_t>(_cpu->_mem->ram_data()));   // mov r12, ram
+
+    vector<size_t> labels(count);
+    int32_t run_cycles = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        const nes_cpu_block_op &op = ops[i];
+        bool is_last = (i + 1 == count);
+        labels[i] = code.size();
+
+        if (op.run_length)
+        {
+            // A run is also split where the loop comes back in
+            if (i == 0 || !ops[i - 1].run_length || i == resume)
+            {
+                const nes_cpu_block_op &run_last = (&op)[op.run_length - 1];
+                uint32_t start = uint32_t(op.pc) + 1;
+                uint32_t end = uint32_t(run_last.pc) + run_last.length;
+
+                emit(code, { 0x48, 0x8b }); emit_rbx_disp(code, 0, _cycle_offset);    // mov rax, [_cycle]
+                emit(code, { 0x48, 0x05 }); emit_value(code, cpu_cycles(op.run_cycles));  // add rax, run_cycles
+                emit(code, { 0x48, 0x3b }); emit_rbx_disp(code, 0, _limit_offset);    // cmp rax, [_jit_limit]
+                exits.push_back(emit_jcc(code, JCC_GE));
+                emit(code, { 0x0f, 0xb7 }); emit_rbx_disp(code, 0, _idle_loop_head_offset);    // movzx eax, word [head]
+                emit(code, { 0x2d }); emit_value(code, int32_t(start));            // sub eax, start
+                emit(code, { 0x3d }); emit_value(code, int32_t(end - start));      // cmp eax, end - start
+                exits.push_back(emit_jcc(code, JCC_BE));
+                run_cycles = 0;
+            }
+
+            emit_run_op(code, op, run_cycles, stubs);
+            run_cycles += cpu_cycles(op.cycles);
+
+            if (op.run_length == 1 || i + 1 == resume)
+            {
+                emit_add_qword(code, _cycle_offset, run_cycles);
+                emit_store_word(code, _PC_offset, uint16_t(op.pc + op.length));
+                run_cycles = 0;
+            }
+        }
+        else if (is_last && native_branch)
+        {
+            size_t not_taken = emit_jcc_test_byte(code, _P_offset, branch_mask, branch_if_set ? JCC_E : JCC_NE);
+
+            if (rel < 0)
+            {
+                emit_cmp_word(code, _idle_loop_head_offset, target);
+                size_t skip = emit_jcc(code, JCC_E);
+                emit(code, { 0x48, 0x89, 0xdf });                               // mov rdi, rbx
+                emit(code, { 0xbe }); emit_value(code, uint32_t(target));      // mov esi, target
+                emit_call(code, reinterpret_cast<void *>(&nes_cpu::jit_enter_idle_loop));
+                patch_rel(code, skip, code.size());
+            }
+
+            emit_add_qword(code, _cycle_offset, cpu_cycles(_cpu->get_branch_cycle(true, target, rel).count()));
+            emit_store_word(code, _PC_offset, target);
+            if (resume >= 0)
+            {
+                emit(code, { 0x48, 0x89, 0xdf });                               // mov rdi, rbx
+                emit(code, { 0xbe }); emit_value(code, uint32_t(resume ? ops[resume].pc : block->pc));  // mov esi, next_pc
+                emit_call(code, reinterpret_cast<void *>(&nes_cpu::jit_loop_head));
+                emit(code, { 0x84, 0xc0 });                                     // test al, al
+                exits.push_back(emit_jcc(code, JCC_E));
+                emit(code, { 0xe9 }); emit_value(code, int32_t(labels[resume] - (code.size() + sizeof(int32_t))));  // jmp resume
+            }
+            else
+            {
+                exits.push_back(emit_jmp(code));
+            }
+
+            patch_rel(code, not_taken, code.size());
+            emit_add_qword(code, _cycle_offset, cpu_cycles(_cpu->get_branch_cycle(false, next_pc, rel).count()));
+            emit_store_word(code, _PC_offset, next_pc);
+        }
+        else
+        {
+            emit(code, { 0x48, 0x89, 0xdf });                                   // mov rdi, rbx
+            emit(code, { 0x48, 0xbe }); emit_value(code, reinterpret_cast<uint64_t>(&op));        // mov rsi, op
+            emit_call(code, reinterpret_cast<void *>(&nes_cpu::jit_exec_op));
+            if (is_last)
+                continue;
+
+            emit(code, { 0x84, 0xc0 });                                         // test al, al
+            exits.push_back(emit_jcc(code, JCC_E));
+            emit_cmp_word(code, _PC_offset, ops[i + 1].pc);
+            exits.push_back(emit_jcc(code, JCC_NE));
+        }
+    }
+
+    size_t exit = code.size();
+    for (auto rel32 : exits)
+        patch_rel(code, rel32, exit);
+
+    emit(code, { 0x48, 0x83, 0xc4, 0x08 });                                 // add rsp, 8
+    emit(code, { 0x41, 0x5c });                                             // pop r12
+    emit(code, { 0x5b });                                                   // pop rbx
+    emit(code, { 0xc3 });                                                   // ret
+
+    for (auto &stub : stubs)
+    {
+        patch_rel(code, stub.rel32, code.size());
+        if (stub.run_cycles)
+            emit_add_qword(code, _cycle_offset, stub.run_cycles);
+        emit(code, { 0x48, 0x89, 0xdf });                                   // mov rdi, rbx
+        emit(code, { 0x48, 0xbe }); emit_value(code, reinterpret_cast<uint64_t>(stub.op));   // mov rsi, op
+        emit_call(code, reinterpret_cast<void *>(&nes_cpu::jit_exec_op));
+        emit(code, { 0xe9 }); emit_value(code, int32_t(exit - (code.size() + sizeof(int32_t))));    // jmp exit
+    }
+
+    void *entry = _arena.place(code);
+    if (!entry)
+        return nullptr;
+
+    NES_TRACE3("[NES_JIT] Compiled block at $" << std::hex << block->pc << " (" << std::dec << count << " ops, " << code.size() << " bytes)");
+    _compiled_block_count++;
+    return reinterpret_cast<nes_cpu_jit_code>(entry);
+}
+
+//
+// Where compiled code goes on after a backward branch to target - the op after target if it is in the
+// block, or the start of the block if the loop head is the instruction right in front of it. The
+// latter is the common case: the loop head always runs in the interpreter (see jit_loop_head), and the
+// block that runs after it starts right after it. -1 if the loop is somewhere else
+//
+int nes_cpu_jit::loop_resume(const nes_cpu_block *block, uint16_t target)
+{
+    const nes_cpu_block_op *ops = _cpu->block_ops(block);
+    for (int i = 0; i + 1 < block->op_count; ++i)
+    {
+        if (ops[i].pc == target)
+            return i + 1;
+    }
+
+    if (target < NES_CPU_BLOCK_START)
+        return -1;
+
+    const char *name;
+    nes_addr_mode addr_mode;
+    bool is_official;
+    nes_cpu::get_op_info(_cpu->_mem->get_byte(target), name, addr_mode, is_official);
+    if (name && uint32_t(target) + nes_cpu::get_op_length(addr_mode) == block->pc)
+        return 0;
+
+    return -1;
+}
+
+// Conditional branches - the P flag they test and whether they branch when it is set
+bool nes_cpu_jit::get_branch_flag(const nes_cpu_block_op &op, uint8_t &mask, bool &if_set)
+{
+    auto handler = op.handler;
+    if (handler == &nes_cpu::BCC) { mask = PROCESSOR_STATUS_CARRY_MASK; if_set = false; }
+    else if (handler == &nes_cpu::BCS) { mask = PROCESSOR_STATUS_CARRY_MASK; if_set = true; }
+    else if (handler == &nes_cpu::BNE) { mask = PROCESSOR_STATUS_ZERO_MASK; if_set = false; }
+    else if (handler == &nes_cpu::BEQ) { mask = PROCESSOR_STATUS_ZERO_MASK; if_set = true; }
+    else if (handler == &nes_cpu::BPL) { mask = PROCESSOR_STATUS_NEGATIVE_MASK; if_set = false; }
+    else if (handler == &nes_cpu::BMI) { mask = PROCESSOR_STATUS_NEGATIVE_MASK; if_set = true; }
+    else if (handler == &nes_cpu::BVC) { mask = PROCESSOR_STATUS_OVERFLOW_MASK; if_set = false; }
+    else if (handler == &nes_cpu::BVS) { mask = PROCESSOR_STATUS_OVERFLOW_MASK; if_set = true; }
+    else return false;
+
+    return true;
+}
+
+//
+// One instruction of a run - registers and RAM only, operand resolved at decode time (see
+// nes_cpu::decode_block_op). Cycles are added by the caller once per run. Writes to a page with
+// watches / dirty tracking on leave through a stub that calls the interpreter instead
+//
+void nes_cpu_jit::emit_run_op(vector<uint8_t> &code, const nes_cpu_block_op &op, int32_t run_cycles, vector<nes_cpu_jit_stub> &stubs)
+{
+    auto handler = op.handler;
+
+    // al = src +/- delta, dst = al, optionally update N/Z
+    auto emit_transfer = [&](int32_t src, int32_t dst, int delta, bool flags) {
+        emit_load_al(code, src);
+        if (delta > 0)
+            emit(code, { 0xfe, 0xc0 });                                     // inc al
+        else if (delta < 0)
+            emit(code, { 0xfe, 0xc8 });                                     // dec al
+        emit_store_al(code, dst);
+        if (flags)
+            emit_calc_alu_flag(code, _P_offset);
+    };
+
+    // A = A <op> 1 with C from x86 CF, then N/Z
+    auto emit_shift = [&](uint8_t modrm, bool carry_in) {
+        emit(code, { 0x0f, 0xb6 }); emit_rbx_disp(code, 1, _P_offset);    // movzx ecx, byte [P]
+        if (carry_in)
+            emit(code, { 0x0f, 0xba, 0xe1, 0x00 });                         // bt ecx, 0
+        emit_load_al(code, _A_offset);
+        emit(code, { 0xd0, modrm });                                        // shl / shr / rcl / rcr al, 1
+        emit(code, { 0x0f, 0x92, 0xc2 });                                   // setc dl
+        emit_store_al(code, _A_offset);
+        emit(code, { 0x80, 0xe1, uint8_t(~PROCESSOR_STATUS_CARRY_MASK) });  // and cl, ~C
+        emit(code, { 0x08, 0xd1 });                                         // or cl, dl
+        emit(code, { 0x88 }); emit_rbx_disp(code, 1, _P_offset);           // mov byte [P], cl
+        emit_calc_alu_flag(code, _P_offset);
+    };
+
+    switch (op.kind)
+    {
+    case nes_cpu_block_op_register:
+        if (handler == &nes_cpu::TAX) emit_transfer(_A_offset, _X_offset, 0, true);
+        else if (handler == &nes_cpu::TAY) emit_transfer(_A_offset, _Y_offset, 0, true);
+        else if (handler == &nes_cpu::TXA) emit_transfer(_X_offset, _A_offset, 0, true);
+        else if (handler == &nes_cpu::TYA) emit_transfer(_Y_offset, _A_offset, 0, true);
+        else if (handler == &nes_cpu::TSX) emit_transfer(_S_offset, _X_offset, 0, true);
+        else if (handler == &nes_cpu::TXS) emit_transfer(_X_offset, _S_offset, 0, false);
+        else if (handler == &nes_cpu::INX) emit_transfer(_X_offset, _X_offset, 1, true);
+        else if (handler == &nes_cpu::INY) emit_transfer(_Y_offset, _Y_offset, 1, true);
+        else if (handler == &nes_cpu::DEX) emit_transfer(_X_offset, _X_offset, -1, true);
+        else if (handler == &nes_cpu::DEY) emit_transfer(_Y_offset, _Y_offset, -1, true);
+        else if (handler == &nes_cpu::CLC) emit_and_byte(code, _P_offset, uint8_t(~PROCESSOR_STATUS_CARRY_MASK));
+        else if (handler == &nes_cpu::SEC) emit_or_byte(code, _P_offset, PROCESSOR_STATUS_CARRY_MASK);
+        else if (handler == &nes_cpu::CLI) emit_and_byte(code, _P_offset, uint8_t(~PROCESSOR_STATUS_INTERRUPT_MASK));
+        else if (handler == &nes_cpu::SEI) emit_or_byte(code, _P_offset, PROCESSOR_STATUS_INTERRUPT_MASK);
+        else if (handler == &nes_cpu::CLD) emit_and_byte(code, _P_offset, uint8_t(~PROCESSOR_STATUS_DECIMAL_MASK));
+        else if (handler == &nes_cpu::SED) emit_or_byte(code, _P_offset, PROCESSOR_STATUS_DECIMAL_MASK);
+        else if (handler == &nes_cpu::CLV) emit_and_byte(code, _P_offset, uint8_t(~PROCESSOR_STATUS_OVERFLOW_MASK));
+        else if (handler == &nes_cpu::NOP) {}
+        else if (handler == &nes_cpu::ASL) emit_shift(0xe0, false);
+        else if (handler == &nes_cpu::LSR) emit_shift(0xe8, false);
+        else if (handler == &nes_cpu::ROL) emit_shift(0xd0, true);
+        else if (handler == &nes_cpu::ROR) emit_shift(0xd8, true);
+        else assert(false);
+        break;
+
+    case nes_cpu_block_op_read_imm:
+    case nes_cpu_block_op_read:
+        if (op.kind == nes_cpu_block_op_read_imm)
+            emit(code, { 0xb0, uint8_t(op.operand) });                      // mov al, imm
+        else
+            emit_load_al_ram(code, op.operand);
+        emit_core(code, op.core);
+        break;
+
+    case nes_cpu_block_op_write:
+    {
+        emit(code, { 0x48, 0xb8 }); emit_value(code, reinterpret_cast<uint64_t>(_cpu->_mem->page_flags_ptr(op.operand)));  // mov rax, page flags
+        emit(code, { 0x80, 0x38, 0x00 });                                   // cmp byte [rax], 0
+        stubs.push_back({ emit_jcc(code, JCC_NE), &op, run_cycles });
+
+        emit_load_al(code, field_offset(_cpu, &(_cpu->_context.*op.reg)));
+        emit_store_al_ram(code, op.operand);
+        emit(code, { 0xc6 }); emit_rbx_disp(code, 0, _idle_loop_pure_offset); code.push_back(0);  // mov byte [pure], 0
+        break;
+    }
+
+    default:
+        assert(false);
+        break;
+    }
+}
+
+// nes_cpu::_LDA etc with the operand in al
+void nes_cpu_jit::emit_core(vector<uint8_t> &code, nes_cpu_op_core core)
+{
+    // A <op>= al, then N/Z
+    auto emit_logic = [&](uint8_t op_code) {
+        emit(code, { op_code }); emit_rbx_disp(code, 0, _A_offset);         // and / or / xor al, [A]
+        emit_store_al(code, _A_offset);
+        emit_calc_alu_flag(code, _P_offset);
+    };
+
+    // C = reg >= al, N/Z from reg - al
+    auto emit_compare = [&](int32_t reg) {
+        emit(code, { 0x0f, 0xb6 }); emit_rbx_disp(code, 1, reg);           // movzx ecx, byte [reg]
+        emit(code, { 0x28, 0xc1 });                                         // sub cl, al
+        emit(code, { 0x0f, 0x93, 0xc2 });                                   // setae dl
+        emit(code, { 0x88, 0xc8 });                                         // mov al, cl
+        emit_and_byte(code, _P_offset, uint8_t(~PROCESSOR_STATUS_CARRY_MASK));
+        emit(code, { 0x08 }); emit_rbx_disp(code, 2, _P_offset);           // or byte [P], dl
+        emit_calc_alu_flag(code, _P_offset);
+    };
+
+    // A = A + al + C, C/V from x86 CF/OF - SBC is ADC with ~al
+    auto emit_add = [&](bool subtract) {
+        emit(code, { 0x88, 0xc2 });                                         // mov dl, al
+        if (subtract)
+            emit(code, { 0xf6, 0xd2 });                                     // not dl
+        emit(code, { 0x0f, 0xb6 }); emit_rbx_disp(code, 1, _P_offset);     // movzx ecx, byte [P]
+        emit_load_al(code, _A_offset);
+        emit(code, { 0x0f, 0xba, 0xe1, 0x00 });                             // bt ecx, 0
+        emit(code, { 0x10, 0xd0 });                                         // adc al, dl
+        emit(code, { 0x0f, 0x92, 0xc2 });                                   // setc dl
+        emit(code, { 0x0f, 0x90, 0xc5 });                                   // seto ch
+        emit_store_al(code, _A_offset);
+        emit(code, { 0x80, 0xe1, uint8_t(~(PROCESSOR_STATUS_CARRY_MASK | PROCESSOR_STATUS_OVERFLOW_MASK)) });  // and cl, ~(C | V)
+        emit(code, { 0x08, 0xd1 });                                         // or cl, dl
+        emit(code, { 0xc0, 0xe5, 0x06 });                                   // shl ch, 6
+        emit(code, { 0x08, 0xe9 });                                         // or cl, ch
+        emit(code, { 0x88 }); emit_rbx_disp(code, 1, _P_offset);           // mov byte [P], cl
+        emit_calc_alu_flag(code, _P_offset);
+    };
+
+    if (core == &nes_cpu::_LDA || core == &nes_cpu::_LDX || core == &nes_cpu::_LDY)
+    {
+        emit_store_al(code, (core == &nes_cpu::_LDA) ? _A_offset : (core == &nes_cpu::_LDX) ? _X_offset : _Y_offset);
+        emit_calc_alu_flag(code, _P_offset);
+    }
+    else if (core == &nes_cpu::_AND) emit_logic(0x22);
+    else if (core == &nes_cpu::_ORA) emit_logic(0x0a);
+    else if (core == &nes_cpu::_EOR) emit_logic(0x32);
+    else if (core == &nes_cpu::_CMP) emit_compare(_A_offset);
+    else if (core == &nes_cpu::_CPX) emit_compare(_X_offset);
+    else if (core == &nes_cpu::_CPY) emit_compare(_Y_offset);
+    else if (core == &nes_cpu::_ADC) emit_add(false);
+    else if (core == &nes_cpu::_SBC) emit_add(true);
+    else if (core == &nes_cpu::_BIT)
+    {
+        // Z from A & al, N/V straight from al
+        emit(code, { 0x0f, 0xb6 }); emit_rbx_disp(code, 1, _P_offset);     // movzx ecx, byte [P]
+        emit(code, { 0x80, 0xe1, uint8_t(~(PROCESSOR_STATUS_ZERO_MASK | PROCESSOR_STATUS_OVERFLOW_MASK | PROCESSOR_STATUS_NEGATIVE_MASK)) });  // and cl, ~(Z | V | N)
+        emit(code, { 0x88, 0xc2 });                                         // mov dl, al
+        emit(code, { 0x80, 0xe2, PROCESSOR_STATUS_OVERFLOW_MASK | PROCESSOR_STATUS_NEGATIVE_MASK });   // and dl, V | N
+        emit(code, { 0x08, 0xd1 });                                         // or cl, dl
+        emit(code, { 0x84 }); emit_rbx_disp(code, 0, _A_offset);           // test [A], al
+        emit(code, { 0x0f, 0x94, 0xc2 });                                   // sete dl
+        emit(code, { 0x00, 0xd2 });                                         // add dl, dl -> Z
+        emit(code, { 0x08, 0xd1 });                                         // or cl, dl
+        emit(code, { 0x88 }); emit_rbx_disp(code, 1, _P_offset);           // mov byte [P], cl
+    }
+    else
+    {
+        assert(false);
+    }
+}
+
+void nes_cpu_jit::verify()
+{
+    if (!_shadow)
+        return;
+
+    // Interpreter stops at the first instruction boundary at or past the cycle - which is where this
+    // block stopped, if the two agree
+    nes_cpu *shadow_cpu = _shadow->cpu();
+    while (shadow_cpu->cycle() < _cpu->cycle() && !_shadow->stop_requested())
+        _shadow->step(_cpu->cycle() - shadow_cpu->cycle());
+
+    const nes_cpu_context &actual = _cpu->_context;
+    const nes_cpu_context &expected = shadow_cpu->_context;
+    if (actual.A != expected.A || actual.X != expected.X || actual.Y != expected.Y || actual.S != expected.S ||
+        actual.P != expected.P || actual.PC != expected.PC || _cpu->cycle() != shadow_cpu->cycle() ||
+        memcmp(_cpu->_mem->ram_data(), shadow_cpu->_mem->ram_data(), 0x800) != 0)
+    {
+        _mismatch_count++;
+        NES_TRACE1("[NES_JIT] MISMATCH at cycle " << std::dec << _cpu->cycle().count() << std::hex <<
+            ": JIT A:" << uint32_t(actual.A) << " X:" << uint32_t(actual.X) << " Y:" << uint32_t(actual.Y) <<
+            " P:" << uint32_t(actual.P) << " SP:" << uint32_t(actual.S) << " PC:" << actual.PC <<
+            ", interpreter A:" << uint32_t(expected.A) << " X:" << uint32_t(expected.X) << " Y:" << uint32_t(expected.Y) <<
+            " P:" << uint32_t(expected.P) << " SP:" << uint32_t(expected.S) << " PC:" << expected.PC <<
+            " cycle " << std::dec << shadow_cpu->cycle().count());
+    }
+}
+
+#endif
@@ -0,0 +1,115 @@
+#include "stdafx.h"
+#include "nes_frame.h"
+
+#include <cstring>
+
+nes_frame_ref::nes_frame_ref(nes_frame_ref &&other)
+    :_pool(other._pool), _slot(other._slot), _sequence(other._sequence), _pixels(other._pixels)
+{
+    other._pool = nullptr;
+    other._pixels = nullptr;
+}
+
+nes_frame_ref &nes_frame_ref::operator =(nes_frame_ref &&other)
+{
+    if (this != &other)
+    {
+        release();
+
+        _pool = other._pool;
+        _slot = other._slot;
+        _sequence = other._sequence;
+        _pixels = other._pixels;
+
+        other._pool = nullptr;
+        other._pixels = nullptr;
+    }
+
+    return *this;
+}
+
+void nes_frame_ref::release()
+{
+    if (_pool)
+    {
+        _pool->release(_slot);
+        _pool = nullptr;
+        _pixels = nullptr;
+    }
+}
+
+nes_frame_pool::nes_frame_pool(size_t frame_size, nes_arena *arena)
+    :_frame_size(frame_size)
+{
+    // One buffer for all slots - in an arena each of them starts on its own cache line
+    size_t slot_size = nes_arena::aligned_size(frame_size);
+    uint8_t *pixels = nes_arena::allocate_buffer(arena, slot_size * NES_FRAME_POOL_SIZE, _owned_pixels);
+    for (auto &slot : _slots)
+    {
+        slot.pixels = pixels;
+        slot.readers = 0;
+        pixels += slot_size;
+    }
+
+    _dropped_count = 0;
+    reset();
+}
+
+void nes_frame_pool::reset()
+{
+    for (auto &slot : _slots)
+    {
+        memset(slot.pixels, 0, _frame_size);
+        slot.sequence = 0;
+    }
+
+    _write = 0;
+    _latest = 1;
+    _latest_sequence = 0;
+}
+
+bool nes_frame_pool::publish(const uint8_t *pixels, uint64_t sequence)
+{
+    // A stale reader might still bump the count of a slot that isn't the latest - it will notice and
+    // back off without reading anything (see acquire)
+    int latest = _latest.load();
+    int next = -1;
+    for (int i = 0; i < NES_FRAME_POOL_SIZE; ++i)
+    {
+        if (i != _write && i != latest && _slots[i].readers.load() == 0)
+        {
+            next = i;
+            break;
+        }
+    }
+
+    if (next < 0)
+    {
+        _dropped_count++;
+        return false;
+    }
+
+    memcpy(_slots[_write].pixels, pixels, _frame_size);
+    _slots[_write].sequence = sequence;
+    _latest.store(_write);
+    _latest_sequence.store(sequence, memory_order_release);
+    _write = next;
+
+    return true;
+}
+
+nes_frame_ref nes_frame_pool::acquire()
+{
+    while (true)
+    {
+        int latest = _latest.load();
+        auto &slot = _slots[latest];
+        slot.readers++;
+
+        // Still the latest - PPU won't touch it until we let go
+        if (_latest.load() == latest)
+            return nes_frame_ref(this, latest, slot.sequence, slot.pixels);
+
+        slot.readers--;
+    }
+}
@@ -3,12 +3,69 @@
 
 #include <nes_input.h>
 #include <nes_mapper.h>
+#include <nes_replay.h>
+#include <nes_system.h>
 
 
 // Make compiler happy about pure virtual dtors
 nes_input_device::~nes_input_device()
 {}
 
+namespace
+{
+    // Buttons of the frame PPU is in - frame boundary is a PPU event so it is never behind here
+    class nes_input_stream_device : public nes_input_device
+    {
+    public :
+        nes_input_stream_device(nes_ppu *ppu, const vector<nes_button_flags> &stream)
+            :_ppu(ppu), _stream(stream)
+        {}
+
+        virtual nes_button_flags poll_status()
+        {
+            uint32_t frame = _ppu->frame_count();
+            if (frame < _stream.size())
+                return _stream[frame];
+            return nes_button_flags_none;
+        }
+
+    private :
+        nes_ppu *_ppu;
+        vector<nes_button_flags> _stream;
+    };
+
+    // Same as nes_input_stream_device but reads straight from the mapped replay file
+    class nes_input_replay_device : public nes_input_device
+    {
+    public :
+        nes_input_replay_device(nes_ppu *ppu, shared_ptr<nes_replay> replay, uint32_t player)
+            :_ppu(ppu), _replay(replay), _player(player)
+        {}
+
+        virtual nes_button_flags poll_status()
+        {
+            return _replay->buttons(_player, _ppu->frame_count());
+        }
+
+    private :
+        nes_ppu *_ppu;
+        shared_ptr<nes_replay> _replay;
+        uint32_t _player;
+    };
+}
+
+void nes_input::register_input_stream(int id, const vector<nes_button_flags> &stream)
+{
+    register_input(id, make_shared<nes_input_stream_device>(_system->ppu(), stream));
+    set_latch_mode(nes_input_latch_mode_frame);
+}
+
+void nes_input::register_input_replay(int id, shared_ptr<nes_replay> replay, uint32_t player)
+{
+    register_input(id, make_shared<nes_input_replay_device>(_system->ppu(), replay, player));
+    set_latch_mode(nes_input_latch_mode_frame);
+}
+
 
 void nes_input::init()
 {
@@ -18,20 +75,47 @@ void nes_input::init()
         _button_flags[i] = nes_button_flags_none;
         _button_id[i] = 0;
     }
+
+    _latched_frame = NES_INPUT_NO_FRAME;
 }
 
-void nes_input::reload()
+void nes_input::poll_inputs(nes_button_flags (&buttons)[NES_MAX_PLAYER])
 {
     for (int i = 0; i < NES_MAX_PLAYER; ++i)
     {
-        auto user_input = _user_inputs[i];
+        auto &user_input = _user_inputs[i];
         if (user_input)
-            _button_flags[i] = user_input->poll_status();
+            buttons[i] = user_input->poll_status();
         else
-            _button_flags[i] = nes_button_flags_none;
+            buttons[i] = nes_button_flags_none;
+    }
+}
 
-        _button_id[i] = 0;
+void nes_input::latch_inputs()
+{
+    poll_inputs(_latched_flags);
+    _latched_frame = _system->ppu()->frame_count();
+}
+
+void nes_input::reload()
+{
+    switch (_latch_mode)
+    {
+    case nes_input_latch_mode_poll :
+        poll_inputs(_button_flags);
+        break;
+    case nes_input_latch_mode_frame :
+        // Frame boundary is a PPU event so PPU is never behind on its frame count here
+        if (_latched_frame != _system->ppu()->frame_count())
+            latch_inputs();
+        memcpy(_button_flags, _latched_flags, sizeof(_button_flags));
+        break;
+    case nes_input_latch_mode_manual :
+        memcpy(_button_flags, _latched_flags, sizeof(_button_flags));
+        break;
     }
+
+    memset(_button_id, 0, sizeof(_button_id));
 }
 
 void nes_input::write_CONTROLLER(uint8_t val)
@@ -73,5 +157,8 @@ bool nes_input::deserialize(const uint8_t *data, size_t size, size_t &offset)
         _button_id[i] = data[offset++];
     }
 
+    // Frame snapshot may be from another point of time altogether
+    _latched_frame = NES_INPUT_NO_FRAME;
+
     return true;
 }
@@ -1,6 +1,8 @@
 #include "stdafx.h"
 #include <cstring>
 
+static_assert(NES_DIRTY_RAM_PAGE_SHIFT == NES_MEMORY_PAGE_SHIFT, "dirty RAM pages are tracked through the page table");
+
 namespace
 {
     template<typename T>
@@ -27,6 +29,8 @@ namespace
 
 void nes_memory::power_on(nes_system *system)
 {
+    if (_dirty)
+        mark_dirty(0, RAM_SIZE);
     memset(&_ram[0], 0, RAM_SIZE);
     _system = system;
     _ppu = _system->ppu();
@@ -35,6 +39,15 @@ void nes_memory::power_on(nes_system *system)
 
 uint8_t nes_memory::read_io_reg(uint16_t addr)
 {
+    if (auto perf = _system->perf())
+        perf->io_reads[nes_perf_counters::io_reg_index(addr)]++;
+
+    // PPU is stepped lazily - bring it up to date before it can be observed
+    if (addr == 0x2002)
+        _system->sync_ppu_status();
+    else if (is_ppu_reg(addr))
+        _system->sync_ppu();
+
     switch (addr)
     {
     case 0x2002: return _ppu->read_PPUSTATUS();
@@ -49,6 +62,13 @@ uint8_t nes_memory::read_io_reg(uint16_t addr)
 
 void nes_memory::write_io_reg(uint16_t addr, uint8_t val)
 {
+    if (auto perf = _system->perf())
+        perf->io_writes[nes_perf_counters::io_reg_index(addr)]++;
+
+    // PPU is stepped lazily - it needs to render everything before this write with the old state
+    if (is_ppu_reg(addr))
+        _system->sync_ppu();
+
     switch (addr)
     {
     case 0x2000: _ppu->write_PPUCTRL(val); return;
@@ -76,6 +96,7 @@ void nes_memory::load_mapper(shared_ptr<nes_mapper> &mapper)
 
     _mapper = mapper;
     _mapper->get_info(_mapper_info);
+    _code_generation++;
 }
 
 void nes_memory::set_byte(uint16_t addr, uint8_t val)
@@ -91,17 +112,171 @@ void nes_memory::set_byte(uint16_t addr, uint8_t val)
     {
         if (addr >= _mapper_info.reg_start && addr <= _mapper_info.reg_end)
         {
+            // Bank switching / mirroring changes what PPU sees - let PPU catch up first
+            _system->sync_ppu();
             _mapper->write_reg(addr, val);
+            _code_generation++;
+
+            if (auto perf = _system->perf())
+                perf->bank_switches++;
             return;
         }
     }
 
+    if (addr >= 0x8000)
+        _code_generation++;
+
+    uint8_t page_flags = _page_flags[addr >> NES_MEMORY_PAGE_SHIFT];
+    if (page_flags & nes_memory_page_flags_clean)
+        mark_dirty(addr, 1);
+    if (page_flags & nes_memory_page_flags_watched)
+        check_watches(addr, &val, 1);
+
     _ram[addr] = val;
 }
 
+int nes_memory::add_watch(uint16_t addr, uint16_t size, nes_watch_callback callback)
+{
+    redirect_addr(addr);
+    if (size == 0 || uint32_t(addr) + size > RAM_SIZE)
+        return -1;
+
+    for (int i = 0; i < NES_MEMORY_MAX_WATCHES; ++i)
+    {
+        if (_watches[i].size != 0)
+            continue;
+
+        _watches[i].addr = addr;
+        _watches[i].size = size;
+        _watches[i].callback = callback;
+        _changed_watches &= ~(nes_watch_mask(1) << i);
+        update_page_flags();
+        return i;
+    }
+
+    return -1;
+}
+
+void nes_memory::remove_watch(int watch_id)
+{
+    assert(watch_id >= 0 && watch_id < NES_MEMORY_MAX_WATCHES);
+    _watches[watch_id] = nes_memory_watch();
+    _changed_watches &= ~(nes_watch_mask(1) << watch_id);
+    update_page_flags();
+}
+
+void nes_memory::clear_watches()
+{
+    for (auto &watch : _watches)
+        watch = nes_memory_watch();
+    _changed_watches = 0;
+    update_page_flags();
+}
+
+void nes_memory::take_changed_watches(vector<int> &watch_ids)
+{
+    watch_ids.clear();
+    nes_watch_mask changed = take_changed_watches();
+    for (int i = 0; changed; ++i, changed >>= 1)
+    {
+        if (changed & 1)
+            watch_ids.push_back(i);
+    }
+}
+
+void nes_memory::update_page_flags()
+{
+    memset(_page_watches, 0, sizeof(_page_watches));
+    for (int i = 0; i < NES_MEMORY_MAX_WATCHES; ++i)
+    {
+        auto &watch = _watches[i];
+        if (watch.size == 0)
+            continue;
+
+        uint32_t first_page = watch.addr >> NES_MEMORY_PAGE_SHIFT;
+        uint32_t last_page = (uint32_t(watch.addr) + watch.size - 1) >> NES_MEMORY_PAGE_SHIFT;
+        for (uint32_t page = first_page; page <= last_page; ++page)
+            _page_watches[page] |= nes_watch_mask(1) << i;
+    }
+
+    _watched_pages = 0;
+    for (uint32_t page = 0; page < NES_MEMORY_PAGE_COUNT; ++page)
+    {
+        if (_page_watches[page])
+        {
+            _page_flags[page] |= nes_memory_page_flags_watched;
+            _watched_pages++;
+        }
+        else
+        {
+            _page_flags[page] &= ~nes_memory_page_flags_watched;
+        }
+    }
+}
+
+void nes_memory::track_dirty_pages(nes_dirty_bitmap *dirty)
+{
+    assert(!dirty || (dirty->page_shift() == NES_MEMORY_PAGE_SHIFT && dirty->page_count() == NES_MEMORY_PAGE_COUNT));
+    _dirty = dirty;
+    for (uint32_t page = 0; page < NES_MEMORY_PAGE_COUNT; ++page)
+    {
+        if (_dirty && !_dirty->is_dirty(page))
+            _page_flags[page] |= nes_memory_page_flags_clean;
+        else
+            _page_flags[page] &= ~nes_memory_page_flags_clean;
+    }
+}
+
+void nes_memory::mark_dirty(uint16_t addr, size_t size)
+{
+    uint32_t last_page = uint32_t((addr + size - 1) >> NES_MEMORY_PAGE_SHIFT);
+    for (uint32_t page = addr >> NES_MEMORY_PAGE_SHIFT; page <= last_page; ++page)
+    {
+        if (_page_flags[page] & nes_memory_page_flags_clean)
+        {
+            _dirty->mark(page << NES_MEMORY_PAGE_SHIFT);
+            _page_flags[page] &= ~nes_memory_page_flags_clean;
+        }
+    }
+}
+
+// data is about to be written to addr ~ addr + size - flags watches whose bytes change
+void nes_memory::check_watches(uint16_t addr, const uint8_t *data, size_t size)
+{
+    uint32_t end = uint32_t(addr) + uint32_t(size);
+    uint32_t first_page = addr >> NES_MEMORY_PAGE_SHIFT;
+    uint32_t last_page = (end - 1) >> NES_MEMORY_PAGE_SHIFT;
+
+    nes_watch_mask candidates = 0;
+    for (uint32_t page = first_page; page <= last_page; ++page)
+        candidates |= _page_watches[page];
+
+    for (int i = 0; candidates; ++i, candidates >>= 1)
+    {
+        if (!(candidates & 1))
+            continue;
+
+        auto &watch = _watches[i];
+        uint32_t from = max<uint32_t>(watch.addr, addr);
+        uint32_t to = min<uint32_t>(uint32_t(watch.addr) + watch.size, end);
+        for (uint32_t cur = from; cur < to; ++cur)
+        {
+            uint8_t old_value = _ram[cur];
+            uint8_t new_value = data[cur - addr];
+            if (old_value == new_value)
+                continue;
+
+            _changed_watches |= nes_watch_mask(1) << i;
+            if (!watch.callback)
+                break;
+            watch.callback(i, uint16_t(cur), old_value, new_value);
+        }
+    }
+}
+
 void nes_memory::serialize(vector<uint8_t> &out) const
 {
-    out.insert(out.end(), _ram.begin(), _ram.end());
+    out.insert(out.end(), _ram, _ram + RAM_SIZE);
 
     uint8_t has_mapper = _mapper ? 1 : 0;
     out.push_back(has_mapper);
@@ -112,13 +287,13 @@ void nes_memory::serialize(vector<uint8_t> &out) const
     out.push_back(uint8_t(mapper_id & 0xff));
     out.push_back(uint8_t((mapper_id >> 8) & 0xff));
 
-    vector<uint8_t> mapper_state;
-    _mapper->serialize(mapper_state);
-    uint32_t mapper_size = uint32_t(mapper_state.size());
+    // Mapper state goes right after its size, which gets filled in afterwards
+    size_t mapper_start = out.size() + 4;
+    out.insert(out.end(), 4, 0);
+    _mapper->serialize(out);
+    uint32_t mapper_size = uint32_t(out.size() - mapper_start);
     for (int i = 0; i < 4; ++i)
-        out.push_back(uint8_t((mapper_size >> (i * 8)) & 0xff));
-
-    out.insert(out.end(), mapper_state.begin(), mapper_state.end());
+        out[mapper_start - 4 + i] = uint8_t((mapper_size >> (i * 8)) & 0xff);
 }
 
 bool nes_memory::deserialize(const uint8_t *data, size_t size, size_t &offset)
@@ -126,8 +301,21 @@ bool nes_memory::deserialize(const uint8_t *data, size_t size, size_t &offset)
     if (offset + RAM_SIZE > size)
         return false;
 
-    memcpy_s(_ram.data(), _ram.size(), data + offset, RAM_SIZE);
+    // Loading state is one big write as far as watches go - and only pages that actually change get dirty
+    if (_dirty)
+    {
+        for (uint32_t page = 0; page < NES_MEMORY_PAGE_COUNT; ++page)
+        {
+            size_t page_offset = size_t(page) << NES_MEMORY_PAGE_SHIFT;
+            if (memcmp(_ram + page_offset, data + offset + page_offset, size_t(1) << NES_MEMORY_PAGE_SHIFT) != 0)
+                mark_dirty(uint16_t(page_offset), 1);
+        }
+    }
+    if (_watched_pages)
+        check_watches(0, data + offset, RAM_SIZE);
+    memcpy_s(_ram, RAM_SIZE, data + offset, RAM_SIZE);
     offset += RAM_SIZE;
+    _code_generation++;
 
     if (offset >= size)
         return false;
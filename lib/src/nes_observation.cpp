@@ -0,0 +1,328 @@
+#include "stdafx.h"
+#include "nes_observation.h"
+#include "nes_ppu.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NES_OBSERVATION_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// SSSE3 (pshufb) isn't part of x86-64 baseline - compiled in for GCC / Clang and picked at runtime
+#if NES_OBSERVATION_SSE2 && defined(__GNUC__)
+#define NES_OBSERVATION_SSSE3 1
+#include <tmmintrin.h>
+#endif
+
+namespace
+{
+    struct luma_table
+    {
+        uint8_t luma[PPU_PALETTE_COLOR_COUNT];
+
+        luma_table()
+        {
+            auto palette = nes_ppu::argb_palette();
+            for (int i = 0; i < PPU_PALETTE_COLOR_COUNT; ++i)
+            {
+                uint32_t r = (palette[i] >> 16) & 0xff;
+                uint32_t g = (palette[i] >> 8) & 0xff;
+                uint32_t b = palette[i] & 0xff;
+                luma[i] = uint8_t((77 * r + 150 * g + 29 * b + 128) >> 8);
+            }
+        }
+    };
+
+    const luma_table &get_luma_table()
+    {
+        static luma_table table;
+        return table;
+    }
+
+    bool cpu_has_ssse3()
+    {
+#if NES_OBSERVATION_SSSE3
+        return __builtin_cpu_supports("ssse3");
+#else
+        return false;
+#endif
+    }
+
+    atomic<bool> s_simd_enabled(true);
+
+    //
+    // Palette indices -> luma
+    //
+    void luma_row_scalar(const uint8_t *frame, uint8_t *out, size_t count)
+    {
+        auto &table = get_luma_table();
+        for (size_t i = 0; i < count; ++i)
+            out[i] = table.luma[frame[i] & (PPU_PALETTE_COLOR_COUNT - 1)];
+    }
+
+#if NES_OBSERVATION_SSSE3
+    // pshufb looks up 16 entries at a time - the 64 colors are 4 lookups picked by bit 5/4
+    __attribute__((target("ssse3")))
+    void luma_row_ssse3(const uint8_t *frame, uint8_t *out, size_t count)
+    {
+        auto &table = get_luma_table();
+        __m128i tables[4];
+        for (int t = 0; t < 4; ++t)
+            tables[t] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(table.luma + t * 16));
+
+        const __m128i low_mask = _mm_set1_epi8(0x0f);
+        const __m128i high_mask = _mm_set1_epi8(0x03);
+
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            __m128i index = _mm_loadu_si128(reinterpret_cast<const __m128i *>(frame + i));
+            __m128i low = _mm_and_si128(index, low_mask);
+            __m128i high = _mm_and_si128(_mm_srli_epi16(index, 4), high_mask);
+
+            __m128i luma = _mm_setzero_si128();
+            for (int t = 0; t < 4; ++t)
+            {
+                __m128i selected = _mm_cmpeq_epi8(high, _mm_set1_epi8(char(t)));
+                luma = _mm_or_si128(luma, _mm_and_si128(selected, _mm_shuffle_epi8(tables[t], low)));
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), luma);
+        }
+
+        luma_row_scalar(frame + i, out + i, count - i);
+    }
+#endif
+
+    void luma_row(const uint8_t *frame, uint8_t *out, size_t count)
+    {
+#if NES_OBSERVATION_SSSE3
+        static const bool has_ssse3 = cpu_has_ssse3();
+        if (has_ssse3 && s_simd_enabled.load(memory_order_relaxed))
+        {
+            luma_row_ssse3(frame, out, count);
+            return;
+        }
+#endif
+        luma_row_scalar(frame, out, count);
+    }
+
+    //
+    // Area downsampling of factor rows into one - rounded average of each factor x factor block
+    //
+    void downsample_row_scalar(const uint8_t *const *rows, uint32_t factor, uint8_t *out, uint32_t out_width)
+    {
+        uint32_t area = factor * factor;
+        for (uint32_t x = 0; x < out_width; ++x)
+        {
+            uint32_t sum = 0;
+            for (uint32_t row = 0; row < factor; ++row)
+            {
+                for (uint32_t i = 0; i < factor; ++i)
+                    sum += rows[row][x * factor + i];
+            }
+            out[x] = uint8_t((sum + area / 2) / area);
+        }
+    }
+
+#if NES_OBSERVATION_SSE2
+    // Vertical sums of 16 pixels widened to 16 bits - columns 0~7 and 8~15
+    inline void column_sums(const uint8_t *const *rows, uint32_t factor, uint32_t x, __m128i &low, __m128i &high)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        low = high = zero;
+        for (uint32_t row = 0; row < factor; ++row)
+        {
+            __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[row] + x));
+            low = _mm_add_epi16(low, _mm_unpacklo_epi8(pixels, zero));
+            high = _mm_add_epi16(high, _mm_unpackhi_epi8(pixels, zero));
+        }
+    }
+
+    // Sums of each 2 neighboring 16 bit lanes of low then high, as 8 16 bit lanes
+    inline __m128i pair_sums(__m128i low, __m128i high)
+    {
+        const __m128i ones = _mm_set1_epi16(1);
+        return _mm_packs_epi32(_mm_madd_epi16(low, ones), _mm_madd_epi16(high, ones));
+    }
+
+    // 32 pixels -> 16
+    void downsample_row_2x_sse2(const uint8_t *const *rows, uint8_t *out, uint32_t out_width)
+    {
+        const __m128i rounding = _mm_set1_epi16(2);
+        uint32_t x = 0;
+        for (; x + 16 <= out_width; x += 16)
+        {
+            __m128i low, high;
+            column_sums(rows, 2, x * 2, low, high);
+            __m128i first = _mm_srli_epi16(_mm_add_epi16(pair_sums(low, high), rounding), 2);
+            column_sums(rows, 2, x * 2 + 16, low, high);
+            __m128i second = _mm_srli_epi16(_mm_add_epi16(pair_sums(low, high), rounding), 2);
+
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x), _mm_packus_epi16(first, second));
+        }
+
+        const uint8_t *rest[2] = { rows[0] + x * 2, rows[1] + x * 2 };
+        downsample_row_scalar(rest, 2, out + x, out_width - x);
+    }
+
+    // 64 pixels -> 16
+    void downsample_row_4x_sse2(const uint8_t *const *rows, uint8_t *out, uint32_t out_width)
+    {
+        const __m128i rounding = _mm_set1_epi16(8);
+        uint32_t x = 0;
+        for (; x + 16 <= out_width; x += 16)
+        {
+            // Sums of 4 columns out of 16 pixels, twice - 8 16 bit lanes at a time
+            __m128i quads[2];
+            for (int half = 0; half < 2; ++half)
+            {
+                __m128i low, high;
+                column_sums(rows, 4, x * 4 + half * 32, low, high);
+                __m128i first = pair_sums(low, high);
+                column_sums(rows, 4, x * 4 + half * 32 + 16, low, high);
+                __m128i second = pair_sums(low, high);
+                quads[half] = _mm_srli_epi16(_mm_add_epi16(pair_sums(first, second), rounding), 4);
+            }
+
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x), _mm_packus_epi16(quads[0], quads[1]));
+        }
+
+        const uint8_t *rest[4] = { rows[0] + x * 4, rows[1] + x * 4, rows[2] + x * 4, rows[3] + x * 4 };
+        downsample_row_scalar(rest, 4, out + x, out_width - x);
+    }
+#endif
+
+    void downsample_row(const uint8_t *const *rows, uint32_t factor, uint8_t *out, uint32_t out_width)
+    {
+#if NES_OBSERVATION_SSE2
+        if (s_simd_enabled.load(memory_order_relaxed))
+        {
+            if (factor == 2)
+            {
+                downsample_row_2x_sse2(rows, out, out_width);
+                return;
+            }
+            if (factor == 4)
+            {
+                downsample_row_4x_sse2(rows, out, out_width);
+                return;
+            }
+        }
+#endif
+        downsample_row_scalar(rows, factor, out, out_width);
+    }
+}
+
+nes_observation::nes_observation(const nes_observation_spec &spec)
+    :_spec(spec)
+{
+    assert(is_valid(spec));
+
+    _first_row = spec.crop_overscan ? NES_OBSERVATION_OVERSCAN_ROWS : 0;
+    _width = PPU_SCREEN_X / spec.downsample;
+    _height = (PPU_SCREEN_Y - _first_row * 2) / spec.downsample;
+}
+
+bool nes_observation::is_valid(const nes_observation_spec &spec)
+{
+    if (spec.format != nes_observation_format_palette && spec.format != nes_observation_format_luma)
+        return false;
+
+    return spec.downsample == 1 || spec.downsample == 2 || spec.downsample == 4;
+}
+
+void nes_observation::transform(const uint8_t *frame, uint8_t *out) const
+{
+    const uint8_t *first = frame + size_t(_first_row) * PPU_SCREEN_X;
+    uint32_t factor = _spec.downsample;
+
+    if (_spec.format == nes_observation_format_palette)
+    {
+        if (factor == 1)
+        {
+            memcpy(out, first, size());
+            return;
+        }
+
+        for (uint32_t y = 0; y < _height; ++y)
+        {
+            const uint8_t *row = first + size_t(y) * factor * PPU_SCREEN_X;
+            for (uint32_t x = 0; x < _width; ++x)
+                out[size_t(y) * _width + x] = row[x * factor];
+        }
+        return;
+    }
+
+    if (factor == 1)
+    {
+        luma_row(first, out, size());
+        return;
+    }
+
+    // Converts factor rows at a time - enough for one output row
+    uint8_t luma[4][PPU_SCREEN_X];
+    const uint8_t *rows[4] = { luma[0], luma[1], luma[2], luma[3] };
+    for (uint32_t y = 0; y < _height; ++y)
+    {
+        for (uint32_t row = 0; row < factor; ++row)
+            luma_row(first + (size_t(y) * factor + row) * PPU_SCREEN_X, luma[row], PPU_SCREEN_X);
+
+        downsample_row(rows, factor, out + size_t(y) * _width, _width);
+    }
+}
+
+const uint8_t *nes_observation::luma_palette()
+{
+    return get_luma_table().luma;
+}
+
+void nes_observation::enable_simd(bool enabled)
+{
+    s_simd_enabled = enabled;
+}
+
+bool nes_observation::simd_enabled()
+{
+#if NES_OBSERVATION_SSE2
+    return s_simd_enabled;
+#else
+    return false;
+#endif
+}
+
+nes_observation_stack::nes_observation_stack(const nes_observation_spec &spec, uint32_t depth)
+    :_observation(spec), _depth(depth), _latest(0)
+{
+    assert(depth >= 1 && depth <= NES_OBSERVATION_MAX_STACK);
+    _ring.assign(_observation.size() * depth, 0);
+}
+
+void nes_observation_stack::push(const uint8_t *frame)
+{
+    _latest = (_latest + 1) % _depth;
+    _observation.transform(frame, _ring.data() + _observation.size() * _latest);
+}
+
+void nes_observation_stack::clear()
+{
+    fill(_ring.begin(), _ring.end(), uint8_t(0));
+}
+
+const uint8_t *nes_observation_stack::get(uint32_t age) const
+{
+    assert(age < _depth);
+    return _ring.data() + _observation.size() * ((_latest + _depth - age) % _depth);
+}
+
+void nes_observation_stack::copy_to(uint8_t *out) const
+{
+    size_t size = _observation.size();
+    for (uint32_t age = _depth; age-- > 0;)
+    {
+        memcpy(out, get(age), size);
+        out += size;
+    }
+}
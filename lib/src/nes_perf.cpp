@@ -0,0 +1,74 @@
+#include "stdafx.h"
+#include "nes_perf.h"
+
+#include <iomanip>
+#include <sstream>
+
+namespace
+{
+    void write_field(ostringstream &out, const char *name, uint64_t value)
+    {
+        out << ",\"" << name << "\":" << value;
+    }
+
+    void write_io_regs(ostringstream &out, const char *name, const uint64_t *counts)
+    {
+        out << ",\"" << name << "\":{";
+        bool first = true;
+        for (int i = 0; i < NES_PERF_IO_REG_COUNT; ++i)
+        {
+            if (!counts[i])
+                continue;
+            out << (first ? "" : ",") << "\"$" << std::hex << std::uppercase << nes_perf_counters::io_reg_addr(i)
+                << "\":" << std::dec << counts[i];
+            first = false;
+        }
+        out << "}";
+    }
+}
+
+string nes_perf_counters::to_json() const
+{
+    ostringstream out;
+
+    out << "{\"frame\":" << frame;
+    write_field(out, "instructions", instructions);
+
+    out << ",\"opcodes\":{";
+    bool first = true;
+    for (int i = 0; i < 0x100; ++i)
+    {
+        if (!opcodes[i])
+            continue;
+        out << (first ? "" : ",") << "\"" << std::hex << std::uppercase << std::setw(2) << std::setfill('0') << i
+            << "\":" << std::dec << opcodes[i];
+        first = false;
+    }
+    out << "}";
+
+    write_io_regs(out, "io_reads", io_reads);
+    write_io_regs(out, "io_writes", io_writes);
+    write_field(out, "bank_switches", bank_switches);
+    write_field(out, "oam_dmas", oam_dmas);
+    write_field(out, "nmis", nmis);
+    write_field(out, "idle_loop_cycles_skipped", idle_loop_cycles_skipped);
+
+    write_field(out, "ppu_syncs", ppu_syncs);
+    write_field(out, "ppu_status_fast", ppu_status_fast);
+    write_field(out, "ppu_status_slow", ppu_status_slow);
+    write_field(out, "scanlines", scanlines);
+    write_field(out, "render_scanlines", render_scanlines);
+
+#ifdef NES_PERF_HAS_RDTSC
+    out << ",\"tick_unit\":\"tsc\"";
+#else
+    out << ",\"tick_unit\":\"ns\"";
+#endif
+    write_field(out, "cpu_ticks", cpu_ticks);
+    write_field(out, "ppu_ticks", ppu_ticks);
+    write_field(out, "apu_ticks", apu_ticks);
+    write_field(out, "frontend_ticks", frontend_ticks);
+    out << "}";
+
+    return out.str();
+}
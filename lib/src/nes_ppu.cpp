@@ -1,5 +1,6 @@
 #include "stdafx.h"
 #include <cstring>
+#include <algorithm>
 
 #include "nes_ppu.h"
 #include "nes_system.h"
@@ -27,6 +28,41 @@ namespace
         value = T(v);
         return true;
     }
+
+    // Marks the pages of current that differ from incoming - loading state only dirties what it changes
+    void mark_changed_pages(nes_dirty_bitmap &dirty, const uint8_t *current, const uint8_t *incoming, size_t size)
+    {
+        for (size_t page_offset = 0; page_offset < size; page_offset += dirty.page_size())
+        {
+            if (memcmp(current + page_offset, incoming + page_offset, dirty.page_size()) != 0)
+                dirty.mark(uint32_t(page_offset));
+        }
+    }
+
+    constexpr uint32_t make_argb(uint8_t r, uint8_t g, uint8_t b)
+    {
+        return (uint32_t(r) << 16) | (uint32_t(g) << 8) | b;
+    }
+
+    static const uint32_t s_argb_palette[] =
+    {
+        make_argb(84,  84,  84),    make_argb(0,  30, 116),    make_argb(8,  16, 144),    make_argb(48,   0, 136),   make_argb(68,   0, 100),   make_argb(92,   0,  48),   make_argb(84,   4,   0),   make_argb(60,  24,   0),   make_argb(32,  42,   0),   make_argb(8,  58,   0),   make_argb(0,  64,   0),    make_argb(0,  60,   0),    make_argb(0,  50,  60),    make_argb(0,   0,   0),   make_argb(0, 0, 0), make_argb(0, 0, 0),
+        make_argb(152, 150, 152),   make_argb(8,  76, 196),    make_argb(48,  50, 236),   make_argb(92,  30, 228),   make_argb(136,  20, 176),  make_argb(160,  20, 100),  make_argb(152,  34,  32),  make_argb(120,  60,   0),  make_argb(84,  90,   0),   make_argb(40, 114,   0),  make_argb(8, 124,   0),    make_argb(0, 118,  40),    make_argb(0, 102, 120),    make_argb(0,   0,   0),   make_argb(0, 0, 0), make_argb(0, 0, 0),
+        make_argb(236, 238, 236),   make_argb(76, 154, 236),   make_argb(120, 124, 236),  make_argb(176,  98, 236),  make_argb(228,  84, 236),  make_argb(236,  88, 180),  make_argb(236, 106, 100),  make_argb(212, 136,  32),  make_argb(160, 170,   0),  make_argb(116, 196,   0), make_argb(76, 208,  32),   make_argb(56, 204, 108),   make_argb(56, 180, 204),   make_argb(60,  60,  60),  make_argb(0, 0, 0), make_argb(0, 0, 0),
+        make_argb(236, 238, 236),   make_argb(168, 204, 236),  make_argb(188, 188, 236),  make_argb(212, 178, 236),  make_argb(236, 174, 236),  make_argb(236, 174, 212),  make_argb(236, 180, 176),  make_argb(228, 196, 144),  make_argb(204, 210, 120),  make_argb(180, 222, 120), make_argb(168, 226, 144),  make_argb(152, 226, 180),  make_argb(160, 214, 228),  make_argb(160, 162, 160), make_argb(0, 0, 0), make_argb(0, 0, 0)
+    };
+    static_assert(sizeof(s_argb_palette) == sizeof(uint32_t) * PPU_PALETTE_COLOR_COUNT, "NES has 64 colors");
+}
+
+const uint32_t *nes_ppu::argb_palette()
+{
+    return s_argb_palette;
+}
+
+void nes_ppu::frame_to_argb(const uint8_t *frame, uint32_t *pixels)
+{
+    for (size_t i = 0; i < size_t(PPU_SCREEN_X) * PPU_SCREEN_Y; ++i)
+        pixels[i] = s_argb_palette[frame[i] & (PPU_PALETTE_COLOR_COUNT - 1)];
 }
 
 nes_ppu_protect::nes_ppu_protect(nes_ppu *ppu)
@@ -54,20 +90,33 @@ void nes_ppu::write_OAMDMA(uint8_t val)
 
 void nes_ppu::oam_dma(uint16_t addr)
 {
+    if (_oam_dirty)
+        _oam_dirty->mark_range(0, PPU_OAM_SIZE);
+
     if (_oam_addr == 0)
     {
         // simple case - copy the 0x100 bytes directly
-        _system->ram()->get_bytes(_oam.get(), PPU_OAM_SIZE, addr, PPU_OAM_SIZE);
+        _system->ram()->get_bytes(_oam, PPU_OAM_SIZE, addr, PPU_OAM_SIZE);
     }
     else
     {
         // the copy starts at _oam_addr and wraps around
         int copy_before_wrap = 0x100 - _oam_addr;
-        _system->ram()->get_bytes(_oam.get() + _oam_addr, copy_before_wrap, addr, copy_before_wrap);
-        _system->ram()->get_bytes(_oam.get(), PPU_OAM_SIZE - copy_before_wrap, addr + copy_before_wrap, PPU_OAM_SIZE - copy_before_wrap);
+        _system->ram()->get_bytes(_oam + _oam_addr, copy_before_wrap, addr, copy_before_wrap);
+        _system->ram()->get_bytes(_oam, PPU_OAM_SIZE - copy_before_wrap, addr + copy_before_wrap, PPU_OAM_SIZE - copy_before_wrap);
     }
 }
 
+void nes_ppu::suppress_frames(bool suppress)
+{
+    if (suppress == _frames_suppressed)
+        return;
+
+    _frames_suppressed = suppress;
+    if (!suppress)
+        _frames.publish(_latest_frame, _frame_count);
+}
+
 void nes_ppu::load_mapper(shared_ptr<nes_mapper> &mapper)
 {
     // unset previous mapper
@@ -86,6 +135,7 @@ void nes_ppu::load_mapper(shared_ptr<nes_mapper> &mapper)
 void nes_ppu::set_mirroring(nes_mapper_flags flags)
 {
     _mirroring_flags = nes_mapper_flags(flags & nes_mapper_flags_mirroring_mask);
+    _status_change_valid = false;
 }
 
 void nes_ppu::init()
@@ -129,20 +179,33 @@ void nes_ppu::init()
     _scanline_cycle = nes_cycle_t(0);
     _cur_scanline = 0;
     _frame_count = 0;
+    _next_event_cycle = nes_cycle_t(0);
+    _status_change_valid = false;
 
     _protect_register = false;
     _stop_after_frame = -1;
     _auto_stop = false;
 
     _mask_oam_read = false;
-    _frame_buffer = _frame_buffer_1;
-    memset(_frame_buffer_1, 0, sizeof(_frame_buffer_1));
-    memset(_frame_buffer_2, 0, sizeof(_frame_buffer_2));
+    _frames.reset();
+    memset(_latest_frame, 0, frame_size());
+    memset(_frame_buffer, 0, frame_size());
     memset(_frame_buffer_bg, 0, sizeof(_frame_buffer_bg));
 
     _last_sprite_id = 0;
     _has_sprite_0 = 0;
-    _mask_oam_read = 0; 
+    _mask_oam_read = 0;
+
+    // Fetch pipeline - all of it is part of the serialized state, so it can't be left to whatever
+    // the memory happened to have (state hashes of identical runs would differ)
+    _tile_index = 0;
+    _tile_palette_bit32 = 0;
+    _bitplane0 = 0;
+    _shift_reg = 0;
+    _x_offset = 0;
+    _sprite_pos_y = 0;
+    memset(_pixel_cycle, 0, sizeof(_pixel_cycle));
+    memset(_sprite_buf, 0, sizeof(_sprite_buf));
 }
 
 void nes_ppu::reset()
@@ -154,21 +217,22 @@ void nes_ppu::reset()
 
 void nes_ppu::power_on(nes_system *system)
 {
+    _system = system;
+    _tracer = system->tracer();
+
     NES_TRACE1("[NES_PPU] POWER ON");
 
     init();
 
-    _system = system;
-
     NES_TRACE3("[NES_PPU] SCANLINE " << std::dec << _cur_scanline << " ------ ");
 }
 
 void nes_ppu::serialize(vector<uint8_t> &out) const
 {
     write_value(out, uint32_t(PPU_VRAM_SIZE));
-    out.insert(out.end(), _vram.get(), _vram.get() + PPU_VRAM_SIZE);
+    out.insert(out.end(), _vram, _vram + PPU_VRAM_SIZE);
     write_value(out, uint32_t(PPU_OAM_SIZE));
-    out.insert(out.end(), _oam.get(), _oam.get() + PPU_OAM_SIZE);
+    out.insert(out.end(), _oam, _oam + PPU_OAM_SIZE);
 
     write_value(out, _name_tbl_addr);
     write_value(out, _bg_pattern_tbl_addr);
@@ -209,9 +273,10 @@ void nes_ppu::serialize(vector<uint8_t> &out) const
     write_value(out, _sprite_pos_y);
     write_value(out, uint16_t(_mirroring_flags));
 
-    write_value(out, uint8_t(_frame_buffer == _frame_buffer_1 ? 1 : 2));
-    out.insert(out.end(), _frame_buffer_1, _frame_buffer_1 + sizeof(_frame_buffer_1));
-    out.insert(out.end(), _frame_buffer_2, _frame_buffer_2 + sizeof(_frame_buffer_2));
+    // Same layout as the old double buffer - frame being rendered as buffer 1, latest frame as buffer 2
+    write_value(out, uint8_t(1));
+    out.insert(out.end(), _frame_buffer, _frame_buffer + frame_size());
+    out.insert(out.end(), _latest_frame, _latest_frame + frame_size());
     out.insert(out.end(), _frame_buffer_bg, _frame_buffer_bg + sizeof(_frame_buffer_bg));
     out.insert(out.end(), _pixel_cycle, _pixel_cycle + sizeof(_pixel_cycle));
     out.insert(out.end(), reinterpret_cast<const uint8_t*>(&_sprite_buf[0]), reinterpret_cast<const uint8_t*>(&_sprite_buf[0]) + sizeof(_sprite_buf));
@@ -229,10 +294,14 @@ bool nes_ppu::deserialize(const uint8_t *data, size_t size, size_t &offset)
     uint8_t frame_buffer_id = 0;
 
     if (!read_value(data, size, offset, len) || len != PPU_VRAM_SIZE || offset + len > size) return false;
-    memcpy_s(_vram.get(), PPU_VRAM_SIZE, data + offset, len);
+    if (_vram_dirty)
+        mark_changed_pages(*_vram_dirty, _vram, data + offset, len);
+    memcpy_s(_vram, PPU_VRAM_SIZE, data + offset, len);
     offset += len;
     if (!read_value(data, size, offset, len) || len != PPU_OAM_SIZE || offset + len > size) return false;
-    memcpy_s(_oam.get(), PPU_OAM_SIZE, data + offset, len);
+    if (_oam_dirty)
+        mark_changed_pages(*_oam_dirty, _oam, data + offset, len);
+    memcpy_s(_oam, PPU_OAM_SIZE, data + offset, len);
     offset += len;
 
     if (!read_value(data, size, offset, _name_tbl_addr)) return false;
@@ -275,13 +344,20 @@ bool nes_ppu::deserialize(const uint8_t *data, size_t size, size_t &offset)
     if (!read_value(data, size, offset, mirror_flags)) return false; _mirroring_flags = nes_mapper_flags(mirror_flags);
 
     if (!read_value(data, size, offset, frame_buffer_id)) return false;
-    if (offset + sizeof(_frame_buffer_1) + sizeof(_frame_buffer_2) + sizeof(_frame_buffer_bg) + sizeof(_pixel_cycle) + sizeof(_sprite_buf) > size) return false;
-    memcpy_s(_frame_buffer_1, sizeof(_frame_buffer_1), data + offset, sizeof(_frame_buffer_1)); offset += sizeof(_frame_buffer_1);
-    memcpy_s(_frame_buffer_2, sizeof(_frame_buffer_2), data + offset, sizeof(_frame_buffer_2)); offset += sizeof(_frame_buffer_2);
+    if (offset + frame_size() * 2 + sizeof(_frame_buffer_bg) + sizeof(_pixel_cycle) + sizeof(_sprite_buf) > size) return false;
+    const uint8_t *frame_buffer_1 = data + offset; offset += frame_size();
+    const uint8_t *frame_buffer_2 = data + offset; offset += frame_size();
+    if (frame_buffer_id != 1)
+        swap(frame_buffer_1, frame_buffer_2);
+    memcpy_s(_frame_buffer, frame_size(), frame_buffer_1, frame_size());
+    memcpy_s(_latest_frame, frame_size(), frame_buffer_2, frame_size());
+    if (!_frames_suppressed)
+        _frames.publish(_latest_frame, _frame_count);
     memcpy_s(_frame_buffer_bg, sizeof(_frame_buffer_bg), data + offset, sizeof(_frame_buffer_bg)); offset += sizeof(_frame_buffer_bg);
     memcpy_s(_pixel_cycle, sizeof(_pixel_cycle), data + offset, sizeof(_pixel_cycle)); offset += sizeof(_pixel_cycle);
     memcpy_s(&_sprite_buf[0], sizeof(_sprite_buf), data + offset, sizeof(_sprite_buf)); offset += sizeof(_sprite_buf);
-    _frame_buffer = (frame_buffer_id == 1) ? _frame_buffer_1 : _frame_buffer_2;
+    schedule_next_event();
+    _status_change_valid = false;
 
     return true;
 }
@@ -388,7 +464,7 @@ void nes_ppu::fetch_tile()
             _pixel_cycle[i] = get_palette_color(/* is_background = */ true, color_4_bit);
 
             uint16_t frame_addr = uint16_t(cur_scanline) * PPU_SCREEN_X + _x_offset++;
-            if (frame_addr >= sizeof(_frame_buffer_1))
+            if (frame_addr >= sizeof(_frame_buffer_bg))
                 continue;
             _frame_buffer[frame_addr] = _pixel_cycle[i];
 
@@ -398,16 +474,7 @@ void nes_ppu::fetch_tile()
         }
 
         // Increment X position
-        if ((_ppu_addr & 0x1f) == 0x1f)
-        {
-            // Wrap to the next name table
-            _ppu_addr &= ~0x1f;
-            _ppu_addr ^= 0x0400;
-        }
-        else
-        {
-            _ppu_addr++;
-        }
+        increment_x(_ppu_addr);
     }
 }
 
@@ -424,32 +491,7 @@ void nes_ppu::fetch_tile_pipeline()
         fetch_tile();
 
         if (_scanline_cycle == nes_ppu_cycle_t(256))
-        {
-            if ((_ppu_addr & 0x7000) != 0x7000)
-            {
-                // Increase fine Y position (within tile)
-                _ppu_addr += 0x1000;
-            }
-            else
-            {
-                _ppu_addr &= ~0x7000;
-
-                // == row 29?
-                if ((_ppu_addr & 0x3e0) != 0x3a0)
-                {
-                     // Increase coarse Y position (next tile)
-                    _ppu_addr += 0x20;
-                }
-                else
-                {
-                    // wrap around
-                    _ppu_addr &= ~0x3e0;
-
-                    // switch to another vertical name table
-                    _ppu_addr ^= 0x0800;
-                }
-            }
-        }
+            increment_y(_ppu_addr);
     }
     else if (_scanline_cycle < nes_ppu_cycle_t(321))
     {
@@ -522,7 +564,7 @@ void nes_ppu::fetch_sprite_pipeline()
         {
             // even cycle - write to secondary OAM
             // if in range
-            if (_sprite_pos_y + 1 <= _cur_scanline && _cur_scanline < _sprite_pos_y + 1 + _sprite_height)
+            if (is_sprite_in_range(_sprite_pos_y, _cur_scanline))
             {
                 if (sprite_id == 0)
                     _has_sprite_0 = true;
@@ -560,24 +602,9 @@ void nes_ppu::fetch_sprite(uint8_t sprite_id)
     assert(sprite_id < PPU_ACTIVE_SPRITE_MAX);
 
     sprite_info *sprite = &_sprite_buf[sprite_id];
-    uint8_t tile_index = sprite->tile_index;
-
-    uint8_t tile_row_index = (_cur_scanline - sprite->pos_y - 1) % _sprite_height;
-
-    if (sprite->attr & PPU_SPRITE_ATTR_VERTICAL_FLIP)
-        tile_row_index = _sprite_height - 1 - tile_row_index;
 
     uint8_t bitplane0, bitplane1;
-    if (_use_8x16_sprite)
-    {
-        bitplane0 = read_pattern_table_column_8x16_sprite(tile_index, 0, tile_row_index);
-        bitplane1 = read_pattern_table_column_8x16_sprite(tile_index, 1, tile_row_index);
-    }
-    else
-    {
-        bitplane0 = read_pattern_table_column(/* sprite = */ true, tile_index, 0, tile_row_index);
-        bitplane1 = read_pattern_table_column(/* sprite = */ true, tile_index, 1, tile_row_index);
-    }
+    fetch_sprite_bitplanes(sprite, _cur_scanline, bitplane0, bitplane1);
 
     // bit3/2 is shared for the entire sprite (just like background attribute table)
     uint8_t palette_index_bit32 = (sprite->attr & PPU_SPRITE_ATTR_BIT32_MASK) << 2;
@@ -601,7 +628,7 @@ void nes_ppu::fetch_sprite(uint8_t sprite_id)
         else
             frame_addr += 7 - i; // high -> low as usual
 
-        if (frame_addr >= sizeof(_frame_buffer_1))
+        if (frame_addr >= sizeof(_frame_buffer_bg))
         {
             // part of the sprite might be over
             continue;
@@ -634,8 +661,32 @@ void nes_ppu::fetch_sprite(uint8_t sprite_id)
     }
 }
 
+void nes_ppu::fetch_sprite_bitplanes(sprite_info *sprite, int scanline, uint8_t &bitplane0, uint8_t &bitplane1)
+{
+    uint8_t tile_index = sprite->tile_index;
+
+    uint8_t tile_row_index = (scanline - sprite->pos_y - 1) % _sprite_height;
+
+    if (sprite->attr & PPU_SPRITE_ATTR_VERTICAL_FLIP)
+        tile_row_index = _sprite_height - 1 - tile_row_index;
+
+    if (_use_8x16_sprite)
+    {
+        bitplane0 = read_pattern_table_column_8x16_sprite(tile_index, 0, tile_row_index);
+        bitplane1 = read_pattern_table_column_8x16_sprite(tile_index, 1, tile_row_index);
+    }
+    else
+    {
+        bitplane0 = read_pattern_table_column(/* sprite = */ true, tile_index, 0, tile_row_index);
+        bitplane1 = read_pattern_table_column(/* sprite = */ true, tile_index, 1, tile_row_index);
+    }
+}
+
 void nes_ppu::step_to(nes_cycle_t count)
 {
+    // Anything could change from here - prediction is recomputed on demand
+    _status_change_valid = false;
+
     while (_master_cycle < count && !_system->stop_requested())
     {     
         step_ppu(nes_ppu_cycle_t(1));
@@ -696,6 +747,287 @@ void nes_ppu::step_to(nes_cycle_t count)
             }
         }
     }
+
+    schedule_next_event();
+}
+
+void nes_ppu::schedule_next_event()
+{
+    // VBlank begins at dot 1 of scanline 241, and frame ends when we wrap from 261 to 0
+    _next_event_cycle = std::min(cycle_at(241, 1), cycle_at(0, 0));
+}
+
+nes_cycle_t nes_ppu::cycle_at(int scanline, int dot) const
+{
+    const int64_t scanline_dots = PPU_SCANLINE_CYCLE.count();
+    int64_t pos = _cur_scanline * scanline_dots + _scanline_cycle.count();
+    int64_t target_pos = scanline * scanline_dots + dot;
+    if (target_pos > pos)
+        return _master_cycle + nes_ppu_cycle_t(target_pos - pos);
+
+    // dots until we wrap from 261 to 0 - odd frames skip the last dot of pre-render scanline
+    int64_t dots_to_frame_end = PPU_SCANLINE_COUNT * scanline_dots - pos;
+    if (_frame_count % 2 == 1)
+        dots_to_frame_end--;
+
+    return _master_cycle + nes_ppu_cycle_t(dots_to_frame_end + target_pos);
+}
+
+nes_cycle_t nes_ppu::next_status_change_cycle()
+{
+    if (!_status_change_valid)
+    {
+        _status_change_cycle = predict_status_change();
+        _status_change_valid = true;
+    }
+
+    return _status_change_cycle;
+}
+
+nes_cycle_t nes_ppu::predict_status_change()
+{
+    // VBlank set, the early VBlank clear @HACK in step_to, and pre-render scanline clears
+    nes_cycle_t next = cycle_at(241, 1);
+    next = std::min(next, cycle_at(260, 341 - 11));
+    next = std::min(next, cycle_at(261, 0));
+    next = std::min(next, cycle_at(261, 1));
+
+    // Sprite overflow / sprite 0 hit only change when sprite pipeline runs
+    if (_show_sprites)
+    {
+        next = std::min(next, predict_sprite_overflow());
+        if (!_sprite_0_hit)
+            next = std::min(next, predict_sprite_0_hit());
+    }
+
+    return next;
+}
+
+//
+// Replays sprite evaluation in fetch_sprite_pipeline against current OAM
+// Only scanlines before the next pre-render scanline matter - anything later is covered by the
+// fixed points in predict_status_change
+//
+nes_cycle_t nes_ppu::predict_sprite_overflow()
+{
+    if (_sprite_overflow)
+    {
+        // cleared at the beginning of next visible scanline with sprites
+        return cycle_at(_cur_scanline < 239 ? _cur_scanline + 1 : 1, 0);
+    }
+
+    int first_scanline;
+    if (_cur_scanline <= 239)
+    {
+        // finish evaluation of current scanline with the state we already have
+        if (_cur_scanline > 0)
+        {
+            uint8_t last_sprite_id = _last_sprite_id;
+            uint8_t sprite_pos_y = _sprite_pos_y;
+            for (int dot = std::max(int(_scanline_cycle.count()) + 1, 65); dot < 257; ++dot)
+            {
+                int sprite_id = (dot - 65) / 2;
+                if (sprite_id >= PPU_SPRITE_MAX)
+                    break;
+
+                if (dot % 2 == 0)
+                {
+                    if (is_sprite_in_range(sprite_pos_y, _cur_scanline))
+                    {
+                        if (last_sprite_id >= PPU_ACTIVE_SPRITE_MAX)
+                            return cycle_at(_cur_scanline, dot);
+                        last_sprite_id++;
+                    }
+                }
+                else
+                {
+                    sprite_pos_y = get_sprite(sprite_id)->pos_y;
+                }
+            }
+        }
+
+        first_scanline = _cur_scanline + 1;
+    }
+    else if (_cur_scanline == 261)
+    {
+        // next frame
+        first_scanline = 1;
+    }
+    else
+    {
+        return nes_cycle_t::max();
+    }
+
+    // count sprites in range for each scanline - the 9th sprite in range sets the flag when
+    // it is checked at dot 66 + sprite_id * 2
+    uint8_t in_range_count[PPU_SCREEN_Y] = {};
+    int overflow_scanline = PPU_SCREEN_Y;
+    int overflow_dot = 0;
+    for (int sprite_id = 0; sprite_id < PPU_SPRITE_MAX; ++sprite_id)
+    {
+        int top = get_sprite(sprite_id)->pos_y + 1;
+        int bottom = std::min(top + _sprite_height, overflow_scanline);
+        for (int scanline = std::max(top, first_scanline); scanline < bottom; ++scanline)
+        {
+            if (++in_range_count[scanline] > PPU_ACTIVE_SPRITE_MAX)
+            {
+                overflow_scanline = scanline;
+                overflow_dot = 66 + sprite_id * 2;
+                break;
+            }
+        }
+    }
+
+    if (overflow_scanline < PPU_SCREEN_Y)
+        return cycle_at(overflow_scanline, overflow_dot);
+
+    return nes_cycle_t::max();
+}
+
+//
+// Sprite 0 hit is checked in fetch_sprite at dot 261 (sprite 0 is always first in _sprite_buf).
+// Predict it by rendering sprite 0 against the background it'll be drawn on. When the background
+// row is being rendered right now, simply assume a hit at the end of that row - catching up
+// once at that point is cheap.
+//
+nes_cycle_t nes_ppu::predict_sprite_0_hit()
+{
+    bool next_frame;
+    if (_cur_scanline <= 239)
+        next_frame = false;
+    else if (_cur_scanline == 261)
+        next_frame = true;
+    else
+        return nes_cycle_t::max();
+
+    auto pos_at = [](int scanline, int dot) { return scanline * PPU_SCANLINE_CYCLE.count() + dot; };
+    int64_t pos = next_frame ? -1 : pos_at(_cur_scanline, int(_scanline_cycle.count()));
+
+    // current scanline has already evaluated sprites - sprite 0 might not be in OAM any more
+    if (!next_frame && pos >= pos_at(_cur_scanline, 66) && pos < pos_at(_cur_scanline, 261))
+    {
+        if (_has_sprite_0)
+            return cycle_at(_cur_scanline, 261);
+    }
+
+    int top = get_sprite(0)->pos_y + 1;
+    int bottom = std::min(top + _sprite_height, PPU_SCREEN_Y);
+    for (int scanline = std::max(top, 1); scanline < bottom; ++scanline)
+    {
+        if (pos >= pos_at(scanline, 66))
+            continue;
+
+        uint8_t bg_row[PPU_SCREEN_X];
+        const uint8_t *bg = &_frame_buffer_bg[scanline * PPU_SCREEN_X];
+        if (_show_bg)
+        {
+            // row is being fetched
+            uint16_t addr;
+            if (pos >= pos_at(scanline - 1, 321) || !predict_bg_addr(scanline, addr))
+                return cycle_at(scanline, 261);
+
+            predict_bg_row(scanline, addr, bg_row);
+            bg = bg_row;
+        }
+
+        if (sprite_0_overlaps(scanline, bg))
+            return cycle_at(scanline, 261);
+    }
+
+    return nes_cycle_t::max();
+}
+
+//
+// Predict _ppu_addr when fetch of <scanline> begins at dot 321 of the scanline before
+// Returns false if the prediction isn't straightforward
+//
+bool nes_ppu::predict_bg_addr(int scanline, uint16_t &addr)
+{
+    // horizontal position is reset from t at dot 257
+    int y_increments;
+    addr = _ppu_addr;
+    if (_cur_scanline == 261)
+    {
+        addr = (addr & 0xfbe0) | (_temp_ppu_addr & ~0xfbe0);
+        y_increments = scanline;
+    }
+    else if (_scanline_cycle < nes_ppu_cycle_t(256))
+    {
+        addr = (addr & 0xfbe0) | (_temp_ppu_addr & ~0xfbe0);
+        y_increments = scanline - _cur_scanline;
+    }
+    else
+    {
+        if (scanline - 1 != _cur_scanline || _scanline_cycle == nes_ppu_cycle_t(256))
+            addr = (addr & 0xfbe0) | (_temp_ppu_addr & ~0xfbe0);
+        y_increments = scanline - _cur_scanline - 1;
+    }
+
+    for (int i = 0; i < y_increments; ++i)
+    {
+        // coarse Y 31 overflows into horizontal name table bit which we don't track
+        if ((addr & 0x73e0) == 0x73e0)
+            return false;
+
+        increment_y(addr);
+    }
+
+    return true;
+}
+
+//
+// Same as fetch_tile but only for the 2-bit palette index in _frame_buffer_bg
+//
+void nes_ppu::predict_bg_row(int scanline, uint16_t addr, uint8_t *row)
+{
+    uint8_t tile_row_index = (scanline + _scroll_y) % 8;
+    int last_tile = (_fine_x_scroll > 0) ? 32 : 31;
+    int x = 0;
+    for (int tile = 0; tile <= last_tile; ++tile)
+    {
+        uint8_t tile_index = read_byte((addr & 0xfff) | 0x2000);
+        uint8_t bitplane0 = read_pattern_table_column(/* sprite = */false, tile_index, /* bitplane = */ 0, tile_row_index);
+        uint8_t bitplane1 = read_pattern_table_column(/* sprite = */false, tile_index, /* bitplane = */ 1, tile_row_index);
+
+        int start_bit = (tile == 0) ? 7 - _fine_x_scroll : 7;
+        int end_bit = (tile == 32) ? 7 - _fine_x_scroll + 1 : 0;
+        for (int i = start_bit; i >= end_bit; --i)
+            row[x++] = ((bitplane0 >> i) & 1) | (((bitplane1 >> i) & 1) << 1);
+
+        increment_x(addr);
+    }
+
+    assert(x == PPU_SCREEN_X);
+}
+
+bool nes_ppu::sprite_0_overlaps(int scanline, const uint8_t *bg_row)
+{
+    sprite_info *sprite = get_sprite(0);
+
+    uint8_t bitplane0, bitplane1;
+    fetch_sprite_bitplanes(sprite, scanline, bitplane0, bitplane1);
+
+    for (int i = 7; i >= 0; --i)
+    {
+        if ((((bitplane0 | bitplane1) >> i) & 1) == 0)
+            continue;
+
+        int x = sprite->pos_x + ((sprite->attr & PPU_SPRITE_ATTR_HORIZONTAL_FLIP) ? i : 7 - i);
+
+        // sprites near the right edge wrap into the start of next row, which isn't fetched yet
+        uint8_t bg;
+        if (x < PPU_SCREEN_X)
+            bg = bg_row[x];
+        else if (scanline * PPU_SCREEN_X + x < PPU_SCREEN_X * PPU_SCREEN_Y)
+            bg = _frame_buffer_bg[scanline * PPU_SCREEN_X + x];
+        else
+            continue;
+
+        if (bg != 0)
+            return true;
+    }
+
+    return false;
 }
 
 void nes_ppu::step_ppu(nes_ppu_cycle_t count)
@@ -708,15 +1040,26 @@ void nes_ppu::step_ppu(nes_ppu_cycle_t count)
     if (_scanline_cycle >= PPU_SCANLINE_CYCLE)
     {
         _scanline_cycle %= PPU_SCANLINE_CYCLE;
+
+        if (auto perf = _system->perf())
+        {
+            perf->scanlines++;
+            if (_cur_scanline <= 239 && !is_render_off())
+                perf->render_scanlines++;
+        }
+
         _cur_scanline++;
         if (_cur_scanline >= PPU_SCANLINE_COUNT)
         {
             _cur_scanline %= PPU_SCANLINE_COUNT;
-            // Frame boundary: publish the finished frame by swapping read/write buffers.
-            swap_buffer();
+            // Frame boundary: publish the finished frame and move on to a free buffer.
             _frame_count++;
+            publish_frame();
             NES_TRACE4("[NES_PPU] FRAME " << std::dec << _frame_count << " ------ ");
 
+            if (_system->is_perf_counters_enabled())
+                _system->end_perf_frame(_frame_count);
+
             if (_auto_stop && _frame_count > _stop_after_frame)
             {
                 NES_TRACE1("[NES_PPU] FRAME exceeding " << std::dec << _stop_after_frame << " -> stopping...");
@@ -0,0 +1,338 @@
+#include "stdafx.h"
+#include "nes_recorder.h"
+
+#include <chrono>
+#include <cstring>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+namespace
+{
+    static const uint32_t NES_FRAME_ARCHIVE_MAGIC = 0x4653454E;    // NESF
+    static const uint32_t NES_FRAME_ARCHIVE_VERSION = 1;
+
+    // NTSC frame rate - 39375000 / 655171 = 60.0988 fps
+    static const char *NES_Y4M_FRAME_RATE = "39375000:655171";
+
+    template<typename T>
+    void append_value(vector<uint8_t> &out, T value)
+    {
+        for (size_t i = 0; i < sizeof(T); ++i)
+            out.push_back(uint8_t((uint64_t(value) >> (i * 8)) & 0xff));
+    }
+
+    template<typename T>
+    bool read_value(ifstream &in, T &value)
+    {
+        uint8_t bytes[sizeof(T)];
+        if (!in.read(reinterpret_cast<char *>(bytes), sizeof(T)))
+            return false;
+
+        uint64_t v = 0;
+        for (size_t i = 0; i < sizeof(T); ++i)
+            v |= uint64_t(bytes[i]) << (i * 8);
+        value = T(v);
+        return true;
+    }
+
+    bool ends_with(const string &str, const char *suffix)
+    {
+        size_t len = strlen(suffix);
+        return str.size() >= len && str.compare(str.size() - len, len, suffix) == 0;
+    }
+
+    uint8_t clamp_byte(double value)
+    {
+        if (value < 0) return 0;
+        if (value > 255) return 255;
+        return uint8_t(value + 0.5);
+    }
+}
+
+unique_ptr<nes_frame_sink> nes_frame_sink::create(const string &path)
+{
+    if (ends_with(path, ".y4m"))
+        return make_unique<nes_y4m_sink>(path);
+    if (path == "-" || ends_with(path, ".rgb"))
+        return make_unique<nes_rgb24_sink>(path);
+    return make_unique<nes_frame_archive_sink>(path);
+}
+
+nes_file_frame_sink::~nes_file_frame_sink()
+{
+    end();
+}
+
+bool nes_file_frame_sink::begin(uint16_t width, uint16_t height)
+{
+    _width = width;
+    _height = height;
+
+    if (_path == "-")
+    {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        _file = stdout;
+        return true;
+    }
+
+    _file = fopen(_path.c_str(), "wb");
+    return _file != nullptr;
+}
+
+bool nes_file_frame_sink::end()
+{
+    if (!_file)
+        return true;
+
+    bool succeeded = (fflush(_file) == 0);
+    if (_file != stdout)
+        succeeded = (fclose(_file) == 0) && succeeded;
+    _file = nullptr;
+
+    return succeeded;
+}
+
+nes_y4m_sink::nes_y4m_sink(const string &path)
+    :nes_file_frame_sink(path)
+{
+    // BT.601 limited range - what players assume when the header doesn't say
+    const uint32_t *palette = nes_ppu::argb_palette();
+    for (int i = 0; i < PPU_PALETTE_COLOR_COUNT; ++i)
+    {
+        double r = (palette[i] >> 16) & 0xff;
+        double g = (palette[i] >> 8) & 0xff;
+        double b = palette[i] & 0xff;
+
+        _palette_yuv[0][i] = clamp_byte(16 + (65.481 * r + 128.553 * g + 24.966 * b) / 255);
+        _palette_yuv[1][i] = clamp_byte(128 + (-37.797 * r - 74.203 * g + 112.0 * b) / 255);
+        _palette_yuv[2][i] = clamp_byte(128 + (112.0 * r - 93.786 * g - 18.214 * b) / 255);
+    }
+}
+
+bool nes_y4m_sink::begin(uint16_t width, uint16_t height)
+{
+    if (!nes_file_frame_sink::begin(width, height))
+        return false;
+
+    _planes.resize(size_t(width) * height * 3);
+
+    string header = "YUV4MPEG2 W" + to_string(width) + " H" + to_string(height) +
+        " F" + NES_Y4M_FRAME_RATE + " Ip A1:1 C444\n";
+    return write(header.data(), header.size());
+}
+
+bool nes_y4m_sink::write_frame(uint64_t /* sequence */, const uint8_t *pixels)
+{
+    size_t frame_size = size_t(_width) * _height;
+    uint8_t *y = _planes.data();
+    uint8_t *u = y + frame_size;
+    uint8_t *v = u + frame_size;
+    for (size_t i = 0; i < frame_size; ++i)
+    {
+        uint8_t color = pixels[i] & (PPU_PALETTE_COLOR_COUNT - 1);
+        y[i] = _palette_yuv[0][color];
+        u[i] = _palette_yuv[1][color];
+        v[i] = _palette_yuv[2][color];
+    }
+
+    static const char frame_header[] = "FRAME\n";
+    return write(frame_header, sizeof(frame_header) - 1) && write(_planes.data(), _planes.size());
+}
+
+bool nes_rgb24_sink::write_frame(uint64_t /* sequence */, const uint8_t *pixels)
+{
+    size_t frame_size = size_t(_width) * _height;
+    _rgb.resize(frame_size * 3);
+
+    const uint32_t *palette = nes_ppu::argb_palette();
+    for (size_t i = 0; i < frame_size; ++i)
+    {
+        uint32_t color = palette[pixels[i] & (PPU_PALETTE_COLOR_COUNT - 1)];
+        _rgb[i * 3] = uint8_t(color >> 16);
+        _rgb[i * 3 + 1] = uint8_t(color >> 8);
+        _rgb[i * 3 + 2] = uint8_t(color);
+    }
+
+    return write(_rgb.data(), _rgb.size());
+}
+
+bool nes_frame_archive_sink::begin(uint16_t width, uint16_t height)
+{
+    if (!nes_file_frame_sink::begin(width, height))
+        return false;
+
+    vector<uint8_t> header;
+    append_value(header, NES_FRAME_ARCHIVE_MAGIC);
+    append_value(header, NES_FRAME_ARCHIVE_VERSION);
+    append_value(header, width);
+    append_value(header, height);
+
+    return write(header.data(), header.size());
+}
+
+bool nes_frame_archive_sink::write_frame(uint64_t sequence, const uint8_t *pixels)
+{
+    if (_chunk_frames == 0)
+    {
+        _chunk.clear();
+        append_value(_chunk, uint32_t(0));      // frame count - filled in by flush_chunk
+    }
+
+    append_value(_chunk, sequence);
+    _chunk.insert(_chunk.end(), pixels, pixels + size_t(_width) * _height);
+    _chunk_frames++;
+
+    if (_chunk_frames == NES_FRAME_ARCHIVE_CHUNK_FRAMES)
+        return flush_chunk();
+
+    return true;
+}
+
+bool nes_frame_archive_sink::flush_chunk()
+{
+    if (_chunk_frames == 0)
+        return true;
+
+    for (size_t i = 0; i < sizeof(uint32_t); ++i)
+        _chunk[i] = uint8_t((_chunk_frames >> (i * 8)) & 0xff);
+    _chunk_frames = 0;
+
+    return write(_chunk.data(), _chunk.size());
+}
+
+bool nes_frame_archive_sink::end()
+{
+    if (!_file)
+        return true;
+
+    bool succeeded = flush_chunk();
+    return nes_file_frame_sink::end() && succeeded;
+}
+
+bool nes_frame_archive_sink::read(const char *path, function<void(uint64_t sequence, const uint8_t *pixels, uint16_t width, uint16_t height)> callback)
+{
+    ifstream in(path, ios::in | ios::binary);
+
+    uint32_t magic = 0, version = 0;
+    uint16_t width = 0, height = 0;
+    if (!read_value(in, magic) || !read_value(in, version) || !read_value(in, width) || !read_value(in, height))
+        return false;
+    if (magic != NES_FRAME_ARCHIVE_MAGIC || version != NES_FRAME_ARCHIVE_VERSION)
+        return false;
+
+    vector<uint8_t> pixels(size_t(width) * height);
+    uint32_t count = 0;
+    while (read_value(in, count))
+    {
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            uint64_t sequence = 0;
+            if (!read_value(in, sequence) || !in.read(reinterpret_cast<char *>(pixels.data()), pixels.size()))
+                return false;
+
+            callback(sequence, pixels.data(), width, height);
+        }
+    }
+
+    return true;
+}
+
+nes_frame_recorder::nes_frame_recorder(unique_ptr<nes_frame_sink> sink, uint16_t width, uint16_t height)
+    :_sink(std::move(sink)), _width(width), _height(height)
+{
+    _frame_size = size_t(width) * height;
+    _frames = make_unique<uint8_t[]>(_frame_size * NES_RECORDER_QUEUE_SIZE);
+
+    _head = 0;
+    _tail = 0;
+    _recorded_count = 0;
+    _dropped_count = 0;
+    _failed = false;
+    _stop = false;
+
+    _thread = thread([this] { write_loop(); });
+}
+
+nes_frame_recorder::~nes_frame_recorder()
+{
+    stop();
+}
+
+bool nes_frame_recorder::record(uint64_t sequence, const uint8_t *pixels)
+{
+    uint64_t head = _head.load(memory_order_relaxed);
+    if (_failed || head - _tail.load(memory_order_acquire) == NES_RECORDER_QUEUE_SIZE)
+    {
+        _dropped_count++;
+        return false;
+    }
+
+    size_t slot = size_t(head & (NES_RECORDER_QUEUE_SIZE - 1));
+    memcpy(&_frames[slot * _frame_size], pixels, _frame_size);
+    _sequences[slot] = sequence;
+    _head.store(head + 1, memory_order_release);
+
+    return true;
+}
+
+bool nes_frame_recorder::stop()
+{
+    if (_thread.joinable())
+    {
+        _stop = true;
+        _thread.join();
+    }
+
+    return !_failed;
+}
+
+bool nes_frame_recorder::write_pending()
+{
+    uint64_t tail = _tail.load(memory_order_relaxed);
+    uint64_t head = _head.load(memory_order_acquire);
+    if (head == tail)
+        return false;
+
+    for (; tail != head; ++tail)
+    {
+        size_t slot = size_t(tail & (NES_RECORDER_QUEUE_SIZE - 1));
+        if (!_failed && _sink->write_frame(_sequences[slot], &_frames[slot * _frame_size]))
+        {
+            _recorded_count++;
+        }
+        else
+        {
+            _failed = true;
+            _dropped_count++;
+        }
+
+        // Free up the slot right away so that emulation can use it
+        _tail.store(tail + 1, memory_order_release);
+    }
+
+    return true;
+}
+
+void nes_frame_recorder::write_loop()
+{
+    // Opening can block (a FIFO waits for its reader) - keep that off the emulation thread as well
+    if (!_sink->begin(_width, _height))
+        _failed = true;
+
+    while (!_stop)
+    {
+        if (!write_pending())
+            this_thread::sleep_for(chrono::milliseconds(1));
+    }
+
+    // Whatever got recorded before stopping
+    write_pending();
+
+    if (!_sink->end())
+        _failed = true;
+}
@@ -0,0 +1,580 @@
+#include "stdafx.h"
+#include "nes_replay.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <sstream>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    static const uint32_t NES_REPLAY_MAGIC = 0x5253454E;      // NESR
+    static const uint32_t NES_REPLAY_VERSION_V1 = 1;       // no nes_replay_keyframe_info
+    static const uint32_t NES_REPLAY_VERSION = 2;
+
+    uint32_t index_count_for(uint32_t frame_count)
+    {
+        return (frame_count + NES_REPLAY_INDEX_INTERVAL - 1) / NES_REPLAY_INDEX_INTERVAL;
+    }
+
+    template<typename T>
+    void append_struct(vector<uint8_t> &out, const T &value)
+    {
+        auto bytes = reinterpret_cast<const uint8_t *>(&value);
+        out.insert(out.end(), bytes, bytes + sizeof(T));
+    }
+
+    uint64_t align_up(uint64_t offset, uint64_t alignment)
+    {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    // offset / count * element_size within size
+    bool is_in_range(uint64_t offset, uint64_t count, uint64_t element_size, size_t size)
+    {
+        return offset <= size && count <= (size - offset) / element_size;
+    }
+}
+
+nes_replay::~nes_replay()
+{
+#ifdef _WIN32
+    if (_data)
+        UnmapViewOfFile(_data);
+    if (_mapping)
+        CloseHandle(_mapping);
+    if (_file && _file != INVALID_HANDLE_VALUE)
+        CloseHandle(_file);
+#else
+    if (_data)
+        munmap(const_cast<uint8_t *>(_data), _size);
+#endif
+}
+
+shared_ptr<nes_replay> nes_replay::open(const char *path)
+{
+    shared_ptr<nes_replay> replay(new nes_replay());
+
+#ifdef _WIN32
+    replay->_file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (replay->_file == INVALID_HANDLE_VALUE)
+        return nullptr;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(replay->_file, &size) || size.QuadPart < LONGLONG(sizeof(nes_replay_header)))
+        return nullptr;
+    replay->_size = size_t(size.QuadPart);
+
+    replay->_mapping = CreateFileMappingA(replay->_file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!replay->_mapping)
+        return nullptr;
+
+    replay->_data = reinterpret_cast<const uint8_t *>(MapViewOfFile(replay->_mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!replay->_data)
+        return nullptr;
+#else
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(nes_replay_header))
+    {
+        close(fd);
+        return nullptr;
+    }
+    replay->_size = size_t(st.st_size);
+
+    void *data = mmap(nullptr, replay->_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return nullptr;
+    replay->_data = reinterpret_cast<const uint8_t *>(data);
+#endif
+
+    if (!replay->validate())
+        return nullptr;
+
+    return replay;
+}
+
+bool nes_replay::validate()
+{
+    _header = reinterpret_cast<const nes_replay_header *>(_data);
+    if (_header->magic != NES_REPLAY_MAGIC || (_header->version != NES_REPLAY_VERSION && _header->version != NES_REPLAY_VERSION_V1))
+        return false;
+
+    size_t players_offset = sizeof(nes_replay_header);
+    if (_header->version >= NES_REPLAY_VERSION)
+    {
+        if (_size < sizeof(nes_replay_header) + sizeof(nes_replay_keyframe_info))
+            return false;
+        _keyframes = reinterpret_cast<const nes_replay_keyframe_info *>(_data + sizeof(nes_replay_header));
+        players_offset += sizeof(nes_replay_keyframe_info);
+
+        if (!validate_keyframes())
+            return false;
+    }
+
+    if (!is_in_range(players_offset, _header->player_count, sizeof(nes_replay_player), _size))
+        return false;
+    _players = reinterpret_cast<const nes_replay_player *>(_data + players_offset);
+
+    // Only the layout and the index - runs are read as they get used
+    for (uint32_t i = 0; i < _header->player_count; ++i)
+    {
+        const nes_replay_player &player = _players[i];
+        if (player.index_offset % sizeof(uint32_t) || player.runs_offset % sizeof(uint32_t))
+            return false;
+        if (!is_in_range(player.index_offset, player.index_count, sizeof(uint32_t), _size))
+            return false;
+        if (!is_in_range(player.runs_offset, player.run_count, sizeof(nes_replay_run), _size))
+            return false;
+
+        if (player.run_count == 0)
+        {
+            if (player.index_count != 0)
+                return false;
+            continue;
+        }
+
+        if (player.index_count != index_count_for(_header->frame_count))
+            return false;
+
+        auto index = reinterpret_cast<const uint32_t *>(_data + player.index_offset);
+        for (uint32_t j = 0; j < player.index_count; ++j)
+        {
+            if (index[j] >= player.run_count)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+bool nes_replay::validate_keyframes()
+{
+    if (_keyframes->keyframes_offset % sizeof(uint64_t) || _keyframes->hashes_offset % sizeof(uint64_t))
+        return false;
+    if (!is_in_range(_keyframes->keyframes_offset, _keyframes->keyframe_count, sizeof(nes_replay_keyframe), _size))
+        return false;
+    if (!is_in_range(_keyframes->hashes_offset, _keyframes->hash_count, sizeof(uint64_t), _size))
+        return false;
+
+    // States themselves are only read when restored - nes_system::deserialize checks those
+    auto keyframes = keyframe_table();
+    for (uint32_t i = 0; i < _keyframes->keyframe_count; ++i)
+    {
+        if (i > 0 && keyframes[i].frame <= keyframes[i - 1].frame)
+            return false;
+        if (!is_in_range(keyframes[i].state_offset, keyframes[i].state_size, 1, _size))
+            return false;
+    }
+
+    return true;
+}
+
+nes_state_blob nes_replay::keyframe_state(uint32_t index) const
+{
+    auto &keyframe = keyframe_table()[index];
+
+    nes_state_blob state;
+    state.data.assign(_data + keyframe.state_offset, _data + keyframe.state_offset + keyframe.state_size);
+    return state;
+}
+
+int nes_replay::find_keyframe(uint32_t frame) const
+{
+    uint32_t count = keyframe_count();
+    if (count == 0)
+        return -1;
+    auto keyframes = keyframe_table();
+
+    // First keyframe after frame, then one back
+    uint32_t lo = 0, hi = count;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (keyframes[mid].frame <= frame)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return int(lo) - 1;
+}
+
+nes_button_flags nes_replay::buttons(uint32_t player, uint32_t frame) const
+{
+    if (player >= _header->player_count || frame >= _header->frame_count)
+        return nes_button_flags_none;
+
+    const nes_replay_player &info = _players[player];
+    if (info.run_count == 0)
+        return nes_button_flags_none;
+
+    auto index = reinterpret_cast<const uint32_t *>(_data + info.index_offset);
+    auto runs = reinterpret_cast<const nes_replay_run *>(_data + info.runs_offset);
+
+    uint32_t run = index[frame / NES_REPLAY_INDEX_INTERVAL];
+    while (run + 1 < info.run_count && runs[run + 1].start_frame <= frame)
+        run++;
+
+    return nes_button_flags(runs[run].buttons);
+}
+
+uint64_t nes_replay::hash_file(const char *path)
+{
+    ifstream in(path, ios::in | ios::binary);
+
+    uint64_t hash = 0xcbf29ce484222325ull;
+    char buf[0x1000];
+    while (in.read(buf, sizeof(buf)) || in.gcount() > 0)
+    {
+        for (streamsize i = 0; i < in.gcount(); ++i)
+        {
+            hash ^= uint8_t(buf[i]);
+            hash *= 0x100000001b3ull;
+        }
+    }
+
+    return hash;
+}
+
+bool nes_replay::convert_text_log(const char *text_path, const char *replay_path, uint64_t rom_hash, uint64_t start_state_hash)
+{
+    ifstream in(text_path);
+    if (!in.is_open())
+        return false;
+
+    vector<pair<uint32_t, nes_button_flags>> samples;
+
+    string line;
+    while (getline(in, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        istringstream parser(line);
+        string frame_token;
+        string flags_token;
+        if (!(parser >> frame_token >> flags_token))
+            continue;
+
+        try
+        {
+            uint32_t frame = static_cast<uint32_t>(stoul(frame_token, nullptr, 0));
+            uint32_t flags = static_cast<uint32_t>(stoul(flags_token, nullptr, 0));
+            samples.emplace_back(frame, nes_button_flags(flags & 0xff));
+        }
+        catch (std::exception &)
+        {
+            return false;
+        }
+    }
+
+    // Lines can come in any order, and the last one wins for a frame listed more than once
+    stable_sort(samples.begin(), samples.end(), [](const pair<uint32_t, nes_button_flags> &a, const pair<uint32_t, nes_button_flags> &b) {
+        return a.first < b.first;
+    });
+
+    nes_replay_writer writer(1, rom_hash, start_state_hash);
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        if (i + 1 < samples.size() && samples[i + 1].first == samples[i].first)
+            continue;
+        writer.set_buttons(0, samples[i].first, samples[i].second);
+    }
+
+    return writer.save(replay_path);
+}
+
+nes_replay_writer::nes_replay_writer(uint32_t player_count, uint64_t rom_hash, uint64_t start_state_hash)
+    :_rom_hash(rom_hash), _start_state_hash(start_state_hash), _players(player_count)
+{
+}
+
+nes_replay_writer::nes_replay_writer(const nes_replay &replay)
+    :nes_replay_writer(replay.player_count(), replay.header().rom_hash, replay.header().start_state_hash)
+{
+    for (uint32_t player = 0; player < replay.player_count(); ++player)
+    {
+        for (uint32_t frame = 0; frame < replay.frame_count(); ++frame)
+            set_buttons(player, frame, replay.buttons(player, frame));
+    }
+}
+
+void nes_replay_writer::add_keyframe(uint32_t frame, const nes_state_blob &state)
+{
+    assert(_keyframes.empty() || frame > _keyframes.back().first);
+    _keyframes.emplace_back(frame, state);
+}
+
+void nes_replay_writer::set_buttons(uint32_t player, uint32_t frame, nes_button_flags buttons)
+{
+    auto &runs = _players[player];
+    assert(frame >= runs.next_frame);
+
+    // Nothing held in the frames skipped over
+    if (frame > runs.next_frame && (runs.runs.empty() || runs.runs.back().buttons != nes_button_flags_none))
+        runs.runs.push_back(nes_replay_run{ runs.next_frame, nes_button_flags_none, {} });
+
+    if (runs.runs.empty() || runs.runs.back().buttons != buttons)
+        runs.runs.push_back(nes_replay_run{ frame, uint8_t(buttons), {} });
+
+    runs.next_frame = frame + 1;
+}
+
+bool nes_replay_writer::save(const char *path) const
+{
+    nes_replay_header header = {};
+    header.magic = NES_REPLAY_MAGIC;
+    header.version = NES_REPLAY_VERSION;
+    header.rom_hash = _rom_hash;
+    header.start_state_hash = _start_state_hash;
+    header.player_count = uint32_t(_players.size());
+    for (auto &player : _players)
+        header.frame_count = max(header.frame_count, player.next_frame);
+
+    // Players with shorter input let go of everything once it ends
+    vector<vector<nes_replay_run>> all_runs;
+    for (auto &player : _players)
+    {
+        all_runs.push_back(player.runs);
+        if (!player.runs.empty() && player.runs.back().buttons != nes_button_flags_none && player.next_frame < header.frame_count)
+            all_runs.back().push_back(nes_replay_run{ player.next_frame, nes_button_flags_none, {} });
+    }
+
+    vector<nes_replay_player> players(_players.size());
+    vector<vector<uint32_t>> indices(_players.size());
+    uint64_t offset = sizeof(nes_replay_header) + sizeof(nes_replay_keyframe_info) + sizeof(nes_replay_player) * players.size();
+    for (size_t i = 0; i < players.size(); ++i)
+    {
+        auto &runs = all_runs[i];
+        auto &index = indices[i];
+        if (!runs.empty())
+        {
+            uint32_t run = 0;
+            for (uint32_t frame = 0; frame < header.frame_count; frame += NES_REPLAY_INDEX_INTERVAL)
+            {
+                while (run + 1 < runs.size() && runs[run + 1].start_frame <= frame)
+                    run++;
+                index.push_back(run);
+            }
+        }
+
+        players[i].index_offset = offset;
+        players[i].index_count = uint32_t(index.size());
+        offset += index.size() * sizeof(uint32_t);
+
+        players[i].runs_offset = offset;
+        players[i].run_count = uint32_t(runs.size());
+        offset += runs.size() * sizeof(nes_replay_run);
+    }
+
+    nes_replay_keyframe_info keyframe_info = {};
+    vector<nes_replay_keyframe> keyframes(_keyframes.size());
+    keyframe_info.keyframe_interval = _keyframes.empty() ? 0 : _keyframe_interval;
+    keyframe_info.keyframe_count = uint32_t(_keyframes.size());
+    keyframe_info.hash_count = uint32_t(_hashes.size());
+
+    offset = align_up(offset, sizeof(uint64_t));
+    keyframe_info.keyframes_offset = offset;
+    offset += keyframes.size() * sizeof(nes_replay_keyframe);
+    for (size_t i = 0; i < keyframes.size(); ++i)
+    {
+        keyframes[i].frame = _keyframes[i].first;
+        keyframes[i].state_offset = offset;
+        keyframes[i].state_size = _keyframes[i].second.data.size();
+        offset += keyframes[i].state_size;
+    }
+
+    offset = align_up(offset, sizeof(uint64_t));
+    keyframe_info.hashes_offset = offset;
+    offset += _hashes.size() * sizeof(uint64_t);
+
+    vector<uint8_t> out;
+    out.reserve(size_t(offset));
+    append_struct(out, header);
+    append_struct(out, keyframe_info);
+    for (auto &player : players)
+        append_struct(out, player);
+    for (size_t i = 0; i < players.size(); ++i)
+    {
+        for (auto entry : indices[i])
+            append_struct(out, entry);
+        for (auto &run : all_runs[i])
+            append_struct(out, run);
+    }
+
+    out.resize(size_t(keyframe_info.keyframes_offset));
+    for (auto &keyframe : keyframes)
+        append_struct(out, keyframe);
+    for (auto &keyframe : _keyframes)
+        out.insert(out.end(), keyframe.second.data.begin(), keyframe.second.data.end());
+
+    out.resize(size_t(keyframe_info.hashes_offset));
+    for (auto hash : _hashes)
+        append_struct(out, hash);
+
+    ofstream file(path, ios::out | ios::binary | ios::trunc);
+    file.write(reinterpret_cast<const char *>(out.data()), out.size());
+    return bool(file);
+}
+
+void nes_replay_runner::prepare(nes_system &system) const
+{
+    system.power_on();
+    system.load_rom(_rom_path.c_str(), nes_rom_exec_mode_reset);
+
+    for (uint32_t player = 0; player < _replay->player_count() && player < NES_MAX_PLAYER; ++player)
+        system.input()->register_input_replay(int(player), _replay, player);
+}
+
+bool nes_replay_runner::embed_keyframes(const char *path, uint32_t interval, uint32_t frames) const
+{
+    if (interval == 0)
+        return false;
+    if (frames == 0)
+        frames = _replay->frame_count();
+
+    nes_system system;
+    prepare(system);
+
+    nes_replay_writer writer(*_replay);
+    writer.set_start_state_hash(system.serialize().hash());
+    writer.set_keyframe_interval(interval);
+    for (uint32_t frame = 0; ; ++frame)
+    {
+        nes_state_blob state = system.serialize();
+        writer.add_frame_hash(state.hash());
+        if (frame % interval == 0)
+            writer.add_keyframe(frame, state);
+
+        if (frame == frames)
+            break;
+        if (!system.run_frame())
+            return false;
+    }
+
+    return writer.save(path);
+}
+
+bool nes_replay_runner::seek(nes_system &system, uint32_t frame) const
+{
+    int keyframe = _replay->find_keyframe(frame);
+    if (keyframe >= 0 && (system.ppu()->frame_count() > frame || _replay->keyframe_frame(keyframe) > system.ppu()->frame_count()))
+    {
+        if (!system.deserialize(_replay->keyframe_state(uint32_t(keyframe))))
+            return false;
+    }
+
+    if (system.ppu()->frame_count() > frame)
+        return false;
+
+    while (system.ppu()->frame_count() < frame)
+    {
+        if (!system.run_frame())
+            return false;
+    }
+
+    return true;
+}
+
+bool nes_replay_runner::verify(uint32_t thread_count, uint32_t &mismatch_frame) const
+{
+    uint32_t keyframe_count = _replay->keyframe_count();
+    uint32_t hashed_frames = _replay->hashed_frame_count();
+    mismatch_frame = 0;
+    if (keyframe_count == 0 || hashed_frames == 0)
+        return false;
+
+    thread_count = max(1u, min(thread_count, keyframe_count));
+    vector<unique_ptr<nes_system>> systems;
+    for (uint32_t i = 0; i < thread_count; ++i)
+    {
+        systems.push_back(make_unique<nes_system>());
+        prepare(*systems.back());
+    }
+
+    atomic<uint32_t> next_keyframe(0);
+    atomic<uint32_t> first_mismatch(UINT32_MAX);
+
+    auto report = [&](uint32_t frame) {
+        uint32_t current = first_mismatch.load();
+        while (frame < current && !first_mismatch.compare_exchange_weak(current, frame))
+        {}
+    };
+
+    auto check_intervals = [&](nes_system &system) {
+        while (true)
+        {
+            uint32_t keyframe = next_keyframe++;
+            if (keyframe >= keyframe_count)
+                return;
+
+            uint32_t frame = _replay->keyframe_frame(keyframe);
+            uint32_t end_frame = (keyframe + 1 < keyframe_count) ? _replay->keyframe_frame(keyframe + 1) : hashed_frames - 1;
+            if (frame >= hashed_frames || end_frame >= hashed_frames)
+            {
+                report(min(frame, hashed_frames));
+                continue;
+            }
+
+            // Intervals after a mismatch don't matter anymore
+            if (frame >= first_mismatch)
+                continue;
+
+            nes_state_blob state = _replay->keyframe_state(keyframe);
+            if (state.hash() != _replay->frame_hash(frame) || !system.deserialize(state))
+            {
+                report(frame);
+                continue;
+            }
+
+            bool matched = true;
+            while (matched && frame < end_frame)
+            {
+                // Emulation stopping counts as not reaching the next frame's state
+                frame++;
+                matched = system.run_frame() && system.serialize().hash() == _replay->frame_hash(frame);
+            }
+
+            if (!matched)
+            {
+                report(frame);
+                continue;
+            }
+
+            // Where the interval ended up is where the next one starts from
+            if (keyframe + 1 < keyframe_count && system.serialize().data != _replay->keyframe_state(keyframe + 1).data)
+                report(end_frame);
+        }
+    };
+
+    vector<thread> threads;
+    for (uint32_t i = 1; i < thread_count; ++i)
+        threads.emplace_back(check_intervals, ref(*systems[i]));
+    check_intervals(*systems[0]);
+    for (auto &t : threads)
+        t.join();
+
+    if (first_mismatch != UINT32_MAX)
+    {
+        mismatch_frame = first_mismatch;
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,160 @@
+#include "stdafx.h"
+#include "nes_rollback.h"
+#include "nes_ppu.h"
+
+#include <algorithm>
+#include <cassert>
+
+nes_rollback_session::nes_rollback_session(nes_system &system, uint32_t window)
+    :_system(system), _window(window), _frame(0), _resimulate_from(NES_ROLLBACK_NO_FRAME), _stats()
+{
+    assert(window >= 1 && window <= NES_ROLLBACK_MAX_WINDOW);
+
+    _system.input()->set_latch_mode(nes_input_latch_mode_manual);
+
+    // States don't change size while the same ROM runs - size the whole ring once
+    size_t state_size = _system.serialize().data.size();
+    _ring.resize(window);
+    for (auto &entry : _ring)
+    {
+        entry.state.data.reserve(state_size);
+        memset(&entry.inputs, 0, sizeof(entry.inputs));
+    }
+}
+
+bool nes_rollback_session::run_frame(uint32_t frame, bool save_state)
+{
+    auto &entry = _ring[frame % _window];
+    if (save_state)
+        _system.serialize(entry.state);
+
+    _system.input()->set_latched_buttons(entry.inputs.buttons);
+    return _system.run_frame();
+}
+
+bool nes_rollback_session::advance(const nes_rollback_inputs &inputs)
+{
+    if (!resimulate())
+        return false;
+
+    _ring[_frame % _window].inputs = inputs;
+    if (!run_frame(_frame, /* save_state = */ true))
+        return false;
+
+    _frame++;
+    return true;
+}
+
+bool nes_rollback_session::correct_inputs(uint32_t frame, const nes_rollback_inputs &corrected)
+{
+    if (frame >= _frame || frame < oldest_frame())
+        return false;
+
+    auto &entry = _ring[frame % _window];
+    if (entry.inputs == corrected)
+    {
+        // Predicted right - nothing to do
+        _stats.unchanged_corrections++;
+        return true;
+    }
+
+    entry.inputs = corrected;
+    _resimulate_from = min(_resimulate_from, frame);
+    return true;
+}
+
+bool nes_rollback_session::rollback_to(uint32_t frame, const nes_rollback_inputs &corrected)
+{
+    return correct_inputs(frame, corrected) && resimulate();
+}
+
+bool nes_rollback_session::resimulate()
+{
+    if (_resimulate_from == NES_ROLLBACK_NO_FRAME)
+        return true;
+
+    uint32_t from = _resimulate_from;
+    _resimulate_from = NES_ROLLBACK_NO_FRAME;
+
+    auto ppu = _system.ppu();
+    ppu->suppress_frames(true);
+
+    // The state at the start of the corrected frame stays - the ones after it are what changes
+    bool ok = _system.deserialize(_ring[from % _window].state);
+    for (uint32_t frame = from; ok && frame < _frame; ++frame)
+        ok = run_frame(frame, /* save_state = */ frame != from);
+
+    ppu->suppress_frames(false);
+
+    uint32_t count = _frame - from;
+    _stats.rollbacks++;
+    _stats.resimulated_frames += count;
+    _stats.max_resimulated_frames = max(_stats.max_resimulated_frames, count);
+
+    return ok;
+}
+
+nes_rollback_loopback::nes_rollback_loopback(nes_rollback_session &peer0, nes_rollback_session &peer1, uint32_t latency)
+    :_latency(latency), _tick(0)
+{
+    assert(latency >= 1 && latency <= peer0.window() && latency <= peer1.window());
+
+    _peers[0] = &peer0;
+    _peers[1] = &peer1;
+    _last_received[0] = _last_received[1] = nes_button_flags_none;
+}
+
+void nes_rollback_loopback::deliver(const message &msg)
+{
+    int receiver = 1 - msg.player;
+    auto &peer = *_peers[receiver];
+
+    // The frame itself gets the real buttons, and every frame after it that was predicted from older
+    // ones gets the new prediction - messages arrive in order, so none of those are confirmed yet
+    for (uint32_t frame = msg.frame; frame < peer.frame(); ++frame)
+    {
+        nes_rollback_inputs corrected = peer.inputs(frame);
+        corrected.buttons[msg.player] = msg.buttons;
+        bool in_window = peer.correct_inputs(frame, corrected);
+        assert(in_window);
+        (void)in_window;
+    }
+
+    _last_received[receiver] = msg.buttons;
+}
+
+bool nes_rollback_loopback::advance(nes_button_flags player0, nes_button_flags player1)
+{
+    while (!_in_flight.empty() && _in_flight.front().deliver_at <= _tick)
+    {
+        deliver(_in_flight.front());
+        _in_flight.pop_front();
+    }
+
+    nes_button_flags local[2] = { player0, player1 };
+    bool ok = true;
+    for (int player = 0; player < 2; ++player)
+    {
+        auto &peer = *_peers[player];
+        nes_rollback_inputs inputs = {};
+        inputs.buttons[player] = local[player];
+        inputs.buttons[1 - player] = _last_received[player];
+
+        uint32_t frame = peer.frame();
+        ok = peer.advance(inputs) && ok;
+        _in_flight.push_back({ frame, player, local[player], _tick + _latency });
+    }
+
+    _tick++;
+    return ok;
+}
+
+bool nes_rollback_loopback::flush()
+{
+    for (auto &msg : _in_flight)
+        deliver(msg);
+    _in_flight.clear();
+
+    bool ok = _peers[0]->resimulate();
+    return _peers[1]->resimulate() && ok;
+}
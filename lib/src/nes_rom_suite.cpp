@@ -0,0 +1,251 @@
+#include "stdafx.h"
+#include "nes_rom_suite.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+namespace
+{
+    static const uint16_t BLARGG_RESULT_ADDR = 0x6000;
+    static const uint16_t BLARGG_TEXT_ADDR = 0x6004;
+    static const uint16_t BLARGG_PPU_RESULT_ADDR = 0xf0;
+    static const uint8_t BLARGG_RUNNING = 0x80;
+
+    bool ends_with(const string &str, const string &suffix)
+    {
+        return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    nes_rom_check check_for(const string &name)
+    {
+        if (name.find("nestest") != string::npos)
+            return nes_rom_check_nestest;
+        if (name.find("blargg_ppu_tests") != string::npos)
+            return nes_rom_check_blargg_ppu;
+        if (name.find("instr_test") != string::npos)
+            return nes_rom_check_blargg;
+        return nes_rom_check_smoke;
+    }
+
+    void find_roms(const string &root, const string &dir, vector<nes_rom_test> &tests)
+    {
+        string dir_path = dir.empty() ? root : root + "/" + dir;
+        vector<pair<string, bool>> entries;        // name, is directory
+
+#ifdef _WIN32
+        WIN32_FIND_DATAA data;
+        HANDLE find = FindFirstFileA((dir_path + "/*").c_str(), &data);
+        if (find == INVALID_HANDLE_VALUE)
+            return;
+        do
+        {
+            entries.emplace_back(data.cFileName, (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0);
+        } while (FindNextFileA(find, &data));
+        FindClose(find);
+#else
+        DIR *handle = opendir(dir_path.c_str());
+        if (!handle)
+            return;
+        while (auto entry = readdir(handle))
+        {
+            struct stat st;
+            string name = entry->d_name;
+            if (stat((dir_path + "/" + name).c_str(), &st) == 0)
+                entries.emplace_back(name, S_ISDIR(st.st_mode));
+        }
+        closedir(handle);
+#endif
+
+        for (auto &entry : entries)
+        {
+            auto &name = entry.first;
+            if (name == "." || name == "..")
+                continue;
+
+            string relative = dir.empty() ? name : dir + "/" + name;
+            if (entry.second)
+                find_roms(root, relative, tests);
+            else if (ends_with(name, ".nes"))
+                tests.push_back({ relative, root + "/" + relative, check_for(relative) });
+        }
+    }
+
+    // blargg's tests print into $6004 too - the first line is usually the name, the rest why it failed
+    string blargg_text(nes_system &system)
+    {
+        string text;
+        for (uint16_t addr = BLARGG_TEXT_ADDR; addr < BLARGG_TEXT_ADDR + 0x100; ++addr)
+        {
+            char ch = char(system.ram()->get_byte(addr));
+            if (ch == 0)
+                break;
+            text += (ch == '\n') ? ' ' : ch;
+        }
+
+        while (!text.empty() && text.back() == ' ')
+            text.pop_back();
+        return text;
+    }
+
+    // Runs until the CPU stops (or frames is reached) - returns false if it didn't stop
+    bool run_until_stop(nes_system &system, uint32_t frames)
+    {
+        while (system.ppu()->frame_count() < frames)
+        {
+            if (!system.run_frame())
+                return true;
+        }
+        return false;
+    }
+
+    void check_result(nes_system &system, const nes_rom_test &test, nes_rom_test_result &result)
+    {
+        auto ram = system.ram();
+        switch (test.check)
+        {
+        case nes_rom_check_nestest :
+        {
+            if (!run_until_stop(system, NES_ROM_SUITE_MAX_FRAMES))
+            {
+                result.detail = "didn't finish";
+                return;
+            }
+
+            uint8_t official = ram->get_byte(0x2);
+            uint8_t unofficial = ram->get_byte(0x3);
+            result.passed = (official == 0 && unofficial == 0);
+            if (!result.passed)
+            {
+                ostringstream detail;
+                detail << "$02 = " << hex << int(official) << ", $03 = " << int(unofficial);
+                result.detail = detail.str();
+            }
+            return;
+        }
+        case nes_rom_check_blargg :
+        {
+            system.cpu()->stop_at_infinite_loop();
+            if (!run_until_stop(system, NES_ROM_SUITE_MAX_FRAMES))
+            {
+                result.detail = "didn't finish";
+                return;
+            }
+
+            uint8_t code = ram->get_byte(BLARGG_RESULT_ADDR);
+            bool has_signature = ram->get_byte(0x6001) == 0xde && ram->get_byte(0x6002) == 0xb0 && ram->get_byte(0x6003) == 0x61;
+            result.passed = (has_signature && code == 0);
+            if (!result.passed)
+            {
+                ostringstream detail;
+                if (!has_signature)
+                    detail << "no result at $6000";
+                else if (code == BLARGG_RUNNING)
+                    detail << "stopped while running";
+                else
+                    detail << "result " << int(code) << ": " << blargg_text(system);
+                result.detail = detail.str();
+            }
+            return;
+        }
+        case nes_rom_check_blargg_ppu :
+        {
+            system.ppu()->stop_after_frame(NES_ROM_SUITE_FIXED_FRAMES);
+            run_until_stop(system, NES_ROM_SUITE_FIXED_FRAMES + 1);
+
+            uint8_t code = ram->get_byte(BLARGG_PPU_RESULT_ADDR);
+            result.passed = (code == 1);
+            if (!result.passed)
+            {
+                ostringstream detail;
+                detail << "$F0 = " << int(code);
+                result.detail = detail.str();
+            }
+            return;
+        }
+        case nes_rom_check_smoke :
+        {
+            result.passed = !run_until_stop(system, NES_ROM_SUITE_FIXED_FRAMES);
+            if (!result.passed)
+                result.detail = "stopped";
+            return;
+        }
+        }
+    }
+}
+
+vector<nes_rom_test> nes_rom_suite::discover(const string &root)
+{
+    vector<nes_rom_test> tests;
+    find_roms(root, "", tests);
+    sort(tests.begin(), tests.end(), [](const nes_rom_test &a, const nes_rom_test &b) { return a.name < b.name; });
+    return tests;
+}
+
+nes_rom_test_result nes_rom_suite::run(const nes_rom_test &test)
+{
+    nes_rom_test_result result = { test, false, "", 0, 0 };
+    auto start = chrono::steady_clock::now();
+
+    try
+    {
+        nes_system system;
+        system.power_on();
+        system.load_rom(test.path.c_str(), test.check == nes_rom_check_nestest ? nes_rom_exec_mode_direct : nes_rom_exec_mode_reset);
+        check_result(system, test, result);
+        result.frames = system.ppu()->frame_count();
+    }
+    catch (std::exception &ex)
+    {
+        result.passed = false;
+        result.detail = string("can't load: ") + ex.what();
+    }
+
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+vector<nes_rom_test_result> nes_rom_suite::run_all(const vector<nes_rom_test> &tests, uint32_t thread_count, result_callback on_result)
+{
+    if (thread_count == 0)
+        thread_count = max(1u, thread::hardware_concurrency());
+    thread_count = max(1u, min(thread_count, uint32_t(tests.size())));
+
+    vector<nes_rom_test_result> results(tests.size());
+    atomic<size_t> next_test(0);
+    mutex callback_lock;
+
+    // Longest tests aren't known up front - threads just take the next one in line
+    auto worker = [&]() {
+        for (size_t i = next_test++; i < tests.size(); i = next_test++)
+        {
+            results[i] = run(tests[i]);
+            if (on_result)
+            {
+                lock_guard<mutex> lock(callback_lock);
+                on_result(results[i]);
+            }
+        }
+    };
+
+    vector<thread> threads;
+    for (uint32_t i = 1; i < thread_count; ++i)
+        threads.emplace_back(worker);
+    worker();
+
+    for (auto &t : threads)
+        t.join();
+
+    return results;
+}
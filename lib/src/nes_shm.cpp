@@ -0,0 +1,295 @@
+#include "stdafx.h"
+#include "nes_shm.h"
+#include "nes_ppu.h"
+
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <thread>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+namespace
+{
+    static const uint32_t NES_SHM_MAGIC = 0x4d53454e;     // NESM
+    static const uint32_t NES_SHM_VERSION = 1;
+    static const uint32_t NES_SHM_SLOT_ALIGNMENT = 64;
+
+    uint32_t slot_size_for(uint32_t frame_size, uint32_t ram_size)
+    {
+        uint32_t size = uint32_t(sizeof(nes_shm_slot)) + frame_size + ram_size;
+        return (size + NES_SHM_SLOT_ALIGNMENT - 1) / NES_SHM_SLOT_ALIGNMENT * NES_SHM_SLOT_ALIGNMENT;
+    }
+
+    // Sleeps while sequence is still value, up to timeout_ms - returns early (and possibly spuriously)
+    // once the other side bumps it. Not a private futex - the other side is another process
+    void wait_on(atomic<uint32_t> &sequence, uint32_t value, int timeout_ms)
+    {
+#ifdef __linux__
+        timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&sequence), FUTEX_WAIT, value, &timeout, nullptr, 0);
+#else
+        (void)sequence;
+        (void)value;
+        (void)timeout_ms;
+        this_thread::sleep_for(chrono::microseconds(50));
+#endif
+    }
+
+    void wake(atomic<uint32_t> &sequence)
+    {
+#ifdef __linux__
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&sequence), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#else
+        (void)sequence;
+#endif
+    }
+
+    // Waits until sequence is odd (owned by the emulator) or even (agent). Gives up after timeout_ms
+    // (never if negative) or once stop is set
+    bool wait_for_owner(atomic<uint32_t> &sequence, bool emulator, int timeout_ms, const atomic<bool> *stop)
+    {
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+        while (true)
+        {
+            uint32_t value = sequence.load(memory_order_acquire);
+            if ((value % 2 == 1) == emulator)
+                return true;
+            if (stop && *stop)
+                return false;
+
+            int slice = NES_SHM_WAIT_SLICE_MS;
+            if (timeout_ms >= 0)
+            {
+                auto remaining = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+                if (remaining <= 0)
+                    return false;
+                slice = int(min<int64_t>(slice, remaining));
+            }
+
+            wait_on(sequence, value, slice);
+        }
+    }
+
+#ifndef _WIN32
+    // Whether name is a transport segment left over from an emulator that didn't get to clean up.
+    // Anything else under that name - a live emulator's segment, or not a transport segment at all -
+    // isn't ours to remove
+    bool is_stale_segment(const char *name)
+    {
+        auto segment = nes_shm_segment::open(name);
+        if (!segment)
+            return false;
+
+        pid_t owner = pid_t(segment->header().owner_pid);
+        return owner > 0 && kill(owner, 0) != 0 && errno == ESRCH;
+    }
+#endif
+}
+
+nes_shm_segment::~nes_shm_segment()
+{
+#ifndef _WIN32
+    if (_data)
+        munmap(_data, _size);
+    if (_owner)
+        shm_unlink(_name.c_str());
+#endif
+}
+
+unique_ptr<nes_shm_segment> nes_shm_segment::create(const char *name, uint32_t slot_count)
+{
+#ifdef _WIN32
+    (void)name;
+    (void)slot_count;
+    return nullptr;
+#else
+    if (slot_count == 0)
+        return nullptr;
+
+    uint32_t frame_size = PPU_SCREEN_X * PPU_SCREEN_Y;
+    uint32_t slot_size = slot_size_for(frame_size, NES_SHM_RAM_SIZE);
+    size_t size = sizeof(nes_shm_header) + size_t(slot_count) * slot_size;
+
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0 && errno == EEXIST && is_stale_segment(name))
+    {
+        shm_unlink(name);
+        fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    }
+    if (fd < 0)
+        return nullptr;
+
+    unique_ptr<nes_shm_segment> segment(new nes_shm_segment());
+    segment->_name = name;
+    segment->_owner = true;
+    if (ftruncate(fd, off_t(size)) != 0)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return nullptr;
+    segment->_data = reinterpret_cast<uint8_t *>(data);
+    segment->_size = size;
+
+    // Fresh shm is zero filled - every slot starts out with the agent, sequence 0
+    auto header = reinterpret_cast<nes_shm_header *>(segment->_data);
+    header->version = NES_SHM_VERSION;
+    header->slot_count = slot_count;
+    header->slot_size = slot_size;
+    header->frame_width = PPU_SCREEN_X;
+    header->frame_height = PPU_SCREEN_Y;
+    header->ram_size = NES_SHM_RAM_SIZE;
+    header->owner_pid = uint32_t(getpid());
+    segment->_header = header;
+
+    // Magic goes last - an agent that maps the segment early doesn't see a half written header
+    reinterpret_cast<atomic<uint32_t> *>(&header->magic)->store(NES_SHM_MAGIC, memory_order_release);
+
+    return segment;
+#endif
+}
+
+unique_ptr<nes_shm_segment> nes_shm_segment::open(const char *name)
+{
+#ifdef _WIN32
+    (void)name;
+    return nullptr;
+#else
+    int fd = shm_open(name, O_RDWR, 0600);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(nes_shm_header))
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    unique_ptr<nes_shm_segment> segment(new nes_shm_segment());
+    segment->_name = name;
+    segment->_size = size_t(st.st_size);
+    void *data = mmap(nullptr, segment->_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return nullptr;
+    segment->_data = reinterpret_cast<uint8_t *>(data);
+
+    auto header = reinterpret_cast<nes_shm_header *>(segment->_data);
+    if (reinterpret_cast<atomic<uint32_t> *>(&header->magic)->load(memory_order_acquire) != NES_SHM_MAGIC || header->version != NES_SHM_VERSION)
+        return nullptr;
+    if (header->slot_count == 0 || header->slot_size != slot_size_for(header->frame_width * header->frame_height, header->ram_size))
+        return nullptr;
+    if ((segment->_size - sizeof(nes_shm_header)) / header->slot_size < header->slot_count)
+        return nullptr;
+    segment->_header = header;
+
+    return segment;
+#endif
+}
+
+void nes_shm_segment::post(uint32_t index, nes_shm_command command, const nes_button_flags (&actions)[NES_MAX_PLAYER])
+{
+    auto &target = slot(index);
+    target.command = command;
+    memcpy(target.actions, actions, sizeof(target.actions));
+
+    target.sequence.fetch_add(1, memory_order_release);
+    wake(target.sequence);
+}
+
+bool nes_shm_segment::wait(uint32_t index, int timeout_ms)
+{
+    return wait_for_owner(slot(index).sequence, /* emulator = */ false, timeout_ms, nullptr);
+}
+
+nes_shm_server::nes_shm_server(shared_ptr<nes_shm_segment> segment, const string &rom_path)
+    :_segment(segment), _stop_requested(false)
+{
+    for (uint32_t i = 0; i < _segment->slot_count(); ++i)
+    {
+        auto system = make_unique<nes_system>();
+        system->power_on();
+        system->load_rom(rom_path.c_str(), nes_rom_exec_mode_reset);
+        system->input()->set_latch_mode(nes_input_latch_mode_manual);
+        _systems.push_back(move(system));
+    }
+
+    _start_state = _systems[0]->serialize();
+}
+
+nes_shm_server::~nes_shm_server()
+{}
+
+void nes_shm_server::run()
+{
+    vector<thread> threads;
+    for (uint32_t i = 0; i < _segment->slot_count(); ++i)
+        threads.emplace_back([this, i] { serve(i); });
+
+    for (auto &t : threads)
+        t.join();
+}
+
+void nes_shm_server::serve(uint32_t index)
+{
+    auto &slot = _segment->slot(index);
+    auto &system = *_systems[index];
+
+    while (wait_for_owner(slot.sequence, /* emulator = */ true, -1, &_stop_requested))
+    {
+        switch (slot.command)
+        {
+        case nes_shm_command_step :
+            for (int player = 0; player < NES_MAX_PLAYER; ++player)
+                system.input()->set_latched_buttons(player, nes_button_flags(slot.actions[player]));
+            observe(index, system.run_frame() ? nes_shm_status_ok : nes_shm_status_stopped);
+            break;
+        case nes_shm_command_reset :
+            system.deserialize(_start_state);
+            observe(index, nes_shm_status_ok);
+            break;
+        case nes_shm_command_close :
+            observe(index, nes_shm_status_closed);
+            return;
+        default :
+            observe(index, nes_shm_status_bad_command);
+            break;
+        }
+    }
+}
+
+void nes_shm_server::observe(uint32_t index, nes_shm_status status)
+{
+    auto &slot = _segment->slot(index);
+    auto &system = *_systems[index];
+    auto snapshot = system.snapshot();
+
+    uint8_t *pixels = _segment->slot_data(index) + sizeof(nes_shm_slot);
+    memcpy(pixels, snapshot.frame_buffer, size_t(snapshot.frame_width) * snapshot.frame_height);
+    memcpy(pixels + size_t(snapshot.frame_width) * snapshot.frame_height, snapshot.cpu_ram, NES_SHM_RAM_SIZE);
+
+    slot.status = status;
+    slot.frame = system.ppu()->frame_count();
+    slot.reward = _reward ? _reward(system) : 0.0f;
+
+    slot.sequence.fetch_add(1, memory_order_release);
+    wake(slot.sequence);
+}
@@ -1,4 +1,5 @@
 #include "stdafx.h"
+#include <cassert>
 #include <cstring>
 
 #include "nes_cpu.h"
@@ -70,11 +71,20 @@ namespace
         return true;
     }
 
-    void push_chunk(vector<uint8_t> &out, uint32_t chunk_id, const vector<uint8_t> &chunk_data)
+    // Chunk header with the size left blank - components serialize straight after it, and end_chunk
+    // fills the size in
+    size_t begin_chunk(vector<uint8_t> &out, uint32_t chunk_id)
     {
         push_u32(out, chunk_id);
-        push_u32(out, uint32_t(chunk_data.size()));
-        out.insert(out.end(), chunk_data.begin(), chunk_data.end());
+        push_u32(out, 0);
+        return out.size();
+    }
+
+    void end_chunk(vector<uint8_t> &out, size_t chunk_start)
+    {
+        uint32_t chunk_size = uint32_t(out.size() - chunk_start);
+        for (int i = 0; i < 4; ++i)
+            out[chunk_start - 4 + i] = uint8_t((chunk_size >> (i * 8)) & 0xff);
     }
 
     bool read_chunk(const uint8_t *data, size_t size, size_t &offset, uint32_t expected_chunk_id, const uint8_t *&chunk, size_t &chunk_size)
@@ -98,20 +108,52 @@ namespace
 
 using namespace std;
 
-nes_system::nes_system()
+nes_dirty_pages::nes_dirty_pages()
+    :ram(RAM_SIZE, NES_DIRTY_RAM_PAGE_SHIFT),
+    vram(PPU_VRAM_SIZE, NES_DIRTY_VRAM_PAGE_SHIFT),
+    oam(PPU_OAM_SIZE, NES_DIRTY_OAM_PAGE_SHIFT)
+{}
+
+nes_system::nes_system(int numa_node)
+{
+    // Everything the constructors below place in the arena
+    size_t frame_pool_size = nes_arena::aligned_size(PPU_SCREEN_X * PPU_SCREEN_Y) * NES_FRAME_POOL_SIZE;
+    size_t ppu_frames_size = nes_arena::aligned_size(PPU_SCREEN_X * PPU_SCREEN_Y) * 2;
+    size_t arena_size =
+        nes_arena::aligned_size(sizeof(nes_memory)) + nes_arena::aligned_size(RAM_SIZE) +
+        nes_arena::aligned_size(sizeof(nes_cpu)) + NES_CPU_BLOCK_CACHE_SIZE +
+        nes_arena::aligned_size(sizeof(nes_ppu)) + nes_arena::aligned_size(PPU_VRAM_SIZE) +
+        nes_arena::aligned_size(PPU_OAM_SIZE) + nes_arena::aligned_size(frame_pool_size) +
+        nes_arena::aligned_size(ppu_frames_size) +
+        nes_arena::aligned_size(sizeof(nes_input));
+
+    _arena = make_unique<nes_arena>(arena_size, numa_node);
+    _ram = _arena->construct<nes_memory>(_arena.get());
+    _cpu = _arena->construct<nes_cpu>(_arena.get());
+    _ppu = _arena->construct<nes_ppu>(_arena.get());
+    _input = _arena->construct<nes_input>();
+    assert(_ram && _cpu && _ppu && _input);
+
+    _components.push_back(_ram);
+    _components.push_back(_cpu);
+    _components.push_back(_ppu);
+    _components.push_back(_input);
+
+    _tracer = nullptr;
+    _perf_enabled = false;
+    _dirty_enabled = false;
+    _perf_step_end = 0;
+    _perf_step_ppu_ticks = 0;
+}
+
+nes_system::~nes_system()
 {
-    _ram = make_unique<nes_memory>();
-    _cpu = make_unique<nes_cpu>();
-    _ppu = make_unique<nes_ppu>();
-    _input = make_unique<nes_input>();
-
-    _components.push_back(_ram.get());
-    _components.push_back(_cpu.get());
-    _components.push_back(_ppu.get());
-    _components.push_back(_input.get());
+    // The arena doesn't know what is in it
+    _input->~nes_input();
+    _ppu->~nes_ppu();
+    _ram->~nes_memory();
+    _cpu->~nes_cpu();
 }
-                         
-nes_system::~nes_system() {}
 
 void nes_system::init()
 {
@@ -127,6 +169,15 @@ void nes_system::power_on()
         comp->power_on(this);
 }
 
+void nes_system::set_tracer(nes_tracer *tracer)
+{
+    _tracer = tracer;
+
+    // Components pick it up at power_on - these are for a system that is already running
+    _cpu->set_tracer(tracer);
+    _ppu->set_tracer(tracer);
+}
+
 void nes_system::reset()
 {
     init();
@@ -136,6 +187,11 @@ void nes_system::reset()
 }
 
 
+nes_frame_ref nes_system::acquire_frame()
+{
+    return _ppu->acquire_frame();
+}
+
 nes_system_snapshot nes_system::snapshot() const
 {
     nes_system_snapshot s{};
@@ -161,28 +217,35 @@ nes_system_snapshot nes_system::snapshot() const
 nes_state_blob nes_system::serialize() const
 {
     nes_state_blob blob;
+    serialize(blob);
+    return blob;
+}
+
+void nes_system::serialize(nes_state_blob &blob) const
+{
+    auto &out = blob.data;
+    out.clear();
 
-    push_u32(blob.data, NES_STATE_MAGIC);
-    push_u32(blob.data, NES_STATE_VERSION);
-    push_u64(blob.data, uint64_t(_master_cycle.count()));
-    blob.data.push_back(_stop_requested ? 1 : 0);
+    push_u32(out, NES_STATE_MAGIC);
+    push_u32(out, NES_STATE_VERSION);
+    push_u64(out, uint64_t(_master_cycle.count()));
+    out.push_back(_stop_requested ? 1 : 0);
 
-    vector<uint8_t> cpu_state;
-    vector<uint8_t> ram_state;
-    vector<uint8_t> ppu_state;
-    vector<uint8_t> input_state;
+    size_t chunk_start = begin_chunk(out, NES_STATE_CHUNK_CPU);
+    _cpu->serialize(out);
+    end_chunk(out, chunk_start);
 
-    _cpu->serialize(cpu_state);
-    _ram->serialize(ram_state);
-    _ppu->serialize(ppu_state);
-    _input->serialize(input_state);
+    chunk_start = begin_chunk(out, NES_STATE_CHUNK_RAM);
+    _ram->serialize(out);
+    end_chunk(out, chunk_start);
 
-    push_chunk(blob.data, NES_STATE_CHUNK_CPU, cpu_state);
-    push_chunk(blob.data, NES_STATE_CHUNK_RAM, ram_state);
-    push_chunk(blob.data, NES_STATE_CHUNK_PPU, ppu_state);
-    push_chunk(blob.data, NES_STATE_CHUNK_INPT, input_state);
+    chunk_start = begin_chunk(out, NES_STATE_CHUNK_PPU);
+    _ppu->serialize(out);
+    end_chunk(out, chunk_start);
 
-    return blob;
+    chunk_start = begin_chunk(out, NES_STATE_CHUNK_INPT);
+    _input->serialize(out);
+    end_chunk(out, chunk_start);
 }
 
 bool nes_system::deserialize(const nes_state_blob &state)
@@ -321,7 +384,7 @@ void nes_system::run_program(vector<uint8_t> &&program, uint16_t addr)
 
 void nes_system::load_rom(const char *rom_path, nes_rom_exec_mode mode)
 {
-    auto mapper = nes_rom_loader::load_from(rom_path);
+    auto mapper = nes_rom_loader::load_from(rom_path, _tracer);
     _ram->load_mapper(mapper);
     _ppu->load_mapper(mapper);
 
@@ -358,10 +421,114 @@ void nes_system::step(nes_cycle_t count)
 {
     _master_cycle += count;
 
+    if (_perf_enabled)
+    {
+        uint64_t start = nes_perf_ticks();
+        if (_perf_step_end)
+            _perf_frame.frontend_ticks += start - _perf_step_end;
+        _perf_step_ppu_ticks = 0;
+
+        _cpu->step_to(_master_cycle);
+
+        // Frame might have rolled over in the middle - it all goes to the new one
+        _perf_step_end = nes_perf_ticks();
+        _perf_frame.cpu_ticks += _perf_step_end - start - _perf_step_ppu_ticks;
+        return;
+    }
+
     // Manually step the individual components instead of all components
     // This saves a loop and also it's kinda stupid to step components that doesn't require stepping in the
     // first place. Such as ram / controller, etc. 
+    // PPU isn't stepped here - see sync_ppu
     _cpu->step_to(_master_cycle);
-    _ppu->step_to(_master_cycle);
+}
+
+bool nes_system::run_frame()
+{
+    uint32_t frame = _ppu->frame_count();
+    while (_ppu->frame_count() == frame)
+    {
+        if (_stop_requested)
+            return false;
+
+        nes_cycle_t frame_end = _ppu->next_frame_cycle();
+        step(frame_end > _master_cycle ? frame_end - _master_cycle : nes_cycle_t(1));
+
+        // CPU would only catch PPU up at the start of its next instruction - do it now so that the
+        // frame is complete by the time we return
+        sync_ppu();
+
+        // That catch-up is already PPU time - it isn't time spent outside of step
+        if (_perf_enabled && _perf_step_end)
+            _perf_step_end = nes_perf_ticks();
+    }
+
+    return true;
+}
+
+void nes_system::sync_ppu()
+{
+    // CPU is always at an instruction boundary (it accounts cycles at the end of instruction) which is
+    // exactly where PPU would be in lockstep when the instruction runs
+    if (_perf_enabled)
+    {
+        uint64_t start = nes_perf_ticks();
+        _ppu->step_to(_cpu->cycle());
+        uint64_t ticks = nes_perf_ticks() - start;
+
+        _perf_frame.ppu_syncs++;
+        _perf_frame.ppu_ticks += ticks;
+        _perf_step_ppu_ticks += ticks;
+        return;
+    }
+
+    _ppu->step_to(_cpu->cycle());
+}
+
+void nes_system::sync_ppu_status()
+{
+    // Games poll PPUSTATUS in a tight loop waiting for VBlank / sprite 0 hit. PPU knows the earliest
+    // cycle any of the flags could flip - until then the flags it has are already current
+    if (_cpu->cycle() >= _ppu->next_status_change_cycle())
+    {
+        if (_perf_enabled)
+            _perf_frame.ppu_status_slow++;
+        sync_ppu();
+    }
+    else if (_perf_enabled)
+    {
+        _perf_frame.ppu_status_fast++;
+    }
+}
+
+void nes_system::enable_perf_counters(bool enable)
+{
+    _perf_enabled = enable;
+    _perf_step_end = 0;
+    _perf_frame.clear(_ppu->frame_count());
+    _perf_last_frame.clear(0);
+}
+
+void nes_system::enable_dirty_tracking(bool enable)
+{
+    _dirty_enabled = enable;
+    _dirty_pages.clear();
+    _ram->track_dirty_pages(enable ? &_dirty_pages.ram : nullptr);
+    _ppu->track_dirty_pages(enable ? &_dirty_pages.vram : nullptr, enable ? &_dirty_pages.oam : nullptr);
+}
+
+void nes_system::clear_dirty_pages()
+{
+    _dirty_pages.clear();
+
+    // Every RAM page is clean again - they need to be flagged for their first write
+    if (_dirty_enabled)
+        _ram->track_dirty_pages(&_dirty_pages.ram);
+}
+
+void nes_system::end_perf_frame(uint32_t next_frame)
+{
+    _perf_last_frame = _perf_frame;
+    _perf_frame.clear(next_frame);
 }
     
@@ -0,0 +1,210 @@
+#include "stdafx.h"
+#include "nes_trace.h"
+
+#include <chrono>
+
+namespace
+{
+    static const uint32_t NES_TRACE_MAGIC = 0x5453454E;    // NEST
+    static const uint32_t NES_TRACE_VERSION = 1;
+
+    template<typename T>
+    void write_value(ofstream &out, T value)
+    {
+        uint8_t bytes[sizeof(T)];
+        for (size_t i = 0; i < sizeof(T); ++i)
+            bytes[i] = uint8_t((uint64_t(value) >> (i * 8)) & 0xff);
+        out.write(reinterpret_cast<const char *>(bytes), sizeof(T));
+    }
+
+    template<typename T>
+    bool read_value(ifstream &in, T &value)
+    {
+        uint8_t bytes[sizeof(T)];
+        if (!in.read(reinterpret_cast<char *>(bytes), sizeof(T)))
+            return false;
+
+        uint64_t v = 0;
+        for (size_t i = 0; i < sizeof(T); ++i)
+            v |= uint64_t(bytes[i]) << (i * 8);
+        value = T(v);
+        return true;
+    }
+
+    bool read_header(ifstream &in)
+    {
+        uint32_t magic = 0, version = 0, record_size = 0;
+        if (!read_value(in, magic) || !read_value(in, version) || !read_value(in, record_size))
+            return false;
+
+        return magic == NES_TRACE_MAGIC && version == NES_TRACE_VERSION && record_size == sizeof(nes_trace_record);
+    }
+
+    atomic<uint64_t> s_next_writer_id(1);
+
+    // Ring of the current thread for the most recently used writer - a thread switching between
+    // writers looks its ring up again in the writer (see nes_trace_writer::find_thread_ring)
+    struct thread_ring_cache
+    {
+        uint64_t writer_id;
+        nes_trace_ring *ring;
+    };
+
+    thread_local thread_ring_cache t_ring_cache = { 0, nullptr };
+}
+
+size_t nes_trace_ring::drain(ofstream &out)
+{
+    uint64_t tail = _tail.load(memory_order_relaxed);
+    uint64_t head = _head.load(memory_order_acquire);
+    if (head == tail)
+        return 0;
+
+    size_t count = size_t(head - tail);
+    write_value(out, _thread_index);
+    write_value(out, uint32_t(count));
+
+    // At most two pieces if it wraps around
+    size_t start = size_t(tail & (NES_TRACE_RING_SIZE - 1));
+    size_t first = min(count, size_t(NES_TRACE_RING_SIZE) - start);
+    out.write(reinterpret_cast<const char *>(&_records[start]), first * sizeof(nes_trace_record));
+    if (first < count)
+        out.write(reinterpret_cast<const char *>(&_records[0]), (count - first) * sizeof(nes_trace_record));
+
+    _tail.store(head, memory_order_release);
+    return count;
+}
+
+nes_trace_writer::nes_trace_writer(const char *file_name)
+{
+    _id = s_next_writer_id++;
+    _stop = false;
+
+    _file.open(file_name, ios::out | ios::binary | ios::trunc);
+    write_value(_file, NES_TRACE_MAGIC);
+    write_value(_file, NES_TRACE_VERSION);
+    write_value(_file, uint32_t(sizeof(nes_trace_record)));
+
+    _thread = thread([this] { drain_loop(); });
+}
+
+nes_trace_writer::~nes_trace_writer()
+{
+    _stop = true;
+    _thread.join();
+
+    _file.close();
+}
+
+void nes_trace_writer::record(const nes_trace_record &record)
+{
+    if (t_ring_cache.writer_id != _id)
+    {
+        t_ring_cache.ring = find_thread_ring();
+        t_ring_cache.writer_id = _id;
+    }
+
+    // Writer is a whole ring behind - wait for it rather than losing records
+    while (!t_ring_cache.ring->push(record))
+        this_thread::yield();
+}
+
+nes_trace_ring *nes_trace_writer::find_thread_ring()
+{
+    lock_guard<mutex> lock(_rings_lock);
+
+    // Same ring every time the thread comes back, so its records stay in one ordered stream
+    auto &ring = _thread_rings[this_thread::get_id()];
+    if (!ring)
+    {
+        _rings.push_back(make_unique<nes_trace_ring>(uint32_t(_rings.size())));
+        ring = _rings.back().get();
+    }
+
+    return ring;
+}
+
+size_t nes_trace_writer::ring_count()
+{
+    lock_guard<mutex> lock(_rings_lock);
+
+    return _rings.size();
+}
+
+bool nes_trace_writer::drain()
+{
+    lock_guard<mutex> lock(_rings_lock);
+
+    size_t count = 0;
+    for (auto &ring : _rings)
+        count += ring->drain(_file);
+
+    return count > 0;
+}
+
+void nes_trace_writer::drain_loop()
+{
+    while (!_stop)
+    {
+        if (!drain())
+            this_thread::sleep_for(chrono::milliseconds(1));
+    }
+
+    // Whatever got recorded before stopping
+    drain();
+}
+
+bool nes_trace_writer::read(const char *file_name, function<void(uint32_t thread_index, const nes_trace_record &record)> callback)
+{
+    ifstream in(file_name, ios::in | ios::binary);
+    if (!read_header(in))
+        return false;
+
+    uint32_t thread_index = 0;
+    while (read_value(in, thread_index))
+    {
+        uint32_t count = 0;
+        if (!read_value(in, count))
+            return false;
+
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            nes_trace_record record;
+            if (!in.read(reinterpret_cast<char *>(&record), sizeof(record)))
+                return false;
+
+            callback(thread_index, record);
+        }
+    }
+
+    return true;
+}
+
+bool nes_trace_writer::read_thread_count(const char *file_name, uint32_t &thread_count)
+{
+    thread_count = 0;
+
+    ifstream in(file_name, ios::in | ios::binary | ios::ate);
+    streamoff size = in.tellg();
+    in.seekg(0);
+    if (!read_header(in))
+        return false;
+
+    // Thread indices are handed out in order, so the count is the highest one plus one
+    uint32_t thread_index = 0;
+    while (read_value(in, thread_index))
+    {
+        uint32_t count = 0;
+        if (!read_value(in, count))
+            return false;
+
+        streamoff end = streamoff(in.tellg()) + streamoff(count) * streamoff(sizeof(nes_trace_record));
+        if (end > size)
+            return false;
+        in.seekg(end);
+
+        thread_count = max(thread_count, thread_index + 1);
+    }
+
+    return true;
+}
@@ -0,0 +1,214 @@
+#include "stdafx.h"
+#include "nes_worker_pool.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace
+{
+#ifdef __linux__
+    // "0-3,8-11" style CPU lists from sysfs
+    vector<int> parse_cpu_list(const string &list)
+    {
+        vector<int> cpus;
+        stringstream stream(list);
+        string range;
+        while (getline(stream, range, ','))
+        {
+            if (range.empty())
+                continue;
+
+            size_t dash = range.find('-');
+            int first = stoi(range.substr(0, dash));
+            int last = (dash == string::npos) ? first : stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; ++cpu)
+                cpus.push_back(cpu);
+        }
+        return cpus;
+    }
+
+    // NUMA node of every CPU sysfs knows about - empty if there is no NUMA information
+    map<int, int> cpu_nodes()
+    {
+        // Node numbers can have gaps
+        static const int MAX_NODES = 64;
+        map<int, int> nodes;
+        for (int node = 0; node < MAX_NODES; ++node)
+        {
+            ifstream file("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+            if (!file)
+                continue;
+
+            string list;
+            getline(file, list);
+            for (int cpu : parse_cpu_list(list))
+                nodes[cpu] = node;
+        }
+        return nodes;
+    }
+#endif
+
+    bool pin_current_thread(int cpu)
+    {
+#ifdef _WIN32
+        if (cpu >= int(sizeof(DWORD_PTR) * 8))
+            return false;
+        return SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu) != 0;
+#elif defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+        (void)cpu;
+        return false;
+#endif
+    }
+}
+
+vector<nes_cpu_core> nes_worker_pool::cores()
+{
+    vector<nes_cpu_core> allowed;
+
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        auto nodes = cpu_nodes();
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (!CPU_ISSET(cpu, &set))
+                continue;
+            auto node = nodes.find(cpu);
+            allowed.push_back({ cpu, node == nodes.end() ? NES_ARENA_ANY_NODE : node->second });
+        }
+    }
+#endif
+
+    if (allowed.empty())
+    {
+        uint32_t count = max(1u, thread::hardware_concurrency());
+        for (uint32_t cpu = 0; cpu < count; ++cpu)
+            allowed.push_back({ int(cpu), NES_ARENA_ANY_NODE });
+    }
+
+    // Round robin between nodes - the nth CPU of every node, then the n+1th, ...
+    map<int, vector<nes_cpu_core>> by_node;
+    for (auto &core : allowed)
+        by_node[core.node].push_back(core);
+
+    vector<nes_cpu_core> ordered;
+    for (size_t i = 0; ordered.size() < allowed.size(); ++i)
+    {
+        for (auto &node : by_node)
+        {
+            if (i < node.second.size())
+                ordered.push_back(node.second[i]);
+        }
+    }
+    return ordered;
+}
+
+nes_worker_pool::nes_worker_pool(uint32_t worker_count, bool pin)
+    :_pin(pin), _stop(false), _pending(0)
+{
+    auto all_cores = cores();
+    if (worker_count == 0)
+        worker_count = uint32_t(all_cores.size());
+
+    // More workers than CPUs share them, same order again
+    for (uint32_t i = 0; i < worker_count; ++i)
+    {
+        auto w = make_unique<worker>();
+        w->core = all_cores[i % all_cores.size()];
+        _workers.push_back(move(w));
+    }
+
+    for (auto &w : _workers)
+    {
+        worker *p = w.get();
+        w->handle = thread([this, p] { worker_loop(*p); });
+    }
+}
+
+nes_worker_pool::~nes_worker_pool()
+{
+    wait();
+
+    _stop = true;
+    for (auto &w : _workers)
+    {
+        // Taking the lock makes sure the worker is either waiting already or sees _stop
+        lock_guard<mutex> guard(w->lock);
+        w->wake.notify_one();
+    }
+
+    for (auto &w : _workers)
+        w->handle.join();
+}
+
+void nes_worker_pool::run(uint32_t worker, task fn)
+{
+    {
+        lock_guard<mutex> guard(_pending_lock);
+        _pending++;
+    }
+
+    auto &w = *_workers[worker];
+    {
+        lock_guard<mutex> guard(w.lock);
+        w.tasks.push_back(move(fn));
+    }
+    w.wake.notify_one();
+}
+
+void nes_worker_pool::wait()
+{
+    unique_lock<mutex> guard(_pending_lock);
+    _idle.wait(guard, [this] { return _pending == 0; });
+}
+
+void nes_worker_pool::task_done()
+{
+    bool idle;
+    {
+        lock_guard<mutex> guard(_pending_lock);
+        idle = (--_pending == 0);
+    }
+    if (idle)
+        _idle.notify_all();
+}
+
+void nes_worker_pool::worker_loop(worker &w)
+{
+    // Pinned before anything runs, so that everything the tasks allocate is first touched here
+    if (_pin)
+        pin_current_thread(w.core.cpu);
+
+    while (true)
+    {
+        task fn;
+        {
+            unique_lock<mutex> guard(w.lock);
+            w.wake.wait(guard, [&] { return _stop || !w.tasks.empty(); });
+            if (w.tasks.empty())
+                return;
+
+            fn = move(w.tasks.front());
+            w.tasks.pop_front();
+        }
+
+        fn();
+        task_done();
+    }
+}
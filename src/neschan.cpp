@@ -3,17 +3,32 @@
 
 #include "stdafx.h"
 #include "neschan.h"
+#include "nes_recorder.h"
+#include "nes_replay.h"
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <map>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <thread>
+
+#ifdef _WIN32
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
 
 using namespace std;
 
-inline uint32_t make_argb(uint8_t r, uint8_t g, uint8_t b)
-{
-    return (r << 16) | (g << 8) | b;
-}
+// Frames --bench runs when --max-frames isn't given
+#define NESCHAN_BENCH_DEFAULT_FRAMES 600
+
+// Emulation gives up on catching up once it is this many frames behind the wall clock
+#define NESCHAN_MAX_LAG_FRAMES 3
 
 #define JOYSTICK_DEADZONE 8000
 
@@ -141,12 +156,73 @@ const SDL_GameControllerButton sdl_game_controller::s_buttons[] = {
     SDL_CONTROLLER_BUTTON_DPAD_RIGHT
 };
 
+//
+// SDL input can only be polled on the main (render) thread. It samples the controllers every time
+// around its loop and the emulation thread reads whatever the latest sample is
+//
+class latched_input_device : public nes_input_device
+{
+public :
+    latched_input_device(shared_ptr<nes_input_device> source)
+        :_source(source), _flags(nes_button_flags_none)
+    {}
+
+    void sample() { _flags = _source->poll_status(); }
+
+    virtual nes_button_flags poll_status() { return nes_button_flags(_flags.load()); }
+
+private :
+    shared_ptr<nes_input_device> _source;
+    atomic<uint8_t> _flags;
+};
+
+//
+// Keeps emulation at the speed of a real NES by sleeping until the wall clock catches up with emulated
+// time. It never tries to make up for more than NESCHAN_MAX_LAG_FRAMES - if it falls further behind
+// (slow machine, window being dragged, debugger) the lost time is forgotten rather than fast forwarded
+// through. There is no audio output yet - once there is, the audio device's position is the clock to
+// pace against instead of steady_clock
+//
+class frame_pacer
+{
+public :
+    void start(nes_cycle_t emulated)
+    {
+        _origin = chrono::steady_clock::now();
+        _origin_cycle = emulated;
+    }
+
+    void wait(nes_cycle_t emulated)
+    {
+        auto elapsed = chrono::duration<double>(double((emulated - _origin_cycle).count()) / NES_CLOCK_HZ);
+        auto target = _origin + chrono::duration_cast<chrono::steady_clock::duration>(elapsed);
+
+        auto max_lag = chrono::duration<double>(NESCHAN_MAX_LAG_FRAMES * double(PPU_SCANLINE_CYCLE.count() * PPU_SCANLINE_COUNT) / NES_CLOCK_HZ);
+        if (chrono::steady_clock::now() > target + chrono::duration_cast<chrono::steady_clock::duration>(max_lag))
+        {
+            start(emulated);
+            return;
+        }
+
+        this_thread::sleep_until(target);
+    }
+
+private :
+    chrono::steady_clock::time_point _origin;
+    nes_cycle_t _origin_cycle;
+};
+
 struct app_options
 {
     const char *rom_path = nullptr;
     const char *replay_log_path = nullptr;
+    const char *record_path = nullptr;
     bool headless = false;
+    bool vsync = false;
+    bool bench = false;
+    bool state_hash = false;
     int max_frames = -1;
+    int seek_frame = -1;
 };
 
 bool parse_args(int argc, char *argv[], app_options &options)
@@ -163,14 +239,35 @@ bool parse_args(int argc, char *argv[], app_options &options)
         {
             options.headless = true;
         }
+        else if (arg == "--vsync")
+        {
+            options.vsync = true;
+        }
+        else if (arg == "--bench")
+        {
+            options.bench = true;
+            options.headless = true;
+        }
+        else if (arg == "--state-hash")
+        {
+            options.state_hash = true;
+        }
         else if (arg == "--replay" && i + 1 < argc)
         {
             options.replay_log_path = argv[++i];
         }
+        else if (arg == "--record" && i + 1 < argc)
+        {
+            options.record_path = argv[++i];
+        }
         else if (arg == "--max-frames" && i + 1 < argc)
         {
             options.max_frames = atoi(argv[++i]);
         }
+        else if (arg == "--seek" && i + 1 < argc)
+        {
+            options.seek_frame = atoi(argv[++i]);
+        }
         else
         {
             return false;
@@ -221,13 +318,87 @@ bool parse_replay_log(const char *path, vector<nes_button_flags> &stream)
     return true;
 }
 
+size_t peak_rss_bytes()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return counters.PeakWorkingSetSize;
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return size_t(usage.ru_maxrss);
+#else
+    return size_t(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+//
+// --bench: runs frames back to back as fast as possible (no SDL, no pacing) and prints JSON with
+// throughput, speed relative to a real NES, frame time percentiles and peak RSS
+//
+int run_bench(nes_system &system, const app_options &options)
+{
+    int max_frames = options.max_frames >= 0 ? options.max_frames : NESCHAN_BENCH_DEFAULT_FRAMES;
+
+    vector<double> frame_ms;
+    frame_ms.reserve(max_frames);
+
+    // Only what runs from here on - --seek may have run frames already
+    nes_cycle_t start_cycle = system.cpu()->cycle();
+
+    auto start = chrono::steady_clock::now();
+    auto frame_start = start;
+    for (int i = 0; i < max_frames; ++i)
+    {
+        if (!system.run_frame())
+            break;
+
+        auto frame_end = chrono::steady_clock::now();
+        frame_ms.push_back(chrono::duration<double, milli>(frame_end - frame_start).count());
+        frame_start = frame_end;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    double emulated_seconds = double((system.cpu()->cycle() - start_cycle).count()) / NES_CLOCK_HZ;
+
+    auto percentile = [&frame_ms](double p) {
+        if (frame_ms.empty())
+            return 0.0;
+        size_t index = min(frame_ms.size() - 1, size_t(p * frame_ms.size()));
+        nth_element(frame_ms.begin(), frame_ms.begin() + index, frame_ms.end());
+        return frame_ms[index];
+    };
+
+    cout << setprecision(3) << fixed;
+    cout << "{\"rom\": \"" << options.rom_path << "\"";
+    cout << ", \"frames\": " << frame_ms.size();
+    cout << ", \"seconds\": " << seconds;
+    cout << ", \"frames_per_sec\": " << frame_ms.size() / seconds;
+    cout << ", \"speed\": " << emulated_seconds / seconds;
+    cout << ", \"frame_ms_p50\": " << percentile(0.50);
+    cout << ", \"frame_ms_p99\": " << percentile(0.99);
+    cout << ", \"peak_rss_bytes\": " << peak_rss_bytes();
+    if (options.state_hash)
+        cout << ", \"state_hash\": \"" << hex << setw(16) << setfill('0') << system.serialize().hash() << dec << "\"";
+    cout << "}" << endl;
+
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     app_options options;
     if (!parse_args(argc, argv, options))
     {
-        cout << "Usage: neschan <rom_file_path> [--replay <input_log>] [--headless] [--max-frames <n>]" << endl;
+        cout << "Usage: neschan <rom_file_path> [--replay <input_log | replay_file>] [--headless] [--vsync] [--max-frames <n>] [--record <path>] [--seek <frame>]" << endl;
+        cout << "       neschan <rom_file_path> --bench [--replay <input_log | replay_file>] [--max-frames <n>] [--state-hash]" << endl;
         cout << "Input log format: <frame_index> <button_flags> (e.g. '120 0x08' for W/UP)." << endl;
+        cout << "--seek starts a binary replay at the given frame - from its nearest keyframe if it has any." << endl;
+        cout << "Recording: *.y4m video, *.rgb or '-' (stdout) raw RGB24, anything else a frame archive." << endl;
         return -1;
     }
 
@@ -248,9 +419,16 @@ int main(int argc, char *argv[])
 
     if (!options.headless)
     {
-        SDL_CreateWindowAndRenderer(PPU_SCREEN_X * 2, PPU_SCREEN_Y * 2, SDL_WINDOW_SHOWN, &sdl_window, &sdl_renderer);
+        sdl_window = SDL_CreateWindow(
+            "NESChan v0.1 by yizhang82",
+            SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+            PPU_SCREEN_X * 2, PPU_SCREEN_Y * 2,
+            SDL_WINDOW_SHOWN);
 
-        SDL_SetWindowTitle(sdl_window, "NESChan v0.1 by yizhang82");
+        Uint32 renderer_flags = SDL_RENDERER_ACCELERATED;
+        if (options.vsync)
+            renderer_flags |= SDL_RENDERER_PRESENTVSYNC;
+        sdl_renderer = SDL_CreateRenderer(sdl_window, -1, renderer_flags);
 
         SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");  // make the scaled rendering look smoother.
         SDL_RenderSetLogicalSize(sdl_renderer, PPU_SCREEN_X, PPU_SCREEN_Y);
@@ -265,6 +443,7 @@ int main(int argc, char *argv[])
     INIT_TRACE("neschan.log");
 
     nes_system system;
+    system.set_tracer(&nes_tracer::get());
 
     system.power_on();
 
@@ -282,102 +461,160 @@ int main(int argc, char *argv[])
         return -1;
     }
 
-    vector<uint32_t> pixels(PPU_SCREEN_Y * PPU_SCREEN_X);
-
-    static uint32_t palette[] =
-    {
-        make_argb(84,  84,  84),    make_argb(0,  30, 116),    make_argb(8,  16, 144),    make_argb(48,   0, 136),   make_argb(68,   0, 100),   make_argb(92,   0,  48),   make_argb(84,   4,   0),   make_argb(60,  24,   0),   make_argb(32,  42,   0),   make_argb(8,  58,   0),   make_argb(0,  64,   0),    make_argb(0,  60,   0),    make_argb(0,  50,  60),    make_argb(0,   0,   0),   make_argb(0, 0, 0), make_argb(0, 0, 0),
-        make_argb(152, 150, 152),   make_argb(8,  76, 196),    make_argb(48,  50, 236),   make_argb(92,  30, 228),   make_argb(136,  20, 176),  make_argb(160,  20, 100),  make_argb(152,  34,  32),  make_argb(120,  60,   0),  make_argb(84,  90,   0),   make_argb(40, 114,   0),  make_argb(8, 124,   0),    make_argb(0, 118,  40),    make_argb(0, 102, 120),    make_argb(0,   0,   0),   make_argb(0, 0, 0), make_argb(0, 0, 0),
-        make_argb(236, 238, 236),   make_argb(76, 154, 236),   make_argb(120, 124, 236),  make_argb(176,  98, 236),  make_argb(228,  84, 236),  make_argb(236,  88, 180),  make_argb(236, 106, 100),  make_argb(212, 136,  32),  make_argb(160, 170,   0),  make_argb(116, 196,   0), make_argb(76, 208,  32),   make_argb(56, 204, 108),   make_argb(56, 180, 204),   make_argb(60,  60,  60),  make_argb(0, 0, 0), make_argb(0, 0, 0),
-        make_argb(236, 238, 236),   make_argb(168, 204, 236),  make_argb(188, 188, 236),  make_argb(212, 178, 236),  make_argb(236, 174, 236),  make_argb(236, 174, 212),  make_argb(236, 180, 176),  make_argb(228, 196, 144),  make_argb(204, 210, 120),  make_argb(180, 222, 120), make_argb(168, 226, 144),  make_argb(152, 226, 180),  make_argb(160, 214, 228),  make_argb(160, 162, 160), make_argb(0, 0, 0), make_argb(0, 0, 0)
-    };
-    assert(sizeof(palette) == sizeof(uint32_t) * 0x40);
-
     vector<nes_button_flags> replay_stream;
+    vector<shared_ptr<latched_input_device>> input_latches;
+    shared_ptr<nes_replay> replay;
     if (options.replay_log_path != nullptr)
     {
-        if (!parse_replay_log(options.replay_log_path, replay_stream))
+        // Binary replays (neschan_replay convert) are mapped and read in place - anything else is a
+        // text log
+        replay = nes_replay::open(options.replay_log_path);
+        if (replay)
         {
-            cerr << "Failed to open replay log: " << options.replay_log_path << endl;
-            return -1;
+            auto &header = replay->header();
+            if (header.rom_hash != 0 && header.rom_hash != nes_replay::hash_file(options.rom_path))
+                cerr << "[NESCHAN] Warning: replay was recorded with a different ROM" << endl;
+            if (header.start_state_hash != 0 && header.start_state_hash != system.serialize().hash())
+                cerr << "[NESCHAN] Warning: replay was recorded from a different start state" << endl;
+
+            for (uint32_t player = 0; player < replay->player_count() && player < NES_MAX_PLAYER; ++player)
+                system.input()->register_input_replay(int(player), replay, player);
         }
+        else
+        {
+            if (!parse_replay_log(options.replay_log_path, replay_stream))
+            {
+                cerr << "Failed to open replay log: " << options.replay_log_path << endl;
+                return -1;
+            }
 
-        system.input()->register_input_stream(0, replay_stream);
+            system.input()->register_input_stream(0, replay_stream);
+        }
     }
-    else
+    else if (!options.headless)
     {
         int num_joysticks = SDL_NumJoysticks();
         NES_LOG("[NESCHAN] " << num_joysticks << " JoySticks detected.");
         if (num_joysticks == 0)
         {
-            system.input()->register_input(0, std::make_shared<sdl_keyboard_controller>());
+            input_latches.push_back(make_shared<latched_input_device>(make_shared<sdl_keyboard_controller>()));
         }
         else
         {
-            for (int i = 0; i < num_joysticks; i++)
-            {
-                if (i < NES_MAX_PLAYER)
-                    system.input()->register_input(i, std::make_shared<sdl_game_controller>(i));
-            }
+            for (int i = 0; i < num_joysticks && i < NES_MAX_PLAYER; i++)
+                input_latches.push_back(make_shared<latched_input_device>(make_shared<sdl_game_controller>(i)));
         }
+
+        for (size_t i = 0; i < input_latches.size(); ++i)
+            system.input()->register_input(int(i), input_latches[i]);
     }
 
-    SDL_Event sdl_event;
-    Uint64 prev_counter = SDL_GetPerformanceCounter();
-    Uint64 count_per_second = SDL_GetPerformanceFrequency();
+    if (options.seek_frame >= 0)
+    {
+        if (!replay)
+        {
+            cerr << "--seek needs a binary replay (neschan_replay convert)" << endl;
+            return -1;
+        }
+
+        nes_replay_runner runner(replay, options.rom_path);
+        if (!runner.seek(system, uint32_t(options.seek_frame)))
+        {
+            cerr << "Failed to seek replay to frame " << options.seek_frame << endl;
+            return -1;
+        }
+    }
 
-    const nes_cycle_t cpu_cycles_per_frame = nes_cycle_t(NES_CLOCK_HZ / 60);
-    int frame_index = 0;
+    if (options.bench)
+    {
+        int result = run_bench(system, options);
+        system.input()->unregister_all_inputs();
+        SDL_Quit();
+        return result;
+    }
 
     //
-    // Game main loop
+    // Frames are handed to the recorder's writer thread as they complete. It never holds emulation
+    // up - if it can't keep up frames get dropped, and that gets reported
     //
-    bool quit = false;
-    while (!quit)
+    unique_ptr<nes_frame_recorder> recorder;
+    if (options.record_path != nullptr)
     {
-        if (!options.headless)
+        recorder = make_unique<nes_frame_recorder>(nes_frame_sink::create(options.record_path), PPU_SCREEN_X, PPU_SCREEN_Y);
+    }
+
+    auto record_frame = [&] {
+        if (!recorder)
+            return;
+
+        auto ppu = system.ppu();
+        if (!recorder->record(ppu->frame_count(), ppu->frame_buffer()) && recorder->dropped_count() == 1 && !recorder->failed())
+            cerr << "[NESCHAN] Recording can't keep up - dropping frames" << endl;
+    };
+
+    if (options.headless)
+    {
+        // Nothing to show - frames back to back
+        for (int frame_index = 0; options.max_frames < 0 || frame_index < options.max_frames; ++frame_index)
         {
-            while (SDL_PollEvent(&sdl_event) != 0)
+            if (!system.run_frame())
+                break;
+
+            record_frame();
+        }
+    }
+    else
+    {
+        //
+        // Emulation runs a whole frame at a time on its own thread and PPU publishes each completed
+        // frame. Main thread owns SDL - it handles events, samples input and presents whatever the
+        // latest frame is (read in place via acquire_frame), so a frame is on screen (and new input is
+        // seen) at most one frame later
+        //
+        vector<uint32_t> pixels(PPU_SCREEN_X * PPU_SCREEN_Y);
+        uint64_t presented_sequence = 0;
+        atomic<bool> quit(false);
+
+        thread emulation([&] {
+            frame_pacer pacer;
+            pacer.start(system.cpu()->cycle());
+
+            for (int frame_index = 0; !quit; ++frame_index)
             {
-                switch (sdl_event.type)
-                {
-                    case SDL_QUIT:
-                        quit = true;
-                        break;
-                }
+                if (options.max_frames >= 0 && frame_index >= options.max_frames)
+                    break;
+                if (!system.run_frame())
+                    break;
+
+                record_frame();
+                pacer.wait(system.cpu()->cycle());
             }
-        }
 
-        nes_cycle_t cpu_cycles = cpu_cycles_per_frame;
-        if (!options.headless)
+            quit = true;
+        });
+
+        SDL_Event sdl_event;
+        while (!quit)
         {
-            Uint64 cur_counter = SDL_GetPerformanceCounter();
-            Uint64 delta_ticks = cur_counter - prev_counter;
-            prev_counter = cur_counter;
-            if (delta_ticks == 0)
-                delta_ticks = 1;
-            cpu_cycles = ms_to_nes_cycle((double)delta_ticks * 1000 / count_per_second);
-
-            // Avoids a scenario where the loop keeps getting longer
-            if (cpu_cycles > nes_cycle_t(NES_CLOCK_HZ))
-                cpu_cycles = nes_cycle_t(NES_CLOCK_HZ);
-        }
+            while (SDL_PollEvent(&sdl_event) != 0)
+            {
+                if (sdl_event.type == SDL_QUIT)
+                    quit = true;
+            }
 
-        for (nes_cycle_t i = nes_cycle_t(0); i < cpu_cycles; ++i)
-            system.step(nes_cycle_t(1));
+            for (auto &latch : input_latches)
+                latch->sample();
 
-        if (!options.headless)
-        {
-            uint32_t *cur_pixel = pixels.data();
-            uint8_t *frame_buffer = system.ppu()->frame_buffer();
-            for (int y = 0; y < PPU_SCREEN_Y; ++y)
+            if (system.ppu()->latest_frame_sequence() == presented_sequence)
             {
-                for (int x = 0; x < PPU_SCREEN_X; ++x)
-                {
-                    *cur_pixel = palette[(*frame_buffer & 0xff)];
-                    frame_buffer++;
-                    cur_pixel++;
-                }
+                SDL_Delay(1);
+                continue;
+            }
+
+            {
+                nes_frame_ref frame = system.acquire_frame();
+                nes_ppu::frame_to_argb(frame.pixels(), pixels.data());
+                presented_sequence = frame.sequence();
             }
 
             SDL_UpdateTexture(sdl_texture, NULL, pixels.data(), PPU_SCREEN_X * sizeof(uint32_t));
@@ -386,9 +623,19 @@ int main(int argc, char *argv[])
             SDL_RenderPresent(sdl_renderer);
         }
 
-        frame_index++;
-        if (options.max_frames >= 0 && frame_index >= options.max_frames)
-            quit = true;
+        emulation.join();
+    }
+
+    if (recorder)
+    {
+        bool succeeded = recorder->stop();
+        cerr << "[NESCHAN] Recorded " << recorder->recorded_count() << " frames to " << options.record_path;
+        if (recorder->dropped_count() > 0)
+            cerr << " (" << recorder->dropped_count() << " dropped)";
+        cerr << endl;
+
+        if (!succeeded)
+            cerr << "[NESCHAN] Failed to write recording to " << options.record_path << endl;
     }
 
     system.input()->unregister_all_inputs();
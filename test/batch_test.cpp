@@ -0,0 +1,123 @@
+#include "stdafx.h"
+
+#include "doctest.h"
+#include "nes_trace.h"
+#include "nes_system.h"
+#include "nes_input.h"
+#include "nes_worker_pool.h"
+#include "nes_batch.h"
+
+#include <atomic>
+#include <thread>
+
+using namespace std;
+
+namespace
+{
+    const char *BATCH_ROM = "./roms/color_test/color_test.nes";
+    const uint32_t BATCH_FRAMES = 8;
+
+    nes_button_flags buttons_at(uint32_t frame)
+    {
+        return (frame % 3 == 1) ? nes_button_flags_right : nes_button_flags_none;
+    }
+}
+
+TEST_CASE("batch_tests") {
+    SUBCASE("worker_pool") {
+        INIT_TRACE("neschan.batch.pool.log");
+        cout << "Running [BATCH][worker_pool]..." << endl;
+
+        nes_worker_pool pool(3);
+        REQUIRE(pool.worker_count() == 3);
+        CHECK(nes_worker_pool::cores().size() >= 1);
+
+        // Every task of a worker runs on the same thread, and in order
+        const int TASKS = 50;
+        vector<vector<thread::id>> ids(pool.worker_count());
+        vector<vector<int>> order(pool.worker_count());
+        for (int i = 0; i < TASKS; ++i)
+        {
+            for (uint32_t w = 0; w < pool.worker_count(); ++w)
+            {
+                pool.run(w, [&, w, i] {
+                    ids[w].push_back(this_thread::get_id());
+                    order[w].push_back(i);
+                });
+            }
+        }
+        pool.wait();
+
+        for (uint32_t w = 0; w < pool.worker_count(); ++w)
+        {
+            REQUIRE(ids[w].size() == TASKS);
+            CHECK(ids[w][0] != this_thread::get_id());
+            for (int i = 0; i < TASKS; ++i)
+            {
+                CHECK(ids[w][i] == ids[w][0]);
+                CHECK(order[w][i] == i);
+            }
+            if (w > 0)
+                CHECK(ids[w][0] != ids[w - 1][0]);
+        }
+
+        // wait with nothing queued returns right away
+        pool.wait();
+    }
+    SUBCASE("runner") {
+        INIT_TRACE("neschan.batch.runner.log");
+        cout << "Running [BATCH][runner]..." << endl;
+
+        nes_system reference;
+        reference.power_on();
+        reference.load_rom(BATCH_ROM, nes_rom_exec_mode_reset);
+        reference.input()->set_latch_mode(nes_input_latch_mode_manual);
+        nes_button_flags buttons[NES_MAX_PLAYER] = {};
+        for (uint32_t frame = 0; frame < BATCH_FRAMES; ++frame)
+        {
+            buttons[0] = buttons_at(frame);
+            reference.input()->set_latched_buttons(buttons);
+            REQUIRE(reference.run_frame());
+        }
+        uint64_t expected_hash = reference.serialize().hash();
+
+        nes_worker_pool pool(2);
+        nes_batch_runner runner(pool, BATCH_ROM, 5);
+        REQUIRE(runner.instance_count() == 5);
+
+        for (uint32_t frame = 0; frame < BATCH_FRAMES; ++frame)
+        {
+            buttons[0] = buttons_at(frame);
+            for (uint32_t i = 0; i < runner.instance_count(); ++i)
+                runner.set_buttons(i, buttons);
+            REQUIRE(runner.run_frames(1));
+        }
+
+        for (uint32_t i = 0; i < runner.instance_count(); ++i)
+            CHECK(runner.system(i).serialize().hash() == expected_hash);
+
+        // Instances stay on their worker, and their memory came from it
+        vector<thread::id> worker_ids(pool.worker_count());
+        for (uint32_t w = 0; w < pool.worker_count(); ++w)
+        {
+            pool.run(w, [&, w] { worker_ids[w] = this_thread::get_id(); });
+        }
+        pool.wait();
+
+        vector<thread::id> ran_on(runner.instance_count());
+        vector<int> nodes(runner.instance_count());
+        runner.for_each([&](uint32_t i, nes_system &system) {
+            ran_on[i] = this_thread::get_id();
+            nodes[i] = system.arena().numa_node();
+        });
+        for (uint32_t i = 0; i < runner.instance_count(); ++i)
+        {
+            CHECK(runner.worker_of(i) == i % pool.worker_count());
+            CHECK(ran_on[i] == worker_ids[runner.worker_of(i)]);
+            CHECK(nodes[i] == pool.worker_core(runner.worker_of(i)).node);
+        }
+
+        // Bad ROMs throw on the calling thread
+        CHECK_THROWS(nes_batch_runner(pool, "./roms/does_not_exist.nes", 2));
+    }
+}
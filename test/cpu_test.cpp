@@ -5,10 +5,14 @@
 #include "nes_mapper.h"
 #include "nes_system.h"
 
+#include <cctype>
+#include <thread>
+
 using namespace std;
 
 TEST_CASE("CPU tests") {
     nes_system system;
+    system.set_tracer(&nes_tracer::get());
 
     SUBCASE("simple") {
         INIT_TRACE("neschan.instrtest.simple.log");
@@ -81,6 +85,147 @@ TEST_CASE("CPU tests") {
         CHECK(cpu->peek(0x2) == 0);
         CHECK(cpu->peek(0x3) == 0);
     }
+#if NES_TRACE_MAX_LEVEL >= 4
+    SUBCASE("nestest_binary_trace") {
+        INIT_TRACE("neschan.instrtest.binary_trace.log");
+        INIT_TRACE_BINARY("neschan.instrtest.binary_trace.bin");
+        cout << "Running [CPU][nestest_binary_trace]..." << endl;
+
+        system.power_on();
+        system.run_rom("./roms/nestest/nestest.nes", nes_rom_exec_mode_direct);
+        nes_tracer::get().stop_binary();
+
+        vector<string> rendered;
+        uint32_t max_thread_index = 0;
+        CHECK(nes_trace_writer::read("neschan.instrtest.binary_trace.bin", [&](uint32_t thread_index, const nes_trace_record &record) {
+            max_thread_index = max(max_thread_index, thread_index);
+            rendered.push_back(nes_cpu::format_trace_record(record));
+        }));
+        CHECK(max_thread_index == 0);
+
+        ifstream baseline("./roms/nestest/nestest.baseline");
+        vector<string> expected;
+        string line;
+        while (getline(baseline, line))
+        {
+            if (!line.empty() && line[0] != '#')
+                expected.push_back(line);
+        }
+
+        REQUIRE(rendered.size() >= expected.size());
+        int mismatch = 0;
+        for (size_t i = 0; i < expected.size(); ++i)
+        {
+            // APU registers ($4000~$4017) aren't emulated
+            size_t apu = expected[i].find(" $40");
+            if (apu != string::npos && apu + 6 < expected[i].size() && expected[i][apu + 6] == ' ')
+                continue;
+            if (rendered[i] != expected[i])
+                mismatch++;
+        }
+        CHECK(mismatch == 0);
+    }
+    SUBCASE("per_system_tracer") {
+        INIT_TRACE("neschan.instrtest.per_system_tracer.log");
+        cout << "Running [CPU][per_system_tracer]..." << endl;
+
+        // Two systems on their own threads, each tracing into its own files
+        const int SYSTEM_COUNT = 2;
+        nes_tracer tracers[SYSTEM_COUNT];
+        vector<thread> threads;
+        for (int i = 0; i < SYSTEM_COUNT; ++i)
+        {
+            string name = "neschan.instrtest.per_system_tracer." + to_string(i);
+            tracers[i].init((name + ".log").c_str());
+            tracers[i].set_level(nes_tracer_level_diag);
+            tracers[i].init_binary((name + ".bin").c_str());
+
+            threads.emplace_back([&tracers, i] {
+                nes_system system;
+                system.set_tracer(&tracers[i]);
+                system.power_on();
+                system.run_rom("./roms/nestest/nestest.nes", nes_rom_exec_mode_direct);
+            });
+        }
+
+        for (auto &t : threads)
+            t.join();
+
+        vector<vector<string>> rendered(SYSTEM_COUNT);
+        vector<size_t> text_lines(SYSTEM_COUNT);
+        for (int i = 0; i < SYSTEM_COUNT; ++i)
+        {
+            string name = "neschan.instrtest.per_system_tracer." + to_string(i);
+            tracers[i].stop_binary();
+            CHECK(nes_trace_writer::read((name + ".bin").c_str(), [&](uint32_t, const nes_trace_record &record) {
+                rendered[i].push_back(nes_cpu::format_trace_record(record));
+            }));
+
+            // Lines get flushed as they are written
+            ifstream log(name + ".log");
+            string line;
+            while (getline(log, line))
+            {
+                // Instructions start with PC - the rest is "[NES_PPU] ..." etc
+                if (!line.empty() && isxdigit(line[0]))
+                    text_lines[i]++;
+            }
+        }
+
+        // Same instructions in both, nothing interleaved from the other system
+        CHECK(rendered[0].size() > 8000);
+        CHECK(rendered[0] == rendered[1]);
+        CHECK(text_lines[0] == rendered[0].size());
+        CHECK(text_lines[1] == rendered[1].size());
+    }
+    SUBCASE("binary_tracers_one_thread") {
+        INIT_TRACE("neschan.instrtest.binary_tracers_one_thread.log");
+        cout << "Running [CPU][binary_tracers_one_thread]..." << endl;
+
+        // Several systems stepped on one thread - alternating between their writers
+        const int WRITER_COUNT = 2;
+        const int RECORD_COUNT = 1000;
+        unique_ptr<nes_trace_writer> writers[WRITER_COUNT];
+        for (int i = 0; i < WRITER_COUNT; ++i)
+            writers[i] = make_unique<nes_trace_writer>(("neschan.instrtest.binary_tracers_one_thread." + to_string(i) + ".bin").c_str());
+
+        for (int n = 0; n < RECORD_COUNT; ++n)
+        {
+            for (int i = 0; i < WRITER_COUNT; ++i)
+            {
+                nes_trace_record record = {};
+                record.cycle = n;
+                writers[i]->record(record);
+            }
+        }
+
+        // One ring per writer for this thread, not one per switch
+        size_t ring_count = 0;
+        for (auto &writer : writers)
+            ring_count += writer->ring_count();
+        CHECK(ring_count == WRITER_COUNT);
+
+        for (int i = 0; i < WRITER_COUNT; ++i)
+        {
+            writers[i] = nullptr;
+
+            uint32_t max_thread_index = 0;
+            vector<int64_t> cycles;
+            CHECK(nes_trace_writer::read(("neschan.instrtest.binary_tracers_one_thread." + to_string(i) + ".bin").c_str(), [&](uint32_t thread_index, const nes_trace_record &record) {
+                max_thread_index = max(max_thread_index, thread_index);
+                cycles.push_back(record.cycle);
+            }));
+
+            CHECK(max_thread_index == 0);
+            uint32_t thread_count = 0;
+            CHECK(nes_trace_writer::read_thread_count(("neschan.instrtest.binary_tracers_one_thread." + to_string(i) + ".bin").c_str(), thread_count));
+            CHECK(thread_count == 1);
+            REQUIRE(cycles.size() == RECORD_COUNT);
+            for (int n = 0; n < RECORD_COUNT; ++n)
+                CHECK(cycles[n] == n);
+        }
+    }
+#endif
 #define INSTR_V5_TEST_CASE(test) \
     SUBCASE("instr_test-v5 " test) { \
         INIT_TRACE("neschan.instrtest.instr_test-v5." test ".log"); \
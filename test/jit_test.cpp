@@ -0,0 +1,82 @@
+#include "stdafx.h"
+
+#include "doctest.h"
+#include "nes_trace.h"
+#include "nes_mapper.h"
+#include "nes_system.h"
+#include "nes_cpu.h"
+#include "nes_ppu.h"
+
+using namespace std;
+
+#ifdef NESCHAN_JIT
+
+namespace
+{
+    // run_rom steps a cycle at a time - compiled blocks would never get past their first instruction
+    void run_loaded_rom(nes_system &system)
+    {
+        while (!system.stop_requested())
+            system.step(nes_cycle_t(PPU_SCANLINE_CYCLE));
+    }
+}
+
+// Every compiled block is compared against an identical system running the interpreter
+TEST_CASE("JIT tests") {
+    nes_system system;
+    nes_system shadow;
+    system.set_tracer(&nes_tracer::get());
+
+    SUBCASE("nestest") {
+        INIT_TRACE("neschan.jit.nestest.log");
+        cout << "Running [JIT][nestest]..." << endl;
+
+        system.power_on();
+        shadow.power_on();
+
+        shadow.load_rom("./roms/nestest/nestest.nes", nes_rom_exec_mode_direct);
+        auto cpu = system.cpu();
+        cpu->enable_jit(&shadow);
+        system.load_rom("./roms/nestest/nestest.nes", nes_rom_exec_mode_direct);
+        run_loaded_rom(system);
+
+        CHECK(cpu->PC() == 0x0005);
+        CHECK(cpu->S() == 0xff);
+        CHECK(cpu->peek(0x2) == 0);
+        CHECK(cpu->peek(0x3) == 0);
+
+        CHECK(cpu->jit()->compiled_block_count() > 0);
+        CHECK(cpu->jit()->mismatch_count() == 0);
+    }
+#define JIT_INSTR_V5_TEST_CASE(test) \
+    SUBCASE("instr_test-v5 " test) { \
+        INIT_TRACE("neschan.jit.instr_test-v5." test ".log"); \
+        cout << "Running [JIT][instr_test-v5-" << test << "]" << endl; \
+        system.power_on(); \
+        shadow.power_on(); \
+        shadow.cpu()->stop_at_infinite_loop(); \
+        shadow.load_rom("./roms/instr_test-v5/rom_singles/" test ".nes", nes_rom_exec_mode_reset); \
+        auto cpu = system.cpu(); \
+        cpu->stop_at_infinite_loop(); \
+        cpu->enable_jit(&shadow); \
+        system.load_rom("./roms/instr_test-v5/rom_singles/" test ".nes", nes_rom_exec_mode_reset); \
+        run_loaded_rom(system); \
+        CHECK(cpu->peek(0x6000) == 0); \
+        CHECK(cpu->jit()->compiled_block_count() > 0); \
+        CHECK(cpu->jit()->mismatch_count() == 0); \
+    }
+    JIT_INSTR_V5_TEST_CASE("01-basics")
+    JIT_INSTR_V5_TEST_CASE("02-implied")
+    JIT_INSTR_V5_TEST_CASE("04-zero_page")
+    JIT_INSTR_V5_TEST_CASE("05-zp_xy")
+    JIT_INSTR_V5_TEST_CASE("06-absolute")
+    JIT_INSTR_V5_TEST_CASE("08-ind_x")
+    JIT_INSTR_V5_TEST_CASE("09-ind_y")
+    JIT_INSTR_V5_TEST_CASE("10-branches")
+    JIT_INSTR_V5_TEST_CASE("11-stack")
+    JIT_INSTR_V5_TEST_CASE("12-jmp_jsr")
+    JIT_INSTR_V5_TEST_CASE("13-rts")
+    JIT_INSTR_V5_TEST_CASE("14-rti")
+}
+
+#endif
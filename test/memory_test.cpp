@@ -0,0 +1,179 @@
+#include "stdafx.h"
+
+#include "doctest.h"
+#include "nes_trace.h"
+#include "nes_system.h"
+#include "nes_memory.h"
+#include "nes_ppu.h"
+
+using namespace std;
+
+namespace
+{
+    // Pages that differ between before and after have to be dirty - what diffing would find
+    int check_dirty_superset(const nes_dirty_bitmap &dirty, const vector<uint8_t> &before, const uint8_t *after)
+    {
+        int changed_pages = 0;
+        for (size_t page = 0; page < dirty.page_count(); ++page)
+        {
+            size_t offset = page * dirty.page_size();
+            if (memcmp(before.data() + offset, after + offset, dirty.page_size()) == 0)
+                continue;
+
+            changed_pages++;
+            CHECK(dirty.is_dirty(page));
+        }
+        return changed_pages;
+    }
+}
+
+TEST_CASE("memory_tests") {
+    SUBCASE("watch") {
+        INIT_TRACE("neschan.memory.watch.log");
+        cout << "Running [MEMORY][watch]..." << endl;
+
+        nes_system system;
+        system.power_on();
+        auto ram = system.ram();
+
+        vector<uint16_t> callback_addrs;
+        int low = ram->add_watch(0x0010, 2);
+        int stack = ram->add_watch(0x01fe, 4, [&](int watch_id, uint16_t addr, uint8_t old_value, uint8_t new_value) {
+            CHECK(old_value != new_value);
+            callback_addrs.push_back(addr);
+        });
+        REQUIRE(low >= 0);
+        REQUIRE(stack >= 0);
+        CHECK(ram->page_flags(0x0010) == nes_memory_page_flags_watched);
+        CHECK(ram->page_flags(0x0200) == nes_memory_page_flags_watched);
+        CHECK(ram->page_flags(0x0300) == nes_memory_page_flags_none);
+
+        // Unwatched bytes and writes of the same value don't count
+        ram->set_byte(0x0012, 1);
+        ram->set_byte(0x0010, 0);
+        CHECK(ram->take_changed_watches() == 0);
+
+        // Mirrors are the same bytes
+        ram->set_byte(0x0811, 7);
+        CHECK(ram->take_changed_watches() == (nes_watch_mask(1) << low));
+
+        // Crossing pages
+        uint8_t bytes[] = { 1, 2, 3, 4 };
+        ram->set_bytes(0x01fc, bytes, sizeof(bytes));
+        vector<int> changed;
+        ram->take_changed_watches(changed);
+        CHECK(changed == vector<int>({ stack }));
+        CHECK(callback_addrs == vector<uint16_t>({ 0x01fe, 0x01ff }));
+
+        ram->remove_watch(stack);
+        CHECK(ram->page_flags(0x0200) == nes_memory_page_flags_none);
+        ram->set_byte(0x0200, 9);
+        CHECK(ram->take_changed_watches() == 0);
+
+        // Whole RAM in 32 byte blocks has to catch every byte that differs between frames - what
+        // diffing RAM would find
+        ram->clear_watches();
+        system.load_rom("./roms/instr_test-v5/all_instrs.nes", nes_rom_exec_mode_reset);
+        for (int i = 0; i < NES_MEMORY_MAX_WATCHES; ++i)
+            REQUIRE(ram->add_watch(uint16_t(i * 32), 32) == i);
+        CHECK(ram->add_watch(0x6000) == -1);
+
+        vector<uint8_t> previous(ram->ram_data(), ram->ram_data() + 0x800);
+        int changed_frames = 0;
+        for (int frame = 0; frame < 60; ++frame)
+        {
+            REQUIRE(system.run_frame());
+            nes_watch_mask mask = ram->take_changed_watches();
+
+            nes_watch_mask diff = 0;
+            for (int addr = 0; addr < 0x800; ++addr)
+            {
+                if (ram->ram_data()[addr] != previous[addr])
+                    diff |= nes_watch_mask(1) << (addr / 32);
+            }
+            nes_watch_mask missed = diff & ~mask;
+            CHECK(missed == 0);
+            if (diff)
+                changed_frames++;
+
+            previous.assign(ram->ram_data(), ram->ram_data() + 0x800);
+        }
+        CHECK(changed_frames > 0);
+
+        // Loading state flags whatever it changes
+        auto state = system.serialize();
+        ram->set_byte(0x0123, uint8_t(ram->get_byte(0x0123) + 1));
+        ram->take_changed_watches();
+        REQUIRE(system.deserialize(state));
+        CHECK(ram->take_changed_watches() == (nes_watch_mask(1) << (0x0123 / 32)));
+    }
+    SUBCASE("dirty_pages") {
+        INIT_TRACE("neschan.memory.dirty_pages.log");
+        cout << "Running [MEMORY][dirty_pages]..." << endl;
+
+        nes_system system;
+        system.power_on();
+        system.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+        auto ram = system.ram();
+        auto ppu = system.ppu();
+
+        // Nothing is tracked while off
+        ram->set_byte(0x0300, 1);
+        CHECK(!system.dirty_pages().any());
+        CHECK(ram->page_flags(0x0300) == nes_memory_page_flags_none);
+
+        system.enable_dirty_tracking(true);
+        CHECK(!system.dirty_pages().any());
+        CHECK(ram->page_flags(0x0300) == nes_memory_page_flags_clean);
+
+        // Mirrors are the same page, and the first write drops the flag
+        ram->set_byte(0x0b00, 2);
+        CHECK(system.dirty_pages().ram.is_dirty(3));
+        CHECK(system.dirty_pages().ram.dirty_count() == 1);
+        CHECK(ram->page_flags(0x0300) == nes_memory_page_flags_none);
+
+        system.clear_dirty_pages();
+        CHECK(!system.dirty_pages().any());
+        CHECK(ram->page_flags(0x0300) == nes_memory_page_flags_clean);
+
+        // Every frame, each page that changed is dirty - and a frame doesn't write everything
+        vector<uint8_t> ram_before(ram->ram_data(), ram->ram_data() + ram->ram_size());
+        vector<uint8_t> vram_before(ppu->vram(), ppu->vram() + ppu->vram_size());
+        vector<uint8_t> oam_before(ppu->oam(), ppu->oam() + ppu->oam_size());
+        int changed_pages = 0;
+        for (int frame = 0; frame < 30; ++frame)
+        {
+            REQUIRE(system.run_frame());
+
+            auto &dirty = system.dirty_pages();
+            changed_pages += check_dirty_superset(dirty.ram, ram_before, ram->ram_data());
+            changed_pages += check_dirty_superset(dirty.vram, vram_before, ppu->vram());
+            changed_pages += check_dirty_superset(dirty.oam, oam_before, ppu->oam());
+            CHECK(dirty.ram.dirty_count() < dirty.ram.page_count());
+
+            system.clear_dirty_pages();
+            ram_before.assign(ram->ram_data(), ram->ram_data() + ram->ram_size());
+            vram_before.assign(ppu->vram(), ppu->vram() + ppu->vram_size());
+            oam_before.assign(ppu->oam(), ppu->oam() + ppu->oam_size());
+        }
+        CHECK(changed_pages > 0);
+
+        // Loading state dirties exactly the pages it changes
+        auto state = system.serialize();
+        ram->set_byte(0x0456, uint8_t(ram->get_byte(0x0456) + 1));
+        ppu->write_byte(0x2345, uint8_t(ppu->read_byte(0x2345) + 1));
+        system.clear_dirty_pages();
+        REQUIRE(system.deserialize(state));
+        auto &dirty = system.dirty_pages();
+        CHECK(dirty.ram.dirty_count() == 1);
+        CHECK(dirty.ram.is_dirty(0x04));
+        CHECK(dirty.vram.dirty_count() == 1);
+        CHECK(dirty.vram.is_dirty(0x2345 >> NES_DIRTY_VRAM_PAGE_SHIFT));
+        CHECK(!dirty.oam.any());
+
+        system.enable_dirty_tracking(false);
+        ram->set_byte(0x0300, 3);
+        CHECK(!system.dirty_pages().any());
+        CHECK(ram->page_flags(0x0300) == nes_memory_page_flags_none);
+    }
+}
@@ -0,0 +1,135 @@
+#include "stdafx.h"
+
+#include "doctest.h"
+#include "nes_trace.h"
+#include "nes_system.h"
+#include "nes_ppu.h"
+#include "nes_observation.h"
+
+#include <algorithm>
+#include <random>
+
+using namespace std;
+
+namespace
+{
+    // Straightforward version of what nes_observation does, one pixel at a time
+    vector<uint8_t> reference_observation(const uint8_t *frame, const nes_observation_spec &spec)
+    {
+        uint32_t first_row = spec.crop_overscan ? NES_OBSERVATION_OVERSCAN_ROWS : 0;
+        uint32_t width = PPU_SCREEN_X / spec.downsample;
+        uint32_t height = (PPU_SCREEN_Y - first_row * 2) / spec.downsample;
+        uint32_t area = spec.downsample * spec.downsample;
+
+        vector<uint8_t> out;
+        for (uint32_t y = 0; y < height; ++y)
+        {
+            for (uint32_t x = 0; x < width; ++x)
+            {
+                uint32_t top = first_row + y * spec.downsample;
+                uint32_t left = x * spec.downsample;
+                if (spec.format == nes_observation_format_palette)
+                {
+                    out.push_back(frame[top * PPU_SCREEN_X + left]);
+                    continue;
+                }
+
+                uint32_t sum = 0;
+                for (uint32_t dy = 0; dy < spec.downsample; ++dy)
+                {
+                    for (uint32_t dx = 0; dx < spec.downsample; ++dx)
+                        sum += nes_observation::luma_palette()[frame[(top + dy) * PPU_SCREEN_X + left + dx] & 0x3f];
+                }
+                out.push_back(uint8_t((sum + area / 2) / area));
+            }
+        }
+
+        return out;
+    }
+}
+
+TEST_CASE("observation_tests") {
+    SUBCASE("transform") {
+        INIT_TRACE("neschan.observation.transform.log");
+        cout << "Running [OBSERVATION][transform]..." << endl;
+
+        // Random palette indices (including the unused bits 6/7) and an actual rendered frame
+        vector<uint8_t> random_frame(PPU_SCREEN_X * PPU_SCREEN_Y);
+        mt19937 random(42);
+        for (auto &pixel : random_frame)
+            pixel = uint8_t(random());
+
+        nes_system system;
+        system.power_on();
+        system.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+        for (int i = 0; i < 10; ++i)
+            REQUIRE(system.run_frame());
+
+        const uint8_t *frames[] = { random_frame.data(), system.snapshot().frame_buffer };
+        for (const uint8_t *frame : frames)
+        {
+            for (auto format : { nes_observation_format_palette, nes_observation_format_luma })
+            {
+                for (uint32_t downsample : { 1u, 2u, 4u })
+                {
+                    for (bool crop : { false, true })
+                    {
+                        nes_observation_spec spec = { format, downsample, crop };
+                        REQUIRE(nes_observation::is_valid(spec));
+                        nes_observation observation(spec);
+                        auto expected = reference_observation(frame, spec);
+                        REQUIRE(observation.size() == expected.size());
+                        CHECK(observation.height() == (crop ? 224 : 240) / downsample);
+
+                        // SIMD and plain loops alike
+                        for (bool simd : { true, false })
+                        {
+                            nes_observation::enable_simd(simd);
+                            vector<uint8_t> out(observation.size());
+                            observation.transform(frame, out.data());
+                            CHECK(out == expected);
+                        }
+                        nes_observation::enable_simd(true);
+                    }
+                }
+            }
+        }
+
+        CHECK(!nes_observation::is_valid({ nes_observation_format_luma, 3, false }));
+    }
+    SUBCASE("stack") {
+        INIT_TRACE("neschan.observation.stack.log");
+        cout << "Running [OBSERVATION][stack]..." << endl;
+
+        nes_observation_stack stack({ nes_observation_format_palette, 4, false }, 3);
+        size_t size = stack.observation().size();
+
+        // Frame i is all palette index i
+        vector<uint8_t> frame(PPU_SCREEN_X * PPU_SCREEN_Y);
+        vector<uint8_t> stacked(size * stack.depth());
+        auto stacked_values = [&] {
+            stack.copy_to(stacked.data());
+            vector<uint8_t> values;
+            for (uint32_t i = 0; i < stack.depth(); ++i)
+            {
+                values.push_back(stacked[i * size]);
+                CHECK(all_of(stacked.begin() + i * size, stacked.begin() + (i + 1) * size, [&](uint8_t v) { return v == stacked[i * size]; }));
+            }
+            return values;
+        };
+
+        CHECK(stacked_values() == vector<uint8_t>({ 0, 0, 0 }));
+        for (uint8_t i = 1; i <= 5; ++i)
+        {
+            fill(frame.begin(), frame.end(), i);
+            stack.push(frame.data());
+        }
+
+        CHECK(stacked_values() == vector<uint8_t>({ 3, 4, 5 }));
+        CHECK(stack.get(0)[0] == 5);
+        CHECK(stack.get(2)[0] == 3);
+
+        stack.clear();
+        CHECK(stacked_values() == vector<uint8_t>({ 0, 0, 0 }));
+    }
+}
@@ -5,10 +5,13 @@
 #include "nes_mapper.h"
 #include "nes_system.h"
 
+#include <thread>
+
 using namespace std;
 
 TEST_CASE("ppu_tests") {
     nes_system system;
+    system.set_tracer(&nes_tracer::get());
 
     SUBCASE("color_test") {
         INIT_TRACE("neschan.ppu.colortest.log");
@@ -32,6 +35,184 @@ TEST_CASE("ppu_tests") {
         CHECK(ppu->read_byte(0x3f03) == 0x30);
         CHECK(ppu->read_byte(0x3f13) == 0x30);
     }
+    SUBCASE("perf_counters") {
+        INIT_TRACE("neschan.ppu.perf_counters.log");
+        cout << "Running [PPU][perf_counters]..." << endl;
+
+        system.power_on();
+        system.enable_perf_counters(true);
+        system.ppu()->stop_after_frame(10);
+
+        system.run_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+
+        // Stopped right at the end of frame 10 (stop_after_frame stops once it is exceeded)
+        auto perf = system.perf_snapshot();
+        CHECK(perf.frame == 10);
+        CHECK(perf.scanlines == 262);
+        CHECK(perf.nmis == 1);
+        CHECK(perf.instructions > 0);
+
+        uint64_t opcodes = 0;
+        for (auto count : perf.opcodes)
+            opcodes += count;
+        CHECK(opcodes == perf.instructions);
+
+        CHECK(perf.cpu_ticks > 0);
+        CHECK(perf.apu_ticks == 0);
+
+        auto json = system.perf_json();
+        CHECK(json.find("{\"frame\":10,\"instructions\":") == 0);
+        CHECK(json.back() == '}');
+    }
+    SUBCASE("run_frame") {
+        INIT_TRACE("neschan.ppu.run_frame.log");
+        cout << "Running [PPU][run_frame]..." << endl;
+
+        system.power_on();
+        system.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+        system.enable_perf_counters(true);
+
+        auto ppu = system.ppu();
+        for (uint32_t frame = 1; frame <= 10; ++frame)
+        {
+            nes_cycle_t frame_end = ppu->next_frame_cycle();
+            CHECK(system.run_frame());
+            CHECK(ppu->frame_count() == frame);
+
+            // Stops at the first instruction boundary after the frame ends
+            CHECK(ppu->cycle() == system.cpu()->cycle());
+            CHECK(ppu->cycle() >= frame_end);
+            CHECK(ppu->cycle() - frame_end < nes_cycle_t(PPU_SCANLINE_CYCLE));
+        }
+
+        CHECK(ppu->read_byte(0x3f01) == 0x16);
+
+        // Catching the PPU up at the end of each frame is PPU time, not time spent between steps
+        auto perf = system.perf_snapshot();
+        CHECK(perf.ppu_ticks > 0);
+        CHECK(perf.frontend_ticks < perf.cpu_ticks);
+    }
+    SUBCASE("frame_pool") {
+        INIT_TRACE("neschan.ppu.frame_pool.log");
+        cout << "Running [PPU][frame_pool]..." << endl;
+
+        system.power_on();
+        system.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+
+        auto ppu = system.ppu();
+        for (int i = 0; i < 5; ++i)
+            CHECK(system.run_frame());
+
+        // A held frame doesn't change while emulation keeps going
+        nes_frame_ref held = system.acquire_frame();
+        CHECK(held.valid());
+        CHECK(held.sequence() == 5);
+        CHECK(memcmp(held.pixels(), ppu->frame_buffer(), ppu->frame_size()) == 0);
+        vector<uint8_t> held_pixels(held.pixels(), held.pixels() + ppu->frame_size());
+
+        for (int i = 0; i < 3; ++i)
+            CHECK(system.run_frame());
+        CHECK(ppu->latest_frame_sequence() == 8);
+        CHECK(memcmp(held.pixels(), held_pixels.data(), held_pixels.size()) == 0);
+
+        // Readers holding every buffer PPU could move on to - the frame is dropped instead of waiting
+        nes_frame_ref held_8 = system.acquire_frame();
+        CHECK(system.run_frame());
+        nes_frame_ref held_9 = system.acquire_frame();
+        CHECK(held_9.sequence() == 9);
+        CHECK(system.run_frame());
+        CHECK(ppu->dropped_frame_count() == 1);
+        CHECK(ppu->latest_frame_sequence() == 9);
+        CHECK(ppu->frame_count() == 10);
+
+        held.release();
+        CHECK(!held.valid());
+        CHECK(system.run_frame());
+        CHECK(ppu->latest_frame_sequence() == 11);
+        CHECK(held_8.sequence() == 8);
+
+        // A reader on another thread sees the same frames emulation thread did, in order
+        held_8.release();
+        held_9.release();
+
+        auto hash_frame = [&](const uint8_t *pixels) {
+            uint64_t hash = 0xcbf29ce484222325ull;
+            for (size_t i = 0; i < ppu->frame_size(); ++i)
+                hash = (hash ^ pixels[i]) * 0x100000001b3ull;
+            return hash;
+        };
+
+        const uint64_t last_sequence = 40;
+        vector<uint64_t> emulated_hashes(last_sequence + 1);
+        vector<pair<uint64_t, uint64_t>> seen;
+        thread reader([&] {
+            while (true)
+            {
+                nes_frame_ref frame = system.acquire_frame();
+                if (seen.empty() || seen.back().first != frame.sequence())
+                    seen.emplace_back(frame.sequence(), hash_frame(frame.pixels()));
+                if (frame.sequence() >= last_sequence)
+                    break;
+            }
+        });
+
+        while (ppu->frame_count() < last_sequence)
+        {
+            CHECK(system.run_frame());
+            emulated_hashes[ppu->frame_count()] = hash_frame(ppu->frame_buffer());
+        }
+        reader.join();
+
+        CHECK(seen.back().first == last_sequence);
+        for (size_t i = 0; i < seen.size(); ++i)
+        {
+            if (i > 0)
+                CHECK(seen[i].first > seen[i - 1].first);
+            if (seen[i].first > 11)
+                CHECK(seen[i].second == emulated_hashes[seen[i].first]);
+        }
+    }
+    SUBCASE("frame_pool_drops") {
+        INIT_TRACE("neschan.ppu.frame_pool_drops.log");
+        cout << "Running [PPU][frame_pool_drops]..." << endl;
+
+        // Readers holding frames (and the frames dropped because of them) don't change emulation
+        struct run_result
+        {
+            uint64_t state_hash;
+            vector<uint8_t> frame;
+            uint64_t dropped;
+        };
+        auto run = [](bool hold) {
+            nes_system system;
+            system.power_on();
+            system.load_rom("./roms/blargg_ppu_tests/vbl_clear_time.nes", nes_rom_exec_mode_reset);
+
+            // Two refs plus the latest frame leave the pool nowhere to publish to
+            nes_frame_ref held_2, held_3;
+            for (int i = 0; i < 40; ++i)
+            {
+                CHECK(system.run_frame());
+                if (hold && i == 1)
+                    held_2 = system.acquire_frame();
+                if (hold && i == 2)
+                    held_3 = system.acquire_frame();
+            }
+
+            nes_state_blob state;
+            system.serialize(state);
+            auto snapshot = system.snapshot();
+            auto ppu = system.ppu();
+            return run_result{ state.hash(), vector<uint8_t>(snapshot.frame_buffer, snapshot.frame_buffer + ppu->frame_size()), ppu->dropped_frame_count() };
+        };
+
+        auto plain = run(false);
+        auto held = run(true);
+        CHECK(plain.dropped == 0);
+        CHECK(held.dropped > 0);
+        CHECK(held.state_hash == plain.state_hash);
+        CHECK(held.frame == plain.frame);
+    }
     SUBCASE("vbl_clear_time") {
         INIT_TRACE("neschan.ppu.vbl_clear_time.log");
         cout << "Running [PPU][vbl_clear_time]..." << endl;
@@ -88,4 +269,89 @@ TEST_CASE("ppu_tests") {
 
         CHECK(cpu->peek(0xf0) == 0x1);
     }
+    SUBCASE("sprite_0_hit") {
+        INIT_TRACE("neschan.ppu.sprite_0_hit.log");
+        cout << "Running [PPU][sprite_0_hit]..." << endl;
+
+        system.power_on();
+        system.ppu()->set_mirroring(nes_mapper_flags_vertical_mirroring);
+
+        // Spin on PPUSTATUS until sprite 0 hit the way games do and count the reads - the count
+        // needs to match exactly regardless of how PPU catches up with CPU
+        system.run_program(
+            {
+                0x2c, 0x02, 0x20,   // BIT $2002    -> wait for VBlank
+                0x10, 0xfb,         // BPL *-3
+                0x2c, 0x02, 0x20,   // BIT $2002    -> wait for another VBlank for PPU to warm up
+                0x10, 0xfb,         // BPL *-3
+
+                0xa9, 0x00,         // LDA #$00     -> PPUADDR = $0010 (tile 1)
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa9, 0x10,         // LDA #$10
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa9, 0xff,         // LDA #$ff     -> bitplane 0 = all 1s
+                0xa2, 0x08,         // LDX #$08
+                0x8d, 0x07, 0x20,   // STA $2007
+                0xca,               // DEX
+                0xd0, 0xfa,         // BNE *-6
+
+                0xa9, 0x21,         // LDA #$21     -> PPUADDR = $2140 (name table row 10)
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa9, 0x40,         // LDA #$40
+                0x8d, 0x06, 0x20,   // STA $2006
+                0xa9, 0x01,         // LDA #$01     -> 512 tiles of tile 1 - scanline 80~207 is opaque
+                0xa0, 0x02,         // LDY #$02
+                0xa2, 0x00,         // LDX #$00
+                0x8d, 0x07, 0x20,   // STA $2007
+                0xca,               // DEX
+                0xd0, 0xfa,         // BNE *-6
+                0x88,               // DEY
+                0xd0, 0xf5,         // BNE *-11
+
+                0xa9, 0x00,         // LDA #$00     -> sprite 0 at (100, 76) with tile 1
+                0x8d, 0x03, 0x20,   // STA $2003    -> rest of the sprites are at Y=0 and overflows
+                0xa9, 0x4b,         // LDA #$4b
+                0x8d, 0x04, 0x20,   // STA $2004
+                0xa9, 0x01,         // LDA #$01
+                0x8d, 0x04, 0x20,   // STA $2004
+                0xa9, 0x00,         // LDA #$00
+                0x8d, 0x04, 0x20,   // STA $2004
+                0xa9, 0x64,         // LDA #$64
+                0x8d, 0x04, 0x20,   // STA $2004
+
+                0xa9, 0x00,         // LDA #$00     -> scroll = (0, 0), name table $2000
+                0x8d, 0x05, 0x20,   // STA $2005
+                0x8d, 0x05, 0x20,   // STA $2005
+                0x8d, 0x00, 0x20,   // STA $2000
+                0x85, 0x10,         // STA $10      -> $10/$11 = read count, $12 = all flags seen
+                0x85, 0x11,         // STA $11
+                0x85, 0x12,         // STA $12
+                0xa9, 0x18,         // LDA #$18     -> show background and sprites
+                0x8d, 0x01, 0x20,   // STA $2001
+
+                0x2c, 0x02, 0x20,   // BIT $2002    -> wait for VBlank
+                0x10, 0xfb,         // BPL *-3
+                0x2c, 0x02, 0x20,   // BIT $2002    -> wait for sprite 0 hit from earlier frame to clear
+                0x70, 0xfb,         // BVS *-3
+
+                0xad, 0x02, 0x20,   // LDA $2002
+                0xaa,               // TAX
+                0x05, 0x12,         // ORA $12
+                0x85, 0x12,         // STA $12
+                0xe6, 0x10,         // INC $10
+                0xd0, 0x02,         // BNE *+4
+                0xe6, 0x11,         // INC $11
+                0x8a,               // TXA
+                0x29, 0x40,         // AND #$40
+                0xf0, 0xed,         // BEQ *-17     -> until sprite 0 hit
+                0x00,               // BRK
+            },
+            0x0300);
+
+        auto cpu = system.cpu();
+
+        // saw both sprite overflow (scanline 1~8) and sprite 0 hit, but not VBlank
+        CHECK((cpu->peek(0x12) & 0xe0) == 0x60);
+        CHECK((cpu->peek(0x11) << 8 | cpu->peek(0x10)) == 429);
+    }
 }
\ No newline at end of file
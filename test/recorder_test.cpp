@@ -0,0 +1,165 @@
+#include "stdafx.h"
+
+#include "doctest.h"
+#include "nes_trace.h"
+#include "nes_system.h"
+#include "nes_recorder.h"
+
+#include <cstdio>
+#include <map>
+
+using namespace std;
+
+namespace
+{
+    // Doesn't write anything until released - stands in for a disk / pipe that can't keep up
+    class blocked_frame_sink : public nes_frame_sink
+    {
+    public :
+        blocked_frame_sink(atomic<bool> &released, vector<uint64_t> &written)
+            :_released(released), _written(written)
+        {}
+
+        virtual bool begin(uint16_t, uint16_t) { return true; }
+
+        virtual bool write_frame(uint64_t sequence, const uint8_t *)
+        {
+            while (!_released)
+                this_thread::sleep_for(chrono::milliseconds(1));
+
+            _written.push_back(sequence);
+            return true;
+        }
+
+    private :
+        atomic<bool> &_released;
+        vector<uint64_t> &_written;
+    };
+
+    size_t file_size(const char *path)
+    {
+        ifstream in(path, ios::in | ios::binary | ios::ate);
+        return in.is_open() ? size_t(in.tellg()) : 0;
+    }
+}
+
+TEST_CASE("recorder_tests") {
+    nes_system system;
+
+    SUBCASE("frame_archive") {
+        INIT_TRACE("neschan.recorder.frame_archive.log");
+        cout << "Running [RECORDER][frame_archive]..." << endl;
+
+        system.power_on();
+        system.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+
+        auto ppu = system.ppu();
+        const char *path = "./neschan.recorder.bin";
+        map<uint64_t, vector<uint8_t>> emulated;
+        {
+            nes_frame_recorder recorder(nes_frame_sink::create(path), ppu->frame_width(), ppu->frame_height());
+            for (int i = 0; i < NES_FRAME_ARCHIVE_CHUNK_FRAMES + 10; ++i)
+            {
+                CHECK(system.run_frame());
+                CHECK(recorder.record(ppu->frame_count(), ppu->frame_buffer()));
+                emulated[ppu->frame_count()].assign(ppu->frame_buffer(), ppu->frame_buffer() + ppu->frame_size());
+            }
+
+            CHECK(recorder.stop());
+            CHECK(recorder.recorded_count() == emulated.size());
+            CHECK(recorder.dropped_count() == 0);
+        }
+
+        size_t frame_count = 0;
+        bool valid = nes_frame_archive_sink::read(path, [&](uint64_t sequence, const uint8_t *pixels, uint16_t width, uint16_t height) {
+            CHECK(width == PPU_SCREEN_X);
+            CHECK(height == PPU_SCREEN_Y);
+            REQUIRE(emulated.count(sequence) == 1);
+            CHECK(memcmp(pixels, emulated[sequence].data(), emulated[sequence].size()) == 0);
+            frame_count++;
+        });
+        CHECK(valid);
+        CHECK(frame_count == emulated.size());
+
+        remove(path);
+    }
+    SUBCASE("video") {
+        INIT_TRACE("neschan.recorder.video.log");
+        cout << "Running [RECORDER][video]..." << endl;
+
+        system.power_on();
+        system.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+
+        auto ppu = system.ppu();
+        const char *y4m_path = "./neschan.recorder.y4m";
+        const char *rgb_path = "./neschan.recorder.rgb";
+        const int frames = 5;
+        {
+            nes_frame_recorder y4m(nes_frame_sink::create(y4m_path), ppu->frame_width(), ppu->frame_height());
+            nes_frame_recorder rgb(nes_frame_sink::create(rgb_path), ppu->frame_width(), ppu->frame_height());
+            for (int i = 0; i < frames; ++i)
+            {
+                CHECK(system.run_frame());
+                CHECK(y4m.record(ppu->frame_count(), ppu->frame_buffer()));
+                CHECK(rgb.record(ppu->frame_count(), ppu->frame_buffer()));
+            }
+
+            CHECK(y4m.stop());
+            CHECK(rgb.stop());
+        }
+
+        string header = "YUV4MPEG2 W256 H240 F39375000:655171 Ip A1:1 C444\n";
+        ifstream in(y4m_path, ios::in | ios::binary);
+        string line;
+        getline(in, line);
+        CHECK(line + "\n" == header);
+        CHECK(file_size(y4m_path) == header.size() + frames * (6 + ppu->frame_size() * 3));
+
+        // Last frame converted the same way the frontend does
+        CHECK(file_size(rgb_path) == frames * ppu->frame_size() * 3);
+        vector<uint32_t> argb(ppu->frame_size());
+        nes_ppu::frame_to_argb(ppu->frame_buffer(), argb.data());
+        vector<uint8_t> rgb(ppu->frame_size() * 3);
+        ifstream rgb_in(rgb_path, ios::in | ios::binary);
+        rgb_in.seekg(streamoff((frames - 1) * rgb.size()));
+        rgb_in.read(reinterpret_cast<char *>(rgb.data()), rgb.size());
+        bool same = true;
+        for (size_t i = 0; i < argb.size(); ++i)
+            same = same && rgb[i * 3] == uint8_t(argb[i] >> 16) && rgb[i * 3 + 1] == uint8_t(argb[i] >> 8) && rgb[i * 3 + 2] == uint8_t(argb[i]);
+        CHECK(same);
+
+        in.close();
+        rgb_in.close();
+        remove(y4m_path);
+        remove(rgb_path);
+    }
+    SUBCASE("queue_full") {
+        INIT_TRACE("neschan.recorder.queue_full.log");
+        cout << "Running [RECORDER][queue_full]..." << endl;
+
+        atomic<bool> released(false);
+        vector<uint64_t> written;
+        vector<uint8_t> frame(PPU_SCREEN_X * PPU_SCREEN_Y);
+
+        nes_frame_recorder recorder(make_unique<blocked_frame_sink>(released, written), PPU_SCREEN_X, PPU_SCREEN_Y);
+
+        // Writer thread is stuck on the first frame - the queue fills up and frames get dropped
+        // instead of record waiting
+        int recorded = 0;
+        for (uint64_t sequence = 1; sequence <= NES_RECORDER_QUEUE_SIZE + 10; ++sequence)
+        {
+            if (recorder.record(sequence, frame.data()))
+                recorded++;
+        }
+
+        CHECK(recorded == NES_RECORDER_QUEUE_SIZE);
+        CHECK(recorder.dropped_count() == 10);
+
+        released = true;
+        CHECK(recorder.stop());
+        CHECK(recorder.recorded_count() == uint64_t(recorded));
+        REQUIRE(written.size() == size_t(recorded));
+        for (size_t i = 0; i < written.size(); ++i)
+            CHECK(written[i] == i + 1);
+    }
+}
@@ -0,0 +1,266 @@
+#include "stdafx.h"
+
+#include "doctest.h"
+#include "nes_system.h"
+#include "nes_input.h"
+#include "nes_replay.h"
+
+#include <cstdio>
+
+namespace
+{
+    // Text log with everything the format allows - comments, out of order and repeated frames, gaps
+    // and runs crossing index boundaries
+    std::vector<nes_button_flags> write_text_log(const char *path)
+    {
+        std::ofstream out(path);
+        out << "# frame flags" << std::endl;
+        out << "10 0x10   # START" << std::endl;
+        out << "3 0x08" << std::endl;
+        out << "4 8" << std::endl;
+        out << "3 0x01" << std::endl;
+        out << std::endl;
+        for (int frame = 250; frame < 700; ++frame)
+            out << frame << " " << ((frame / 100) % 2 ? "0x80" : "0x40") << std::endl;
+        out << "1000 0xff" << std::endl;
+
+        std::vector<nes_button_flags> expected(1001, nes_button_flags_none);
+        expected[3] = nes_button_flags_right;
+        expected[4] = nes_button_flags_up;
+        expected[10] = nes_button_flags_start;
+        for (int frame = 250; frame < 700; ++frame)
+            expected[frame] = (frame / 100) % 2 ? nes_button_flags_a : nes_button_flags_b;
+        expected[1000] = nes_button_flags(0xff);
+
+        return expected;
+    }
+
+    // Counts polls - a stand-in for a device that is expensive to poll (SDL, etc.)
+    class counting_input_device : public nes_input_device
+    {
+    public :
+        counting_input_device(nes_ppu *ppu, const std::vector<nes_button_flags> &stream)
+            :_ppu(ppu), _stream(stream)
+        {}
+
+        virtual nes_button_flags poll_status()
+        {
+            poll_count++;
+            uint32_t frame = _ppu->frame_count();
+            return frame < _stream.size() ? _stream[frame] : nes_button_flags_none;
+        }
+
+        int poll_count = 0;
+
+    private :
+        nes_ppu *_ppu;
+        std::vector<nes_button_flags> _stream;
+    };
+}
+
+TEST_CASE("Binary replay converted from text log plays back the same buttons") {
+    const char *text_path = "./neschan.replay.log";
+    const char *replay_path = "./neschan.replay.bin";
+    auto expected = write_text_log(text_path);
+
+    REQUIRE(nes_replay::convert_text_log(text_path, replay_path, 0x1234, 0x5678));
+    auto replay = nes_replay::open(replay_path);
+    REQUIRE(replay != nullptr);
+
+    CHECK(replay->header().rom_hash == 0x1234);
+    CHECK(replay->header().start_state_hash == 0x5678);
+    CHECK(replay->player_count() == 1);
+    CHECK(replay->frame_count() == expected.size());
+
+    bool same = true;
+    for (uint32_t frame = 0; frame < expected.size() + 10; ++frame)
+    {
+        nes_button_flags want = frame < expected.size() ? expected[frame] : nes_button_flags_none;
+        same = same && replay->buttons(0, frame) == want;
+    }
+    CHECK(same);
+    CHECK(replay->buttons(1, 3) == nes_button_flags_none);
+
+    // Seeking backwards works as well as forward
+    CHECK(replay->buttons(0, 1000) == nes_button_flags(0xff));
+    CHECK(replay->buttons(0, 4) == nes_button_flags_up);
+
+    replay.reset();
+    remove(text_path);
+    remove(replay_path);
+}
+
+TEST_CASE("Binary replay drives emulation like the input stream") {
+    const char *replay_path = "./neschan.replay.bin";
+
+    nes_replay_writer writer(2, 0, 0);
+    std::vector<nes_button_flags> stream(30, nes_button_flags_none);
+    for (uint32_t frame = 10; frame < 30; ++frame)
+    {
+        stream[frame] = nes_button_flags_start;
+        writer.set_buttons(0, frame, nes_button_flags_start);
+    }
+    writer.set_buttons(1, 5, nes_button_flags_a);
+    REQUIRE(writer.save(replay_path));
+
+    auto replay = nes_replay::open(replay_path);
+    REQUIRE(replay != nullptr);
+    CHECK(replay->buttons(1, 5) == nes_button_flags_a);
+    CHECK(replay->buttons(1, 6) == nes_button_flags_none);
+
+    auto run = [](std::function<void(nes_system &)> register_input) {
+        nes_system system;
+        system.power_on();
+        register_input(system);
+        system.ppu()->stop_after_frame(20);
+        system.run_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+        return system.serialize().hash();
+    };
+
+    uint64_t from_stream = run([&](nes_system &system) { system.input()->register_input_stream(0, stream); });
+    uint64_t from_replay = run([&](nes_system &system) { system.input()->register_input_replay(0, replay, 0); });
+    CHECK(from_stream == from_replay);
+
+    replay.reset();
+    remove(replay_path);
+}
+
+TEST_CASE("Binary replay rejects files that aren't replays") {
+    const char *path = "./neschan.replay.bin";
+
+    CHECK(nes_replay::open("./neschan.replay.missing") == nullptr);
+
+    {
+        std::ofstream out(path, std::ios::out | std::ios::binary);
+        out << "0 0x08" << std::endl;
+    }
+    CHECK(nes_replay::open(path) == nullptr);
+
+    // Index pointing past the runs
+    nes_replay_writer writer(1, 0, 0);
+    writer.set_buttons(0, 0, nes_button_flags_a);
+    writer.set_buttons(0, 300, nes_button_flags_b);
+    REQUIRE(writer.save(path));
+    REQUIRE(nes_replay::open(path) != nullptr);
+    {
+        std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(sizeof(nes_replay_header) + sizeof(nes_replay_keyframe_info) + sizeof(nes_replay_player));
+        uint32_t bad_run = 100;
+        file.write(reinterpret_cast<const char *>(&bad_run), sizeof(bad_run));
+    }
+    CHECK(nes_replay::open(path) == nullptr);
+
+    remove(path);
+}
+
+TEST_CASE("Replay keyframes seek and verify like straight emulation") {
+    const char *replay_path = "./neschan.replay.bin";
+    const char *keyframed_path = "./neschan.replay.keyframes.bin";
+    const char *rom_path = "./roms/color_test/color_test.nes";
+    const uint32_t frames = 45;
+
+    nes_replay_writer writer(1, 0, 0);
+    for (uint32_t frame = 5; frame < frames; frame += 7)
+        writer.set_buttons(0, frame, frame % 2 ? nes_button_flags_start : nes_button_flags_select);
+    REQUIRE(writer.save(replay_path));
+
+    nes_replay_runner plain_runner(nes_replay::open(replay_path), rom_path);
+    REQUIRE(plain_runner.embed_keyframes(keyframed_path, 10, frames));
+
+    auto replay = nes_replay::open(keyframed_path);
+    REQUIRE(replay != nullptr);
+    CHECK(replay->keyframe_interval() == 10);
+    CHECK(replay->keyframe_count() == 5);
+    CHECK(replay->hashed_frame_count() == frames + 1);
+    CHECK(replay->find_keyframe(0) == 0);
+    CHECK(replay->find_keyframe(29) == 2);
+    CHECK(replay->find_keyframe(frames) == 4);
+
+    // Same state as emulating every frame, going forward and back
+    nes_replay_runner runner(replay, rom_path);
+    nes_system straight;
+    runner.prepare(straight);
+    std::vector<uint64_t> hashes(1, straight.serialize().hash());
+    for (uint32_t frame = 1; frame <= frames; ++frame)
+    {
+        REQUIRE(straight.run_frame());
+        hashes.push_back(straight.serialize().hash());
+    }
+
+    bool same = true;
+    for (uint32_t frame = 0; frame <= frames; ++frame)
+        same = same && replay->frame_hash(frame) == hashes[frame];
+    CHECK(same);
+
+    nes_system system;
+    runner.prepare(system);
+    for (uint32_t frame : { 33u, 12u, 13u, 40u, 0u, 45u })
+    {
+        REQUIRE(runner.seek(system, frame));
+        CHECK(system.ppu()->frame_count() == frame);
+        CHECK(system.serialize().hash() == hashes[frame]);
+    }
+
+    uint32_t mismatch_frame = 0;
+    CHECK(runner.verify(1, mismatch_frame));
+    CHECK(runner.verify(4, mismatch_frame));
+
+    // A frame hash that doesn't match is reported from whichever interval it's in
+    uint64_t hashes_offset = 0;
+    {
+        std::ifstream in(keyframed_path, std::ios::in | std::ios::binary);
+        in.seekg(sizeof(nes_replay_header) + offsetof(nes_replay_keyframe_info, hashes_offset));
+        in.read(reinterpret_cast<char *>(&hashes_offset), sizeof(hashes_offset));
+    }
+    replay.reset();
+    runner = nes_replay_runner(nullptr, rom_path);
+    {
+        std::fstream file(keyframed_path, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(std::streamoff(hashes_offset + 27 * sizeof(uint64_t)));
+        uint64_t bad_hash = hashes[27] ^ 1;
+        file.write(reinterpret_cast<const char *>(&bad_hash), sizeof(bad_hash));
+    }
+
+    nes_replay_runner tampered(nes_replay::open(keyframed_path), rom_path);
+    CHECK(!tampered.verify(4, mismatch_frame));
+    CHECK(mismatch_frame == 27);
+
+    remove(replay_path);
+    remove(keyframed_path);
+}
+
+TEST_CASE("Latched input snapshot plays back the same as polling on every strobe") {
+    const uint32_t frames = 30;
+    std::vector<nes_button_flags> stream(frames, nes_button_flags_none);
+    for (uint32_t frame = 10; frame < frames; ++frame)
+        stream[frame] = frame % 3 ? nes_button_flags_start : nes_button_flags_a;
+
+    auto run = [&](nes_input_latch_mode mode, int &poll_count) {
+        nes_system system;
+        system.power_on();
+        system.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+
+        auto device = std::make_shared<counting_input_device>(system.ppu(), stream);
+        system.input()->register_input(0, device);
+        system.input()->set_latch_mode(mode);
+        for (uint32_t frame = 0; frame < frames; ++frame)
+        {
+            if (mode == nes_input_latch_mode_manual)
+                system.input()->set_latched_buttons(0, stream[system.ppu()->frame_count()]);
+            REQUIRE(system.run_frame());
+        }
+
+        poll_count = device->poll_count;
+        return system.serialize().hash();
+    };
+
+    int polled = 0, latched = 0, manual = 0;
+    uint64_t hash = run(nes_input_latch_mode_poll, polled);
+    CHECK(run(nes_input_latch_mode_frame, latched) == hash);
+    CHECK(run(nes_input_latch_mode_manual, manual) == hash);
+
+    // Once per frame at most, and never when buttons are set directly
+    CHECK(polled > int(frames));
+    CHECK(latched <= int(frames));
+    CHECK(manual == 0);
+}
@@ -0,0 +1,141 @@
+#include "stdafx.h"
+
+#include "doctest.h"
+#include "nes_trace.h"
+#include "nes_system.h"
+#include "nes_ppu.h"
+#include "nes_rollback.h"
+
+#include <cstring>
+
+using namespace std;
+
+namespace
+{
+    const uint32_t TEST_FRAMES = 60;
+
+    void make_system(nes_system &system)
+    {
+        system.power_on();
+        system.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+    }
+
+    // Player 0 changes buttons every few frames, player 1 a bit less often
+    nes_rollback_inputs test_inputs(uint32_t frame)
+    {
+        static const nes_button_flags buttons[] = { nes_button_flags_none, nes_button_flags_right, nes_button_flags_a, nes_button_flags_down, nes_button_flags_start };
+        nes_rollback_inputs inputs = {};
+        inputs.buttons[0] = buttons[(frame / 4) % 5];
+        inputs.buttons[1] = buttons[(frame / 7) % 5];
+        return inputs;
+    }
+
+    // Straight run without any rollback - what the sessions need to end up with
+    void run_reference(nes_system &system, uint32_t frames)
+    {
+        make_system(system);
+        system.input()->set_latch_mode(nes_input_latch_mode_manual);
+        for (uint32_t frame = 0; frame < frames; ++frame)
+        {
+            system.input()->set_latched_buttons(test_inputs(frame).buttons);
+            REQUIRE(system.run_frame());
+        }
+    }
+}
+
+TEST_CASE("rollback_tests") {
+    SUBCASE("resimulate") {
+        INIT_TRACE("neschan.rollback.resimulate.log");
+        cout << "Running [ROLLBACK][resimulate]..." << endl;
+
+        nes_system reference;
+        run_reference(reference, TEST_FRAMES);
+
+        nes_system system;
+        make_system(system);
+        nes_rollback_session session(system, 8);
+
+        // Every 10th frame goes with player 1's buttons missing, and gets corrected 5 frames later
+        for (uint32_t frame = 0; frame < TEST_FRAMES; ++frame)
+        {
+            auto inputs = test_inputs(frame);
+            if (frame % 10 == 3)
+                inputs.buttons[1] = nes_button_flags_select;
+            REQUIRE(session.advance(inputs));
+
+            if (frame >= 5 && (frame - 5) % 10 == 3)
+            {
+                uint64_t published = system.ppu()->latest_frame_sequence();
+                REQUIRE(session.rollback_to(frame - 5, test_inputs(frame - 5)));
+
+                // Re-simulated frames don't get published - readers only see the latest one again
+                CHECK(system.ppu()->latest_frame_sequence() == published);
+            }
+        }
+
+        CHECK(session.frame() == TEST_FRAMES);
+        CHECK(system.serialize().hash() == reference.serialize().hash());
+        CHECK(memcmp(system.ppu()->frame_buffer(), reference.ppu()->frame_buffer(), system.ppu()->frame_size()) == 0);
+
+        auto &stats = session.stats();
+        CHECK(stats.rollbacks == TEST_FRAMES / 10);
+        CHECK(stats.resimulated_frames == stats.rollbacks * 6);
+        CHECK(stats.max_resimulated_frames == 6);
+
+        // Predicted right - nothing to re-simulate
+        REQUIRE(session.rollback_to(TEST_FRAMES - 2, session.inputs(TEST_FRAMES - 2)));
+        CHECK(stats.unchanged_corrections == 1);
+        CHECK(stats.rollbacks == TEST_FRAMES / 10);
+
+        // Out of the window / not run yet
+        CHECK(session.oldest_frame() == TEST_FRAMES - 8);
+        CHECK(!session.rollback_to(TEST_FRAMES - 9, test_inputs(0)));
+        CHECK(!session.rollback_to(TEST_FRAMES, test_inputs(0)));
+
+        // Wrong inputs do make a difference
+        REQUIRE(session.rollback_to(TEST_FRAMES - 8, test_inputs(0)));
+        CHECK(system.serialize().hash() != reference.serialize().hash());
+
+        // Saving into the same blob again reuses its buffer
+        nes_state_blob state;
+        system.serialize(state);
+        const uint8_t *buffer = state.data.data();
+        REQUIRE(session.advance(test_inputs(0)));
+        system.serialize(state);
+        CHECK(state.data.data() == buffer);
+        CHECK(state.data == system.serialize().data);
+    }
+    SUBCASE("loopback") {
+        INIT_TRACE("neschan.rollback.loopback.log");
+        cout << "Running [ROLLBACK][loopback]..." << endl;
+
+        nes_system reference;
+        run_reference(reference, TEST_FRAMES);
+
+        for (uint32_t latency : { 1u, 3u, 8u })
+        {
+            nes_system system0, system1;
+            make_system(system0);
+            make_system(system1);
+            nes_rollback_session peer0(system0, 8);
+            nes_rollback_session peer1(system1, 8);
+            nes_rollback_loopback loopback(peer0, peer1, latency);
+
+            for (uint32_t frame = 0; frame < TEST_FRAMES; ++frame)
+            {
+                auto inputs = test_inputs(frame);
+                REQUIRE(loopback.advance(inputs.buttons[0], inputs.buttons[1]));
+            }
+            REQUIRE(loopback.flush());
+
+            uint64_t hash = reference.serialize().hash();
+            CHECK(system0.serialize().hash() == hash);
+            CHECK(system1.serialize().hash() == hash);
+
+            // Mispredictions happen whenever the other player's buttons change
+            CHECK(peer0.stats().rollbacks > 0);
+            CHECK(peer1.stats().rollbacks > 0);
+            CHECK(peer0.stats().max_resimulated_frames <= latency);
+        }
+    }
+}
@@ -0,0 +1,77 @@
+#include "stdafx.h"
+
+#include "doctest.h"
+#include "nes_trace.h"
+#include "nes_rom_suite.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace
+{
+    // The quick ones - the instr_test-v5 singles take seconds each in debug
+    bool is_quick(const nes_rom_test &test)
+    {
+        return test.check != nes_rom_check_blargg || test.name.find("01-basics") != string::npos;
+    }
+}
+
+TEST_CASE("rom_suite_tests") {
+    SUBCASE("discover") {
+        cout << "Running [ROM_SUITE][discover]..." << endl;
+
+        auto tests = nes_rom_suite::discover("./roms");
+        REQUIRE(tests.size() > 0);
+        CHECK(is_sorted(tests.begin(), tests.end(), [](const nes_rom_test &a, const nes_rom_test &b) { return a.name < b.name; }));
+
+        auto check_of = [&](const char *name) {
+            auto test = find_if(tests.begin(), tests.end(), [&](const nes_rom_test &t) { return t.name == name; });
+            REQUIRE(test != tests.end());
+            return test->check;
+        };
+        CHECK(check_of("nestest/nestest.nes") == nes_rom_check_nestest);
+        CHECK(check_of("instr_test-v5/rom_singles/01-basics.nes") == nes_rom_check_blargg);
+        CHECK(check_of("blargg_ppu_tests/vram_access.nes") == nes_rom_check_blargg_ppu);
+        CHECK(check_of("color_test/color_test.nes") == nes_rom_check_smoke);
+
+        CHECK(nes_rom_suite::discover("./no_such_dir").empty());
+    }
+    SUBCASE("run_all") {
+        cout << "Running [ROM_SUITE][run_all]..." << endl;
+
+        // The suite's systems don't trace into the process wide tracer - nothing ends up in here
+        INIT_TRACE("neschan.rom_suite.run_all.log");
+
+        auto tests = nes_rom_suite::discover("./roms");
+        tests.erase(remove_if(tests.begin(), tests.end(), [](const nes_rom_test &test) { return !is_quick(test); }), tests.end());
+        REQUIRE(tests.size() > 4);
+
+        auto serial = nes_rom_suite::run_all(tests, 1);
+
+        size_t callbacks = 0;
+        auto parallel = nes_rom_suite::run_all(tests, 4, [&](const nes_rom_test_result &) { callbacks++; });
+        CHECK(callbacks == tests.size());
+
+        // Same results in the same order, however the threads get to them
+        REQUIRE(parallel.size() == serial.size());
+        for (size_t i = 0; i < tests.size(); ++i)
+        {
+            CHECK(parallel[i].test.name == tests[i].name);
+            CHECK(parallel[i].passed == serial[i].passed);
+            CHECK(parallel[i].frames == serial[i].frames);
+            CHECK(parallel[i].detail == serial[i].detail);
+
+            // power_up_palette expects palette RAM values from a different console
+            bool expected = tests[i].name.find("power_up_palette") == string::npos;
+            CHECK(parallel[i].passed == expected);
+        }
+
+        CHECK(ifstream("neschan.rom_suite.run_all.log", ios::ate).tellg() == 0);
+
+        nes_rom_test missing = { "missing.nes", "./roms/missing.nes", nes_rom_check_smoke };
+        auto result = nes_rom_suite::run(missing);
+        CHECK(!result.passed);
+        CHECK(!result.detail.empty());
+    }
+}
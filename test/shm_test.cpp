@@ -0,0 +1,160 @@
+#include "stdafx.h"
+
+#include "doctest.h"
+#include "nes_trace.h"
+#include "nes_system.h"
+#include "nes_input.h"
+#include "nes_ppu.h"
+#include "nes_shm.h"
+
+#include <thread>
+
+// POSIX shm only - see nes_shm_segment
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace
+{
+    nes_button_flags buttons_for(uint32_t slot, uint32_t frame)
+    {
+        return frame >= 10 + slot * 5 ? nes_button_flags_start : nes_button_flags_none;
+    }
+}
+
+TEST_CASE("shm_tests") {
+    const char *rom_path = "./roms/color_test/color_test.nes";
+    string name = "/neschan.test." + to_string(getpid());
+
+    SUBCASE("step") {
+        INIT_TRACE("neschan.shm.step.log");
+        cout << "Running [SHM][step]..." << endl;
+
+        const uint32_t slots = 3;
+        const uint32_t frames = 30;
+
+        shared_ptr<nes_shm_segment> segment = nes_shm_segment::create(name.c_str(), slots);
+        REQUIRE(segment != nullptr);
+        nes_shm_server server(segment, rom_path);
+        server.set_reward([](nes_system &system) { return float(system.ppu()->frame_count()) / 2; });
+        thread serving([&] { server.run(); });
+
+        // Agent maps it separately, like another process would
+        auto agent = nes_shm_segment::open(name.c_str());
+        REQUIRE(agent != nullptr);
+        CHECK(agent->slot_count() == slots);
+        CHECK(agent->header().frame_width == PPU_SCREEN_X);
+
+        // All slots step at the same time, each with its own buttons
+        for (uint32_t frame = 0; frame < frames; ++frame)
+        {
+            for (uint32_t slot = 0; slot < slots; ++slot)
+            {
+                nes_button_flags actions[NES_MAX_PLAYER] = { buttons_for(slot, frame) };
+                agent->post(slot, nes_shm_command_step, actions);
+            }
+            for (uint32_t slot = 0; slot < slots; ++slot)
+            {
+                REQUIRE(agent->wait(slot, 10000));
+                CHECK(agent->slot(slot).status == nes_shm_status_ok);
+                CHECK(agent->slot(slot).frame == frame + 1);
+                CHECK(agent->slot(slot).reward == float(frame + 1) / 2);
+            }
+        }
+
+        // Same frame and RAM as emulating the same buttons directly
+        for (uint32_t slot = 0; slot < slots; ++slot)
+        {
+            nes_system system;
+            system.power_on();
+            system.load_rom(rom_path, nes_rom_exec_mode_reset);
+            system.input()->set_latch_mode(nes_input_latch_mode_manual);
+            for (uint32_t frame = 0; frame < frames; ++frame)
+            {
+                system.input()->set_latched_buttons(0, buttons_for(slot, frame));
+                REQUIRE(system.run_frame());
+            }
+
+            auto snapshot = system.snapshot();
+            CHECK(memcmp(agent->pixels(slot), snapshot.frame_buffer, PPU_SCREEN_X * PPU_SCREEN_Y) == 0);
+            CHECK(memcmp(agent->ram(slot), snapshot.cpu_ram, NES_SHM_RAM_SIZE) == 0);
+        }
+
+        nes_button_flags none[NES_MAX_PLAYER] = {};
+        agent->post(0, nes_shm_command_reset, none);
+        REQUIRE(agent->wait(0, 10000));
+        CHECK(agent->slot(0).frame == 0);
+
+        for (uint32_t slot = 0; slot < slots; ++slot)
+        {
+            agent->post(slot, nes_shm_command_close, none);
+            REQUIRE(agent->wait(slot, 10000));
+            CHECK(agent->slot(slot).status == nes_shm_status_closed);
+        }
+
+        serving.join();
+    }
+    SUBCASE("open") {
+        INIT_TRACE("neschan.shm.open.log");
+        cout << "Running [SHM][open]..." << endl;
+
+        CHECK(nes_shm_segment::open(name.c_str()) == nullptr);
+
+        // Name goes away with the segment that created it
+        {
+            auto segment = nes_shm_segment::create(name.c_str(), 1);
+            REQUIRE(segment != nullptr);
+            CHECK(nes_shm_segment::open(name.c_str()) != nullptr);
+
+            // Nothing serving it - waiting for an observation times out
+            nes_button_flags none[NES_MAX_PLAYER] = {};
+            segment->post(0, nes_shm_command_step, none);
+            CHECK(!segment->wait(0, 50));
+        }
+        CHECK(nes_shm_segment::open(name.c_str()) == nullptr);
+
+        // A second emulator doesn't take the name over from one that is still running
+        {
+            auto segment = nes_shm_segment::create(name.c_str(), 2);
+            REQUIRE(segment != nullptr);
+            CHECK(nes_shm_segment::create(name.c_str(), 1) == nullptr);
+
+            auto agent = nes_shm_segment::open(name.c_str());
+            REQUIRE(agent != nullptr);
+            CHECK(agent->slot_count() == 2);
+        }
+
+        // ... but does from one that exited without cleaning up
+        {
+            pid_t child = fork();
+            REQUIRE(child >= 0);
+            if (child == 0)
+            {
+                nes_shm_segment::create(name.c_str(), 2).release();
+                _exit(0);
+            }
+            waitpid(child, nullptr, 0);
+
+            auto stale = nes_shm_segment::open(name.c_str());
+            REQUIRE(stale != nullptr);
+            CHECK(stale->header().owner_pid == uint32_t(child));
+
+            auto segment = nes_shm_segment::create(name.c_str(), 1);
+            REQUIRE(segment != nullptr);
+            CHECK(segment->header().owner_pid == uint32_t(getpid()));
+            CHECK(nes_shm_segment::open(name.c_str())->slot_count() == 1);
+        }
+        CHECK(nes_shm_segment::open(name.c_str()) == nullptr);
+
+        // Stop takes a server out of waiting on slots that are never posted to
+        auto segment = shared_ptr<nes_shm_segment>(nes_shm_segment::create(name.c_str(), 2));
+        nes_shm_server server(segment, rom_path);
+        thread serving([&] { server.run(); });
+        server.stop();
+        serving.join();
+    }
+}
+
+#endif
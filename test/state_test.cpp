@@ -2,6 +2,7 @@
 
 #include "doctest.h"
 #include "nes_system.h"
+#include "nes_input.h"
 
 namespace
 {
@@ -20,16 +21,13 @@ namespace
             out.push_back(uint8_t((value >> (i * 8)) & 0xff));
     }
 
-    nes_system make_nestest_system(int steps = 5000)
+    void make_nestest_system(nes_system &system, int steps = 5000)
     {
-        nes_system system;
         system.power_on();
         system.load_rom("./roms/nestest/nestest.nes", nes_rom_exec_mode_direct);
 
         for (int i = 0; i < steps; ++i)
             system.step(nes_cycle_t(1));
-
-        return system;
     }
 
     nes_state_blob make_v1_fixture_from_system(nes_system &source)
@@ -46,9 +44,15 @@ namespace
         source.ppu()->serialize(ppu_state);
         source.input()->serialize(input_state);
 
+        // v1 and v2 share the same header layout - take the master cycle from the current v2 header
+        nes_state_blob current = source.serialize();
+        uint64_t master_cycle = 0;
+        for (int i = 0; i < 8; ++i)
+            master_cycle |= uint64_t(current.data[8 + i]) << (i * 8);
+
         push_u32(fixture.data, TEST_STATE_MAGIC);
         push_u32(fixture.data, TEST_STATE_VERSION_V1);
-        push_u64(fixture.data, uint64_t(0));
+        push_u64(fixture.data, master_cycle);
         fixture.data.push_back(0);
 
         push_u32(fixture.data, uint32_t(cpu_state.size()));
@@ -68,7 +72,8 @@ namespace
 }
 
 TEST_CASE("NES state v2 serialize/deserialize round-trip") {
-    nes_system system = make_nestest_system();
+    nes_system system;
+    make_nestest_system(system);
 
     nes_state_blob saved = system.serialize();
 
@@ -82,10 +87,12 @@ TEST_CASE("NES state v2 serialize/deserialize round-trip") {
 }
 
 TEST_CASE("NES state deserialize accepts known-good v1 fixture") {
-    nes_system source = make_nestest_system();
+    nes_system source;
+    make_nestest_system(source);
     nes_state_blob v1_fixture = make_v1_fixture_from_system(source);
 
-    nes_system target = make_nestest_system(100);
+    nes_system target;
+    make_nestest_system(target, 100);
     CHECK(target.deserialize(v1_fixture));
 
     nes_state_blob target_after_restore = target.serialize();
@@ -94,7 +101,8 @@ TEST_CASE("NES state deserialize accepts known-good v1 fixture") {
 }
 
 TEST_CASE("NES state deserialize rejects future version") {
-    nes_system system = make_nestest_system();
+    nes_system system;
+    make_nestest_system(system);
     nes_state_blob blob = system.serialize();
 
     blob.data[4] = 3;
@@ -106,7 +114,8 @@ TEST_CASE("NES state deserialize rejects future version") {
 }
 
 TEST_CASE("NES state deserialize rejects unknown old version") {
-    nes_system system = make_nestest_system();
+    nes_system system;
+    make_nestest_system(system);
     nes_state_blob blob = system.serialize();
 
     blob.data[4] = 0;
@@ -116,3 +125,23 @@ TEST_CASE("NES state deserialize rejects unknown old version") {
 
     CHECK_FALSE(system.deserialize(blob));
 }
+
+TEST_CASE("NES state hash is deterministic under replayed input") {
+    auto run = [](const std::vector<nes_button_flags> &stream) {
+        nes_system system;
+        system.power_on();
+        system.input()->register_input_stream(0, stream);
+        system.ppu()->stop_after_frame(20);
+        system.run_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+        return system.serialize().hash();
+    };
+
+    std::vector<nes_button_flags> idle(30, nes_button_flags_none);
+    std::vector<nes_button_flags> pressed(idle);
+    for (int frame = 10; frame < 30; ++frame)
+        pressed[frame] = nes_button_flags_start;
+
+    CHECK(run(idle) == run(idle));
+    CHECK(run(pressed) == run(pressed));
+    CHECK(run(idle) != run(pressed));
+}
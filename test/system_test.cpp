@@ -0,0 +1,115 @@
+#include "stdafx.h"
+
+#include "doctest.h"
+#include "nes_trace.h"
+#include "nes_system.h"
+#include "nes_memory.h"
+#include "nes_ppu.h"
+#include "nes_input.h"
+#include "nes_arena.h"
+
+#include <atomic>
+#include <thread>
+
+using namespace std;
+
+namespace
+{
+    const uint32_t STRESS_FRAMES = 8;
+
+    // Some button changes so that every system takes the same non-trivial path. Returns false if
+    // emulation got stopped - doesn't check anything itself, it runs on other threads
+    bool run_system(nes_system &system, uint32_t frames)
+    {
+        system.power_on();
+        system.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+        system.input()->set_latch_mode(nes_input_latch_mode_manual);
+
+        nes_button_flags buttons[NES_MAX_PLAYER] = {};
+        for (uint32_t frame = 0; frame < frames; ++frame)
+        {
+            buttons[0] = (frame % 3 == 1) ? nes_button_flags_right : nes_button_flags_none;
+            system.input()->set_latched_buttons(buttons);
+            if (!system.run_frame())
+                return false;
+        }
+        return true;
+    }
+
+    bool is_aligned(const void *p)
+    {
+        return (reinterpret_cast<uintptr_t>(p) % NES_ARENA_ALIGN) == 0;
+    }
+}
+
+TEST_CASE("system_tests") {
+    SUBCASE("arena") {
+        INIT_TRACE("neschan.system.arena.log");
+        cout << "Running [SYSTEM][arena]..." << endl;
+
+        nes_system system;
+        auto &arena = system.arena();
+
+        // Components and their buffers, all in the one allocation and on their own cache lines
+        const void *placed[] = { system.cpu(), system.ram(), system.ppu(), system.input(),
+            system.ram()->ram_data(), system.ppu()->vram(), system.ppu()->oam(), system.ppu()->frame_buffer(),
+            system.cpu()->block_cache() };
+        for (auto p : placed)
+        {
+            CHECK(arena.contains(p));
+            CHECK(is_aligned(p));
+        }
+        CHECK(arena.used() <= arena.capacity());
+        CHECK(arena.capacity() - arena.used() < NES_ARENA_ALIGN);
+
+        // Node 0 always exists - whether it got bound depends on the OS
+        nes_system on_node(0);
+        CHECK(on_node.arena().numa_node() == 0);
+        CHECK(on_node.arena().contains(on_node.ppu()));
+
+        nes_arena small(100);
+        CHECK(small.allocate(60) != nullptr);
+        CHECK(small.allocate(60) == nullptr);
+        CHECK(small.allocate(36) != nullptr);
+    }
+    SUBCASE("threads") {
+        INIT_TRACE("neschan.system.threads.log");
+        cout << "Running [SYSTEM][threads]..." << endl;
+
+        // Systems don't share the process wide tracer unless asked to
+        nes_system reference;
+        CHECK(reference.tracer() == nullptr);
+        REQUIRE(run_system(reference, STRESS_FRAMES));
+        uint64_t expected_hash = reference.serialize().hash();
+
+        // One system per thread, all at once - systems share nothing but the tracer, which they
+        // don't get here
+        const int THREAD_COUNT = 64;
+        vector<uint64_t> hashes(THREAD_COUNT);
+        atomic<int> started(0);
+        vector<thread> threads;
+        for (int i = 0; i < THREAD_COUNT; ++i)
+        {
+            threads.emplace_back([&, i] {
+                started++;
+                while (started < THREAD_COUNT)
+                    this_thread::yield();
+
+                // No tracer by default - nothing shared between the threads
+                nes_system system;
+                hashes[i] = run_system(system, STRESS_FRAMES) ? system.serialize().hash() : 0;
+            });
+        }
+
+        for (auto &t : threads)
+            t.join();
+
+        int mismatches = 0;
+        for (auto hash : hashes)
+        {
+            if (hash != expected_hash)
+                mismatches++;
+        }
+        CHECK(mismatches == 0);
+    }
+}
@@ -4,5 +4,8 @@
 #include "stdafx.h"
 
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+// Newer glibc makes SIGSTKSZ a runtime value which this doctest version can't size arrays with
+#define DOCTEST_CONFIG_NO_POSIX_SIGNALS
 #include "doctest.h"
 
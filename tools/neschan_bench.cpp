@@ -0,0 +1,707 @@
+//=================================================================================================
+// NESChan
+// Author: Yi Zhang (yizhang82@outlook.com)
+//
+// neschan_bench - microbenchmarks for neschanlib, reported as JSON
+//
+// Usage: neschan_bench [--roms <dir>] [--filter <substring>] [--repetitions <n>] [--min-time <seconds>]
+//                      [--out <file>]
+//
+// ROMs are the ones under test/roms - by default it expects to run from test/ just like the tests.
+// Every benchmark is deterministic (same ROM, same number of frames / instructions every time). Each
+// repetition runs it for at least --min-time and the median repetition is reported.
+//=================================================================================================
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "nes_cycle.h"
+#include "nes_component.h"
+#include "nes_system.h"
+#include "nes_memory.h"
+#include "nes_mapper.h"
+#include "nes_ppu.h"
+#include "nes_cpu.h"
+#include "nes_input.h"
+#include "nes_trace.h"
+#include "nes_observation.h"
+#include "nes_rollback.h"
+#include "nes_worker_pool.h"
+#include "nes_batch.h"
+
+using namespace std;
+
+namespace
+{
+    struct bench_options
+    {
+        string roms = "./roms";
+        string filter;
+        int repetitions = 5;
+        double min_time = 0.2;
+        const char *out_path = nullptr;
+    };
+
+    // What one run of a benchmark did
+    struct bench_work
+    {
+        uint64_t ops;
+        uint64_t frames;
+        uint64_t bytes;
+    };
+
+    struct bench_result
+    {
+        string name;
+        string unit;                // what an op is
+        uint64_t iterations;        // runs in the median repetition
+        double ns_per_op;           // median
+        double min_ns_per_op;
+        double max_ns_per_op;
+        double ops_per_sec;
+        double frames_per_sec;      // 0 if the benchmark doesn't produce frames
+        double bytes_per_sec;       // 0 if the benchmark doesn't move bytes
+        double render_ratio;        // visible scanlines with rendering on - < 0 if not applicable
+    };
+
+    double seconds_since(chrono::steady_clock::time_point start)
+    {
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+
+    // Steps until the system stops itself (KIL, infinite loop, stop_after_frame, etc)
+    void run_until_stop(nes_system &system)
+    {
+        // Same amount the app steps per frame
+        const nes_cycle_t cycles_per_frame = nes_cycle_t(NES_CLOCK_HZ / 60);
+        while (!system.stop_requested())
+            system.step(cycles_per_frame);
+    }
+
+    // Puts system back to a state taken with serialize - cheaper than power_on + load_rom, which would
+    // otherwise be measured along with the emulation
+    void restore_state(nes_system &system, const nes_state_blob &state)
+    {
+        bool succeeded = system.deserialize(state);
+        assert(succeeded);
+        (void)succeeded;
+    }
+
+    // JIT builds are measured with the JIT on - that is what they would run with
+    void enable_jit(nes_system &system)
+    {
+#ifdef NESCHAN_JIT
+        system.cpu()->enable_jit();
+#endif
+    }
+
+    //
+    // Instructions / visible scanlines rendered of an emulation run, using perf counters. This is only
+    // done once up front as perf counters change what is being measured (and bypass the JIT)
+    //
+    struct emulation_profile
+    {
+        uint64_t instructions;
+        uint64_t render_scanlines;
+    };
+
+    emulation_profile profile_emulation(nes_system &system)
+    {
+        emulation_profile profile = {};
+
+        system.enable_perf_counters(true);
+        uint32_t frame = system.ppu()->frame_count();
+        while (!system.stop_requested())
+        {
+            // Small enough steps to never skip over a whole frame of counters
+            system.step(nes_cycle_t(PPU_SCANLINE_CYCLE));
+            if (system.ppu()->frame_count() != frame)
+            {
+                frame = system.ppu()->frame_count();
+                auto last = system.perf_snapshot();
+                profile.instructions += last.instructions;
+                profile.render_scanlines += last.render_scanlines;
+            }
+        }
+
+        profile.instructions += system.perf()->instructions;
+        profile.render_scanlines += system.perf()->render_scanlines;
+        system.enable_perf_counters(false);
+
+        return profile;
+    }
+
+    class bench_runner
+    {
+    public :
+        bench_runner(const bench_options &options)
+            :_options(options)
+        {}
+
+        // fn runs the benchmark once and returns what it did
+        void run(const string &name, const char *unit, function<bench_work()> fn, double render_ratio = -1)
+        {
+            if (!_options.filter.empty() && name.find(_options.filter) == string::npos)
+                return;
+
+            cerr << "Running [" << name << "]..." << endl;
+
+            // Warm up caches / allocations
+            fn();
+
+            struct repetition
+            {
+                uint64_t iterations;
+                bench_work work;
+                double seconds;
+                double ns_per_op;
+            };
+            vector<repetition> reps;
+
+            for (int i = 0; i < _options.repetitions; ++i)
+            {
+                repetition rep = {};
+                auto start = chrono::steady_clock::now();
+                do
+                {
+                    auto work = fn();
+                    rep.work.ops += work.ops;
+                    rep.work.frames += work.frames;
+                    rep.work.bytes += work.bytes;
+                    rep.iterations++;
+                } while (seconds_since(start) < _options.min_time);
+
+                rep.seconds = seconds_since(start);
+                rep.ns_per_op = rep.seconds * 1e9 / max<uint64_t>(rep.work.ops, 1);
+                reps.push_back(rep);
+            }
+
+            sort(reps.begin(), reps.end(), [](const repetition &a, const repetition &b) { return a.ns_per_op < b.ns_per_op; });
+            auto &median = reps[reps.size() / 2];
+
+            bench_result result;
+            result.name = name;
+            result.unit = unit;
+            result.iterations = median.iterations;
+            result.ns_per_op = median.ns_per_op;
+            result.min_ns_per_op = reps.front().ns_per_op;
+            result.max_ns_per_op = reps.back().ns_per_op;
+            result.ops_per_sec = median.work.ops / median.seconds;
+            result.frames_per_sec = median.work.frames / median.seconds;
+            result.bytes_per_sec = median.work.bytes / median.seconds;
+            result.render_ratio = render_ratio;
+            _results.push_back(result);
+        }
+
+        string to_json() const
+        {
+            ostringstream out;
+            out << setprecision(6) << fixed;
+
+            char date[32];
+            time_t now = time(nullptr);
+            strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+            out << "{" << endl;
+            out << "  \"context\": {" << endl;
+            out << "    \"date\": \"" << date << "\"," << endl;
+#ifdef NDEBUG
+            out << "    \"build_type\": \"release\"," << endl;
+#else
+            out << "    \"build_type\": \"debug\"," << endl;
+#endif
+#ifdef NESCHAN_JIT
+            out << "    \"jit\": true," << endl;
+#else
+            out << "    \"jit\": false," << endl;
+#endif
+            out << "    \"trace_max_level\": " << NES_TRACE_MAX_LEVEL << "," << endl;
+            out << "    \"repetitions\": " << _options.repetitions << "," << endl;
+            out << "    \"min_time\": " << _options.min_time << endl;
+            out << "  }," << endl;
+
+            out << "  \"benchmarks\": [";
+            for (size_t i = 0; i < _results.size(); ++i)
+            {
+                auto &result = _results[i];
+                out << (i ? "," : "") << endl << "    {";
+                out << "\"name\": \"" << result.name << "\", ";
+                out << "\"unit\": \"" << result.unit << "\", ";
+                out << "\"iterations\": " << result.iterations << ", ";
+                out << "\"ns_per_op\": " << result.ns_per_op << ", ";
+                out << "\"min_ns_per_op\": " << result.min_ns_per_op << ", ";
+                out << "\"max_ns_per_op\": " << result.max_ns_per_op << ", ";
+                out << "\"ops_per_sec\": " << result.ops_per_sec;
+                if (result.frames_per_sec > 0)
+                    out << ", \"frames_per_sec\": " << result.frames_per_sec;
+                if (result.bytes_per_sec > 0)
+                    out << ", \"bytes_per_sec\": " << result.bytes_per_sec;
+                if (result.render_ratio >= 0)
+                    out << ", \"render_ratio\": " << result.render_ratio;
+                out << "}";
+            }
+            out << endl << "  ]" << endl << "}" << endl;
+
+            return out.str();
+        }
+
+    private :
+        const bench_options &_options;
+        vector<bench_result> _results;
+    };
+
+    //
+    // CPU - instructions / sec running CPU test ROMs to completion
+    //
+    void bench_cpu_rom(bench_runner &runner, const string &name, const string &path, nes_rom_exec_mode mode)
+    {
+        nes_system system;
+        system.power_on();
+        system.load_rom(path.c_str(), mode);
+
+        // Test ROMs in reset mode spin forever once they are done
+        if (mode == nes_rom_exec_mode_reset)
+            system.cpu()->stop_at_infinite_loop();
+
+        auto start = system.serialize();
+        enable_jit(system);
+        uint64_t instructions = profile_emulation(system).instructions;
+
+        runner.run(name, "instruction", [&]() {
+            restore_state(system, start);
+            run_until_stop(system);
+            return bench_work{ instructions, 0, 0 };
+        });
+    }
+
+    // Writes a generated ROM next to the benchmark and returns its path
+    string write_rom(const string &name, const vector<uint8_t> &rom)
+    {
+        string path = "neschan_bench." + name + ".nes";
+        ofstream file(path, ios::out | ios::binary | ios::trunc);
+        file.write(reinterpret_cast<const char *>(rom.data()), rom.size());
+        return path;
+    }
+
+    //
+    // Game logic like loop with rendering off - zero page / absolute loads, ALU ops and stores plus
+    // register ops, 256 x 256 times. The test ROMs spend most of their time rendering text, this one
+    // is mostly CPU (block cache / JIT)
+    //
+    string make_cpu_loop_rom()
+    {
+        vector<uint8_t> rom(0x10 + 0x4000 + 0x2000);
+        memcpy(rom.data(), "NES\x1a", 4);
+        rom[4] = 1;         // 16KB PRG at $8000 and $c000
+        rom[5] = 1;
+
+        const vector<uint8_t> code = {
+            0xa2, 0x00,         // 8000: LDX #$00
+            0xa9, 0x00,         //       LDA #$00
+            0x85, 0x20,         //       STA $20        outer count
+            0xa5, 0x10,         // 8006: LDA $10
+            0x18,               //       CLC
+            0x69, 0x03,         //       ADC #$03
+            0x85, 0x10,         //       STA $10
+            0xad, 0x00, 0x02,   //       LDA $0200
+            0x45, 0x11,         //       EOR $11
+            0x8d, 0x01, 0x02,   //       STA $0201
+            0xa8,               //       TAY
+            0xc8,               //       INY
+            0x84, 0x12,         //       STY $12
+            0xc9, 0x40,         //       CMP #$40
+            0xe8,               //       INX
+            0xd0, 0xe8,         //       BNE $8006
+            0xc6, 0x20,         //       DEC $20
+            0xd0, 0xe4,         //       BNE $8006
+            0x00,               //       BRK            stops
+        };
+        memcpy(&rom[0x10], code.data(), code.size());
+
+        // NMI / reset / IRQ all at $8000 - NMI never gets enabled
+        size_t prg_end = 0x10 + 0x4000;
+        for (int vector = 0; vector < 3; ++vector)
+        {
+            rom[prg_end - 6 + vector * 2] = 0x00;
+            rom[prg_end - 5 + vector * 2] = 0x80;
+        }
+
+        return write_rom("cpu_loop", rom);
+    }
+
+    //
+    // PPU - frames / sec of a ROM, with whatever rendering the ROM does. render_ratio tells how much
+    // of it was actually rendered
+    //
+    void bench_ppu_rom(bench_runner &runner, const string &name, const string &path, uint32_t frames)
+    {
+        nes_system system;
+        system.power_on();
+        system.load_rom(path.c_str(), nes_rom_exec_mode_reset);
+        system.ppu()->stop_after_frame(frames - 1);
+
+        auto start = system.serialize();
+        enable_jit(system);
+        auto profile = profile_emulation(system);
+        double render_ratio = double(profile.render_scanlines) / (double(frames) * PPU_SCREEN_Y);
+
+        runner.run(name, "frame", [&]() {
+            restore_state(system, start);
+            run_until_stop(system);
+            return bench_work{ frames, frames, 0 };
+        }, render_ratio);
+    }
+
+    //
+    // State - nes_system::serialize / deserialize of a system in the middle of rendering
+    //
+    void bench_state(bench_runner &runner, const string &roms)
+    {
+        nes_system system;
+        system.power_on();
+        system.ppu()->stop_after_frame(10);
+        system.load_rom((roms + "/color_test/color_test.nes").c_str(), nes_rom_exec_mode_reset);
+        run_until_stop(system);
+
+        const int count = 100;
+        size_t size = system.serialize().data.size();
+
+        runner.run("state/serialize", "serialize", [&]() {
+            for (int i = 0; i < count; ++i)
+            {
+                auto state = system.serialize();
+                assert(state.data.size() == size);
+            }
+            return bench_work{ uint64_t(count), 0, uint64_t(count * size) };
+        });
+
+        auto state = system.serialize();
+        runner.run("state/deserialize", "deserialize", [&]() {
+            for (int i = 0; i < count; ++i)
+            {
+                restore_state(system, state);
+            }
+            return bench_work{ uint64_t(count), 0, uint64_t(count * size) };
+        });
+    }
+
+    //
+    // Rollback - a late input for the oldest frame of an 8 frame window, which re-simulates all 8
+    // frames. Has to fit in a frame (16.6ms) with room to spare for netplay to be playable
+    //
+    void bench_rollback(bench_runner &runner, const string &roms)
+    {
+        const uint32_t window = 8;
+
+        nes_system system;
+        system.power_on();
+        system.load_rom((roms + "/color_test/color_test.nes").c_str(), nes_rom_exec_mode_reset);
+        nes_rollback_session session(system, window);
+
+        nes_rollback_inputs inputs = {};
+        for (uint32_t i = 0; i < window; ++i)
+            session.advance(inputs);
+
+        runner.run("rollback/resimulate_8", "rollback", [&]() {
+            // Flip between two inputs so that every correction actually differs
+            auto corrected = session.inputs(session.oldest_frame());
+            corrected.buttons[1] = nes_button_flags(corrected.buttons[1] ^ nes_button_flags_a);
+            bool succeeded = session.rollback_to(session.oldest_frame(), corrected);
+            assert(succeeded);
+            (void)succeeded;
+            return bench_work{ 1, window, 0 };
+        });
+    }
+
+    //
+    // Mappers - cost of a bank switch through the CPU bus (nes_memory::set_byte), including PPU
+    // catch-up and throwing away decoded blocks. None of the test ROMs switch banks so this makes
+    // a ROM with 8 PRG banks of 16KB and 8 CHR banks of 8KB for each mapper that can switch
+    //
+    string make_bank_switch_rom(const string &name, uint8_t mapper_id)
+    {
+        const int prg_banks = 8;        // 16KB each
+        const int chr_banks = 8;        // 8KB each
+
+        vector<uint8_t> rom(0x10 + prg_banks * 0x4000 + chr_banks * 0x2000);
+        memcpy(rom.data(), "NES\x1a", 4);
+        rom[4] = prg_banks;
+        rom[5] = chr_banks;
+        rom[6] = uint8_t(mapper_id << 4);
+
+        // Fill banks with something distinct - reset handler in the fixed last 8KB loops forever
+        for (size_t i = 0x10; i < rom.size(); ++i)
+            rom[i] = uint8_t(i >> 13);
+
+        size_t prg_end = 0x10 + prg_banks * 0x4000;
+        uint8_t *code = &rom[prg_end - 0x2000];
+        code[0] = 0x4c;     // JMP $E000
+        code[1] = 0x00;
+        code[2] = 0xe0;
+        for (int vector = 0; vector < 3; ++vector)
+        {
+            rom[prg_end - 6 + vector * 2] = 0x00;
+            rom[prg_end - 5 + vector * 2] = 0xe0;
+        }
+
+        return write_rom(name, rom);
+    }
+
+    void bench_mappers(bench_runner &runner)
+    {
+        const int count = 1000;
+
+        {
+            auto path = make_bank_switch_rom("mmc1", 1);
+            nes_system system;
+            system.power_on();
+            system.load_rom(path.c_str(), nes_rom_exec_mode_reset);
+            remove(path.c_str());
+
+            auto ram = system.ram();
+            runner.run("mapper/mmc1_prg_switch", "switch", [&]() {
+                for (int i = 0; i < count; ++i)
+                {
+                    // PRG bank register is written serially - 5 writes, lowest bit first
+                    uint8_t bank = uint8_t(i & 0x7);
+                    for (int bit = 0; bit < 5; ++bit)
+                        ram->set_byte(0xe000, uint8_t((bank >> bit) & 1));
+                }
+                return bench_work{ uint64_t(count), 0, 0 };
+            });
+        }
+
+        {
+            auto path = make_bank_switch_rom("mmc3", 4);
+            nes_system system;
+            system.power_on();
+            system.load_rom(path.c_str(), nes_rom_exec_mode_reset);
+            remove(path.c_str());
+
+            auto ram = system.ram();
+            runner.run("mapper/mmc3_prg_switch", "switch", [&]() {
+                for (int i = 0; i < count; ++i)
+                {
+                    // R6 - 8KB PRG bank at $8000
+                    ram->set_byte(0x8000, 0x06);
+                    ram->set_byte(0x8001, uint8_t(i & 0xf));
+                }
+                return bench_work{ uint64_t(count), 0, 0 };
+            });
+
+            runner.run("mapper/mmc3_chr_switch", "switch", [&]() {
+                for (int i = 0; i < count; ++i)
+                {
+                    // R2 - 1KB CHR bank at PPU $1000
+                    ram->set_byte(0x8000, 0x02);
+                    ram->set_byte(0x8001, uint8_t(i & 0x3f));
+                }
+                return bench_work{ uint64_t(count), 0, 0 };
+            });
+        }
+    }
+
+    //
+    // Frame conversion - palette indices to 0x00RRGGBB, what the app does every frame
+    //
+    void bench_frame_conversion(bench_runner &runner, const string &roms)
+    {
+        nes_system system;
+        system.power_on();
+        system.ppu()->stop_after_frame(10);
+        system.load_rom((roms + "/color_test/color_test.nes").c_str(), nes_rom_exec_mode_reset);
+        run_until_stop(system);
+
+        const int count = 100;
+        const uint8_t *frame = system.ppu()->frame_buffer();
+        vector<uint32_t> pixels(size_t(PPU_SCREEN_X) * PPU_SCREEN_Y);
+
+        runner.run("frame/to_argb", "frame", [&]() {
+            for (int i = 0; i < count; ++i)
+                nes_ppu::frame_to_argb(frame, pixels.data());
+            return bench_work{ uint64_t(count), uint64_t(count), uint64_t(count) * pixels.size() * sizeof(uint32_t) };
+        });
+    }
+
+    //
+    // Observations - frame to model input (nes_observation), with SIMD kernels and with plain loops
+    //
+    void bench_observation(bench_runner &runner, const string &roms)
+    {
+        nes_system system;
+        system.power_on();
+        system.ppu()->stop_after_frame(10);
+        system.load_rom((roms + "/color_test/color_test.nes").c_str(), nes_rom_exec_mode_reset);
+        run_until_stop(system);
+
+        const int count = 100;
+        const uint8_t *frame = system.ppu()->frame_buffer();
+
+        struct observation_bench
+        {
+            const char *name;
+            nes_observation_spec spec;
+        };
+        const observation_bench benches[] = {
+            { "luma", { nes_observation_format_luma, 1, false } },
+            { "luma_2x", { nes_observation_format_luma, 2, false } },
+            { "luma_4x_crop", { nes_observation_format_luma, 4, true } },
+        };
+
+        for (auto &bench : benches)
+        {
+            nes_observation observation(bench.spec);
+            vector<uint8_t> out(observation.size());
+            for (bool simd : { true, false })
+            {
+                nes_observation::enable_simd(simd);
+                runner.run(string("observation/") + bench.name + (simd ? "" : "/scalar"), "frame", [&]() {
+                    for (int i = 0; i < count; ++i)
+                        observation.transform(frame, out.data());
+                    return bench_work{ uint64_t(count), uint64_t(count), uint64_t(count) * PPU_SCREEN_X * PPU_SCREEN_Y };
+                });
+            }
+            nes_observation::enable_simd(true);
+        }
+
+        nes_observation_stack stack({ nes_observation_format_luma, 2, true }, 4);
+        vector<uint8_t> stacked(stack.observation().size() * stack.depth());
+        runner.run("observation/stack_4_luma_2x_crop", "frame", [&]() {
+            for (int i = 0; i < count; ++i)
+            {
+                stack.push(frame);
+                stack.copy_to(stacked.data());
+            }
+            return bench_work{ uint64_t(count), uint64_t(count), uint64_t(count) * PPU_SCREEN_X * PPU_SCREEN_Y };
+        });
+    }
+
+    //
+    // Batch - many color_test instances on a nes_worker_pool, 1 worker up to one per CPU. Same number
+    // of instances per worker so that frames / second should grow with the workers until memory
+    // bandwidth runs out. Unpinned runs are there to compare against
+    //
+    void bench_batch(bench_runner &runner, const string &roms)
+    {
+        const uint32_t instances_per_worker = 4;
+        const uint32_t frames = 10;
+
+        uint32_t core_count = uint32_t(nes_worker_pool::cores().size());
+        vector<uint32_t> worker_counts;
+        for (uint32_t workers = 1; workers < core_count; workers *= 2)
+            worker_counts.push_back(workers);
+        worker_counts.push_back(core_count);
+
+        for (bool pin : { true, false })
+        {
+            for (auto workers : worker_counts)
+            {
+                nes_worker_pool pool(workers, pin);
+                nes_batch_runner batch(pool, roms + "/color_test/color_test.nes", workers * instances_per_worker);
+
+                uint64_t total_frames = uint64_t(batch.instance_count()) * frames;
+                runner.run(string("batch/") + (pin ? "pinned" : "unpinned") + "/workers_" + to_string(workers), "frame", [&]() {
+                    bool succeeded = batch.run_frames(frames);
+                    assert(succeeded);
+                    (void)succeeded;
+                    return bench_work{ total_frames, total_frames, 0 };
+                });
+            }
+        }
+    }
+
+    bool parse_options(int argc, char *argv[], bench_options &options)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            string arg = argv[i];
+            if (i + 1 >= argc)
+                return false;
+
+            if (arg == "--roms")
+                options.roms = argv[++i];
+            else if (arg == "--filter")
+                options.filter = argv[++i];
+            else if (arg == "--repetitions")
+                options.repetitions = max(1, atoi(argv[++i]));
+            else if (arg == "--min-time")
+                options.min_time = atof(argv[++i]);
+            else if (arg == "--out")
+                options.out_path = argv[++i];
+            else
+                return false;
+        }
+
+        return true;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    bench_options options;
+    if (!parse_options(argc, argv, options))
+    {
+        cerr << "Usage: neschan_bench [--roms <dir>] [--filter <substring>] [--repetitions <n>] [--min-time <seconds>] [--out <file>]" << endl;
+        return 1;
+    }
+
+    bench_runner runner(options);
+    auto &roms = options.roms;
+
+    try
+    {
+        bench_cpu_rom(runner, "cpu/nestest", roms + "/nestest/nestest.nes", nes_rom_exec_mode_direct);
+        for (auto test : { "01-basics", "04-zero_page", "06-absolute", "10-branches", "11-stack" })
+            bench_cpu_rom(runner, string("cpu/instr_test-v5/") + test, roms + "/instr_test-v5/rom_singles/" + test + ".nes", nes_rom_exec_mode_reset);
+
+        auto cpu_loop = make_cpu_loop_rom();
+        bench_cpu_rom(runner, "cpu/alu_loop", cpu_loop, nes_rom_exec_mode_reset);
+        remove(cpu_loop.c_str());
+
+        // color_test renders every frame, vbl_clear_time keeps rendering off for its first 10 frames
+        bench_ppu_rom(runner, "ppu/render_on/color_test", roms + "/color_test/color_test.nes", 60);
+        bench_ppu_rom(runner, "ppu/render_off/vbl_clear_time", roms + "/blargg_ppu_tests/vbl_clear_time.nes", 10);
+
+        bench_state(runner, roms);
+        bench_rollback(runner, roms);
+        bench_mappers(runner);
+        bench_frame_conversion(runner, roms);
+        bench_observation(runner, roms);
+        bench_batch(runner, roms);
+    }
+    catch (std::exception &ex)
+    {
+        cerr << "Benchmark failed: " << ex.what() << " (are ROMs under " << roms << "? see --roms)" << endl;
+        return 1;
+    }
+
+    auto json = runner.to_json();
+    if (options.out_path)
+    {
+        ofstream file(options.out_path);
+        if (!file)
+        {
+            cerr << "Can't open " << options.out_path << endl;
+            return 1;
+        }
+        file << json;
+    }
+    else
+    {
+        cout << json;
+    }
+
+    return 0;
+}
@@ -0,0 +1,232 @@
+//=================================================================================================
+// NESChan
+// Author: Yi Zhang (yizhang82@outlook.com)
+//
+// neschan_replay - converts text input logs (doc/replay_input_log.md) to binary replays and back
+//
+// Usage: neschan_replay convert <input log> <replay file> [--rom <rom file>]
+//        neschan_replay dump <replay file>
+//        neschan_replay keyframes <replay file> <rom file> <output file> [--interval <frames>] [--frames <n>]
+//        neschan_replay verify <replay file> <rom file> [--threads <n>]
+//=================================================================================================
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include "nes_cycle.h"
+#include "nes_component.h"
+#include "nes_system.h"
+#include "nes_memory.h"
+#include "nes_mapper.h"
+#include "nes_ppu.h"
+#include "nes_cpu.h"
+#include "nes_input.h"
+#include "nes_trace.h"
+#include "nes_replay.h"
+
+using namespace std;
+
+namespace
+{
+    void usage()
+    {
+        cerr << "Usage: neschan_replay convert <input log> <replay file> [--rom <rom file>]" << endl;
+        cerr << "       neschan_replay dump <replay file>" << endl;
+        cerr << "       neschan_replay keyframes <replay file> <rom file> <output file> [--interval <frames>] [--frames <n>]" << endl;
+        cerr << "       neschan_replay verify <replay file> <rom file> [--threads <n>]" << endl;
+        cerr << "--rom records the ROM and start state hashes so that neschan can tell if the replay is played on something else" << endl;
+    }
+
+    int convert(int argc, char *argv[])
+    {
+        if (argc != 4 && !(argc == 6 && string(argv[4]) == "--rom"))
+        {
+            usage();
+            return 1;
+        }
+
+        uint64_t rom_hash = 0;
+        uint64_t start_state_hash = 0;
+        if (argc == 6)
+        {
+            const char *rom_path = argv[5];
+            rom_hash = nes_replay::hash_file(rom_path);
+
+            nes_system system;
+            system.power_on();
+            try
+            {
+                system.load_rom(rom_path, nes_rom_exec_mode_reset);
+            }
+            catch (std::exception &ex)
+            {
+                cerr << "Unable to load " << rom_path << ": " << ex.what() << endl;
+                return 1;
+            }
+            start_state_hash = system.serialize().hash();
+        }
+
+        if (!nes_replay::convert_text_log(argv[2], argv[3], rom_hash, start_state_hash))
+        {
+            cerr << "Unable to convert " << argv[2] << " to " << argv[3] << endl;
+            return 1;
+        }
+
+        return 0;
+    }
+
+    shared_ptr<nes_replay> open_replay(const char *path)
+    {
+        auto replay = nes_replay::open(path);
+        if (!replay)
+            cerr << path << " is not a valid NESChan replay file" << endl;
+        return replay;
+    }
+
+    // --<name> <value> pairs from argv[first] on. Returns false on anything else
+    bool parse_options(int argc, char *argv[], int first, const vector<pair<string, uint32_t *>> &options)
+    {
+        for (int i = first; i < argc; i += 2)
+        {
+            auto option = find_if(options.begin(), options.end(), [&](const pair<string, uint32_t *> &o) { return o.first == argv[i]; });
+            if (option == options.end() || i + 1 >= argc)
+                return false;
+            *option->second = uint32_t(stoul(argv[i + 1]));
+        }
+        return true;
+    }
+
+    int keyframes(int argc, char *argv[])
+    {
+        uint32_t interval = NES_REPLAY_KEYFRAME_INTERVAL;
+        uint32_t frames = 0;
+        if (argc < 5 || !parse_options(argc, argv, 5, { { "--interval", &interval }, { "--frames", &frames } }) || interval == 0)
+        {
+            usage();
+            return 1;
+        }
+
+        auto replay = open_replay(argv[2]);
+        if (!replay)
+            return 1;
+
+        nes_replay_runner runner(replay, argv[3]);
+        try
+        {
+            if (!runner.embed_keyframes(argv[4], interval, frames))
+            {
+                cerr << "Unable to write " << argv[4] << endl;
+                return 1;
+            }
+        }
+        catch (std::exception &ex)
+        {
+            cerr << "Unable to load " << argv[3] << ": " << ex.what() << endl;
+            return 1;
+        }
+
+        return 0;
+    }
+
+    int verify(int argc, char *argv[])
+    {
+        uint32_t threads = max(1u, thread::hardware_concurrency());
+        if (argc < 4 || !parse_options(argc, argv, 4, { { "--threads", &threads } }))
+        {
+            usage();
+            return 1;
+        }
+
+        auto replay = open_replay(argv[2]);
+        if (!replay)
+            return 1;
+        if (replay->keyframe_count() == 0 || replay->hashed_frame_count() == 0)
+        {
+            cerr << argv[2] << " has no keyframes - add them with neschan_replay keyframes" << endl;
+            return 1;
+        }
+
+        nes_replay_runner runner(replay, argv[3]);
+        uint32_t mismatch_frame = 0;
+        try
+        {
+            if (!runner.verify(threads, mismatch_frame))
+            {
+                cout << "MISMATCH at frame " << mismatch_frame << endl;
+                return 1;
+            }
+        }
+        catch (std::exception &ex)
+        {
+            cerr << "Unable to load " << argv[3] << ": " << ex.what() << endl;
+            return 1;
+        }
+
+        cout << "OK - " << replay->hashed_frame_count() << " frames, " << replay->keyframe_count() << " keyframes" << endl;
+        return 0;
+    }
+
+    int dump(int argc, char *argv[])
+    {
+        if (argc != 3)
+        {
+            usage();
+            return 1;
+        }
+
+        auto replay = open_replay(argv[2]);
+        if (!replay)
+            return 1;
+
+        auto &header = replay->header();
+        cout << "# rom_hash " << hex << setw(16) << setfill('0') << header.rom_hash << endl;
+        cout << "# start_state_hash " << hex << setw(16) << setfill('0') << header.start_state_hash << endl;
+        cout << "# frames " << dec << header.frame_count << ", players " << header.player_count << endl;
+        if (replay->keyframe_count() > 0)
+            cout << "# keyframes " << replay->keyframe_count() << " every " << replay->keyframe_interval() << " frames, " << replay->hashed_frame_count() << " frame hashes" << endl;
+
+        // Same format as the text log - only player 0 has a text form
+        for (uint32_t player = 0; player < replay->player_count(); ++player)
+        {
+            if (player > 0)
+                cout << "# player " << player << endl;
+
+            for (uint32_t frame = 0; frame < replay->frame_count(); ++frame)
+            {
+                nes_button_flags buttons = replay->buttons(player, frame);
+                if (buttons != nes_button_flags_none)
+                    cout << dec << frame << " 0x" << hex << setw(2) << setfill('0') << uint32_t(buttons) << endl;
+            }
+        }
+
+        return 0;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        usage();
+        return 1;
+    }
+
+    string command = argv[1];
+    if (command == "convert")
+        return convert(argc, argv);
+    if (command == "dump")
+        return dump(argc, argv);
+    if (command == "keyframes")
+        return keyframes(argc, argv);
+    if (command == "verify")
+        return verify(argc, argv);
+
+    usage();
+    return 1;
+}
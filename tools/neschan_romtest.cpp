@@ -0,0 +1,140 @@
+//=================================================================================================
+// NESChan
+// Author: Yi Zhang (yizhang82@outlook.com)
+//
+// neschan_romtest - runs every test ROM under a directory, each in its own nes_system on a pool of
+// threads, and reports pass / fail and timings. Exits with 1 if anything not expected to fail did
+//
+// Usage: neschan_romtest [<rom dir>] [--threads <n>] [--expect-fail <name>]... [--skip <name>]...
+//=================================================================================================
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "nes_rom_suite.h"
+
+using namespace std;
+
+namespace
+{
+    // Known failures in test/roms - see the commented out ones in test/cpu_test.cpp
+    const char *const DEFAULT_EXPECTED_FAILURES[] = {
+        "blargg_ppu_tests/power_up_palette.nes",
+        "instr_test-v5/official_only.nes",
+        "instr_test-v5/rom_singles/15-brk.nes",
+        "instr_test-v5/rom_singles/16-special.nes",
+    };
+
+    // Run into opcodes that aren't implemented - they assert in debug builds, which takes the whole
+    // process down
+    const char *const DEFAULT_SKIPPED[] = {
+        "instr_test-v5/all_instrs.nes",
+        "instr_test-v5/rom_singles/03-immediate.nes",
+        "instr_test-v5/rom_singles/07-abs_xy.nes",
+    };
+
+    void usage()
+    {
+        cerr << "Usage: neschan_romtest [<rom dir>] [--threads <n>] [--expect-fail <name>]... [--skip <name>]..." << endl;
+        cerr << "<rom dir> defaults to ./roms. Names are paths under it, like instr_test-v5/rom_singles/01-basics.nes" << endl;
+        cerr << "Without any --expect-fail / --skip the known failures in test/roms are expected / skipped" << endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    string root = "./roms";
+    uint32_t threads = 0;
+    vector<string> expected_failures;
+    vector<string> skipped;
+    bool has_root = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if ((arg == "--threads" || arg == "--expect-fail" || arg == "--skip") && i + 1 < argc)
+        {
+            if (arg == "--threads")
+                threads = uint32_t(stoul(argv[++i]));
+            else if (arg == "--expect-fail")
+                expected_failures.push_back(argv[++i]);
+            else
+                skipped.push_back(argv[++i]);
+        }
+        else if (arg[0] != '-' && !has_root)
+        {
+            root = arg;
+            has_root = true;
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    if (expected_failures.empty() && skipped.empty())
+    {
+        expected_failures.assign(begin(DEFAULT_EXPECTED_FAILURES), end(DEFAULT_EXPECTED_FAILURES));
+        skipped.assign(begin(DEFAULT_SKIPPED), end(DEFAULT_SKIPPED));
+    }
+
+    auto tests = nes_rom_suite::discover(root);
+    tests.erase(remove_if(tests.begin(), tests.end(), [&](const nes_rom_test &test) {
+        return find(skipped.begin(), skipped.end(), test.name) != skipped.end();
+    }), tests.end());
+    if (tests.empty())
+    {
+        cerr << "No test ROMs under " << root << endl;
+        return 1;
+    }
+
+    if (threads == 0)
+        threads = max(1u, thread::hardware_concurrency());
+    cout << "Running " << tests.size() << " test ROMs on " << min(threads, uint32_t(tests.size())) << " threads" << endl;
+
+    auto is_expected_failure = [&](const nes_rom_test_result &result) {
+        return find(expected_failures.begin(), expected_failures.end(), result.test.name) != expected_failures.end();
+    };
+
+    auto start = chrono::steady_clock::now();
+    auto results = nes_rom_suite::run_all(tests, threads, [&](const nes_rom_test_result &result) {
+        const char *status = result.passed ? "PASS " : (is_expected_failure(result) ? "XFAIL" : "FAIL ");
+        cout << status << " " << left << setw(48) << result.test.name << right << fixed << setprecision(3)
+             << setw(8) << result.seconds << "s " << setw(6) << result.frames << " frames";
+        if (!result.passed)
+            cout << "  " << result.detail;
+        cout << endl;
+    });
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    uint32_t passed = 0, failed = 0, unexpected = 0;
+    double cpu_seconds = 0;
+    for (auto &result : results)
+    {
+        cpu_seconds += result.seconds;
+        if (result.passed)
+        {
+            passed++;
+            if (is_expected_failure(result))
+                cout << "Unexpected pass: " << result.test.name << endl;
+        }
+        else
+        {
+            failed++;
+            if (!is_expected_failure(result))
+                unexpected++;
+        }
+    }
+
+    cout << passed << " passed, " << failed << " failed (" << unexpected << " unexpected) in " << fixed << setprecision(3)
+         << seconds << "s, " << cpu_seconds << "s summed over tests" << endl;
+
+    return unexpected > 0 ? 1 : 0;
+}
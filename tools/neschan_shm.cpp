@@ -0,0 +1,81 @@
+//=================================================================================================
+// NESChan
+// Author: Yi Zhang (yizhang82@outlook.com)
+//
+// neschan_shm - serves emulator instances to an agent process over shared memory (doc/shm_transport.md)
+//
+// Usage: neschan_shm <rom file> [--name <shm name>] [--slots <n>]
+//
+// Creates the segment, runs one emulator per slot and exits once the agent has closed every slot
+//=================================================================================================
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+#include "nes_system.h"
+#include "nes_shm.h"
+
+using namespace std;
+
+namespace
+{
+    void usage()
+    {
+        cerr << "Usage: neschan_shm <rom file> [--name <shm name>] [--slots <n>]" << endl;
+        cerr << "--name defaults to /neschan and --slots to 1" << endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        usage();
+        return 1;
+    }
+
+    const char *rom_path = argv[1];
+    string name = "/neschan";
+    uint32_t slots = 1;
+    for (int i = 2; i < argc; i += 2)
+    {
+        string arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            usage();
+            return 1;
+        }
+
+        if (arg == "--name")
+            name = argv[i + 1];
+        else if (arg == "--slots")
+            slots = uint32_t(stoul(argv[i + 1]));
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    shared_ptr<nes_shm_segment> segment = nes_shm_segment::create(name.c_str(), slots);
+    if (!segment)
+    {
+        cerr << "Unable to create shared memory segment " << name << endl;
+        return 1;
+    }
+
+    try
+    {
+        nes_shm_server server(segment, rom_path);
+        cout << "Serving " << slots << " slot(s) on " << name << endl;
+        server.run();
+    }
+    catch (std::exception &ex)
+    {
+        cerr << "Unable to load " << rom_path << ": " << ex.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,67 @@
+//=================================================================================================
+// NESChan
+// Author: Yi Zhang (yizhang82@outlook.com)
+//
+// neschan_trace - renders a binary trace (INIT_TRACE_BINARY) as Nintendulator style text
+//
+// Usage: neschan_trace <trace file> [output file]
+//=================================================================================================
+
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <fstream>
+#include <string>
+
+#include "nes_cycle.h"
+#include "nes_component.h"
+#include "nes_system.h"
+#include "nes_memory.h"
+#include "nes_mapper.h"
+#include "nes_ppu.h"
+#include "nes_cpu.h"
+#include "nes_input.h"
+#include "nes_trace.h"
+
+using namespace std;
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        cerr << "Usage: neschan_trace <trace file> [output file]" << endl;
+        return 1;
+    }
+
+    ofstream file;
+    if (argc > 2)
+    {
+        file.open(argv[2]);
+        if (!file)
+        {
+            cerr << "Unable to open " << argv[2] << endl;
+            return 1;
+        }
+    }
+    ostream &out = (argc > 2) ? file : cout;
+
+    // Records from a trace with more than one thread get prefixed with the thread they came from -
+    // all of them, so it's decided up front
+    uint32_t thread_count = 0;
+    bool ok = nes_trace_writer::read_thread_count(argv[1], thread_count);
+    bool multi_thread = thread_count > 1;
+    ok = ok && nes_trace_writer::read(argv[1], [&](uint32_t thread_index, const nes_trace_record &record) {
+        if (multi_thread)
+            out << "[" << thread_index << "] ";
+
+        out << nes_cpu::format_trace_record(record) << '\n';
+    });
+
+    if (!ok)
+    {
+        cerr << argv[1] << " is not a valid NESChan trace file" << endl;
+        return 1;
+    }
+
+    return 0;
+}